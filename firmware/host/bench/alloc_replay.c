@@ -0,0 +1,250 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "lua_alloc.h"
+#include "lua_system.h"
+#include "alloc_trace.h"
+
+/**
+ * Replays a trace of the Lua allocator's calls, recorded by running ccpeed_host with CCPEED_ALLOC_TRACE set, against
+ * lua_heap_alloc and against the C library's malloc, and reports the time each takes and the peak RSS of the process
+ * that ran it.  Each replay runs in a process of its own so that one's peak isn't counted in the other's, after a
+ * baseline that goes through the trace without allocating anything.  Every byte allocated is written, as Lua would.
+ *
+ *     alloc_replay TRACE [REPS]
+ */
+
+/**
+ * A call from the trace, with its block numbered rather than given by address.
+ */
+typedef struct
+{
+    uint32_t block;
+    uint32_t osize; // Old size, or the type of object for a new block
+    uint32_t nsize; // 0 to free the block
+    bool fresh;
+} op_t;
+
+typedef enum
+{
+    REPLAY_NONE,
+    REPLAY_LUA_HEAP,
+    REPLAY_MALLOC,
+} replay_t;
+
+static const char *const replay_names[] = {"trace", "lua_heap_alloc", "malloc"};
+
+static op_t *ops;
+static size_t num_ops;
+static uint32_t num_blocks;
+
+/**
+ * Stand ins for the rest of the runtime, which lua_alloc.c asks who to count each allocation against.
+ */
+lua_source_type_t lua_running_source()
+{
+    return LUA_SOURCE_OTHER;
+}
+
+const char *lua_source_name(lua_source_type_t source)
+{
+    return "other";
+}
+
+/**
+ * Reads the trace and numbers its blocks.  An address names the same block from the call that returns it until the
+ * one that frees it, so a table from address to block number only ever needs entries adding or replacing.  Calls that
+ * failed are left out, as they didn't change anything.
+ */
+static bool load_trace(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f)
+    {
+        perror(path);
+        return false;
+    }
+    fseek(f, 0, SEEK_END);
+    size_t count = ftell(f) / sizeof(alloc_trace_record_t);
+    rewind(f);
+    alloc_trace_record_t *records = malloc(count * sizeof(*records));
+    ops = malloc(count * sizeof(*ops));
+    if (!records || !ops || fread(records, sizeof(*records), count, f) != count)
+    {
+        fprintf(stderr, "Could not read %zu records from %s\n", count, path);
+        fclose(f);
+        return false;
+    }
+    fclose(f);
+
+    size_t capacity = 16;
+    while (capacity < count * 2)
+    {
+        capacity *= 2;
+    }
+    uint64_t *addrs = calloc(capacity, sizeof(*addrs));
+    uint32_t *blocks = calloc(capacity, sizeof(*blocks));
+    if (!addrs || !blocks)
+    {
+        fprintf(stderr, "Out of memory numbering %zu records\n", count);
+        return false;
+    }
+
+    bool ok = true;
+    for (size_t i = 0; ok && i < count; i++)
+    {
+        const alloc_trace_record_t *r = &records[i];
+        if (!r->result && r->nsize)
+        {
+            continue;
+        }
+        op_t *op = &ops[num_ops++];
+        *op = (op_t){.osize = r->osize, .nsize = r->nsize, .fresh = !r->ptr};
+        if (r->ptr)
+        {
+            size_t slot = (r->ptr * 0x9e3779b97f4a7c15ull) & (capacity - 1);
+            while (addrs[slot] && addrs[slot] != r->ptr)
+            {
+                slot = (slot + 1) & (capacity - 1);
+            }
+            if (!addrs[slot])
+            {
+                fprintf(stderr, "Record %zu is for a block that was never allocated; is the trace complete?\n", i);
+                ok = false;
+            }
+            op->block = blocks[slot];
+        }
+        else
+        {
+            op->block = num_blocks++;
+        }
+        if (r->result && r->result != r->ptr)
+        {
+            size_t slot = (r->result * 0x9e3779b97f4a7c15ull) & (capacity - 1);
+            while (addrs[slot] && addrs[slot] != r->result)
+            {
+                slot = (slot + 1) & (capacity - 1);
+            }
+            addrs[slot] = r->result;
+            blocks[slot] = op->block;
+        }
+    }
+    free(addrs);
+    free(blocks);
+    free(records);
+    return ok;
+}
+
+static void *replay_alloc(replay_t replay, void *ptr, const op_t *op)
+{
+    switch (replay)
+    {
+    case REPLAY_LUA_HEAP:
+        return lua_heap_alloc(NULL, ptr, op->osize, op->nsize);
+    case REPLAY_MALLOC:
+        if (op->nsize == 0)
+        {
+            free(ptr);
+            return NULL;
+        }
+        return realloc(ptr, op->nsize);
+    default:
+        return op->nsize ? (void *)(uintptr_t)(op->block + 1) : NULL;
+    }
+}
+
+/**
+ * Runs the trace reps times, freeing whatever it left allocated after each, and prints the time per call and the peak
+ * RSS.  Runs in a child process.
+ */
+static void run(replay_t replay, int reps)
+{
+    void **live = calloc(num_blocks, sizeof(*live));
+    uint32_t *sizes = calloc(num_blocks, sizeof(*sizes));
+    if (!live || !sizes)
+    {
+        fprintf(stderr, "Out of memory for %u blocks\n", num_blocks);
+        exit(1);
+    }
+    lua_heap_set_limit(0);
+
+    struct timespec start, end;
+    double ns = 0;
+    for (int rep = 0; rep < reps; rep++)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (size_t i = 0; i < num_ops; i++)
+        {
+            const op_t *op = &ops[i];
+            void *ptr = op->fresh ? NULL : live[op->block];
+            void *block = replay_alloc(replay, ptr, op);
+            if (!block && op->nsize)
+            {
+                fprintf(stderr, "%s failed to allocate %u bytes\n", replay_names[replay], op->nsize);
+                exit(1);
+            }
+            size_t osize = op->fresh ? 0 : op->osize;
+            if (replay != REPLAY_NONE && op->nsize > osize)
+            {
+                memset((char *)block + osize, 0xa5, op->nsize - osize);
+            }
+            live[op->block] = block;
+            sizes[op->block] = op->nsize;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        ns += (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+
+        for (uint32_t b = 0; b < num_blocks; b++)
+        {
+            if (live[b] && replay != REPLAY_NONE)
+            {
+                replay_alloc(replay, live[b], &(op_t){.block = b, .osize = sizes[b], .nsize = 0});
+            }
+            live[b] = NULL;
+        }
+    }
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("%-16s %12.1f %12.1f %12ld\n", replay_names[replay], ns / reps / 1e6, ns / reps / num_ops, usage.ru_maxrss);
+    fflush(stdout);
+    exit(0);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s TRACE [REPS]\n", argv[0]);
+        return 1;
+    }
+    int reps = argc > 2 ? atoi(argv[2]) : 10;
+    if (!load_trace(argv[1]) || reps < 1)
+    {
+        return 1;
+    }
+    printf("%zu calls, %u blocks, %d reps\n", num_ops, num_blocks, reps);
+    printf("%-16s %12s %12s %12s\n", "allocator", "ms per rep", "ns per call", "peak RSS kB");
+    fflush(stdout);
+    for (replay_t replay = REPLAY_NONE; replay <= REPLAY_MALLOC; replay++)
+    {
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            run(replay, reps);
+        }
+        int status;
+        if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
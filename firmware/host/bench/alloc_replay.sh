@@ -0,0 +1,16 @@
+#!/usr/bin/env sh
+# Records every call to the Lua allocator while a scenario runs on the host build, and replays them with alloc_replay
+# against lua_heap_alloc and against malloc, for the time and peak RSS of each.  The scenario is cbor_view.lua unless
+# another is given.
+#
+#     host/bench/alloc_replay.sh build.host [SCENARIO]
+
+HERE=$(cd "$(dirname "$0")" && pwd)
+BUILD=$(cd "${1:-$HERE/../../build.host}" && pwd) || exit 1
+SCENARIO=${2:-$HERE/cbor_view.lua}
+LUA_DIR=$HERE/../../../lua
+TRACE=$BUILD/bench_alloc.trace
+
+CCPEED_ALLOC_TRACE=$TRACE CCPEED_LOG_LEVEL=${CCPEED_LOG_LEVEL:-2} \
+    $BUILD/ccpeed_host --virtual --scenario $SCENARIO $LUA_DIR/shared > /dev/null || exit 1
+$BUILD/alloc_replay $TRACE
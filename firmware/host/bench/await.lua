@@ -0,0 +1,26 @@
+-- Time per DALI query awaited through a Future set by the transmit callback, against DaliBus:await_transmit, which
+-- suspends the task from C and resumes it with the result.  The simulated gear answers every query; os.clock() is the
+-- host's CPU time, so the virtual bus timing doesn't count.
+system.budget_config { instructions = 0, time_ms = 0 }
+
+local bus, n = DaliBus:new(4, 5), 10000
+
+start_async_task(function()
+    local t = os.clock()
+    for _ = 1, n do
+        local f = Future:new()
+        bus:transmit(0x1a0, Future.set, f)
+        await(f)
+    end
+    local future_us = (os.clock() - t) * 1e6 / n
+
+    t = os.clock()
+    for _ = 1, n do
+        bus:await_transmit(0x1a0)
+    end
+    local c_us = (os.clock() - t) * 1e6 / n
+
+    print(string.format("%-16s %8.2fus", "future", future_us))
+    print(string.format("%-16s %8.2fus", "await_transmit", c_us))
+    sim.stop()
+end)
@@ -0,0 +1,19 @@
+-- Time to decode payloads like the ones the bridge gets: device info, a scene and a configuration.
+system.budget_config { instructions = 0, time_ms = 0 }
+
+local payloads = {
+    info = cbor.encode { esp_idf_ver = "v5.2", uptime = 123456, mac_address = "0123456789abcdef",
+        heap = { free = 123456, lua = { used = 45678, limit = 98304 } } },
+    scene = cbor.encode(cbor.encode_as_list { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16 }),
+    config = cbor.encode { name = "hall", devices = cbor.encode_as_list { "dali/1", "dali/2", "dali/3" },
+        fade = 0.5, long_press_ms = 800, bindings = { short = "toggle", long = "dim" } },
+}
+for name, bytes in pairs(payloads) do
+    local reps = 20000
+    local t = os.clock()
+    for _ = 1, reps do
+        cbor.decode(bytes)
+    end
+    print(name, #bytes, string.format("%.2fus", (os.clock() - t) / reps * 1e6))
+end
+sim.stop()
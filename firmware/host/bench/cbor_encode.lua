@@ -0,0 +1,20 @@
+-- Time to encode a directory listing of 4 to 4096 entries, and the size of the result.  The larger ones don't fit the
+-- encoder's stack buffer, so they show the cost of counting the bytes and encoding again into a buffer of that size.
+system.budget_config { instructions = 0, time_ms = 0 }
+system.heap_limit(0)
+
+for _, n in ipairs { 4, 16, 64, 256, 1024, 4096 } do
+    local doc = {}
+    for i = 1, n do
+        doc[i] = { name = "file" .. i .. ".lua", size = i * 37, dir = false }
+    end
+    cbor.encode_as_list(doc)
+    local reps = math.max(1, 20000 // n)
+    local t = os.clock()
+    local bytes
+    for _ = 1, reps do
+        bytes = cbor.encode(doc)
+    end
+    print(n, #bytes, string.format("%.1fus", (os.clock() - t) / reps * 1e6))
+end
+sim.stop()
@@ -0,0 +1,22 @@
+-- Evaluations per second of a compiled long press action (dim up on odd click counts, down on even), for an event given
+-- as encoded bytes and as a table.
+system.budget_config { instructions = 0, time_ms = 0 }
+
+local SELF, INDEX, IF, MOD = 0, 1, 2, 14
+local E = cbor.expr
+local action = cbor.compile(cbor.encode_as_list { "light", "brightness", "delta",
+    E(IF, E(MOD, E(INDEX, E(SELF), "clickCount"), 2), -1, 1) })
+for _, event in ipairs {
+    { "bytes", cbor.encode { clickCount = 3, pin = 20 } },
+    { "table", { clickCount = 3, pin = 20 } },
+} do
+    local n, t = 0, os.clock()
+    while os.clock() - t < 1 do
+        for _ = 1, 1000 do
+            action(event[2])
+        end
+        n = n + 1000
+    end
+    print(event[1], string.format("%.0f evaluations/s", n / (os.clock() - t)), action(event[2])[4])
+end
+sim.stop()
@@ -0,0 +1,36 @@
+-- Time to decode a sequence fed in 1024 byte blocks, against decoding it whole: first 500 small records, then one
+-- array of 16384 numbers, 48kB in one item.
+system.budget_config { instructions = 0, time_ms = 0 }
+system.heap_limit(0)
+
+local function compare(name, bytes)
+    local reps = 20
+    local t = os.clock()
+    local n
+    for _ = 1, reps do
+        _, n = cbor.decode_seq(bytes)
+    end
+    print(name, "whole", #bytes, n, string.format("%.2fms", (os.clock() - t) / reps * 1e3))
+    t = os.clock()
+    for _ = 1, reps do
+        local dec = cbor.decoder()
+        for pos = 1, #bytes, 1024 do
+            for _ in dec:feed(bytes:sub(pos, pos + 1023)) do end
+        end
+        n = dec:finish()
+    end
+    print(name, "blocks", #bytes, n, string.format("%.2fms", (os.clock() - t) / reps * 1e3))
+end
+
+local records = {}
+for i = 1, 500 do
+    records[i] = { name = "dali/" .. i, level = i % 254, fade = 0.5 }
+end
+compare("records", cbor.encode_seq(table.unpack(records)))
+
+local levels = {}
+for i = 1, 16384 do
+    levels[i] = i % 254 + 1000
+end
+compare("large", cbor.encode_seq(cbor.encode_as_list(levels)))
+sim.stop()
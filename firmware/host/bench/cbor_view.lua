@@ -0,0 +1,26 @@
+-- Time and garbage per lookup of one field of a 64 device configuration, by decoding all of it and through a view.
+system.budget_config { instructions = 0, time_ms = 0 }
+system.heap_limit(0)
+
+local devices = {}
+for i = 1, 64 do
+    devices["dali/" .. i] = { name = "light " .. i, min = 1, max = 254, fade = 0.5, groups = cbor.encode_as_list { 1, 2 } }
+end
+local bytes = cbor.encode { name = "hall", devices = devices }
+local reps = 2000
+for _, get in ipairs {
+    { "decode", function(b) return cbor.decode(b).devices["dali/42"].max end },
+    { "view", function(b) return cbor.view(b).devices["dali/42"].max end },
+} do
+    collectgarbage()
+    collectgarbage("stop")
+    local kb = collectgarbage("count")
+    local t = os.clock()
+    for _ = 1, reps do
+        assert(get[2](bytes) == 254)
+    end
+    print(get[1], #bytes, string.format("%.1fus %.2fkB", (os.clock() - t) / reps * 1e6,
+        (collectgarbage("count") - kb) / reps))
+    collectgarbage("restart")
+end
+sim.stop()
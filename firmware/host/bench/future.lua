@@ -0,0 +1,40 @@
+-- Allocations per await, by type, for one deferred future and for the first of a deferred future and a reused timer's
+-- (which builds a oneof).  system.heap_info().lua.objects counts every allocation the Lua heap has made, by type.
+system.budget_config { instructions = 0, time_ms = 0 }
+
+local n = 10000
+
+local function counts()
+    local c = {}
+    for t, count in pairs(system.heap_info().lua.objects) do c[t] = count end
+    return c
+end
+
+local function report(name, before)
+    local after, total, types = counts(), 0, {}
+    for t, count in pairs(after) do
+        local d = count - (before[t] or 0)
+        if d > 0 then
+            total = total + d
+            types[#types + 1] = string.format("%s %.2f", t, d / n)
+        end
+    end
+    table.sort(types)
+    print(string.format("%-16s %6.2f per await (%s)", name, total / n, table.concat(types, ", ")))
+end
+
+start_async_task(function()
+    local before = counts()
+    for i = 1, n do
+        await(Future:defer(1, i))
+    end
+    report("one future", before)
+
+    local timer = Timer:new()
+    before = counts()
+    for i = 1, n do
+        await(Future:defer(1, i), timer:defer(2))
+    end
+    report("oneof of two", before)
+    sim.stop()
+end)
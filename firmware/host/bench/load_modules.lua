@@ -0,0 +1,51 @@
+-- Loads each module in BENCH_MODULES (without running it) from its source in BENCH_SOURCE and from its bytecode image in
+-- BENCH_IMAGES, and reports how long each takes and how much of the Lua heap.  Run by load_modules.sh.
+local modules = assert(os.getenv("BENCH_MODULES"), "BENCH_MODULES isn't set")
+local source_path = assert(os.getenv("BENCH_SOURCE"), "BENCH_SOURCE isn't set") .. "/?.lua"
+local image_path = assert(os.getenv("BENCH_IMAGES"), "BENCH_IMAGES isn't set") .. "/?.lua"
+local reps = 50
+
+system.budget_config { instructions = 0, time_ms = 0 }
+system.heap_limit(0)
+
+-- The standard source searcher comes before the two for C modules, and lua_loader.c puts the image one just before it.
+local searchers = package.searchers
+local load_source, load_image = searchers[#searchers - 2], searchers[#searchers - 3]
+
+-- Time per load in us, the peak heap while loading and the heap kept by the loaded function, in bytes.
+local function measure(name, searcher, path)
+    package.path = path
+    collectgarbage()
+    collectgarbage("stop")
+    local _, base = system.heap_peak(true)
+    local loader = searcher(name)
+    local peak = system.heap_peak() - base
+    assert(type(loader) == "function", loader)
+    collectgarbage()
+    local _, kept = system.heap_peak()
+    kept = kept - base
+    loader = nil
+    collectgarbage("restart")
+
+    local t = os.clock()
+    for _ = 1, reps do
+        searcher(name)
+    end
+    return (os.clock() - t) / reps * 1e6, peak, kept
+end
+
+local saved_path = package.path
+local totals = { 0, 0, 0, 0, 0, 0 }
+print(string.format("%-20s %11s %11s %11s %11s %11s %11s", "module", "source us", "image us", "source peak", "image peak",
+    "source kept", "image kept"))
+for name in modules:gmatch("%S+") do
+    local su, sp, sk = measure(name, load_source, source_path)
+    local iu, ip, ik = measure(name, load_image, image_path)
+    for i, v in ipairs { su, iu, sp, ip, sk, ik } do
+        totals[i] = totals[i] + v
+    end
+    print(string.format("%-20s %11.1f %11.1f %11d %11d %11d %11d", name, su, iu, sp, ip, sk, ik))
+end
+print(string.format("%-20s %11.1f %11.1f %11d %11d %11d %11d", "total", table.unpack(totals)))
+package.path = saved_path
+sim.stop()
@@ -0,0 +1,30 @@
+#!/usr/bin/env sh
+# Compares loading the Lua modules from source with loading them from bytecode images, for each set of modules that
+# flashfs.sh puts on a device: the shared ones, and the shared ones with the dali or button ones on top.  Needs a host
+# build, for ccpeed_host and a matching luac.
+#
+#     host/bench/load_modules.sh build.host
+
+HERE=$(cd "$(dirname "$0")" && pwd)
+BUILD=$(cd "${1:-$HERE/../../build.host}" && pwd) || exit 1
+LUA_DIR=$HERE/../../../lua
+WORK=$BUILD/bench_load
+
+for SET in shared dali button; do
+    SRC=$WORK/$SET/src
+    IMG=$WORK/$SET/img
+    rm -rf $WORK/$SET
+    mkdir -p $SRC $IMG
+    cp $LUA_DIR/shared/* $SRC
+    if [ $SET != shared ]; then
+        cp $LUA_DIR/$SET/* $SRC
+    fi
+    cp $SRC/*.lua $IMG
+    python3 $LUA_DIR/compile.py --luac $BUILD/luac $IMG > /dev/null || exit 1
+
+    echo "== $SET"
+    # Runs on the shared init.lua, which doesn't start anything, whichever set is being loaded.
+    BENCH_MODULES=$(cd $SRC && ls *.lua | sed 's/\.lua$//') BENCH_SOURCE=$SRC BENCH_IMAGES=$IMG \
+        CCPEED_LOG_LEVEL=${CCPEED_LOG_LEVEL:-2} \
+        $BUILD/ccpeed_host --virtual --scenario $HERE/load_modules.lua $LUA_DIR/shared || exit 1
+done
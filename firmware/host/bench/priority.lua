@@ -0,0 +1,24 @@
+-- Press-to-action latency under a housekeeping load: a dozen timers that each take 3ms of Lua every 20ms, and a button
+-- press every 50ms.  Prints the p99 queueing latency of GPIO and timer events, and how many turns housekeeping was given
+-- because it had been passed over too often.  Runs in real time (under --virtual time stands still while Lua runs, so
+-- there's no backlog); compare against a build from before priority classes.
+system.budget_config { instructions = 0, time_ms = 0 }
+
+local function busy(ms)
+    local t = os.clock() + ms / 1000
+    while os.clock() < t do end
+end
+
+for i = 1, 12 do
+    Timer:new(function() busy(3) end):start(20, true)
+end
+gpio.set_pin_isr(9, "negative", function() end)
+for i = 1, 200 do
+    sim.pulse(9, 0, 10, 100 + i * 50)
+end
+Timer:new(function()
+    local s = system.loop_stats()
+    print("gpio p99", s.gpio.queued.p99_us, "timer p99", s.timer.queued.p99_us,
+        "starved", system.event_stats().classes.housekeeping.starved)
+    sim.stop()
+end):start(11000)
@@ -0,0 +1,38 @@
+-- A week of virtual time (run with --until 604800) creating a confirmable-style timer every second, none of them ever
+-- deleted, to check that timers that have fired and been forgotten are collected.  Each carries a field whose __gc
+-- counts it, as a timer's fields only go when it does.  Logs the Lua heap each hour, which should stay flat once the
+-- collector has settled, and fails if the timers weren't collected or the heap didn't come back to where it was after
+-- the first hour.
+system.budget_config { instructions = 0, time_ms = 0 }
+
+local created, collected = 0, 0
+local baseline
+local token_mt = { __gc = function() collected = collected + 1 end }
+
+Timer:new(function()
+    local t = Timer:new(function() end)
+    t.token = setmetatable({}, token_mt)
+    t:start(500)
+    created = created + 1
+    if created % 3600 == 0 then
+        collectgarbage()
+        local in_use = system.heap_info().lua.in_use
+        baseline = baseline or in_use
+        print(string.format("%3d hours, %d timers created, %d collected, lua heap %d", created // 3600, created,
+            collected, in_use))
+    end
+end):start(1000, true)
+
+sim.on_finish(function()
+    collectgarbage()
+    collectgarbage()
+    local in_use = system.heap_info().lua.in_use
+    -- Only the repeating timer and the one created last can still be armed.
+    local live = created - collected
+    local armed = system.event_stats().timers.armed - 1
+    print(string.format("%d timers created, %d collected, %d armed, lua heap %d after the first hour and %d at the end",
+        created, collected, armed, baseline or 0, in_use))
+    assert(baseline, "the soak didn't run for an hour; run it with --until 604800")
+    assert(live <= armed, string.format("%d timers that aren't armed were never collected", live - armed))
+    assert(in_use <= baseline * 1.1, "the Lua heap grew from " .. baseline .. " to " .. in_use)
+end)
@@ -0,0 +1,26 @@
+-- Starts 5000 one-shot timers due at random times over a minute, and reports the host CPU time per start, that they all
+-- fired, and the number of dispatches from the timer wheel and times its esp_timer was armed, which should be about one
+-- per distinct deadline rather than one per timer.
+system.budget_config { instructions = 0, time_ms = 0 }
+
+local n, fired = 5000, 0
+local deadlines = {}
+local function on_timeout() fired = fired + 1 end
+
+local t = os.clock()
+for _ = 1, n do
+    local ms = math.random(1, 60000)
+    deadlines[ms] = true
+    Timer:new(on_timeout):start(ms)
+end
+local start_us = (os.clock() - t) * 1e6 / n
+
+local distinct = 0
+for _ in pairs(deadlines) do distinct = distinct + 1 end
+
+Timer:new(function()
+    local stats = system.event_stats().timers
+    print(string.format("start %.3fus each, fired %d of %d, %d distinct deadlines, %d dispatches, armed %d times",
+        start_us, fired, n, distinct, stats.dispatches, stats.programmed))
+    sim.stop()
+end):start(61000)
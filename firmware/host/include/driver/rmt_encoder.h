@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdint.h>
+#include "esp_err.h"
+
+// Only the types, so that dali_driver.h can be shared.  There is no RMT on the host.
+typedef struct rmt_encoder_t *rmt_encoder_handle_t;
+typedef struct rmt_channel_t *rmt_channel_handle_t;
+
+typedef union
+{
+    struct
+    {
+        uint16_t duration0 : 15;
+        uint16_t level0 : 1;
+        uint16_t duration1 : 15;
+        uint16_t level1 : 1;
+    };
+    uint32_t val;
+} rmt_symbol_word_t;
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stdint.h>
+#include "esp_err.h"
+
+/**
+ * Fills in 8 bytes of MAC address.  On the host it is made up, but can be set with CCPEED_HOST_MAC (16 hex digits) so
+ * that several instances can be told apart.
+ */
+esp_err_t esp_efuse_mac_get_default(uint8_t *mac);
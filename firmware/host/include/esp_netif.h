@@ -0,0 +1,21 @@
+#pragma once
+
+#include "esp_err.h"
+
+/**
+ * Network interfaces are only handles, as the host's own interfaces are used.
+ */
+typedef struct esp_netif_obj esp_netif_t;
+typedef void *esp_netif_iodriver_handle;
+
+typedef struct
+{
+    const char *if_key;
+} esp_netif_config_t;
+
+#define ESP_NETIF_DEFAULT_OPENTHREAD() {.if_key = "OT_DEF"}
+
+esp_netif_t *esp_netif_new(const esp_netif_config_t *config);
+esp_err_t esp_netif_attach(esp_netif_t *esp_netif, esp_netif_iodriver_handle driver_handle);
+esp_err_t esp_netif_set_default_netif(esp_netif_t *esp_netif);
+void esp_netif_destroy(esp_netif_t *esp_netif);
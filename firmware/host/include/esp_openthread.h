@@ -0,0 +1,17 @@
+#pragma once
+
+#include "esp_err.h"
+#include "esp_openthread_types.h"
+#include <openthread/instance.h>
+
+/**
+ * OpenThread on top of the host's own IPv6 stack (see openthread/udp.h).  There is no Thread network, and no radio.
+ */
+esp_err_t esp_openthread_init(const esp_openthread_platform_config_t *config);
+otInstance *esp_openthread_get_instance(void);
+
+/**
+ * Doesn't return until the program exits, as the real main loop doesn't.  The host sockets have threads of their own,
+ * so there's nothing for it to do.
+ */
+esp_err_t esp_openthread_launch_mainloop(void);
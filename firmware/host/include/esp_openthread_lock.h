@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stdbool.h>
+#include <freertos/FreeRTOS.h>
+
+/**
+ * The lock that the OpenThread task holds while it runs, and so while it calls socket handlers.
+ */
+bool esp_openthread_lock_acquire(TickType_t block_ticks);
+void esp_openthread_lock_release(void);
@@ -0,0 +1,8 @@
+#pragma once
+
+#include "esp_netif.h"
+#include "esp_openthread_types.h"
+
+void *esp_openthread_netif_glue_init(const esp_openthread_platform_config_t *config);
+void esp_openthread_netif_glue_deinit(void);
+esp_netif_t *esp_openthread_get_netif(void);
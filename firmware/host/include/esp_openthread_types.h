@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdint.h>
+#include <driver/uart.h>
+
+typedef enum
+{
+    RADIO_MODE_NATIVE = 0,
+    RADIO_MODE_UART_RCP,
+    RADIO_MODE_SPI_RCP,
+} esp_openthread_radio_mode_t;
+
+typedef enum
+{
+    HOST_CONNECTION_MODE_NONE = 0,
+    HOST_CONNECTION_MODE_CLI_UART,
+    HOST_CONNECTION_MODE_RCP_UART,
+} esp_openthread_host_connection_mode_t;
+
+typedef struct
+{
+    int port;
+    uart_config_t uart_config;
+    int rx_pin;
+    int tx_pin;
+} esp_openthread_uart_config_t;
+
+typedef struct
+{
+    esp_openthread_radio_mode_t radio_mode;
+} esp_openthread_radio_config_t;
+
+typedef struct
+{
+    esp_openthread_host_connection_mode_t host_connection_mode;
+    esp_openthread_uart_config_t host_uart_config;
+} esp_openthread_host_connection_config_t;
+
+typedef struct
+{
+    const char *storage_partition_name;
+    uint8_t netif_queue_size;
+    uint8_t task_queue_size;
+} esp_openthread_port_config_t;
+
+typedef struct
+{
+    esp_openthread_radio_config_t radio_config;
+    esp_openthread_host_connection_config_t host_config;
+    esp_openthread_port_config_t port_config;
+} esp_openthread_platform_config_t;
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stdint.h>
+#include <mbedtls/md5.h>
+
+#define ESP_ROM_MD5_DIGEST_LEN 16
+
+typedef mbedtls_md5_context md5_context_t;
+
+void esp_rom_md5_init(md5_context_t *context);
+void esp_rom_md5_update(md5_context_t *context, const void *buf, uint32_t len);
+void esp_rom_md5_final(uint8_t *digest, md5_context_t *context);
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+typedef enum
+{
+    ESP_RST_UNKNOWN,
+} esp_reset_reason_t;
+
+// Using the chip's reset codes, as lua_system.c reports those.
+enum
+{
+    RESET_REASON_CHIP_POWER_ON = 0x01,
+    RESET_REASON_CORE_SW = 0x03,
+    RESET_REASON_CORE_DEEP_SLEEP = 0x05,
+    RESET_REASON_CORE_MWDT0 = 0x07,
+    RESET_REASON_CORE_RTC_WDT = 0x09,
+    RESET_REASON_CPU0_MWDT0 = 0x0B,
+    RESET_REASON_CPU0_SW = 0x0C,
+    RESET_REASON_CPU0_RTC_WDT = 0x0D,
+    RESET_REASON_SYS_BROWN_OUT = 0x0F,
+    RESET_REASON_SYS_RTC_WDT = 0x10,
+    RESET_REASON_SYS_SUPER_WDT = 0x12,
+    RESET_REASON_CORE_EFUSE_CRC = 0x14,
+    RESET_REASON_CPU0_JTAG = 0x18,
+};
+
+int esp_reset_reason(void);
+void esp_restart(void) __attribute__((noreturn));
+
+typedef struct
+{
+    size_t total_free_bytes;
+    size_t total_allocated_bytes;
+    size_t largest_free_block;
+    size_t minimum_free_bytes;
+    size_t allocated_blocks;
+    size_t free_blocks;
+    size_t total_blocks;
+} multi_heap_info_t;
+
+#define MALLOC_CAP_DEFAULT (1 << 12)
+#define MALLOC_CAP_8BIT (1 << 2)
+
+void heap_caps_get_info(multi_heap_info_t *info, uint32_t caps);
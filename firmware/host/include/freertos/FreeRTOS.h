@@ -0,0 +1,47 @@
+#pragma once
+
+/**
+ * Just enough of FreeRTOS, on top of pthreads, for the Lua runtime to run on a Linux host.  Ticks are milliseconds.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sdkconfig.h"
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS pdTRUE
+#define pdFAIL pdFALSE
+#define portMAX_DELAY ((TickType_t)0xffffffffu)
+#define configTICK_RATE_HZ 1000
+#define portTICK_PERIOD_MS (1000 / configTICK_RATE_HZ)
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+#define portYIELD_FROM_ISR(x) (void)(x)
+#define configASSERT(x) assert(x)
+
+typedef struct
+{
+    int unused;
+} portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED {0}
+
+// There is only the one big lock on the host, which is plenty to keep the "ISR" threads out of each other's way.
+void portENTER_CRITICAL(portMUX_TYPE *mux);
+void portEXIT_CRITICAL(portMUX_TYPE *mux);
+#define portENTER_CRITICAL_ISR(mux) portENTER_CRITICAL(mux)
+#define portEXIT_CRITICAL_ISR(mux) portEXIT_CRITICAL(mux)
+
+BaseType_t xPortInIsrContext(void);
+size_t xPortGetFreeHeapSize(void);
+
+/**
+ * Marks the calling thread as running "interrupt" code (timer and GPIO callbacks) or not.
+ */
+void host_set_isr_context(bool isr);
@@ -0,0 +1,3 @@
+#pragma once
+
+// lua_crypto.c includes this, but only needs mbedtls.
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "ip6.h"
+
+#define OT_NETWORK_NAME_MAX_SIZE 16
+
+typedef struct
+{
+    uint64_t mSeconds;
+    uint16_t mTicks;
+    bool mAuthoritative;
+} otTimestamp;
+
+typedef struct
+{
+    bool mIsActiveTimestampPresent;
+    bool mIsPendingTimestampPresent;
+    bool mIsNetworkKeyPresent;
+    bool mIsNetworkNamePresent;
+    bool mIsExtendedPanIdPresent;
+    bool mIsMeshLocalPrefixPresent;
+    bool mIsDelayPresent;
+    bool mIsPanIdPresent;
+    bool mIsChannelPresent;
+    bool mIsPskcPresent;
+    bool mIsSecurityPolicyPresent;
+    bool mIsChannelMaskPresent;
+} otOperationalDatasetComponents;
+
+typedef struct
+{
+    otTimestamp mActiveTimestamp;
+    otTimestamp mPendingTimestamp;
+    struct
+    {
+        uint8_t m8[16];
+    } mNetworkKey;
+    struct
+    {
+        char m8[OT_NETWORK_NAME_MAX_SIZE + 1];
+    } mNetworkName;
+    struct
+    {
+        uint8_t m8[8];
+    } mExtendedPanId;
+    struct
+    {
+        uint8_t m8[OT_IP6_PREFIX_SIZE];
+    } mMeshLocalPrefix;
+    uint32_t mDelay;
+    uint16_t mPanId;
+    uint16_t mChannel;
+    struct
+    {
+        uint8_t m8[16];
+    } mPskc;
+    uint32_t mChannelMask;
+    otOperationalDatasetComponents mComponents;
+} otOperationalDataset;
+
+/**
+ * There is no Thread network, so the dataset is only checked and kept.
+ */
+otError otDatasetCreateNewNetwork(otInstance *aInstance, otOperationalDataset *aDataset);
+otError otDatasetSetActive(otInstance *aInstance, const otOperationalDataset *aDataset);
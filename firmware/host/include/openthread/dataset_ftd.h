@@ -0,0 +1,3 @@
+#pragma once
+
+// lua_openthread.c includes this, but uses nothing from it.
@@ -0,0 +1,16 @@
+#pragma once
+
+#include "instance.h"
+
+typedef enum
+{
+    OT_ICMP6_ECHO_HANDLER_DISABLED = 0,
+    OT_ICMP6_ECHO_HANDLER_UNICAST_ONLY = 1,
+    OT_ICMP6_ECHO_HANDLER_MULTICAST_ONLY = 2,
+    OT_ICMP6_ECHO_HANDLER_ALL = 3,
+} otIcmp6EchoMode;
+
+/**
+ * The host answers pings itself, so this does nothing.
+ */
+void otIcmp6SetEchoMode(otInstance *aInstance, otIcmp6EchoMode aMode);
@@ -0,0 +1,8 @@
+#pragma once
+
+#include "error.h"
+
+/**
+ * There is only the one instance, which stands for the host's own IPv6 stack.
+ */
+typedef struct otInstance otInstance;
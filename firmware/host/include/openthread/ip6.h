@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "instance.h"
+
+#define OT_IP6_ADDRESS_SIZE 16
+#define OT_IP6_ADDRESS_STRING_SIZE 40
+#define OT_IP6_PREFIX_SIZE 8
+
+typedef struct
+{
+    union
+    {
+        uint8_t m8[OT_IP6_ADDRESS_SIZE];
+        uint16_t m16[OT_IP6_ADDRESS_SIZE / 2];
+        uint32_t m32[OT_IP6_ADDRESS_SIZE / 4];
+    } mFields;
+} otIp6Address;
+
+typedef struct
+{
+    otIp6Address mPrefix;
+    uint8_t mLength;
+} otIp6Prefix;
+
+typedef struct
+{
+    otIp6Address mAddress;
+    uint16_t mPort;
+} otSockAddr;
+
+enum
+{
+    OT_ADDRESS_ORIGIN_THREAD = 0,
+    OT_ADDRESS_ORIGIN_SLAAC = 1,
+    OT_ADDRESS_ORIGIN_DHCPV6 = 2,
+    OT_ADDRESS_ORIGIN_MANUAL = 3,
+};
+
+typedef struct otNetifAddress
+{
+    otIp6Address mAddress;
+    uint8_t mPrefixLength;
+    uint8_t mAddressOrigin;
+    bool mPreferred : 1;
+    bool mValid : 1;
+    bool mScopeOverrideValid : 1;
+    unsigned int mScopeOverride : 4;
+    bool mRloc : 1;
+    bool mMeshLocal : 1;
+    const struct otNetifAddress *mNext;
+} otNetifAddress;
+
+typedef struct
+{
+    const otIp6Address *mAddress;
+    uint8_t mPrefixLength;
+    uint8_t mScope;
+    bool mPreferred;
+    bool mMeshLocal;
+} otIp6AddressInfo;
+
+typedef void (*otIp6AddressCallback)(const otIp6AddressInfo *aAddressInfo, bool aIsAdded, void *aContext);
+
+/**
+ * The only address is loopback, standing in for the mesh local address so that other processes on the host can reach
+ * the runtime.
+ */
+const otNetifAddress *otIp6GetUnicastAddresses(otInstance *aInstance);
+otError otIp6SetEnabled(otInstance *aInstance, bool aEnabled);
+void otIp6SetAddressCallback(otInstance *aInstance, otIp6AddressCallback aCallback, void *aCallbackContext);
+
+otError otIp6AddressFromString(const char *aString, otIp6Address *aAddress);
+otError otIp6PrefixFromString(const char *aString, otIp6Prefix *aPrefix);
+void otIp6AddressToString(const otIp6Address *aAddress, char *aBuffer, uint16_t aSize);
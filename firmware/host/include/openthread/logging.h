@@ -0,0 +1,10 @@
+#pragma once
+
+#include "error.h"
+
+typedef int otLogLevel;
+
+/**
+ * Nothing logs through OpenThread on the host, so this does nothing.
+ */
+otError otLoggingSetLevel(otLogLevel aLogLevel);
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdint.h>
+#include "ip6.h"
+
+/**
+ * A message is a malloc'ed buffer that holds the whole datagram.
+ */
+typedef struct otMessage otMessage;
+
+typedef struct
+{
+    otIp6Address mSockAddr;
+    otIp6Address mPeerAddr;
+    uint16_t mSockPort;
+    uint16_t mPeerPort;
+    const void *mLinkInfo;
+    uint8_t mHopLimit;
+    uint8_t mEcn : 2;
+    bool mIsHostInterface : 1;
+    bool mAllowZeroHopLimit : 1;
+    bool mMulticastLoop : 1;
+} otMessageInfo;
+
+typedef struct
+{
+    bool mLinkSecurityEnabled;
+    uint8_t mPriority;
+} otMessageSettings;
+
+otError otMessageAppend(otMessage *aMessage, const void *aBuf, uint16_t aLength);
+uint16_t otMessageGetLength(const otMessage *aMessage);
+uint16_t otMessageRead(const otMessage *aMessage, uint16_t aOffset, void *aBuf, uint16_t aLength);
+void otMessageFree(otMessage *aMessage);
@@ -0,0 +1,9 @@
+#pragma once
+
+#include <stdbool.h>
+#include "instance.h"
+
+/**
+ * There is no SRP server to register with, so the client never runs.
+ */
+bool otSrpClientIsRunning(otInstance *aInstance);
@@ -0,0 +1,7 @@
+#pragma once
+
+#include <stdbool.h>
+#include "instance.h"
+
+otError otThreadSetEnabled(otInstance *aInstance, bool aEnabled);
+const char *otThreadErrorToString(otError aError);
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "message.h"
+
+typedef void (*otUdpReceive)(void *aContext, otMessage *aMessage, const otMessageInfo *aMessageInfo);
+
+typedef enum
+{
+    OT_NETIF_UNSPECIFIED = 0,
+    OT_NETIF_THREAD,
+    OT_NETIF_BACKBONE,
+} otNetifIdentifier;
+
+typedef struct otUdpSocket
+{
+    otSockAddr mSockName;
+    otSockAddr mPeerName;
+    otUdpReceive mHandler;
+    void *mContext;
+    void *mHandle; // The host socket behind it
+    struct otUdpSocket *mNext;
+} otUdpSocket;
+
+/**
+ * Sockets are the host's own UDP sockets, each with a thread that receives datagrams and hands them to the socket's
+ * handler with the OpenThread lock held, as the OpenThread task does.  In virtual time there are no host sockets, and
+ * datagrams only come and go through the simulation (host_udp_deliver() and host_udp_sent()).
+ */
+otMessage *otUdpNewMessage(otInstance *aInstance, const otMessageSettings *aSettings);
+otError otUdpOpen(otInstance *aInstance, otUdpSocket *aSocket, otUdpReceive aCallback, void *aContext);
+otError otUdpBind(otInstance *aInstance, otUdpSocket *aSocket, const otSockAddr *aSockName, otNetifIdentifier aNetif);
+otError otUdpClose(otInstance *aInstance, otUdpSocket *aSocket);
+otError otUdpSendDatagram(otInstance *aInstance, otMessage *aMessage, const otMessageInfo *aMessageInfo);
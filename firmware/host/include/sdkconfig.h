@@ -0,0 +1,52 @@
+#pragma once
+
+/**
+ * Stands in for the sdkconfig.h that an ESP-IDF build generates, with the defaults from main/Kconfig.projbuild.  Any
+ * of these can be overridden from the compiler command line.
+ */
+
+// Scripts are loaded relative to the directory that the host runtime is started in.
+#define CONFIG_LUA_ROOT "."
+#ifndef CONFIG_LOG_DEFAULT_LEVEL
+#define CONFIG_LOG_DEFAULT_LEVEL 3
+#endif
+
+#ifndef CONFIG_CCPEED_EVENT_QUEUE_SIZE
+#define CONFIG_CCPEED_EVENT_QUEUE_SIZE 64
+#endif
+#ifndef CONFIG_CCPEED_LUA_HEAP_LIMIT_KB
+#define CONFIG_CCPEED_LUA_HEAP_LIMIT_KB 192
+#endif
+#ifndef CONFIG_CCPEED_LUA_GC_IDLE_BUDGET_US
+#define CONFIG_CCPEED_LUA_GC_IDLE_BUDGET_US 2000
+#endif
+#ifndef CONFIG_CCPEED_LUA_GC_IDLE_STEP_KB
+#define CONFIG_CCPEED_LUA_GC_IDLE_STEP_KB 4
+#endif
+#ifndef CONFIG_CCPEED_LUA_BUDGET_INSTRUCTIONS
+#define CONFIG_CCPEED_LUA_BUDGET_INSTRUCTIONS 10000000
+#endif
+#ifndef CONFIG_CCPEED_LUA_BUDGET_MS
+#define CONFIG_CCPEED_LUA_BUDGET_MS 2000
+#endif
+#ifndef CONFIG_CCPEED_LUA_TASK_SLICE_MS
+#define CONFIG_CCPEED_LUA_TASK_SLICE_MS 0
+#endif
+#ifndef CONFIG_CCPEED_LUA_PROFILER_SLOTS
+#define CONFIG_CCPEED_LUA_PROFILER_SLOTS 64
+#endif
+#ifndef CONFIG_CCPEED_EVENT_STARVATION_LIMIT
+#define CONFIG_CCPEED_EVENT_STARVATION_LIMIT 8
+#endif
+#ifndef CONFIG_CCPEED_LUA_MAX_TASKS
+#define CONFIG_CCPEED_LUA_MAX_TASKS 8
+#endif
+#ifndef CONFIG_CCPEED_LUA_TASK_QUEUE_LENGTH
+#define CONFIG_CCPEED_LUA_TASK_QUEUE_LENGTH 32
+#endif
+#ifndef CONFIG_CCPEED_EVENT_POOL_BLOCKS
+#define CONFIG_CCPEED_EVENT_POOL_BLOCKS 8
+#endif
+#ifndef CONFIG_CCPEED_EVENT_POOL_BLOCK_SIZE
+#define CONFIG_CCPEED_EVENT_POOL_BLOCK_SIZE 1344
+#endif
@@ -0,0 +1,41 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <esp_log.h>
+#include "alloc_trace.h"
+
+#define TAG "alloc_trace"
+
+static lua_Alloc traced;
+static FILE *trace;
+
+static void *trace_alloc(void *ud, void *ptr, size_t osize, size_t nsize)
+{
+    void *result = traced(ud, ptr, osize, nsize);
+    alloc_trace_record_t record = {
+        .ptr = (uintptr_t)ptr,
+        .result = (uintptr_t)result,
+        .osize = osize,
+        .nsize = nsize,
+    };
+    // Lua only runs with the Lua mutex held, so records don't interleave, and exit() flushes the last of them.
+    fwrite(&record, sizeof(record), 1, trace);
+    return result;
+}
+
+lua_Alloc host_alloc_trace(lua_Alloc alloc)
+{
+    const char *path = getenv("CCPEED_ALLOC_TRACE");
+    if (!path)
+    {
+        return alloc;
+    }
+    trace = fopen(path, "wb");
+    if (!trace)
+    {
+        ESP_LOGE(TAG, "Could not open %s for the allocation trace", path);
+        return alloc;
+    }
+    ESP_LOGI(TAG, "Tracing Lua allocations to %s", path);
+    traced = alloc;
+    return trace_alloc;
+}
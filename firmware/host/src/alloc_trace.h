@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdint.h>
+#include <lua/lua.h>
+
+/**
+ * One call to the Lua allocator, as written to the trace.  Blocks are identified by their address at the time, so an
+ * address is the same block from the call that returns it until the one that frees it.
+ */
+typedef struct
+{
+    uint64_t ptr;    // Block passed in, or 0 for a new one
+    uint64_t result; // Block returned, or 0 if it was freed or the allocation failed
+    uint32_t osize;  // Old size, or the type of object for a new block
+    uint32_t nsize;
+} alloc_trace_record_t;
+
+/**
+ * Returns an allocator that writes every call to the file named by CCPEED_ALLOC_TRACE before passing it on to `alloc`,
+ * or `alloc` itself if that isn't set.  The trace can be replayed against other allocators with alloc_replay.
+ */
+lua_Alloc host_alloc_trace(lua_Alloc alloc);
@@ -0,0 +1,211 @@
+#include <stdlib.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+#include <esp_timer.h>
+#include <esp_log.h>
+#include "dali_driver.h"
+
+#define TAG "dali"
+#define MAX_GEAR 64
+#define FRAME_TIME_MS 20 // Forward frame, settling time and a backward frame, near enough.
+
+/**
+ * A DALI bus with simulated control gear on it, in place of the RMT driver.  Short addresses 0 to CCPEED_HOST_DALI_GEAR
+ * - 1 (8 by default) answer like a basic DT6 LED driver, which is enough for scripts to scan the bus and set levels.
+ *
+ * Frames are timed with an esp_timer rather than a task, so that the bus keeps to virtual time.  The command at the
+ * head of the queue is the one on the bus, and is only removed once its callback has been called.
+ */
+typedef struct
+{
+    uint16_t command;
+    dali_command_callback_t cb;
+    void *arg;
+} command_t;
+
+typedef struct
+{
+    uint8_t level;
+    uint8_t last_active;
+    uint8_t min;
+    uint8_t max;
+} gear_t;
+
+static gear_t gear[MAX_GEAR];
+static int num_gear;
+
+static void set_level(gear_t *g, int level)
+{
+    if (level == 0)
+    {
+        g->level = 0;
+        return;
+    }
+    g->level = level < g->min ? g->min : level > g->max ? g->max : level;
+    g->last_active = g->level;
+}
+
+/**
+ * Applies a forward frame to one piece of gear, returning the backward frame or DALI_RESPONSE_NAK for no answer.
+ */
+static int apply(gear_t *g, bool dapc, uint8_t data)
+{
+    if (dapc)
+    {
+        if (data != 0xFF)
+        {
+            set_level(g, data);
+        }
+        return DALI_RESPONSE_NAK;
+    }
+    switch (data)
+    {
+    case 0x00: // OFF
+        g->level = 0;
+        break;
+    case 0x01: // UP
+        if (g->level && g->level < g->max)
+        {
+            set_level(g, g->level + 1);
+        }
+        break;
+    case 0x02: // DOWN
+        if (g->level > g->min)
+        {
+            set_level(g, g->level - 1);
+        }
+        break;
+    case 0x05: // RECALL MAX LEVEL
+        set_level(g, g->max);
+        break;
+    case 0x06: // RECALL MIN LEVEL
+        set_level(g, g->min);
+        break;
+    case 0x0A: // GO TO LAST ACTIVE LEVEL
+        set_level(g, g->last_active);
+        break;
+    case 0x90: // QUERY STATUS
+        return g->level ? 0x04 : 0x00; // Lamp on, everything else fine
+    case 0x91: // QUERY CONTROL GEAR PRESENT
+        return 0xFF;
+    case 0x99: // QUERY DEVICE TYPE
+        return 6;
+    case 0xA0: // QUERY ACTUAL LEVEL
+        return g->level;
+    case 0xA1: // QUERY MAX LEVEL
+        return g->max;
+    case 0xA2: // QUERY MIN LEVEL
+        return g->min;
+    }
+    return DALI_RESPONSE_NAK;
+}
+
+static int transceive(uint16_t command)
+{
+    uint8_t addr = command >> 8;
+    uint8_t data = command & 0xFF;
+    bool dapc = (addr & 1) == 0;
+
+    if ((addr & 0xFE) == 0xFE)
+    {
+        // Broadcast.  Answers would collide, so queries are only answered by a lone device.
+        int response = DALI_RESPONSE_NAK;
+        for (int i = 0; i < num_gear; i++)
+        {
+            response = apply(&gear[i], dapc, data);
+        }
+        return num_gear > 1 && response != DALI_RESPONSE_NAK ? DALI_RESPONSE_COLLISION : response;
+    }
+    if ((addr & 0x80) == 0)
+    {
+        int short_addr = addr >> 1;
+        if (short_addr < num_gear)
+        {
+            return apply(&gear[short_addr], dapc, data);
+        }
+    }
+    // Group addresses and special commands aren't simulated.
+    return DALI_RESPONSE_NAK;
+}
+
+static portMUX_TYPE bus_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static void frame_done(void *arg)
+{
+    dali_driver_t *self = arg;
+    command_t command;
+
+    if (xQueuePeek(self->pending_cmd_queue, &command, 0) != pdTRUE)
+    {
+        return;
+    }
+    int response = transceive(command.command);
+    ESP_LOGD(TAG, "0x%04x -> %d", command.command, response);
+    if (command.cb)
+    {
+        command.cb(response, command.arg);
+    }
+
+    portENTER_CRITICAL(&bus_lock);
+    xQueueReceive(self->pending_cmd_queue, &command, 0);
+    if (uxQueueMessagesWaiting(self->pending_cmd_queue))
+    {
+        esp_timer_start_once(self->rxTimeoutTimer, FRAME_TIME_MS * 1000);
+    }
+    portEXIT_CRITICAL(&bus_lock);
+}
+
+ccpeed_err_t dali_send_command(dali_driver_t *driver, uint16_t value, dali_command_callback_t cb, void *arg)
+{
+    command_t command = {
+        .command = value,
+        .cb = cb,
+        .arg = arg,
+    };
+    ESP_LOGD(TAG, "Enqueueing 0x%04x", value);
+    portENTER_CRITICAL(&bus_lock);
+    if (xQueueSend(driver->pending_cmd_queue, &command, 0) == pdFALSE)
+    {
+        portEXIT_CRITICAL(&bus_lock);
+        ESP_LOGW(TAG, "TX Queue overflow");
+        return CCPEED_ERROR_NOMEM;
+    }
+    if (uxQueueMessagesWaiting(driver->pending_cmd_queue) == 1)
+    {
+        // The bus was idle.
+        esp_timer_start_once(driver->rxTimeoutTimer, FRAME_TIME_MS * 1000);
+    }
+    portEXIT_CRITICAL(&bus_lock);
+    return CCPEED_NO_ERR;
+}
+
+ccpeed_err_t dali_driver_init(dali_driver_t *driver, uint32_t tx, uint32_t rx)
+{
+    driver->tx_pin = tx;
+    driver->rx_pin = rx;
+
+    const char *env = getenv("CCPEED_HOST_DALI_GEAR");
+    num_gear = env ? atoi(env) : 8;
+    if (num_gear < 0 || num_gear > MAX_GEAR)
+    {
+        num_gear = MAX_GEAR;
+    }
+    for (int i = 0; i < num_gear; i++)
+    {
+        gear[i] = (gear_t){.level = 254, .last_active = 254, .min = 1, .max = 254};
+    }
+
+    driver->pending_cmd_queue = xQueueCreate(10, sizeof(command_t));
+    // There's nothing to receive, so the RX timeout timer is used to time frames instead.
+    const esp_timer_create_args_t timer_args = {
+        .callback = frame_done,
+        .arg = driver,
+        .name = "dali_frame",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &driver->rxTimeoutTimer));
+
+    ESP_LOGI(TAG, "Simulating %d DALI devices on TX: %lu, RX: %lu", num_gear, (unsigned long)driver->tx_pin,
+             (unsigned long)driver->rx_pin);
+    return CCPEED_NO_ERR;
+}
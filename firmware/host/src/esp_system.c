@@ -0,0 +1,345 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <esp_system.h>
+#include <esp_log.h>
+#include <esp_mac.h>
+#include <esp_app_desc.h>
+#include <esp_idf_version.h>
+#include <esp_partition.h>
+#include <esp_rom_crc.h>
+#include <esp_rom_md5.h>
+#include "host.h"
+
+#define TAG "host"
+#define MAX_TAG_LEVELS 32
+#define MAX_PARTITIONS 4
+
+typedef struct
+{
+    char tag[32];
+    esp_log_level_t level;
+} tag_level_t;
+
+typedef struct
+{
+    esp_partition_t part;
+    int fd;
+    const void *mapped;
+    size_t mapped_size;
+} host_partition_t;
+
+static const struct
+{
+    esp_err_t code;
+    const char *name;
+} err_names[] = {
+    {ESP_OK, "ESP_OK"},
+    {ESP_FAIL, "ESP_FAIL"},
+    {ESP_ERR_NO_MEM, "ESP_ERR_NO_MEM"},
+    {ESP_ERR_INVALID_ARG, "ESP_ERR_INVALID_ARG"},
+    {ESP_ERR_INVALID_STATE, "ESP_ERR_INVALID_STATE"},
+    {ESP_ERR_INVALID_SIZE, "ESP_ERR_INVALID_SIZE"},
+    {ESP_ERR_NOT_FOUND, "ESP_ERR_NOT_FOUND"},
+    {ESP_ERR_NOT_SUPPORTED, "ESP_ERR_NOT_SUPPORTED"},
+    {ESP_ERR_TIMEOUT, "ESP_ERR_TIMEOUT"},
+    {ESP_ERR_INVALID_RESPONSE, "ESP_ERR_INVALID_RESPONSE"},
+    {ESP_ERR_INVALID_CRC, "ESP_ERR_INVALID_CRC"},
+    {ESP_ERR_INVALID_VERSION, "ESP_ERR_INVALID_VERSION"},
+};
+
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static esp_log_level_t default_level = CONFIG_LOG_DEFAULT_LEVEL;
+static tag_level_t tag_levels[MAX_TAG_LEVELS];
+static host_partition_t partitions[MAX_PARTITIONS];
+static int num_partitions;
+static char **saved_argv;
+
+const char *esp_err_to_name(esp_err_t code)
+{
+    for (size_t i = 0; i < sizeof(err_names) / sizeof(err_names[0]); i++)
+    {
+        if (err_names[i].code == code)
+        {
+            return err_names[i].name;
+        }
+    }
+    return "UNKNOWN ERROR";
+}
+
+esp_log_level_t esp_log_level_get(const char *tag)
+{
+    esp_log_level_t level = default_level;
+    pthread_mutex_lock(&log_lock);
+    for (int i = 0; i < MAX_TAG_LEVELS && tag_levels[i].tag[0]; i++)
+    {
+        if (strcmp(tag_levels[i].tag, tag) == 0)
+        {
+            level = tag_levels[i].level;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&log_lock);
+    return level;
+}
+
+void esp_log_level_set(const char *tag, esp_log_level_t level)
+{
+    if (strcmp(tag, "*") == 0)
+    {
+        default_level = level;
+        return;
+    }
+    pthread_mutex_lock(&log_lock);
+    for (int i = 0; i < MAX_TAG_LEVELS; i++)
+    {
+        if (!tag_levels[i].tag[0] || strcmp(tag_levels[i].tag, tag) == 0)
+        {
+            strncpy(tag_levels[i].tag, tag, sizeof(tag_levels[i].tag) - 1);
+            tag_levels[i].level = level;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&log_lock);
+}
+
+void host_log(esp_log_level_t level, const char *tag, const char *fmt, ...)
+{
+    static const char letters[] = "NEWIDV";
+    if (level > esp_log_level_get(tag))
+    {
+        return;
+    }
+    va_list args;
+    va_start(args, fmt);
+    pthread_mutex_lock(&log_lock);
+    fprintf(stderr, "%c (%lu) %s: ", letters[level], (unsigned long)xTaskGetTickCount(), tag);
+    vfprintf(stderr, fmt, args);
+    // Device log lines don't carry their own newline, but some Lua printed ones do.
+    size_t len = strlen(fmt);
+    if (len == 0 || fmt[len - 1] != '\n')
+    {
+        fputc('\n', stderr);
+    }
+    pthread_mutex_unlock(&log_lock);
+    va_end(args);
+}
+
+void host_log_buffer_hex(esp_log_level_t level, const char *tag, const void *buf, size_t len)
+{
+    const uint8_t *bytes = buf;
+    char line[16 * 3 + 1];
+    for (size_t off = 0; off < len; off += 16)
+    {
+        size_t n = len - off < 16 ? len - off : 16;
+        for (size_t i = 0; i < n; i++)
+        {
+            snprintf(line + i * 3, 4, "%02x ", bytes[off + i]);
+        }
+        host_log(level, tag, "%s", line);
+    }
+}
+
+void host_init(int argc, char **argv)
+{
+    saved_argv = argv;
+    const char *level = getenv("CCPEED_LOG_LEVEL");
+    if (level)
+    {
+        default_level = atoi(level);
+    }
+}
+
+int esp_reset_reason(void)
+{
+    return getenv("CCPEED_HOST_RESTARTED") ? RESET_REASON_CORE_SW : RESET_REASON_CHIP_POWER_ON;
+}
+
+/**
+ * Restarting re-executes the runtime with the same arguments, so that a restart after syncing files behaves like it
+ * does on a device.
+ */
+void esp_restart(void)
+{
+    ESP_LOGI(TAG, "Restarting");
+    fflush(NULL);
+    setenv("CCPEED_HOST_RESTARTED", "1", 1);
+    if (saved_argv)
+    {
+        execv("/proc/self/exe", saved_argv);
+        ESP_LOGE(TAG, "Could not restart");
+    }
+    exit(0);
+}
+
+void heap_caps_get_info(multi_heap_info_t *info, uint32_t caps)
+{
+    struct mallinfo2 mi = mallinfo2();
+    memset(info, 0, sizeof(*info));
+    info->total_free_bytes = mi.fordblks;
+    info->total_allocated_bytes = mi.uordblks;
+    info->largest_free_block = mi.fordblks;
+    info->minimum_free_bytes = mi.fordblks;
+    info->allocated_blocks = mi.hblks;
+    info->free_blocks = mi.ordblks;
+    info->total_blocks = mi.hblks + mi.ordblks;
+}
+
+esp_err_t esp_efuse_mac_get_default(uint8_t *mac)
+{
+    static const uint8_t default_mac[8] = {0x02, 0x00, 0x00, 0xff, 0xfe, 0x00, 0x00, 0x01};
+    memcpy(mac, default_mac, sizeof(default_mac));
+    const char *env = getenv("CCPEED_HOST_MAC");
+    if (env)
+    {
+        for (int i = 0; i < 8 && isxdigit((unsigned char)env[i * 2]) && isxdigit((unsigned char)env[i * 2 + 1]); i++)
+        {
+            char byte[3] = {env[i * 2], env[i * 2 + 1], 0};
+            mac[i] = strtoul(byte, NULL, 16);
+        }
+    }
+    return ESP_OK;
+}
+
+const char *esp_get_idf_version(void)
+{
+    return "host";
+}
+
+const esp_app_desc_t *esp_app_get_description(void)
+{
+    static const esp_app_desc_t desc = {
+        .project_name = "coap_server",
+        .version = "host",
+        .idf_ver = "host",
+        .date = __DATE__,
+        .time = __TIME__,
+    };
+    return &desc;
+}
+
+uint32_t esp_rom_crc32_le(uint32_t crc, uint8_t const *buf, uint32_t len)
+{
+    // Same as zlib's crc32(), which is what the ROM implements.
+    crc = ~crc;
+    for (uint32_t i = 0; i < len; i++)
+    {
+        crc ^= buf[i];
+        for (int b = 0; b < 8; b++)
+        {
+            crc = (crc >> 1) ^ (0xEDB88320u & -(crc & 1));
+        }
+    }
+    return ~crc;
+}
+
+void esp_rom_md5_init(md5_context_t *context)
+{
+    mbedtls_md5_init(context);
+    mbedtls_md5_starts(context);
+}
+
+void esp_rom_md5_update(md5_context_t *context, const void *buf, uint32_t len)
+{
+    mbedtls_md5_update(context, buf, len);
+}
+
+void esp_rom_md5_final(uint8_t *digest, md5_context_t *context)
+{
+    mbedtls_md5_finish(context, digest);
+    mbedtls_md5_free(context);
+}
+
+const esp_partition_t *esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype,
+                                                const char *label)
+{
+    for (int i = 0; i < num_partitions; i++)
+    {
+        if (partitions[i].part.type == type && partitions[i].part.subtype == subtype &&
+            (!label || strcmp(partitions[i].part.label, label) == 0))
+        {
+            return &partitions[i].part;
+        }
+    }
+    if (!label || num_partitions == MAX_PARTITIONS)
+    {
+        return NULL;
+    }
+
+    char var[48] = "CCPEED_PARTITION_";
+    for (size_t i = strlen(var), j = 0; label[j] && i < sizeof(var) - 1; i++, j++)
+    {
+        var[i] = toupper((unsigned char)label[j]);
+    }
+    const char *path = getenv(var);
+    if (!path)
+    {
+        return NULL;
+    }
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        ESP_LOGE(TAG, "Could not open %s for partition %s", path, label);
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return NULL;
+    }
+    host_partition_t *p = &partitions[num_partitions++];
+    p->fd = fd;
+    p->part.type = type;
+    p->part.subtype = subtype;
+    p->part.size = st.st_size;
+    strncpy(p->part.label, label, sizeof(p->part.label) - 1);
+    return &p->part;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t *partition, size_t src_offset, void *dst, size_t size)
+{
+    const host_partition_t *p = (const host_partition_t *)partition;
+    if (src_offset + size > partition->size)
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    return pread(p->fd, dst, size, src_offset) == (ssize_t)size ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t esp_partition_mmap(const esp_partition_t *partition, size_t offset, size_t size,
+                             esp_partition_mmap_memory_t memory, const void **out_ptr,
+                             esp_partition_mmap_handle_t *out_handle)
+{
+    host_partition_t *p = (host_partition_t *)partition;
+    if (offset != 0 || size > partition->size || p->mapped)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    void *mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, p->fd, 0);
+    if (mapped == MAP_FAILED)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+    p->mapped = mapped;
+    p->mapped_size = size;
+    *out_ptr = mapped;
+    *out_handle = p - partitions;
+    return ESP_OK;
+}
+
+void esp_partition_munmap(esp_partition_mmap_handle_t handle)
+{
+    host_partition_t *p = &partitions[handle];
+    munmap((void *)p->mapped, p->mapped_size);
+    p->mapped = NULL;
+}
@@ -0,0 +1,321 @@
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <freertos/FreeRTOS.h>
+#include <esp_timer.h>
+#include <esp_log.h>
+#include "host.h"
+
+#define TAG "esp_timer"
+
+/**
+ * esp_timer on a single thread, standing in for the esp_timer task (and the ISR dispatch).  Armed timers are kept in a
+ * list sorted by expiry.
+ *
+ * With virtual time there is no timer thread.  The clock stands still until the Lua task has nothing left to do, when
+ * host_clock_advance() moves it straight on to the next deadline and runs the timer there and then.
+ */
+struct esp_timer
+{
+    esp_timer_cb_t callback;
+    void *arg;
+    const char *name;
+    int64_t expiry;
+    uint64_t period; // 0 for one shot timers
+    bool armed;
+    struct esp_timer *next;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t changed = PTHREAD_COND_INITIALIZER;
+static pthread_t timer_thread;
+static bool running;
+static struct esp_timer *armed;
+static struct esp_timer *dispatching; // The timer whose callback is running, so that it can be deleted safely.
+static pthread_t dispatch_thread;
+static uint32_t fired;
+
+static bool virtual_time;
+static int64_t virtual_now;
+static int64_t virtual_end = INT64_MAX;
+
+int64_t host_wall_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int64_t esp_timer_get_time(void)
+{
+    return virtual_time ? virtual_now : host_wall_time();
+}
+
+void host_clock_set_virtual(int64_t end_us)
+{
+    virtual_time = true;
+    virtual_end = end_us;
+}
+
+bool host_clock_is_virtual(void)
+{
+    return virtual_time;
+}
+
+uint32_t host_clock_timers_fired(void)
+{
+    return fired;
+}
+
+static void unlink_timer(struct esp_timer *t)
+{
+    for (struct esp_timer **p = &armed; *p; p = &(*p)->next)
+    {
+        if (*p == t)
+        {
+            *p = t->next;
+            break;
+        }
+    }
+    t->next = NULL;
+    t->armed = false;
+}
+
+static void insert_timer(struct esp_timer *t)
+{
+    struct esp_timer **p = &armed;
+    while (*p && (*p)->expiry <= t->expiry)
+    {
+        p = &(*p)->next;
+    }
+    t->next = *p;
+    *p = t;
+    t->armed = true;
+    pthread_cond_signal(&changed);
+}
+
+/**
+ * Runs a timer that has expired, re-arming it first if it is periodic.  Called with the lock held, which is dropped
+ * while the callback runs.
+ */
+static void dispatch(struct esp_timer *t, int64_t now)
+{
+    unlink_timer(t);
+    if (t->period)
+    {
+        t->expiry += t->period;
+        if (t->expiry < now)
+        {
+            // We fell behind.  Like skip_unhandled_events, just carry on from now rather than firing repeatedly.
+            t->expiry = now + t->period;
+        }
+        insert_timer(t);
+    }
+    fired++;
+    dispatching = t;
+    dispatch_thread = pthread_self();
+    pthread_mutex_unlock(&lock);
+    t->callback(t->arg);
+    pthread_mutex_lock(&lock);
+    dispatching = NULL;
+}
+
+static void *timer_worker(void *arg)
+{
+    host_set_isr_context(true);
+    pthread_mutex_lock(&lock);
+    while (running)
+    {
+        if (!armed)
+        {
+            pthread_cond_wait(&changed, &lock);
+            continue;
+        }
+        int64_t now = esp_timer_get_time();
+        struct esp_timer *t = armed;
+        if (t->expiry > now)
+        {
+            // CLOCK_MONOTONIC waits, so that the wall clock being changed doesn't matter.
+            struct timespec ts = {.tv_sec = t->expiry / 1000000, .tv_nsec = (t->expiry % 1000000) * 1000};
+            pthread_cond_timedwait(&changed, &lock, &ts);
+            continue;
+        }
+        dispatch(t, now);
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+bool host_clock_advance(int64_t limit)
+{
+    pthread_mutex_lock(&lock);
+    int64_t stop = limit < virtual_end ? limit : virtual_end;
+    struct esp_timer *t = armed;
+    if (!t || t->expiry > stop)
+    {
+        if (stop != INT64_MAX && stop > virtual_now)
+        {
+            virtual_now = stop;
+        }
+        pthread_mutex_unlock(&lock);
+        if (stop == virtual_end)
+        {
+            // Either the end was reached, or there is nothing left that could ever happen.
+            host_sim_finish();
+        }
+        return false;
+    }
+    if (t->expiry > virtual_now)
+    {
+        virtual_now = t->expiry;
+    }
+    host_set_isr_context(true);
+    dispatch(t, virtual_now);
+    host_set_isr_context(false);
+    pthread_mutex_unlock(&lock);
+    return true;
+}
+
+esp_err_t esp_timer_init(void)
+{
+    pthread_mutex_lock(&lock);
+    if (running)
+    {
+        pthread_mutex_unlock(&lock);
+        return ESP_ERR_INVALID_STATE;
+    }
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&changed, &attr);
+    pthread_condattr_destroy(&attr);
+    running = true;
+    pthread_mutex_unlock(&lock);
+    if (virtual_time)
+    {
+        return ESP_OK;
+    }
+    if (pthread_create(&timer_thread, NULL, timer_worker, NULL) != 0)
+    {
+        running = false;
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_deinit(void)
+{
+    pthread_mutex_lock(&lock);
+    if (!running)
+    {
+        pthread_mutex_unlock(&lock);
+        return ESP_ERR_INVALID_STATE;
+    }
+    running = false;
+    pthread_cond_signal(&changed);
+    pthread_mutex_unlock(&lock);
+    if (!virtual_time && !pthread_equal(pthread_self(), timer_thread))
+    {
+        pthread_join(timer_thread, NULL);
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *args, esp_timer_handle_t *out_handle)
+{
+    if (!args || !args->callback || !out_handle)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    struct esp_timer *t = calloc(1, sizeof(struct esp_timer));
+    if (!t)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+    t->callback = args->callback;
+    t->arg = args->arg;
+    t->name = args->name;
+    *out_handle = t;
+    return ESP_OK;
+}
+
+static esp_err_t start(esp_timer_handle_t t, uint64_t timeout_us, uint64_t period, bool restart)
+{
+    pthread_mutex_lock(&lock);
+    if (t->armed != restart)
+    {
+        pthread_mutex_unlock(&lock);
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (restart)
+    {
+        period = t->period ? timeout_us : 0;
+        unlink_timer(t);
+    }
+    t->expiry = esp_timer_get_time() + timeout_us;
+    t->period = period;
+    insert_timer(t);
+    pthread_mutex_unlock(&lock);
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t t, uint64_t timeout_us)
+{
+    return start(t, timeout_us, 0, false);
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t t, uint64_t period)
+{
+    return start(t, period, period, false);
+}
+
+esp_err_t esp_timer_restart(esp_timer_handle_t t, uint64_t timeout_us)
+{
+    return start(t, timeout_us, 0, true);
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t t)
+{
+    pthread_mutex_lock(&lock);
+    esp_err_t err = ESP_ERR_INVALID_STATE;
+    if (t->armed)
+    {
+        unlink_timer(t);
+        err = ESP_OK;
+    }
+    pthread_mutex_unlock(&lock);
+    return err;
+}
+
+esp_err_t esp_timer_delete(esp_timer_handle_t t)
+{
+    pthread_mutex_lock(&lock);
+    if (t->armed)
+    {
+        pthread_mutex_unlock(&lock);
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (dispatching == t && !pthread_equal(pthread_self(), dispatch_thread))
+    {
+        // Wait for the callback to finish, rather than freeing it out from under the timer thread.
+        while (dispatching == t)
+        {
+            pthread_mutex_unlock(&lock);
+            sched_yield();
+            pthread_mutex_lock(&lock);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    free(t);
+    return ESP_OK;
+}
+
+bool esp_timer_is_active(esp_timer_handle_t t)
+{
+    pthread_mutex_lock(&lock);
+    bool active = t->armed;
+    pthread_mutex_unlock(&lock);
+    return active;
+}
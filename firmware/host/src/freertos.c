@@ -0,0 +1,365 @@
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <errno.h>
+#include <malloc.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <esp_timer.h>
+#include <esp_log.h>
+#include "host.h"
+
+#define TAG "freertos"
+
+struct host_task
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint32_t notify;
+    TaskFunction_t fn;
+    void *arg;
+};
+
+struct host_queue
+{
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    UBaseType_t length;
+    UBaseType_t item_size;
+    UBaseType_t head;
+    UBaseType_t count;
+    uint8_t *items;
+};
+
+struct host_mutex
+{
+    pthread_mutex_t lock;
+};
+
+static pthread_mutex_t critical = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct host_task *current_task;
+static __thread bool in_isr;
+
+/**
+ * Works out the absolute time that a wait of `ticks` ends at, for the pthread timed waits.
+ */
+static struct timespec deadline_after(TickType_t ticks)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    uint64_t ns = ts.tv_nsec + (uint64_t)ticks * portTICK_PERIOD_MS * 1000000ULL;
+    ts.tv_sec += ns / 1000000000ULL;
+    ts.tv_nsec = ns % 1000000000ULL;
+    return ts;
+}
+
+/**
+ * Waits on a condition variable for up to `ticks`.  Returns false if the time ran out.
+ */
+static bool cond_wait(pthread_cond_t *cond, pthread_mutex_t *lock, TickType_t ticks, const struct timespec *deadline)
+{
+    if (ticks == portMAX_DELAY)
+    {
+        pthread_cond_wait(cond, lock);
+        return true;
+    }
+    return pthread_cond_timedwait(cond, lock, deadline) != ETIMEDOUT;
+}
+
+void portENTER_CRITICAL(portMUX_TYPE *mux)
+{
+    pthread_mutex_lock(&critical);
+}
+
+void portEXIT_CRITICAL(portMUX_TYPE *mux)
+{
+    pthread_mutex_unlock(&critical);
+}
+
+BaseType_t xPortInIsrContext(void)
+{
+    return in_isr;
+}
+
+void host_set_isr_context(bool isr)
+{
+    in_isr = isr;
+}
+
+size_t xPortGetFreeHeapSize(void)
+{
+    struct mallinfo2 info = mallinfo2();
+    return info.fordblks;
+}
+
+static struct host_task *task_new(TaskFunction_t fn, void *arg)
+{
+    struct host_task *task = calloc(1, sizeof(struct host_task));
+    assert(task);
+    pthread_mutex_init(&task->lock, NULL);
+    pthread_cond_init(&task->cond, NULL);
+    task->fn = fn;
+    task->arg = arg;
+    return task;
+}
+
+static void *task_entry(void *arg)
+{
+    current_task = arg;
+    current_task->fn(current_task->arg);
+    return NULL;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack_depth, void *arg, UBaseType_t priority,
+                       TaskHandle_t *handle)
+{
+    struct host_task *task = task_new(fn, arg);
+    if (pthread_create(&task->thread, NULL, task_entry, task) != 0)
+    {
+        ESP_LOGE(TAG, "Could not create task %s", name);
+        free(task);
+        return pdFAIL;
+    }
+    pthread_detach(task->thread);
+    if (handle)
+    {
+        *handle = task;
+    }
+    return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+    if (task == NULL || task == current_task)
+    {
+        pthread_exit(NULL);
+    }
+    ESP_LOGE(TAG, "Deleting another task isn't supported on the host");
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+    if (!current_task)
+    {
+        // A thread that wasn't created through xTaskCreate (i.e. main).
+        current_task = task_new(NULL, NULL);
+        current_task->thread = pthread_self();
+    }
+    return current_task;
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    struct timespec ts = {.tv_sec = ticks / 1000, .tv_nsec = (ticks % 1000) * 1000000L};
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+    {
+    }
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+    // Follows esp_timer, so that it keeps to virtual time too.
+    return (TickType_t)(esp_timer_get_time() / 1000);
+}
+
+void taskYIELD(void)
+{
+    sched_yield();
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+    pthread_mutex_lock(&task->lock);
+    task->notify++;
+    pthread_cond_signal(&task->cond);
+    pthread_mutex_unlock(&task->lock);
+    return pdPASS;
+}
+
+void vTaskNotifyGiveFromISR(TaskHandle_t task, BaseType_t *higher_priority_task_woken)
+{
+    xTaskNotifyGive(task);
+    if (higher_priority_task_woken)
+    {
+        *higher_priority_task_woken = pdTRUE;
+    }
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear_on_exit, TickType_t ticks_to_wait)
+{
+    struct host_task *task = xTaskGetCurrentTaskHandle();
+    if (host_clock_is_virtual() && ticks_to_wait)
+    {
+        // Nothing happens by itself in virtual time, so waiting is a matter of running timers until one of them
+        // notifies us, or the wait times out.
+        int64_t limit = ticks_to_wait == portMAX_DELAY ? INT64_MAX
+                                                       : esp_timer_get_time() + (int64_t)ticks_to_wait * 1000;
+        pthread_mutex_lock(&task->lock);
+        while (task->notify == 0)
+        {
+            pthread_mutex_unlock(&task->lock);
+            bool ran = host_clock_advance(limit);
+            pthread_mutex_lock(&task->lock);
+            if (!ran)
+            {
+                break;
+            }
+        }
+        pthread_mutex_unlock(&task->lock);
+        ticks_to_wait = 0;
+    }
+    struct timespec deadline = deadline_after(ticks_to_wait);
+    pthread_mutex_lock(&task->lock);
+    while (task->notify == 0 && ticks_to_wait && cond_wait(&task->cond, &task->lock, ticks_to_wait, &deadline))
+    {
+    }
+    uint32_t value = task->notify;
+    if (value)
+    {
+        task->notify = clear_on_exit ? 0 : value - 1;
+    }
+    pthread_mutex_unlock(&task->lock);
+    return value;
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size)
+{
+    struct host_queue *q = calloc(1, sizeof(struct host_queue));
+    if (!q)
+    {
+        return NULL;
+    }
+    q->items = malloc(length * item_size);
+    if (!q->items)
+    {
+        free(q);
+        return NULL;
+    }
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+    q->length = length;
+    q->item_size = item_size;
+    return q;
+}
+
+void vQueueDelete(QueueHandle_t q)
+{
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->not_empty);
+    pthread_cond_destroy(&q->not_full);
+    free(q->items);
+    free(q);
+}
+
+BaseType_t xQueueSend(QueueHandle_t q, const void *item, TickType_t ticks_to_wait)
+{
+    struct timespec deadline = deadline_after(ticks_to_wait);
+    pthread_mutex_lock(&q->lock);
+    while (q->count == q->length)
+    {
+        if (!ticks_to_wait || !cond_wait(&q->not_full, &q->lock, ticks_to_wait, &deadline))
+        {
+            pthread_mutex_unlock(&q->lock);
+            return pdFAIL;
+        }
+    }
+    memcpy(q->items + ((q->head + q->count) % q->length) * q->item_size, item, q->item_size);
+    q->count++;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+    return pdPASS;
+}
+
+BaseType_t xQueueSendFromISR(QueueHandle_t q, const void *item, BaseType_t *higher_priority_task_woken)
+{
+    if (higher_priority_task_woken)
+    {
+        *higher_priority_task_woken = pdFALSE;
+    }
+    return xQueueSend(q, item, 0);
+}
+
+BaseType_t xQueueReceive(QueueHandle_t q, void *item, TickType_t ticks_to_wait)
+{
+    struct timespec deadline = deadline_after(ticks_to_wait);
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0)
+    {
+        if (!ticks_to_wait || !cond_wait(&q->not_empty, &q->lock, ticks_to_wait, &deadline))
+        {
+            pthread_mutex_unlock(&q->lock);
+            return pdFAIL;
+        }
+    }
+    memcpy(item, q->items + q->head * q->item_size, q->item_size);
+    q->head = (q->head + 1) % q->length;
+    q->count--;
+    pthread_cond_signal(&q->not_full);
+    pthread_mutex_unlock(&q->lock);
+    return pdPASS;
+}
+
+BaseType_t xQueuePeek(QueueHandle_t q, void *item, TickType_t ticks_to_wait)
+{
+    struct timespec deadline = deadline_after(ticks_to_wait);
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0)
+    {
+        if (!ticks_to_wait || !cond_wait(&q->not_empty, &q->lock, ticks_to_wait, &deadline))
+        {
+            pthread_mutex_unlock(&q->lock);
+            return pdFAIL;
+        }
+    }
+    memcpy(item, q->items + q->head * q->item_size, q->item_size);
+    pthread_mutex_unlock(&q->lock);
+    return pdPASS;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t q)
+{
+    pthread_mutex_lock(&q->lock);
+    UBaseType_t count = q->count;
+    pthread_mutex_unlock(&q->lock);
+    return count;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+    struct host_mutex *m = calloc(1, sizeof(struct host_mutex));
+    if (m)
+    {
+        pthread_mutex_init(&m->lock, NULL);
+    }
+    return m;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t m)
+{
+    pthread_mutex_destroy(&m->lock);
+    free(m);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t m, TickType_t ticks_to_wait)
+{
+    if (ticks_to_wait == portMAX_DELAY)
+    {
+        return pthread_mutex_lock(&m->lock) == 0;
+    }
+    if (ticks_to_wait == 0)
+    {
+        return pthread_mutex_trylock(&m->lock) == 0;
+    }
+    struct timespec deadline = deadline_after(ticks_to_wait);
+    return pthread_mutex_timedlock(&m->lock, &deadline) == 0;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t m)
+{
+    return pthread_mutex_unlock(&m->lock) == 0;
+}
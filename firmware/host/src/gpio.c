@@ -0,0 +1,195 @@
+#include <pthread.h>
+#include <freertos/FreeRTOS.h>
+#include <driver/gpio.h>
+#include <esp_log.h>
+
+#define TAG "gpio"
+
+/**
+ * Pins on the host are just levels in memory.  Outputs hold whatever was last set, and inputs are driven from outside
+ * with host_gpio_drive(), which raises the pin's interrupt the way the GPIO ISR service would.
+ */
+typedef struct
+{
+    gpio_mode_t mode;
+    int level;
+    gpio_int_type_t intr_type;
+    bool intr_enabled;
+    gpio_isr_t handler;
+    void *arg;
+} host_pin_t;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static host_pin_t pins[GPIO_NUM_MAX];
+static bool isr_service;
+
+static bool valid_pin(gpio_num_t pin)
+{
+    return pin >= 0 && pin < GPIO_NUM_MAX;
+}
+
+esp_err_t gpio_config(const gpio_config_t *config)
+{
+    pthread_mutex_lock(&lock);
+    for (int i = 0; i < GPIO_NUM_MAX; i++)
+    {
+        if (config->pin_bit_mask & (1ULL << i))
+        {
+            pins[i].mode = config->mode;
+            pins[i].intr_type = config->intr_type;
+            // Pulled up inputs idle high, as a button to ground would.
+            pins[i].level = config->pull_up_en == GPIO_PULLUP_ENABLE;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return ESP_OK;
+}
+
+int gpio_get_level(gpio_num_t pin)
+{
+    if (!valid_pin(pin))
+    {
+        return 0;
+    }
+    pthread_mutex_lock(&lock);
+    int level = pins[pin].level;
+    pthread_mutex_unlock(&lock);
+    return level;
+}
+
+esp_err_t gpio_set_level(gpio_num_t pin, uint32_t level)
+{
+    if (!valid_pin(pin))
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    pthread_mutex_lock(&lock);
+    pins[pin].level = level ? 1 : 0;
+    pthread_mutex_unlock(&lock);
+    ESP_LOGD(TAG, "Pin %d set to %d", pin, level ? 1 : 0);
+    return ESP_OK;
+}
+
+esp_err_t gpio_set_intr_type(gpio_num_t pin, gpio_int_type_t intr_type)
+{
+    if (!valid_pin(pin) || intr_type >= GPIO_INTR_MAX)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    pthread_mutex_lock(&lock);
+    pins[pin].intr_type = intr_type;
+    pthread_mutex_unlock(&lock);
+    return ESP_OK;
+}
+
+static esp_err_t set_intr_enabled(gpio_num_t pin, bool enabled)
+{
+    if (!valid_pin(pin))
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    pthread_mutex_lock(&lock);
+    pins[pin].intr_enabled = enabled;
+    pthread_mutex_unlock(&lock);
+    return ESP_OK;
+}
+
+esp_err_t gpio_intr_enable(gpio_num_t pin)
+{
+    return set_intr_enabled(pin, true);
+}
+
+esp_err_t gpio_intr_disable(gpio_num_t pin)
+{
+    return set_intr_enabled(pin, false);
+}
+
+esp_err_t gpio_install_isr_service(int intr_alloc_flags)
+{
+    if (isr_service)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    isr_service = true;
+    return ESP_OK;
+}
+
+void gpio_uninstall_isr_service(void)
+{
+    isr_service = false;
+}
+
+esp_err_t gpio_isr_handler_add(gpio_num_t pin, gpio_isr_t isr_handler, void *args)
+{
+    if (!valid_pin(pin))
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!isr_service)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    pthread_mutex_lock(&lock);
+    pins[pin].handler = isr_handler;
+    pins[pin].arg = args;
+    pthread_mutex_unlock(&lock);
+    return ESP_OK;
+}
+
+esp_err_t gpio_isr_handler_remove(gpio_num_t pin)
+{
+    if (!valid_pin(pin))
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    pthread_mutex_lock(&lock);
+    pins[pin].handler = NULL;
+    pins[pin].arg = NULL;
+    pthread_mutex_unlock(&lock);
+    return ESP_OK;
+}
+
+static bool triggers(gpio_int_type_t type, int old_level, int level)
+{
+    switch (type)
+    {
+    case GPIO_INTR_POSEDGE:
+        return !old_level && level;
+    case GPIO_INTR_NEGEDGE:
+        return old_level && !level;
+    case GPIO_INTR_ANYEDGE:
+        return old_level != level;
+    case GPIO_INTR_LOW_LEVEL:
+        return !level;
+    case GPIO_INTR_HIGH_LEVEL:
+        return level;
+    default:
+        return false;
+    }
+}
+
+esp_err_t host_gpio_drive(gpio_num_t pin, int level)
+{
+    if (!valid_pin(pin))
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    level = level ? 1 : 0;
+    pthread_mutex_lock(&lock);
+    host_pin_t *p = &pins[pin];
+    int old_level = p->level;
+    p->level = level;
+    gpio_isr_t handler = isr_service && p->intr_enabled && triggers(p->intr_type, old_level, level) ? p->handler : NULL;
+    void *arg = p->arg;
+    pthread_mutex_unlock(&lock);
+
+    if (handler)
+    {
+        // The handler is run on the calling thread, marked as an ISR so that it takes the FromISR paths.
+        bool was_isr = xPortInIsrContext();
+        host_set_isr_context(true);
+        handler(arg);
+        host_set_isr_context(was_isr);
+    }
+    return ESP_OK;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Start up for the host shims.  Keeps argv so that esp_restart() can re-execute the runtime, and picks up the log
+ * level from CCPEED_LOG_LEVEL.
+ */
+void host_init(int argc, char **argv);
+
+/**
+ * The real monotonic clock in microseconds, whichever clock esp_timer is running on.
+ */
+int64_t host_wall_time(void);
+
+/**
+ * Switches esp_timer to virtual time, which only moves on when the Lua task is idle, ending the simulation when it
+ * reaches `end_us` (or INT64_MAX to run until nothing is left to happen).  Must be called before esp_timer_init().
+ */
+void host_clock_set_virtual(int64_t end_us);
+bool host_clock_is_virtual(void);
+
+/**
+ * Virtual time only.  Moves the clock on to the first timer due at or before `limit` and runs it, returning true.  If
+ * there isn't one the clock moves on to `limit` and false is returned.  Doesn't return if the simulation is over.
+ */
+bool host_clock_advance(int64_t limit);
+uint32_t host_clock_timers_fired(void);
+
+/**
+ * Delivers a datagram to the UDP listener on `port`, as if it had come in from the network.  Returns false if nothing
+ * is listening.  Takes the OpenThread lock, as receiving a datagram from the network does.
+ */
+bool host_udp_deliver(uint16_t port, const uint8_t peer_addr[16], uint16_t peer_port, const void *body, size_t len);
+
+/**
+ * Called for every datagram that Lua sends.  Returns true if it was taken by the simulation, and so shouldn't go out
+ * on the network.
+ */
+bool host_udp_sent(uint16_t sock_port, const uint8_t peer_addr[16], uint16_t peer_port, const void *body, size_t len);
+
+/**
+ * Runs `path` once init.lua has finished, with the sim module available to it.
+ */
+void host_sim_set_scenario(const char *path);
+
+/**
+ * Ends the simulation, reporting what happened.  Called from the Lua task when it is idle.
+ */
+void host_sim_finish(void) __attribute__((noreturn));
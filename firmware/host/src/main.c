@@ -0,0 +1,82 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#include "lua_system.h"
+#include "host.h"
+
+const static char *TAG = "CCPEED Host";
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [--virtual] [--until SECONDS] [--scenario FILE] [image directory]\n"
+                    "  --virtual        run on a virtual clock that jumps to the next timer when idle\n"
+                    "  --until SECONDS  end the simulation at this (virtual) time\n"
+                    "  --scenario FILE  Lua script to run after init.lua, using the sim module\n",
+            prog);
+}
+
+/**
+ * Runs the Lua runtime against a directory of scripts, in place of the SPIFFS image on a device.
+ */
+int main(int argc, char **argv)
+{
+    static const struct option options[] = {
+        {"virtual", no_argument, NULL, 'v'},
+        {"until", required_argument, NULL, 'u'},
+        {"scenario", required_argument, NULL, 's'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}};
+    bool virtual_time = false;
+    int64_t end_us = INT64_MAX;
+    char scenario[PATH_MAX];
+    int opt;
+
+    host_init(argc, argv);
+    while ((opt = getopt_long(argc, argv, "vu:s:h", options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'v':
+            virtual_time = true;
+            break;
+        case 'u':
+            end_us = (int64_t)(atof(optarg) * 1000000);
+            break;
+        case 's':
+            // Resolved now, as we're about to change directory.
+            if (!realpath(optarg, scenario))
+            {
+                ESP_LOGE(TAG, "Could not find scenario %s", optarg);
+                return 1;
+            }
+            host_sim_set_scenario(scenario);
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (optind < argc && chdir(argv[optind]) != 0)
+    {
+        ESP_LOGE(TAG, "Could not change to %s", argv[optind]);
+        return 1;
+    }
+    if (virtual_time)
+    {
+        host_clock_set_virtual(end_us);
+    }
+    else if (end_us != INT64_MAX)
+    {
+        ESP_LOGW(TAG, "--until only applies to virtual time");
+    }
+    ESP_ERROR_CHECK(esp_timer_init());
+
+    run_lua_loop();
+    return 0;
+}
@@ -0,0 +1,516 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <esp_log.h>
+#include <esp_mac.h>
+#include <esp_openthread.h>
+#include <esp_openthread_lock.h>
+#include <esp_openthread_netif_glue.h>
+#include <esp_vfs_eventfd.h>
+#include <openthread/udp.h>
+#include <openthread/thread.h>
+#include <openthread/dataset.h>
+#include <openthread/icmp6.h>
+#include <openthread/logging.h>
+#include <openthread/srp_client.h>
+#include "host.h"
+
+#define TAG "openthread"
+#define MESSAGE_MAX 1500 // Bigger than the MTU
+#define MAX_SOCKETS 16
+
+/**
+ * The OpenThread API on top of the host's own IPv6 stack, so that lua_openthread.c runs as it is.  There is no Thread
+ * network: the dataset is only kept, and the one address is loopback.  Everything that the OpenThread task does on a
+ * device - calling socket handlers - is done with the OpenThread lock held, as it is there.
+ */
+struct otInstance
+{
+    otOperationalDataset dataset;
+};
+
+struct otMessage
+{
+    uint16_t len;
+    uint8_t body[MESSAGE_MAX];
+};
+
+/**
+ * The host socket behind an otUdpSocket.  Lives until the socket is closed and its receiver thread (if it has one)
+ * has finished, whichever is later.
+ */
+typedef struct
+{
+    otUdpSocket *sock;
+    uint16_t port;
+    int fd;
+    bool closed;
+    bool receiving; // The receiver thread is running, and will free this once closed.
+    pthread_t thread;
+} host_socket_t;
+
+static otInstance instance;
+static pthread_mutex_t ot_lock = PTHREAD_MUTEX_INITIALIZER;
+// Bound sockets, by port, so that replies go out from the port that the request came in on, and so that the simulation
+// can deliver to them.  Only touched with the OpenThread lock held.
+static host_socket_t *sockets[MAX_SOCKETS];
+
+static otNetifAddress loopback = {
+    .mAddress.mFields.m8 = {[15] = 1},
+    .mPrefixLength = 128,
+    .mAddressOrigin = OT_ADDRESS_ORIGIN_MANUAL,
+    .mPreferred = true,
+    .mValid = true,
+};
+
+static struct
+{
+    int unused;
+} netif;
+
+bool esp_openthread_lock_acquire(TickType_t block_ticks)
+{
+    pthread_mutex_lock(&ot_lock);
+    return true;
+}
+
+void esp_openthread_lock_release(void)
+{
+    pthread_mutex_unlock(&ot_lock);
+}
+
+esp_err_t esp_openthread_init(const esp_openthread_platform_config_t *config)
+{
+    return ESP_OK;
+}
+
+otInstance *esp_openthread_get_instance(void)
+{
+    return &instance;
+}
+
+esp_err_t esp_openthread_launch_mainloop(void)
+{
+    while (1)
+    {
+        pause();
+    }
+    return ESP_OK;
+}
+
+void *esp_openthread_netif_glue_init(const esp_openthread_platform_config_t *config)
+{
+    return &netif;
+}
+
+void esp_openthread_netif_glue_deinit(void)
+{
+}
+
+esp_netif_t *esp_openthread_get_netif(void)
+{
+    return (esp_netif_t *)&netif;
+}
+
+esp_netif_t *esp_netif_new(const esp_netif_config_t *config)
+{
+    return (esp_netif_t *)&netif;
+}
+
+esp_err_t esp_netif_attach(esp_netif_t *esp_netif, esp_netif_iodriver_handle driver_handle)
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_netif_set_default_netif(esp_netif_t *esp_netif)
+{
+    return ESP_OK;
+}
+
+void esp_netif_destroy(esp_netif_t *esp_netif)
+{
+}
+
+esp_err_t esp_vfs_eventfd_unregister(void)
+{
+    return ESP_OK;
+}
+
+otError otLoggingSetLevel(otLogLevel aLogLevel)
+{
+    return OT_ERROR_NONE;
+}
+
+void otIcmp6SetEchoMode(otInstance *aInstance, otIcmp6EchoMode aMode)
+{
+}
+
+bool otSrpClientIsRunning(otInstance *aInstance)
+{
+    return false;
+}
+
+otError otIp6SetEnabled(otInstance *aInstance, bool aEnabled)
+{
+    return OT_ERROR_NONE;
+}
+
+otError otThreadSetEnabled(otInstance *aInstance, bool aEnabled)
+{
+    ESP_LOGI(TAG, "Using host networking, so there's no Thread network to %s", aEnabled ? "join" : "leave");
+    return OT_ERROR_NONE;
+}
+
+const otNetifAddress *otIp6GetUnicastAddresses(otInstance *aInstance)
+{
+    return &loopback;
+}
+
+void otIp6SetAddressCallback(otInstance *aInstance, otIp6AddressCallback aCallback, void *aCallbackContext)
+{
+    // The address is there from the start, so it's added as soon as anyone is listening.
+    if (aCallback)
+    {
+        otIp6AddressInfo info = {
+            .mAddress = &loopback.mAddress,
+            .mPrefixLength = loopback.mPrefixLength,
+            .mPreferred = true,
+        };
+        aCallback(&info, true, aCallbackContext);
+    }
+}
+
+otError otIp6AddressFromString(const char *aString, otIp6Address *aAddress)
+{
+    return inet_pton(AF_INET6, aString, aAddress->mFields.m8) == 1 ? OT_ERROR_NONE : OT_ERROR_PARSE;
+}
+
+otError otIp6PrefixFromString(const char *aString, otIp6Prefix *aPrefix)
+{
+    const char *slash = strchr(aString, '/');
+    char addr[INET6_ADDRSTRLEN];
+    if (!slash || slash - aString >= sizeof(addr))
+    {
+        return OT_ERROR_PARSE;
+    }
+    memcpy(addr, aString, slash - aString);
+    addr[slash - aString] = '\0';
+    char *end;
+    long len = strtol(slash + 1, &end, 10);
+    if (*end || end == slash + 1 || len < 0 || len > 128)
+    {
+        return OT_ERROR_PARSE;
+    }
+    aPrefix->mLength = len;
+    return otIp6AddressFromString(addr, &aPrefix->mPrefix);
+}
+
+void otIp6AddressToString(const otIp6Address *aAddress, char *aBuffer, uint16_t aSize)
+{
+    char buf[INET6_ADDRSTRLEN];
+    inet_ntop(AF_INET6, aAddress->mFields.m8, buf, sizeof(buf));
+    snprintf(aBuffer, aSize, "%s", buf);
+}
+
+const char *otThreadErrorToString(otError aError)
+{
+    switch (aError)
+    {
+    case OT_ERROR_NONE:
+        return "OK";
+    case OT_ERROR_FAILED:
+        return "Failed";
+    case OT_ERROR_NO_BUFS:
+        return "NoBufs";
+    case OT_ERROR_PARSE:
+        return "Parse";
+    case OT_ERROR_INVALID_ARGS:
+        return "InvalidArgs";
+    case OT_ERROR_INVALID_STATE:
+        return "InvalidState";
+    case OT_ERROR_NOT_FOUND:
+        return "NotFound";
+    case OT_ERROR_ALREADY:
+        return "Already";
+    default:
+        return "UnknownErrorType";
+    }
+}
+
+otError otDatasetCreateNewNetwork(otInstance *aInstance, otOperationalDataset *aDataset)
+{
+    // Made from the MAC address rather than at random, so that runs can be repeated.
+    uint8_t mac[8];
+    esp_efuse_mac_get_default(mac);
+    memset(aDataset, 0, sizeof(*aDataset));
+    aDataset->mChannel = 15;
+    aDataset->mPanId = (mac[6] << 8) | mac[7];
+    memcpy(aDataset->mExtendedPanId.m8, mac, sizeof(aDataset->mExtendedPanId.m8));
+    snprintf(aDataset->mNetworkName.m8, sizeof(aDataset->mNetworkName.m8), "OpenThread-%04x", aDataset->mPanId);
+    aDataset->mComponents.mIsChannelPresent = true;
+    aDataset->mComponents.mIsPanIdPresent = true;
+    aDataset->mComponents.mIsExtendedPanIdPresent = true;
+    aDataset->mComponents.mIsNetworkNamePresent = true;
+    return OT_ERROR_NONE;
+}
+
+otError otDatasetSetActive(otInstance *aInstance, const otOperationalDataset *aDataset)
+{
+    aInstance->dataset = *aDataset;
+    return OT_ERROR_NONE;
+}
+
+otMessage *otUdpNewMessage(otInstance *aInstance, const otMessageSettings *aSettings)
+{
+    otMessage *msg = malloc(sizeof(otMessage));
+    if (msg)
+    {
+        msg->len = 0;
+    }
+    return msg;
+}
+
+otError otMessageAppend(otMessage *aMessage, const void *aBuf, uint16_t aLength)
+{
+    if (aLength > sizeof(aMessage->body) - aMessage->len)
+    {
+        return OT_ERROR_NO_BUFS;
+    }
+    memcpy(aMessage->body + aMessage->len, aBuf, aLength);
+    aMessage->len += aLength;
+    return OT_ERROR_NONE;
+}
+
+uint16_t otMessageGetLength(const otMessage *aMessage)
+{
+    return aMessage->len;
+}
+
+uint16_t otMessageRead(const otMessage *aMessage, uint16_t aOffset, void *aBuf, uint16_t aLength)
+{
+    if (aOffset >= aMessage->len)
+    {
+        return 0;
+    }
+    if (aLength > aMessage->len - aOffset)
+    {
+        aLength = aMessage->len - aOffset;
+    }
+    memcpy(aBuf, aMessage->body + aOffset, aLength);
+    return aLength;
+}
+
+void otMessageFree(otMessage *aMessage)
+{
+    free(aMessage);
+}
+
+static host_socket_t *find_socket(uint16_t port)
+{
+    for (int i = 0; i < MAX_SOCKETS; i++)
+    {
+        if (sockets[i] && sockets[i]->port == port)
+        {
+            return sockets[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Hands a datagram to the socket's handler, as the OpenThread task would.  With the lock held.
+ */
+static void deliver(host_socket_t *hs, otMessage *msg, const uint8_t peer_addr[OT_IP6_ADDRESS_SIZE], uint16_t peer_port)
+{
+    otMessageInfo info = {
+        .mSockAddr = loopback.mAddress,
+        .mSockPort = hs->port,
+        .mPeerPort = peer_port,
+        .mHopLimit = 64,
+    };
+    memcpy(info.mPeerAddr.mFields.m8, peer_addr, OT_IP6_ADDRESS_SIZE);
+    hs->sock->mHandler(hs->sock->mContext, msg, &info);
+}
+
+static void *udp_receiver(void *arg)
+{
+    host_socket_t *hs = arg;
+    otMessage msg;
+    struct sockaddr_in6 peer;
+
+    while (1)
+    {
+        socklen_t peer_len = sizeof(peer);
+        ssize_t n = recvfrom(hs->fd, msg.body, sizeof(msg.body), 0, (struct sockaddr *)&peer, &peer_len);
+        int err = errno;
+        esp_openthread_lock_acquire(portMAX_DELAY);
+        if (hs->closed)
+        {
+            break;
+        }
+        if (n >= 0)
+        {
+            msg.len = n;
+            deliver(hs, &msg, peer.sin6_addr.s6_addr, ntohs(peer.sin6_port));
+        }
+        else if (err != EINTR)
+        {
+            ESP_LOGE(TAG, "Error receiving on port %d: %s", hs->port, strerror(err));
+            break;
+        }
+        esp_openthread_lock_release();
+    }
+    hs->receiving = false;
+    if (hs->closed)
+    {
+        close(hs->fd);
+        free(hs);
+    }
+    esp_openthread_lock_release();
+    return NULL;
+}
+
+bool host_udp_deliver(uint16_t port, const uint8_t peer_addr[16], uint16_t peer_port, const void *body, size_t len)
+{
+    // Injections come from the timer thread in real time, so this is done under the lock, as receiving is.
+    esp_openthread_lock_acquire(portMAX_DELAY);
+    host_socket_t *hs = find_socket(port);
+    if (hs)
+    {
+        otMessage *msg = otUdpNewMessage(&instance, NULL);
+        if (msg && otMessageAppend(msg, body, len) == OT_ERROR_NONE)
+        {
+            deliver(hs, msg, peer_addr, peer_port);
+        }
+        else
+        {
+            ESP_LOGW(TAG, "Can't deliver a %d byte datagram to port %d", (int)len, port);
+        }
+        otMessageFree(msg);
+    }
+    esp_openthread_lock_release();
+    return hs != NULL;
+}
+
+otError otUdpOpen(otInstance *aInstance, otUdpSocket *aSocket, otUdpReceive aCallback, void *aContext)
+{
+    memset(aSocket, 0, sizeof(*aSocket));
+    aSocket->mHandler = aCallback;
+    aSocket->mContext = aContext;
+    return OT_ERROR_NONE;
+}
+
+otError otUdpBind(otInstance *aInstance, otUdpSocket *aSocket, const otSockAddr *aSockName, otNetifIdentifier aNetif)
+{
+    int slot = 0;
+    while (slot < MAX_SOCKETS && sockets[slot])
+    {
+        slot++;
+    }
+    if (slot == MAX_SOCKETS || aSocket->mHandle)
+    {
+        return slot == MAX_SOCKETS ? OT_ERROR_NO_BUFS : OT_ERROR_ALREADY;
+    }
+    host_socket_t *hs = calloc(1, sizeof(host_socket_t));
+    if (!hs)
+    {
+        return OT_ERROR_NO_BUFS;
+    }
+    hs->sock = aSocket;
+    hs->port = aSockName->mPort;
+    hs->fd = -1;
+
+    // Nothing comes in from the network in virtual time, only what the simulation delivers.
+    if (!host_clock_is_virtual())
+    {
+        hs->fd = socket(AF_INET6, SOCK_DGRAM, 0);
+        int off = 0;
+        setsockopt(hs->fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+        struct sockaddr_in6 addr = {
+            .sin6_family = AF_INET6,
+            .sin6_addr = in6addr_any,
+            .sin6_port = htons(hs->port),
+        };
+        if (hs->fd < 0 || bind(hs->fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+        {
+            ESP_LOGE(TAG, "Could not bind to port %d: %s", hs->port, strerror(errno));
+            if (hs->fd >= 0)
+            {
+                close(hs->fd);
+            }
+            free(hs);
+            return OT_ERROR_FAILED;
+        }
+        hs->receiving = true;
+        pthread_create(&hs->thread, NULL, udp_receiver, hs);
+        pthread_detach(hs->thread);
+    }
+    sockets[slot] = hs;
+    aSocket->mSockName = *aSockName;
+    aSocket->mHandle = hs;
+    return OT_ERROR_NONE;
+}
+
+otError otUdpClose(otInstance *aInstance, otUdpSocket *aSocket)
+{
+    host_socket_t *hs = aSocket->mHandle;
+    if (!hs)
+    {
+        return OT_ERROR_NONE;
+    }
+    aSocket->mHandle = NULL;
+    for (int i = 0; i < MAX_SOCKETS; i++)
+    {
+        if (sockets[i] == hs)
+        {
+            sockets[i] = NULL;
+        }
+    }
+    hs->closed = true;
+    if (hs->receiving)
+    {
+        // Wakes the receiver thread up, which sees that it's closed and frees it.
+        shutdown(hs->fd, SHUT_RDWR);
+        return OT_ERROR_NONE;
+    }
+    if (hs->fd >= 0)
+    {
+        close(hs->fd);
+    }
+    free(hs);
+    return OT_ERROR_NONE;
+}
+
+otError otUdpSendDatagram(otInstance *aInstance, otMessage *aMessage, const otMessageInfo *aMessageInfo)
+{
+    const uint8_t *peer_addr = aMessageInfo->mPeerAddr.mFields.m8;
+    if (!host_udp_sent(aMessageInfo->mSockPort, peer_addr, aMessageInfo->mPeerPort, aMessage->body, aMessage->len))
+    {
+        struct sockaddr_in6 peer = {
+            .sin6_family = AF_INET6,
+            .sin6_port = htons(aMessageInfo->mPeerPort),
+        };
+        memcpy(peer.sin6_addr.s6_addr, peer_addr, OT_IP6_ADDRESS_SIZE);
+        host_socket_t *hs = find_socket(aMessageInfo->mSockPort);
+        int fd = hs && hs->fd >= 0 ? hs->fd : socket(AF_INET6, SOCK_DGRAM, 0);
+        ssize_t sent = sendto(fd, aMessage->body, aMessage->len, 0, (struct sockaddr *)&peer, sizeof(peer));
+        int err = errno;
+        if (!hs || hs->fd != fd)
+        {
+            close(fd);
+        }
+        if (sent < 0)
+        {
+            ESP_LOGE(TAG, "Could not send from port %d: %s", aMessageInfo->mSockPort, strerror(err));
+            return OT_ERROR_FAILED; // The message is still the caller's.
+        }
+    }
+    otMessageFree(aMessage);
+    return OT_ERROR_NONE;
+}
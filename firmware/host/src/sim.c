@@ -0,0 +1,473 @@
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <freertos/FreeRTOS.h>
+#include <driver/gpio.h>
+#include <esp_timer.h>
+#include <esp_log.h>
+#include <lua/lua.h>
+#include <lua/lauxlib.h>
+
+#include "lua_system.h"
+#include "loop_stats.h"
+#include "sim.h"
+#include "host.h"
+
+#define TAG "sim"
+#define MAX_OUTSTANDING 32
+#define DEFAULT_PEER_PORT 49152
+
+/**
+ * Drives the host runtime from a script: GPIO edges and datagrams are injected at set times, and datagrams that the
+ * device sends can be answered.  Everything is injected with esp_timer, so that it happens at the right moment in
+ * virtual time as well as real time.
+ */
+typedef enum
+{
+    INJECT_GPIO,
+    INJECT_DATAGRAM,
+} inject_kind_t;
+
+typedef struct
+{
+    esp_timer_handle_t timer;
+    inject_kind_t kind;
+    int pin;
+    int level;
+    uint16_t port;
+    uint8_t peer_addr[16];
+    uint16_t peer_port;
+    size_t len;
+    uint8_t body[];
+} injection_t;
+
+typedef struct
+{
+    uint8_t peer_addr[16];
+    uint16_t peer_port;
+    int64_t at;
+} outstanding_t;
+
+static struct
+{
+    uint32_t gpio_edges;
+    uint32_t datagrams_in;
+    uint32_t datagrams_out;
+    uint32_t undeliverable;
+    uint32_t timers_at_start;
+    int64_t wall_start;
+    int64_t time_start;
+    latency_histogram_t response; // From a datagram going in to the first one going back to the same peer.
+} stats;
+
+static outstanding_t outstanding[MAX_OUTSTANDING];
+static const char *scenario;
+static int on_send_ref = LUA_NOREF;
+static int on_finish_ref = LUA_NOREF;
+
+void host_sim_set_scenario(const char *path)
+{
+    scenario = path;
+}
+
+static void reset_stats()
+{
+    memset(&stats, 0, sizeof(stats));
+    stats.wall_start = host_wall_time();
+    stats.time_start = esp_timer_get_time();
+    stats.timers_at_start = host_clock_timers_fired();
+}
+
+static void call_on_send(lua_State *L, injection_t *inj)
+{
+    lua_rawgeti(L, LUA_REGISTRYINDEX, on_send_ref);
+    lua_newtable(L);
+    lua_pushstring(L, "body");
+    lua_pushlstring(L, (const char *)inj->body, inj->len);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "peer_addr");
+    lua_pushlstring(L, (const char *)inj->peer_addr, sizeof(inj->peer_addr));
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "peer_port");
+    lua_pushinteger(L, inj->peer_port);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "sock_port");
+    lua_pushinteger(L, inj->port);
+    lua_settable(L, -3);
+
+    if (lua_pcall(L, 1, 0, 0))
+    {
+        ESP_LOGE(TAG, "Error in on_send handler: %s", lua_tostring(L, -1));
+        lua_pop(L, 1);
+    }
+}
+
+/**
+ * Timer callback that carries out an injection, then frees it.
+ */
+static void inject(void *arg)
+{
+    injection_t *inj = arg;
+    switch (inj->kind)
+    {
+    case INJECT_GPIO:
+        stats.gpio_edges++;
+        host_gpio_drive(inj->pin, inj->level);
+        break;
+    case INJECT_DATAGRAM:
+        stats.datagrams_in++;
+        for (int i = 0; i < MAX_OUTSTANDING; i++)
+        {
+            if (outstanding[i].at == 0)
+            {
+                memcpy(outstanding[i].peer_addr, inj->peer_addr, sizeof(inj->peer_addr));
+                outstanding[i].peer_port = inj->peer_port;
+                outstanding[i].at = esp_timer_get_time();
+                break;
+            }
+        }
+        if (!host_udp_deliver(inj->port, inj->peer_addr, inj->peer_port, inj->body, inj->len))
+        {
+            stats.undeliverable++;
+            ESP_LOGW(TAG, "Nothing listening on port %d", inj->port);
+        }
+        break;
+    }
+    esp_timer_delete(inj->timer);
+    free(inj);
+}
+
+/**
+ * Hands a datagram that the device sent to the on_send handler, on the Lua task.
+ */
+static void dispatch_sent(lua_State *L, void *ctx)
+{
+    injection_t *inj = ctx;
+    if (on_send_ref != LUA_NOREF)
+    {
+        call_on_send(L, inj);
+    }
+    free(inj);
+}
+
+static injection_t *new_injection(lua_State *L, inject_kind_t kind, size_t len)
+{
+    injection_t *inj = calloc(1, sizeof(injection_t) + len);
+    if (!inj)
+    {
+        luaL_error(L, "Out of memory");
+    }
+    inj->kind = kind;
+    inj->len = len;
+    const esp_timer_create_args_t args = {
+        .callback = inject,
+        .arg = inj,
+        .name = "sim",
+    };
+    if (esp_timer_create(&args, &inj->timer) != ESP_OK)
+    {
+        free(inj);
+        luaL_error(L, "Could not create timer");
+    }
+    return inj;
+}
+
+static void schedule(injection_t *inj, int64_t delay_us)
+{
+    esp_timer_start_once(inj->timer, delay_us < 0 ? 0 : delay_us);
+}
+
+bool host_udp_sent(uint16_t sock_port, const uint8_t peer_addr[16], uint16_t peer_port, const void *body, size_t len)
+{
+    stats.datagrams_out++;
+    for (int i = 0; i < MAX_OUTSTANDING; i++)
+    {
+        outstanding_t *o = &outstanding[i];
+        if (o->at && o->peer_port == peer_port && memcmp(o->peer_addr, peer_addr, sizeof(o->peer_addr)) == 0)
+        {
+            histogram_record(&stats.response, esp_timer_get_time() - o->at);
+            o->at = 0;
+            break;
+        }
+    }
+    if (on_send_ref != LUA_NOREF)
+    {
+        // We're in the middle of some Lua, so the handler gets the datagram once that has finished.
+        injection_t *inj = calloc(1, sizeof(injection_t) + len);
+        if (inj)
+        {
+            inj->port = sock_port;
+            memcpy(inj->peer_addr, peer_addr, sizeof(inj->peer_addr));
+            inj->peer_port = peer_port;
+            inj->len = len;
+            memcpy(inj->body, body, len);
+            if (!schedule_callback(LUA_SOURCE_UDP, LUA_PRIORITY_NETWORK, dispatch_sent, inj))
+            {
+                free(inj);
+            }
+        }
+    }
+    return host_clock_is_virtual();
+}
+
+static int64_t delay_arg(lua_State *L, int idx)
+{
+    return (int64_t)(luaL_optnumber(L, idx, 0) * 1000);
+}
+
+/**
+ * sim.gpio(pin, level, [delay_ms]) - drives an input pin to a level.
+ */
+static int sim_gpio(lua_State *L)
+{
+    int pin = luaL_checkinteger(L, 1);
+    int level = lua_isboolean(L, 2) ? lua_toboolean(L, 2) : luaL_checkinteger(L, 2);
+    injection_t *inj = new_injection(L, INJECT_GPIO, 0);
+    inj->pin = pin;
+    inj->level = level;
+    schedule(inj, delay_arg(L, 3));
+    return 0;
+}
+
+/**
+ * sim.pulse(pin, level, duration_ms, [delay_ms]) - drives a pin to a level and back again, e.g. a button press.
+ */
+static int sim_pulse(lua_State *L)
+{
+    int pin = luaL_checkinteger(L, 1);
+    int level = lua_isboolean(L, 2) ? lua_toboolean(L, 2) : luaL_checkinteger(L, 2);
+    int64_t duration = (int64_t)(luaL_checknumber(L, 3) * 1000);
+    int64_t delay = delay_arg(L, 4);
+
+    injection_t *on = new_injection(L, INJECT_GPIO, 0);
+    on->pin = pin;
+    on->level = level;
+    injection_t *off = new_injection(L, INJECT_GPIO, 0);
+    off->pin = pin;
+    off->level = !level;
+    schedule(on, delay);
+    schedule(off, delay + duration);
+    return 0;
+}
+
+/**
+ * sim.datagram{port=, body=, [peer_addr=], [peer_port=], [delay_ms=]} - delivers a datagram to the listener on port.
+ */
+static int sim_datagram(lua_State *L)
+{
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_getfield(L, 1, "port");
+    lua_getfield(L, 1, "body");
+    lua_getfield(L, 1, "peer_addr");
+    lua_getfield(L, 1, "peer_port");
+    lua_getfield(L, 1, "delay_ms");
+
+    int port = luaL_checkinteger(L, 2);
+    size_t len;
+    const char *body = luaL_checklstring(L, 3, &len);
+    size_t addr_len = 16;
+    const char *peer_addr = lua_isnil(L, 4) ? (const char *)in6addr_loopback.s6_addr : lua_tolstring(L, 4, &addr_len);
+    luaL_argcheck(L, peer_addr && addr_len == 16, 1, "peer_addr must be a 16 byte string");
+
+    injection_t *inj = new_injection(L, INJECT_DATAGRAM, len);
+    inj->port = port;
+    memcpy(inj->peer_addr, peer_addr, sizeof(inj->peer_addr));
+    inj->peer_port = luaL_optinteger(L, 5, DEFAULT_PEER_PORT);
+    memcpy(inj->body, body, len);
+    schedule(inj, delay_arg(L, 6));
+    return 0;
+}
+
+static void set_handler(lua_State *L, int *ref)
+{
+    luaL_unref(L, LUA_REGISTRYINDEX, *ref);
+    *ref = LUA_NOREF;
+    if (!lua_isnoneornil(L, 1))
+    {
+        luaL_checktype(L, 1, LUA_TFUNCTION);
+        lua_pushvalue(L, 1);
+        *ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+}
+
+/**
+ * sim.on_send(fn) - fn(datagram) is called with each datagram that the device sends.
+ */
+static int sim_on_send(lua_State *L)
+{
+    set_handler(L, &on_send_ref);
+    return 0;
+}
+
+/**
+ * sim.on_finish(fn) - fn(stats) is called when the simulation ends.  If it raises an error the program exits with 1.
+ */
+static int sim_on_finish(lua_State *L)
+{
+    set_handler(L, &on_finish_ref);
+    return 0;
+}
+
+static int sim_now(lua_State *L)
+{
+    lua_pushnumber(L, (lua_Number)esp_timer_get_time() / 1000);
+    return 1;
+}
+
+static void push_stats(lua_State *L)
+{
+    int64_t wall_us = host_wall_time() - stats.wall_start;
+    int64_t time_us = esp_timer_get_time() - stats.time_start;
+
+    lua_newtable(L);
+    lua_pushstring(L, "virtual");
+    lua_pushboolean(L, host_clock_is_virtual());
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "elapsed_ms");
+    lua_pushinteger(L, time_us / 1000);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "wall_ms");
+    lua_pushinteger(L, wall_us / 1000);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "speedup");
+    lua_pushnumber(L, wall_us ? (lua_Number)time_us / wall_us : 0);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "timers_fired");
+    lua_pushinteger(L, host_clock_timers_fired() - stats.timers_at_start);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "gpio_edges");
+    lua_pushinteger(L, stats.gpio_edges);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "datagrams_in");
+    lua_pushinteger(L, stats.datagrams_in);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "datagrams_out");
+    lua_pushinteger(L, stats.datagrams_out);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "undeliverable");
+    lua_pushinteger(L, stats.undeliverable);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "response");
+    histogram_push(L, &stats.response);
+    lua_settable(L, -3);
+}
+
+/**
+ * sim.stats([reset]) - what has been simulated, and how long the device took to respond to datagrams.
+ */
+static int sim_stats(lua_State *L)
+{
+    push_stats(L);
+    if (lua_toboolean(L, 1))
+    {
+        reset_stats();
+    }
+    return 1;
+}
+
+static void report()
+{
+    int64_t wall_us = host_wall_time() - stats.wall_start;
+    int64_t time_us = esp_timer_get_time() - stats.time_start;
+    ESP_LOGI(TAG, "Simulated %.3fs in %.3fs (%.0fx)", time_us / 1e6, wall_us / 1e6,
+             wall_us ? (double)time_us / wall_us : 0.0);
+    ESP_LOGI(TAG, "%u timers fired, %u GPIO edges, %u datagrams in (%u undeliverable), %u out",
+             (unsigned)(host_clock_timers_fired() - stats.timers_at_start), (unsigned)stats.gpio_edges,
+             (unsigned)stats.datagrams_in, (unsigned)stats.undeliverable, (unsigned)stats.datagrams_out);
+    if (stats.response.count)
+    {
+        ESP_LOGI(TAG, "%u responses, mean %.1fms, max %.1fms", (unsigned)stats.response.count,
+                 stats.response.total_us / 1e3 / stats.response.count, stats.response.max_us / 1e3);
+    }
+}
+
+static void finish(lua_State *L)
+{
+    int status = 0;
+    if (on_finish_ref != LUA_NOREF)
+    {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, on_finish_ref);
+        push_stats(L);
+        if (lua_pcall(L, 1, 0, 0))
+        {
+            ESP_LOGE(TAG, "Error in on_finish handler: %s", lua_tostring(L, -1));
+            lua_pop(L, 1);
+            // It's where a scenario checks how the run went, so failing fails the run, as an error in the scenario does.
+            status = 1;
+        }
+    }
+    report();
+    fflush(NULL);
+    exit(status);
+}
+
+void host_sim_finish(void)
+{
+    finish(acquireLuaMutex(LUA_SOURCE_OTHER));
+}
+
+/**
+ * sim.stop() - ends the simulation now.
+ */
+static int sim_stop(lua_State *L)
+{
+    finish(L);
+    return 0;
+}
+
+static void run_scenario(lua_State *L, void *ctx)
+{
+    ESP_LOGI(TAG, "Running scenario %s", scenario);
+    reset_stats();
+    int r = luaL_loadfile(L, scenario);
+    if (r == LUA_OK)
+    {
+        r = lua_pcall(L, 0, 0, 0);
+    }
+    if (r)
+    {
+        lua_report_error(L, r, "Scenario Error");
+        // A scenario that fails ends the run, so that a broken benchmark or test doesn't pass for one that ran.
+        fflush(NULL);
+        exit(1);
+    }
+}
+
+static const struct luaL_Reg sim_funcs[] = {
+    {"gpio", sim_gpio},
+    {"pulse", sim_pulse},
+    {"datagram", sim_datagram},
+    {"on_send", sim_on_send},
+    {"on_finish", sim_on_finish},
+    {"now", sim_now},
+    {"stats", sim_stats},
+    {"stop", sim_stop},
+    {NULL, NULL}};
+
+int luaopen_sim(lua_State *L)
+{
+    luaL_newlib(L, sim_funcs);
+    lua_pushstring(L, "virtual");
+    lua_pushboolean(L, host_clock_is_virtual());
+    lua_settable(L, -3);
+
+    reset_stats();
+    if (scenario)
+    {
+        // The scenario runs after init.lua, once the device has set itself up.
+        schedule_callback_from_ISR(LUA_PRIORITY_HOUSEKEEPING, run_scenario, NULL);
+    }
+    return 1;
+}
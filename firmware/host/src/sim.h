@@ -0,0 +1,9 @@
+#ifndef HOST_SIM_H_
+#define HOST_SIM_H_
+
+#include <lua/lua.h>
+#include <lua/lauxlib.h>
+
+int luaopen_sim(lua_State *L);
+
+#endif /* HOST_SIM_H_ */
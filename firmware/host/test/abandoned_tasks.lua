@@ -0,0 +1,25 @@
+-- A task waiting on a future that is dropped is collected with it, and must give back its place in the pool, or once
+-- CONFIG_CCPEED_LUA_MAX_TASKS (8 on the host) of them had been, no task would run again.  Abandons 20, so that some are
+-- queued behind the others, and checks that a new task still runs and that the queued ones get to run too.
+local abandoned, started = 20, 0
+for _ = 1, abandoned do
+    start_async_task(function()
+        started = started + 1
+        await(Future:new())
+    end)
+end
+collectgarbage()
+
+local ran = false
+start_async_task(function() ran = true end)
+assert(ran, "a new task didn't run once abandoned ones had been collected")
+
+-- The queued tasks start from callbacks of their own, and are abandoned in turn.
+Timer:new(function(timer)
+    collectgarbage()
+    if started == abandoned then
+        timer:stop()
+        print("abandoned_tasks: ok")
+        sim.stop()
+    end
+end):start(100, true)
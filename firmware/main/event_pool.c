@@ -0,0 +1,103 @@
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <lua/lua.h>
+#include <lua/lauxlib.h>
+#include <esp_log.h>
+#include "sdkconfig.h"
+#include "event_pool.h"
+
+#define TAG "event_pool"
+#define POOL_BLOCKS CONFIG_CCPEED_EVENT_POOL_BLOCKS
+#define BLOCK_SIZE ((CONFIG_CCPEED_EVENT_POOL_BLOCK_SIZE + 7) & ~7)
+
+_Static_assert(POOL_BLOCKS <= 32, "CONFIG_CCPEED_EVENT_POOL_BLOCKS must fit in the in use bitmap");
+
+typedef struct
+{
+    atomic_uint in_use; // Number of blocks allocated right now.
+    uint32_t high_water;
+    atomic_uint allocated;
+    atomic_uint exhausted; // Allocations that failed because every block was in use.
+    atomic_uint oversized; // Allocations that failed because they were bigger than a block.
+} pool_stats_t;
+
+static uint8_t blocks[POOL_BLOCKS][BLOCK_SIZE] __attribute__((aligned(8)));
+static atomic_uint_least32_t used; // Bit n set means blocks[n] is allocated.
+static pool_stats_t stats;
+
+void *event_pool_alloc(size_t size)
+{
+    if (size > BLOCK_SIZE)
+    {
+        atomic_fetch_add_explicit(&stats.oversized, 1, memory_order_relaxed);
+        return NULL;
+    }
+    uint32_t map = atomic_load_explicit(&used, memory_order_relaxed);
+    for (;;)
+    {
+        uint32_t free_map = ~map & (POOL_BLOCKS == 32 ? UINT32_MAX : (1u << POOL_BLOCKS) - 1);
+        if (!free_map)
+        {
+            atomic_fetch_add_explicit(&stats.exhausted, 1, memory_order_relaxed);
+            return NULL;
+        }
+        int n = __builtin_ctz(free_map);
+        if (atomic_compare_exchange_weak_explicit(&used, &map, map | (1u << n), memory_order_acquire,
+                                                  memory_order_relaxed))
+        {
+            unsigned int in_use = atomic_fetch_add_explicit(&stats.in_use, 1, memory_order_relaxed) + 1;
+            // Racy, but it's only a statistic.
+            if (in_use > stats.high_water)
+            {
+                stats.high_water = in_use;
+            }
+            atomic_fetch_add_explicit(&stats.allocated, 1, memory_order_relaxed);
+            return blocks[n];
+        }
+    }
+}
+
+void event_pool_free(void *block)
+{
+    if (!block)
+    {
+        return;
+    }
+    size_t n = ((uint8_t *)block - &blocks[0][0]) / BLOCK_SIZE;
+    assert(n < POOL_BLOCKS && block == blocks[n]);
+    atomic_fetch_sub_explicit(&stats.in_use, 1, memory_order_relaxed);
+    atomic_fetch_and_explicit(&used, ~(1u << n), memory_order_release);
+}
+
+void event_pool_push_stats(lua_State *L)
+{
+    lua_newtable(L);
+    lua_pushstring(L, "blocks");
+    lua_pushinteger(L, POOL_BLOCKS);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "block_size");
+    lua_pushinteger(L, BLOCK_SIZE);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "in_use");
+    lua_pushinteger(L, atomic_load(&stats.in_use));
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "high_water");
+    lua_pushinteger(L, stats.high_water);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "allocated");
+    lua_pushinteger(L, atomic_load(&stats.allocated));
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "exhausted");
+    lua_pushinteger(L, atomic_load(&stats.exhausted));
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "oversized");
+    lua_pushinteger(L, atomic_load(&stats.oversized));
+    lua_settable(L, -3);
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stddef.h>
+#include <lua/lua.h>
+
+/**
+ * A fixed pool of buffers for handing data from other tasks (and ISRs) to the Lua task through the event queue.
+ * Allocation never blocks and never touches the heap - if there's no free block, or the request is bigger than a
+ * block, NULL is returned and the caller should drop whatever it was delivering.
+ */
+void *event_pool_alloc(size_t size);
+void event_pool_free(void *block);
+void event_pool_push_stats(lua_State *L);
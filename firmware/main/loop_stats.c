@@ -0,0 +1,144 @@
+#include <string.h>
+#include <lua/lua.h>
+#include <lua/lauxlib.h>
+#include "loop_stats.h"
+#include "lua_system.h"
+
+typedef struct
+{
+    latency_histogram_t queued; // Time between the event being raised and its callback starting.
+    latency_histogram_t run;    // Time spent running the callback.
+} source_stats_t;
+
+static source_stats_t source_stats[LUA_SOURCE_MAX];
+
+static const code_lookup_t source_names[] = {
+    {.sval = "boot", .ival = LUA_SOURCE_BOOT},
+    {.sval = "other", .ival = LUA_SOURCE_OTHER},
+    {.sval = "timer", .ival = LUA_SOURCE_TIMER},
+    {.sval = "gpio", .ival = LUA_SOURCE_GPIO},
+    {.sval = "dali", .ival = LUA_SOURCE_DALI},
+    {.sval = "udp", .ival = LUA_SOURCE_UDP},
+    {.sval = "task", .ival = LUA_SOURCE_TASK},
+    {.sval = "idle", .ival = LUA_SOURCE_IDLE},
+    {.sval = NULL, .ival = -1}};
+
+const char *lua_source_name(lua_source_type_t source)
+{
+    return code_int_to_str(source, source_names);
+}
+
+void histogram_record(latency_histogram_t *h, int64_t us)
+{
+    if (us < 0)
+    {
+        us = 0;
+    }
+    uint32_t v = us > UINT32_MAX ? UINT32_MAX : (uint32_t)us;
+
+    // Index is the bit length of the value, less the 5 bits that all fall into the first bucket.
+    int bucket = v < 32 ? 0 : (32 - __builtin_clz(v)) - 5;
+    if (bucket >= LATENCY_HISTOGRAM_BUCKETS)
+    {
+        bucket = LATENCY_HISTOGRAM_BUCKETS - 1;
+    }
+    h->buckets[bucket]++;
+    h->count++;
+    h->total_us += v;
+    if (v > h->max_us)
+    {
+        h->max_us = v;
+    }
+}
+
+void histogram_push(lua_State *L, const latency_histogram_t *h)
+{
+    lua_newtable(L);
+    lua_pushstring(L, "count");
+    lua_pushinteger(L, h->count);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "max_us");
+    lua_pushinteger(L, h->max_us);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "mean_us");
+    lua_pushinteger(L, h->count ? h->total_us / h->count : 0);
+    lua_settable(L, -3);
+
+    // The 99th percentile, to the upper bound of the bucket that it falls in (or the maximum, if that's lower).
+    uint32_t p99 = 0;
+    uint32_t seen = 0;
+    for (int i = 0; h->count && i < LATENCY_HISTOGRAM_BUCKETS; i++)
+    {
+        seen += h->buckets[i];
+        if ((uint64_t)seen * 100 >= (uint64_t)h->count * 99)
+        {
+            p99 = i < LATENCY_HISTOGRAM_BUCKETS - 1 && (32u << i) < h->max_us ? 32u << i : h->max_us;
+            break;
+        }
+    }
+    lua_pushstring(L, "p99_us");
+    lua_pushinteger(L, p99);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "buckets");
+    lua_createtable(L, LATENCY_HISTOGRAM_BUCKETS, 0);
+    for (int i = 0; i < LATENCY_HISTOGRAM_BUCKETS; i++)
+    {
+        lua_pushinteger(L, h->buckets[i]);
+        lua_rawseti(L, -2, i + 1);
+    }
+    lua_settable(L, -3);
+}
+
+void loop_stats_record_queued(lua_source_type_t source, int64_t us)
+{
+    histogram_record(&source_stats[source].queued, us);
+}
+
+void loop_stats_record_run(lua_source_type_t source, int64_t us)
+{
+    histogram_record(&source_stats[source].run, us);
+}
+
+void loop_stats_push(lua_State *L)
+{
+    lua_newtable(L);
+
+    // Upper bound of each bucket, so that readers don't need to know how they are laid out.  The last one is unbounded.
+    lua_pushstring(L, "bucket_upper_us");
+    lua_createtable(L, LATENCY_HISTOGRAM_BUCKETS - 1, 0);
+    for (int i = 0; i < LATENCY_HISTOGRAM_BUCKETS - 1; i++)
+    {
+        lua_pushinteger(L, 32LL << i);
+        lua_rawseti(L, -2, i + 1);
+    }
+    lua_settable(L, -3);
+
+    for (int i = 0; i < LUA_SOURCE_MAX; i++)
+    {
+        source_stats_t *s = &source_stats[i];
+        if (s->queued.count == 0 && s->run.count == 0)
+        {
+            continue;
+        }
+        lua_pushstring(L, lua_source_name(i));
+        lua_newtable(L);
+
+        lua_pushstring(L, "queued");
+        histogram_push(L, &s->queued);
+        lua_settable(L, -3);
+
+        lua_pushstring(L, "run");
+        histogram_push(L, &s->run);
+        lua_settable(L, -3);
+
+        lua_settable(L, -3);
+    }
+}
+
+void loop_stats_reset()
+{
+    memset(source_stats, 0, sizeof(source_stats));
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <lua/lua.h>
+
+#define LATENCY_HISTOGRAM_BUCKETS 16
+
+/**
+ * The kinds of things that cause Lua code to run.  Used to attribute latency (and later, other costs) to where it came from.
+ */
+typedef enum
+{
+    LUA_SOURCE_BOOT,
+    LUA_SOURCE_OTHER,
+    LUA_SOURCE_TIMER,
+    LUA_SOURCE_GPIO,
+    LUA_SOURCE_DALI,
+    LUA_SOURCE_UDP,
+    LUA_SOURCE_TASK, // An async task carrying on after being time sliced.
+    LUA_SOURCE_IDLE,
+    LUA_SOURCE_MAX,
+} lua_source_type_t;
+
+/**
+ * Fixed bucket histogram of durations in microseconds. Bucket 0 holds everything under 32us, and each subsequent bucket
+ * doubles the upper bound, with the last one catching everything else (over ~0.5s).
+ */
+typedef struct
+{
+    uint32_t buckets[LATENCY_HISTOGRAM_BUCKETS];
+    uint32_t count;
+    uint32_t max_us;
+    uint64_t total_us;
+} latency_histogram_t;
+
+void histogram_record(latency_histogram_t *h, int64_t us);
+void histogram_push(lua_State *L, const latency_histogram_t *h);
+
+const char *lua_source_name(lua_source_type_t source);
+
+void loop_stats_record_queued(lua_source_type_t source, int64_t us);
+void loop_stats_record_run(lua_source_type_t source, int64_t us);
+void loop_stats_push(lua_State *L);
+void loop_stats_reset();
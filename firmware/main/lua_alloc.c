@@ -0,0 +1,457 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <esp_log.h>
+#include <lua/lua.h>
+#include <lua/lauxlib.h>
+#include "lua_alloc.h"
+#include "lua_system.h"
+#include "sdkconfig.h"
+
+#define TAG "lua_alloc"
+
+#define SLAB_SIZE 2048
+#define SLAB_ALIGN 8 // Lua needs blocks aligned for a lua_Number
+#define NUM_SIZE_CLASSES (sizeof(size_classes) / sizeof(size_classes[0]))
+#define MAX_SLAB_OBJECT 128
+#define SLAB_INDEX_INITIAL 16
+
+// Chosen to fit what Lua allocates most of on a 32 bit target - short strings, closures, upvalues and small tables.
+static const uint16_t size_classes[] = {16, 24, 32, 48, 64, 96, 128};
+
+/**
+ * A slab is a fixed sized chunk of system heap carved up into equal sized blocks.  Slabs with at least one free block
+ * are kept on a per class list, and every slab is in the (address ordered) slab index so that a pointer being freed can
+ * be traced back to its slab.
+ */
+typedef struct slab
+{
+    struct slab *next; // Neighbours on the class's list of slabs with free blocks.
+    struct slab *prev;
+    void *free_list;
+    uint16_t used;
+    uint16_t capacity;
+    uint8_t size_class;
+    bool available; // True when on the available list.
+} slab_t;
+
+#define SLAB_HEADER_SIZE ((sizeof(slab_t) + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1))
+
+typedef struct
+{
+    slab_t *available;
+    uint32_t slabs;
+    uint32_t used;
+} size_class_t;
+
+// Lua type tags for the objects we count.  Everything that isn't one of these (arrays, protos, upvalues) is "other".
+static const code_lookup_t object_types[] = {
+    {.sval = "string", .ival = LUA_TSTRING},
+    {.sval = "table", .ival = LUA_TTABLE},
+    {.sval = "function", .ival = LUA_TFUNCTION},
+    {.sval = "userdata", .ival = LUA_TUSERDATA},
+    {.sval = "thread", .ival = LUA_TTHREAD},
+    {.sval = "other", .ival = LUA_NUMTYPES},
+    {.sval = NULL, .ival = -1}};
+
+typedef struct
+{
+    size_t limit;
+    size_t in_use;           // Bytes that Lua thinks it has allocated.
+    size_t peak;
+    size_t large_bytes;      // Of in_use, how much went straight to the system heap.
+    uint32_t failed;         // Allocations refused, either because of the limit or because the system heap is out.
+    uint32_t objects[LUA_NUMTYPES + 1];
+    uint64_t allocated_by[LUA_SOURCE_MAX]; // Cumulative bytes allocated while each type of event was being handled.
+} heap_stats_t;
+
+static size_class_t classes[NUM_SIZE_CLASSES];
+static slab_t **slab_index;
+static uint32_t slab_index_count;
+static uint32_t slab_index_capacity;
+static heap_stats_t stats = {.limit = CONFIG_CCPEED_LUA_HEAP_LIMIT_KB * 1024};
+
+static int size_class_for(size_t size)
+{
+    for (int i = 0; i < NUM_SIZE_CLASSES; i++)
+    {
+        if (size <= size_classes[i])
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Finds the position in the index at which a slab containing ptr would be, i.e the number of slabs starting at or below
+ * ptr.
+ */
+static uint32_t slab_index_search(const void *ptr)
+{
+    uint32_t lo = 0, hi = slab_index_count;
+    while (lo < hi)
+    {
+        uint32_t mid = (lo + hi) / 2;
+        if ((const void *)slab_index[mid] <= ptr)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static slab_t *slab_for(const void *ptr)
+{
+    uint32_t pos = slab_index_search(ptr);
+    if (pos == 0)
+    {
+        return NULL;
+    }
+    slab_t *slab = slab_index[pos - 1];
+    return (const uint8_t *)ptr < (const uint8_t *)slab + SLAB_SIZE ? slab : NULL;
+}
+
+static void available_push(size_class_t *cls, slab_t *slab)
+{
+    slab->prev = NULL;
+    slab->next = cls->available;
+    if (cls->available)
+    {
+        cls->available->prev = slab;
+    }
+    cls->available = slab;
+    slab->available = true;
+}
+
+static void available_remove(size_class_t *cls, slab_t *slab)
+{
+    if (slab->prev)
+    {
+        slab->prev->next = slab->next;
+    }
+    else
+    {
+        cls->available = slab->next;
+    }
+    if (slab->next)
+    {
+        slab->next->prev = slab->prev;
+    }
+    slab->next = slab->prev = NULL;
+    slab->available = false;
+}
+
+static slab_t *slab_new(int class_idx)
+{
+    if (slab_index_count == slab_index_capacity)
+    {
+        uint32_t capacity = slab_index_capacity ? slab_index_capacity * 2 : SLAB_INDEX_INITIAL;
+        slab_t **index = realloc(slab_index, capacity * sizeof(slab_t *));
+        if (!index)
+        {
+            return NULL;
+        }
+        slab_index = index;
+        slab_index_capacity = capacity;
+    }
+
+    slab_t *slab = malloc(SLAB_SIZE);
+    if (!slab)
+    {
+        return NULL;
+    }
+    uint16_t block_size = size_classes[class_idx];
+    slab->size_class = class_idx;
+    slab->used = 0;
+    slab->capacity = (SLAB_SIZE - SLAB_HEADER_SIZE) / block_size;
+
+    // Thread the free list through the blocks, lowest address first.
+    uint8_t *blocks = (uint8_t *)slab + SLAB_HEADER_SIZE;
+    slab->free_list = NULL;
+    for (int i = slab->capacity - 1; i >= 0; i--)
+    {
+        void **block = (void **)(blocks + i * block_size);
+        *block = slab->free_list;
+        slab->free_list = block;
+    }
+
+    uint32_t pos = slab_index_search(slab);
+    memmove(&slab_index[pos + 1], &slab_index[pos], (slab_index_count - pos) * sizeof(slab_t *));
+    slab_index[pos] = slab;
+    slab_index_count++;
+
+    classes[class_idx].slabs++;
+    available_push(&classes[class_idx], slab);
+    return slab;
+}
+
+static void slab_release(slab_t *slab)
+{
+    size_class_t *cls = &classes[slab->size_class];
+    available_remove(cls, slab);
+    cls->slabs--;
+
+    uint32_t pos = slab_index_search(slab) - 1;
+    memmove(&slab_index[pos], &slab_index[pos + 1], (slab_index_count - pos - 1) * sizeof(slab_t *));
+    slab_index_count--;
+    free(slab);
+}
+
+static void *slab_alloc(int class_idx)
+{
+    size_class_t *cls = &classes[class_idx];
+    slab_t *slab = cls->available;
+    if (!slab)
+    {
+        slab = slab_new(class_idx);
+        if (!slab)
+        {
+            return NULL;
+        }
+    }
+    void **block = slab->free_list;
+    slab->free_list = *block;
+    slab->used++;
+    cls->used++;
+    if (slab->used == slab->capacity)
+    {
+        available_remove(cls, slab);
+    }
+    return block;
+}
+
+static void slab_free(slab_t *slab, void *ptr)
+{
+    size_class_t *cls = &classes[slab->size_class];
+    void **block = ptr;
+    *block = slab->free_list;
+    slab->free_list = block;
+    slab->used--;
+    cls->used--;
+
+    if (!slab->available)
+    {
+        available_push(cls, slab);
+    }
+    else if (slab->used == 0 && (slab->next || slab->prev))
+    {
+        // Give empty slabs back to the system, but keep the last one for each class so that we don't thrash when
+        // an object is repeatedly created and collected.
+        slab_release(slab);
+    }
+}
+
+static void *block_alloc(size_t size)
+{
+    int class_idx = size_class_for(size);
+    return class_idx >= 0 ? slab_alloc(class_idx) : malloc(size);
+}
+
+static void block_free(void *ptr)
+{
+    slab_t *slab = slab_for(ptr);
+    if (slab)
+    {
+        slab_free(slab, ptr);
+    }
+    else
+    {
+        free(ptr);
+    }
+}
+
+static void account(size_t osize, size_t nsize, bool was_large, bool is_large)
+{
+    stats.in_use = stats.in_use - osize + nsize;
+    stats.large_bytes = stats.large_bytes - (was_large ? osize : 0) + (is_large ? nsize : 0);
+    if (stats.in_use > stats.peak)
+    {
+        stats.peak = stats.in_use;
+    }
+    if (nsize > osize)
+    {
+        stats.allocated_by[lua_running_source()] += nsize - osize;
+    }
+}
+
+void *lua_heap_alloc(void *ud, void *ptr, size_t osize, size_t nsize)
+{
+    if (!ptr)
+    {
+        // osize is the type of object being created rather than a size.
+        stats.objects[osize >= LUA_TSTRING && osize < LUA_NUMTYPES ? osize : LUA_NUMTYPES]++;
+        osize = 0;
+    }
+
+    if (nsize == 0)
+    {
+        if (ptr)
+        {
+            account(osize, 0, !slab_for(ptr), false);
+            block_free(ptr);
+        }
+        return NULL;
+    }
+
+    if (nsize > osize && stats.limit && stats.in_use - osize + nsize > stats.limit)
+    {
+        // Lua will run an emergency collection and try again, and raise a memory error if that doesn't help.
+        stats.failed++;
+        return NULL;
+    }
+
+    if (!ptr)
+    {
+        void *block = block_alloc(nsize);
+        if (!block)
+        {
+            stats.failed++;
+            return NULL;
+        }
+        account(0, nsize, nsize > MAX_SLAB_OBJECT, nsize > MAX_SLAB_OBJECT);
+        return block;
+    }
+
+    slab_t *slab = slab_for(ptr);
+    int class_idx = size_class_for(nsize);
+    void *block;
+    if (slab && slab->size_class == class_idx)
+    {
+        // Still fits the block it is in.
+        block = ptr;
+    }
+    else if (!slab && class_idx < 0)
+    {
+        block = realloc(ptr, nsize);
+    }
+    else
+    {
+        block = block_alloc(nsize);
+        if (block)
+        {
+            memcpy(block, ptr, osize < nsize ? osize : nsize);
+            block_free(ptr);
+        }
+    }
+
+    if (!block)
+    {
+        if (nsize <= osize)
+        {
+            // Lua assumes that shrinking never fails.  The old block is still big enough, so keep using that.
+            account(osize, nsize, !slab, !slab);
+            return ptr;
+        }
+        stats.failed++;
+        return NULL;
+    }
+    account(osize, nsize, !slab, !slab_for(block));
+    return block;
+}
+
+void lua_heap_set_limit(size_t limit)
+{
+    stats.limit = limit;
+}
+
+size_t lua_heap_get_limit()
+{
+    return stats.limit;
+}
+
+size_t lua_heap_get_peak(bool reset)
+{
+    if (reset)
+    {
+        stats.peak = stats.in_use;
+    }
+    return stats.peak;
+}
+
+void lua_heap_push_stats(lua_State *L)
+{
+    lua_newtable(L);
+    lua_pushstring(L, "limit");
+    lua_pushinteger(L, stats.limit);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "in_use");
+    lua_pushinteger(L, stats.in_use);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "peak");
+    lua_pushinteger(L, stats.peak);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "large");
+    lua_pushinteger(L, stats.large_bytes);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "failed");
+    lua_pushinteger(L, stats.failed);
+    lua_settable(L, -3);
+
+    // How well the slabs are being used.  Memory held in slabs that isn't handed out is the price paid for not
+    // fragmenting the system heap.
+    size_t slab_bytes = 0, slab_used = 0;
+    lua_pushstring(L, "classes");
+    lua_createtable(L, NUM_SIZE_CLASSES, 0);
+    for (int i = 0; i < NUM_SIZE_CLASSES; i++)
+    {
+        size_class_t *cls = &classes[i];
+        lua_createtable(L, 0, 4);
+        lua_pushstring(L, "size");
+        lua_pushinteger(L, size_classes[i]);
+        lua_settable(L, -3);
+
+        lua_pushstring(L, "slabs");
+        lua_pushinteger(L, cls->slabs);
+        lua_settable(L, -3);
+
+        lua_pushstring(L, "used");
+        lua_pushinteger(L, cls->used);
+        lua_settable(L, -3);
+
+        lua_pushstring(L, "capacity");
+        lua_pushinteger(L, cls->slabs * ((SLAB_SIZE - SLAB_HEADER_SIZE) / size_classes[i]));
+        lua_settable(L, -3);
+        lua_rawseti(L, -2, i + 1);
+
+        slab_bytes += cls->slabs * SLAB_SIZE;
+        slab_used += cls->used * size_classes[i];
+    }
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "slab_bytes");
+    lua_pushinteger(L, slab_bytes);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "slab_used");
+    lua_pushinteger(L, slab_used);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "objects");
+    lua_newtable(L);
+    for (const code_lookup_t *t = object_types; t->sval; t++)
+    {
+        lua_pushstring(L, t->sval);
+        lua_pushinteger(L, stats.objects[t->ival]);
+        lua_settable(L, -3);
+    }
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "allocated_by");
+    lua_newtable(L);
+    for (int i = 0; i < LUA_SOURCE_MAX; i++)
+    {
+        lua_pushstring(L, lua_source_name(i));
+        lua_pushinteger(L, stats.allocated_by[i]);
+        lua_settable(L, -3);
+    }
+    lua_settable(L, -3);
+}
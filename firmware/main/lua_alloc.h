@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <lua/lua.h>
+
+/**
+ * Allocator for the Lua state.  Small objects (which is most of what Lua allocates) come out of fixed size class slabs
+ * so that they don't fragment the system heap, and everything is counted against a hard limit.  When the limit is hit
+ * allocation fails, and Lua turns that into an emergency GC followed by a LUA_ERRMEM error if that didn't help.
+ */
+void *lua_heap_alloc(void *ud, void *ptr, size_t osize, size_t nsize);
+
+void lua_heap_set_limit(size_t limit);
+size_t lua_heap_get_limit();
+
+/**
+ * The most that Lua has had in use at once.  With reset, the peak is first brought down to what is in use now, so that
+ * the peak of something that is about to run can be measured.
+ */
+size_t lua_heap_get_peak(bool reset);
+void lua_heap_push_stats(lua_State *L);
@@ -0,0 +1,110 @@
+#include <lua/lua.h>
+#include <lua/lauxlib.h>
+#include <esp_log.h>
+#include "lua_await.h"
+#include "lua_future.h"
+
+#define TAG "await"
+
+void lua_awaiter_init(lua_awaiter_t *w)
+{
+    w->threadRef = LUA_NOREF;
+}
+
+void lua_await_check(lua_State *L, const lua_awaiter_t *w)
+{
+    if (!lua_isyieldable(L))
+    {
+        luaL_error(L, "Can only await from within a task");
+    }
+    if (w && lua_await_pending(w))
+    {
+        luaL_error(L, "Something is already waiting on this");
+    }
+}
+
+/**
+ * Continuation for lua_await.  The stack is as it was when we yielded, with the resume arguments on top, and those
+ * are the results.
+ */
+static int await_continue(lua_State *L, int status, lua_KContext base)
+{
+    return lua_gettop(L) - (int)base;
+}
+
+int lua_await_suspend(lua_State *L)
+{
+    return lua_yieldk(L, 0, lua_gettop(L), await_continue);
+}
+
+int lua_await(lua_State *L, lua_awaiter_t *w)
+{
+    lua_await_check(L, w);
+    lua_pushthread(L);
+    w->threadRef = luaL_ref(L, LUA_REGISTRYINDEX);
+    return lua_await_suspend(L);
+}
+
+/**
+ * Deals with how a resumed coroutine stopped: finished, failed, suspended in C again, or yielded a future to wait on.
+ */
+bool lua_await_resume_thread(lua_State *L, int nargs)
+{
+    lua_State *co = lua_tothread(L, -nargs - 1);
+    if (lua_status(co) != LUA_YIELD && !(lua_status(co) == LUA_OK && lua_gettop(co) > 0))
+    {
+        ESP_LOGE(TAG, "Can't resume a coroutine that isn't suspended");
+        lua_pop(L, nargs + 1);
+        return false;
+    }
+    lua_xmove(L, co, nargs);
+    int nres;
+    int status = lua_resume(co, L, nargs, &nres);
+    bool ok = true;
+    if (status == LUA_YIELD)
+    {
+        // Nothing yielded means that it's suspended in C, and will be resumed from there.  A future can also be
+        // yielded directly with coroutine.yield(), as tasks used to.
+        if (nres > 0)
+        {
+            lua_xmove(co, L, nres);
+            if (!lua_future_wait(L, -nres, -nres - 1))
+            {
+                ESP_LOGE(TAG, "Async task yielded something that isn't a future");
+            }
+            lua_pop(L, nres);
+        }
+    }
+    else if (status == LUA_OK)
+    {
+        if (nres > 0)
+        {
+            ESP_LOGW(TAG, "Task returned a value, it will be ignored");
+            lua_pop(co, nres);
+        }
+    }
+    else
+    {
+        luaL_traceback(L, co, lua_tostring(co, -1), 0);
+        ESP_LOGE(TAG, "Unhandled error running task: %s", lua_tostring(L, -1));
+        lua_pop(L, 1);
+        ok = false;
+    }
+    lua_pop(L, 1); // The coroutine
+    return ok;
+}
+
+void lua_await_resume(lua_State *L, lua_awaiter_t *w, int nargs)
+{
+    if (!lua_await_pending(w))
+    {
+        lua_pop(L, nargs);
+        return;
+    }
+    lua_rawgeti(L, LUA_REGISTRYINDEX, w->threadRef);
+    lua_insert(L, -nargs - 1);
+    // Released first, so that the coroutine can wait on the same thing again.  The stack keeps it alive meanwhile.
+    luaL_unref(L, LUA_REGISTRYINDEX, w->threadRef);
+    w->threadRef = LUA_NOREF;
+    lua_await_resume_thread(L, nargs);
+}
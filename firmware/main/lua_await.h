@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdbool.h>
+#include <lua/lua.h>
+
+/**
+ * A coroutine suspended inside a C function until something completes (a DALI command, a timer, a datagram).  The C
+ * function does `return lua_await(L, &w);` and whatever finishes the work later calls lua_await_resume() on the Lua
+ * task, which resumes the coroutine directly with the result.  Nothing is allocated on the Lua side, so an await costs
+ * a yield and a resume.
+ *
+ * Futures (lua_future.h) use the same suspend and resume, so a task can mix both kinds of await.
+ */
+typedef struct
+{
+    int threadRef; // The suspended coroutine, or LUA_NOREF.
+} lua_awaiter_t;
+
+void lua_awaiter_init(lua_awaiter_t *w);
+
+static inline bool lua_await_pending(const lua_awaiter_t *w)
+{
+    return w->threadRef != LUA_NOREF;
+}
+
+/**
+ * Raises an error unless the caller can be suspended on w.  Call it before starting anything that will complete w.
+ */
+void lua_await_check(lua_State *L, const lua_awaiter_t *w);
+
+/**
+ * Suspends the running coroutine.  The values given to lua_await_resume() become the results of the C function.
+ */
+int lua_await(lua_State *L, lua_awaiter_t *w);
+
+/**
+ * Resumes the coroutine suspended on w with the top nargs values on L's stack, which are popped.
+ */
+void lua_await_resume(lua_State *L, lua_awaiter_t *w, int nargs);
+
+/**
+ * Lower level versions of the above, for when the suspended coroutine is kept somewhere other than an awaiter.
+ * lua_await_suspend() yields without taking a reference, so the caller must keep the coroutine.
+ * lua_await_resume_thread() resumes the coroutine that is on L's stack under nargs arguments, popping them all, and
+ * logs how it ended.  If the coroutine yields a Future it is made to wait on it.  Returns false if it raised an error.
+ */
+int lua_await_suspend(lua_State *L);
+bool lua_await_resume_thread(lua_State *L, int nargs);
@@ -0,0 +1,192 @@
+#include <string.h>
+#include <esp_log.h>
+#include <esp_partition.h>
+#include <esp_rom_crc.h>
+#include <lua/lua.h>
+#include <lua/lauxlib.h>
+#include "lua_bundle.h"
+#include "lua_loader.h"
+
+#define TAG "bundle"
+
+typedef struct
+{
+    const uint8_t *base;
+    const lua_bundle_header_t *header;
+    const lua_bundle_entry_t *index;
+    esp_partition_mmap_handle_t handle;
+} bundle_t;
+
+typedef struct
+{
+    const char *data;
+    size_t len;
+} chunk_reader_t;
+
+static bundle_t bundle;
+
+/**
+ * Hands Lua the whole chunk straight out of the mapped flash, so it is never copied into RAM.
+ */
+static const char *read_chunk(lua_State *L, void *ud, size_t *size)
+{
+    chunk_reader_t *reader = ud;
+    *size = reader->len;
+    reader->len = 0;
+    return *size ? reader->data : NULL;
+}
+
+static const lua_bundle_entry_t *find_entry(const char *name, size_t len)
+{
+    uint32_t lo = 0, hi = bundle.header->count;
+    while (lo < hi)
+    {
+        uint32_t mid = (lo + hi) / 2;
+        const lua_bundle_entry_t *e = &bundle.index[mid];
+        size_t n = e->name_len < len ? e->name_len : len;
+        int cmp = memcmp(bundle.base + e->name_offset, name, n);
+        if (cmp == 0)
+        {
+            cmp = e->name_len < len ? -1 : (e->name_len > len ? 1 : 0);
+        }
+        if (cmp == 0)
+        {
+            return e;
+        }
+        if (cmp < 0)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return NULL;
+}
+
+int lua_bundle_load(lua_State *L, const char *name)
+{
+    const lua_bundle_entry_t *e = bundle.base ? find_entry(name, strlen(name)) : NULL;
+    if (!e)
+    {
+        lua_pushfstring(L, "no module '%s' in bundle", name);
+        return LUA_ERRFILE;
+    }
+    chunk_reader_t reader = {.data = (const char *)bundle.base + e->chunk_offset, .len = e->chunk_len};
+    lua_pushfstring(L, "=bundle:%s", name);
+    int status = lua_load(L, read_chunk, &reader, lua_tostring(L, -1), "b");
+    lua_remove(L, -2);
+    return status;
+}
+
+static int bundle_searcher(lua_State *L)
+{
+    const char *name = luaL_checkstring(L, 1);
+    int status = lua_bundle_load(L, name);
+    if (status == LUA_ERRFILE)
+    {
+        return 1;
+    }
+    if (status != LUA_OK)
+    {
+        return luaL_error(L, "error loading module '%s' from bundle:\n\t%s", name, lua_tostring(L, -1));
+    }
+    lua_pushfstring(L, "bundle:%s", name);
+    return 2;
+}
+
+/**
+ * Whether length bytes at offset lie within a bundle of size bytes, without working out offset + length, which could
+ * wrap round for a corrupt entry and look small.
+ */
+static bool in_bundle(uint32_t offset, uint32_t length, uint32_t size)
+{
+    return offset <= size && length <= size - offset;
+}
+
+static bool bundle_valid(const lua_bundle_header_t *hdr, const esp_partition_t *part)
+{
+    if (memcmp(hdr->magic, LUA_BUNDLE_MAGIC, sizeof(hdr->magic)) != 0)
+    {
+        // Nothing has been written to the partition, which is fine.
+        return false;
+    }
+    if (hdr->version != LUA_BUNDLE_VERSION)
+    {
+        ESP_LOGW(TAG, "Unsupported bundle version %d", hdr->version);
+        return false;
+    }
+    if (hdr->fingerprint != lua_loader_fingerprint())
+    {
+        ESP_LOGW(TAG, "Bundle was compiled for a different Lua build");
+        return false;
+    }
+    // Checked by division, as the count comes from flash and multiplying could wrap.
+    if (hdr->size > part->size || hdr->size < sizeof(*hdr) ||
+        hdr->count > (hdr->size - sizeof(*hdr)) / sizeof(lua_bundle_entry_t))
+    {
+        ESP_LOGW(TAG, "Bundle size %lu is invalid", (unsigned long)hdr->size);
+        return false;
+    }
+    return true;
+}
+
+bool lua_bundle_init(lua_State *L)
+{
+    const esp_partition_t *part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, LUA_BUNDLE_PARTITION_SUBTYPE,
+                                                           LUA_BUNDLE_PARTITION_LABEL);
+    if (!part)
+    {
+        return false;
+    }
+
+    lua_bundle_header_t hdr;
+    if (esp_partition_read(part, 0, &hdr, sizeof(hdr)) != ESP_OK || !bundle_valid(&hdr, part))
+    {
+        return false;
+    }
+
+    const void *base;
+    esp_err_t err = esp_partition_mmap(part, 0, hdr.size, ESP_PARTITION_MMAP_DATA, &base, &bundle.handle);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Could not map bundle: %s", esp_err_to_name(err));
+        return false;
+    }
+    const uint8_t *bytes = base;
+    if (esp_rom_crc32_le(0, bytes + sizeof(hdr), hdr.size - sizeof(hdr)) != hdr.crc)
+    {
+        ESP_LOGW(TAG, "Bundle is corrupt");
+        esp_partition_munmap(bundle.handle);
+        return false;
+    }
+    const lua_bundle_entry_t *index = (const lua_bundle_entry_t *)(bytes + sizeof(hdr));
+    for (uint32_t i = 0; i < hdr.count; i++)
+    {
+        if (!in_bundle(index[i].name_offset, index[i].name_len, hdr.size) ||
+            !in_bundle(index[i].chunk_offset, index[i].chunk_len, hdr.size))
+        {
+            ESP_LOGW(TAG, "Bundle entry %lu is out of bounds", (unsigned long)i);
+            esp_partition_munmap(bundle.handle);
+            return false;
+        }
+    }
+    bundle.base = bytes;
+    bundle.header = base;
+    bundle.index = index;
+    ESP_LOGI(TAG, "Mapped bundle of %lu modules (%lu bytes)", (unsigned long)hdr.count, (unsigned long)hdr.size);
+
+    // Ahead of everything except the preload searcher, so that bundled modules never hit the filesystem.
+    lua_getglobal(L, "package");
+    lua_getfield(L, -1, "searchers");
+    for (lua_Integer i = luaL_len(L, -1); i >= 2; i--)
+    {
+        lua_rawgeti(L, -1, i);
+        lua_rawseti(L, -2, i + 1);
+    }
+    lua_pushcfunction(L, bundle_searcher);
+    lua_rawseti(L, -2, 2);
+    lua_pop(L, 2);
+    return true;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <lua/lua.h>
+
+#define LUA_BUNDLE_MAGIC "CCLB"
+#define LUA_BUNDLE_VERSION 1
+#define LUA_BUNDLE_PARTITION_LABEL "lua"
+#define LUA_BUNDLE_PARTITION_SUBTYPE 0x40
+
+/**
+ * A bundle is a flash partition holding precompiled modules, written by lua/bundle.py.  It is laid out as this header,
+ * then `count` index entries sorted by module name, then the names and the luac chunks that the entries point at.
+ * Offsets are from the start of the bundle, and all integers are little endian.
+ */
+typedef struct __attribute__((packed))
+{
+    char magic[4];
+    uint8_t version;
+    uint8_t reserved[3];
+    uint32_t fingerprint; // Same as for .luac images - see lua_loader.h
+    uint32_t count;
+    uint32_t size;        // Of the whole bundle, including this header
+    uint32_t crc;         // CRC32 of everything after the header
+} lua_bundle_header_t;
+
+typedef struct __attribute__((packed))
+{
+    uint32_t name_offset;
+    uint32_t name_len;
+    uint32_t chunk_offset;
+    uint32_t chunk_len;
+} lua_bundle_entry_t;
+
+/**
+ * Maps the bundle partition, if there is a valid one, and installs a package searcher that loads modules from it ahead
+ * of the filesystem.  Must be called after lua_loader_init().
+ */
+bool lua_bundle_init(lua_State *L);
+
+/**
+ * Loads the named module from the bundle, leaving the function on the stack.  Returns LUA_ERRFILE (with a message on
+ * the stack) if it isn't there.
+ */
+int lua_bundle_load(lua_State *L, const char *name);
@@ -2,11 +2,15 @@
 #define LOG_LOCAL_LEVEL ESP_LOG_DEBUG
 
 #include "lua_cbor.h"
+#include "lua_cbor_expr.h"
 #include "lua_system.h"
 #include <lua/lua.h>
 #include <lua/lauxlib.h>
 #include <lua/lualib.h>
 #include <esp_log.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
 
 #define TAG "cbor"
 
@@ -42,22 +46,197 @@ static CborType to_typehint(lua_State *L, int pos)
     return CborInvalidType;
 }
 
-static CborError encode_luaval(lua_State *L, int stackPos, CborEncoder *enc, uint8_t *buf, CborType typehint, bool strict);
+/**
+ * Most documents fit in this much stack.  See push_encoded().
+ */
+#define ENCODE_STACK_BUF 256
+
+/**
+ * State of a single cbor.encode(), passed down through the recursion.
+ */
+typedef struct
+{
+    bool strict;
+    bool deterministic; // Definite lengths and the shortest exact floats.
+    bool sort_keys;     // Map keys in RFC 8949 deterministic order.
+    int depth;
+} encode_ctx_t;
+
+/**
+ * Running out of buffer doesn't stop encoding - the encoder carries on counting the bytes that it would have needed,
+ * which is how the size of a large document is found - so it is the only error that isn't a failure.
+ */
+#define ENCODE_FAILED(err) (((err) & ~CborErrorOutOfMemory) != CborNoError)
+
+/**
+ * A tag that isn't otherwise understood, from cbor.tag() or decoding, which encodes as the tag and then its value.  The
+ * value is its user value.
+ */
+#define TAG_CLASS "cbor.tag"
+
+typedef struct
+{
+    CborTag tag;
+} cbor_tagged_t;
+
+/**
+ * A simple value other than true, false, null and undefined, from cbor.simple() or decoding.  cbor.null is one too, for
+ * where a nil would be lost (in an array, say).
+ */
+#define SIMPLE_CLASS "cbor.simple"
+
+typedef struct
+{
+    uint8_t value;
+} cbor_simple_t;
+
+static CborError encode_luaval(lua_State *L, int stackPos, CborEncoder *enc, CborType typehint, encode_ctx_t *ctx);
+static CborError push_encoded(lua_State *L, int stackPos, CborType typeHint, encode_ctx_t *ctx);
+
+/**
+ * How to encode tables with a given metatable: its __enc, __keyenc and __valenc hints, resolved once when the metatable
+ * is first seen and then reused for every table that shares it.  The plan is a userdata, kept in a weak table keyed by
+ * the metatable, so it goes when the metatable does.  Its first user value is __valenc turned into a table of key to
+ * CborType, when that is a table, and its second the keys of that table in deterministic order, worked out the first
+ * time that one is encoded with sort_keys.
+ *
+ * Hints are only read when the plan is made, so changing a metatable's hints after it has been used to encode has no
+ * effect - except through cbor.encode_as_list(), which drops the plan.
+ */
+typedef struct
+{
+    CborType enc;     // __enc, e.g. "array"
+    CborType keyHint; // __keyenc
+    CborType valHint; // __valenc, when it's a single hint for every value.
+    bool perKey;      // __valenc is a table of hints by key.
+} encode_plan_t;
+
+enum
+{
+    PLAN_UV_HINTS = 1,
+    PLAN_UV_ORDER,
+};
+
+static const encode_plan_t no_plan = {
+    .enc = CborInvalidType,
+    .keyHint = CborInvalidType,
+    .valHint = CborInvalidType,
+    .perKey = false};
+
+static int planCacheRef = LUA_NOREF;
+
+/**
+ * Pushes the plan for the table at tableIdx (nil if it has no metatable), and returns it.
+ */
+static const encode_plan_t *push_plan(lua_State *L, int tableIdx)
+{
+    if (!lua_getmetatable(L, tableIdx))
+    {
+        lua_pushnil(L);
+        return &no_plan;
+    }
+    lua_rawgeti(L, LUA_REGISTRYINDEX, planCacheRef);
+    lua_pushvalue(L, -2);
+    if (lua_rawget(L, -2) == LUA_TUSERDATA)
+    {
+        encode_plan_t *plan = lua_touserdata(L, -1);
+        lua_replace(L, -3);
+        lua_pop(L, 1);
+        return plan;
+    }
+    lua_pop(L, 1);
+
+    // Stack is metatable, cache.
+    encode_plan_t *plan = lua_newuserdatauv(L, sizeof(encode_plan_t), 2);
+    lua_getfield(L, -3, "__enc");
+    plan->enc = to_typehint(L, -1);
+    lua_getfield(L, -4, "__keyenc");
+    plan->keyHint = to_typehint(L, -1);
+    lua_getfield(L, -5, "__valenc");
+    plan->perKey = lua_istable(L, -1);
+    plan->valHint = plan->perKey ? CborInvalidType : to_typehint(L, -1);
+    if (plan->perKey)
+    {
+        lua_newtable(L);
+        lua_pushnil(L);
+        while (lua_next(L, -3))
+        {
+            CborType hint = to_typehint(L, -1);
+            lua_pop(L, 1);
+            if (hint != CborInvalidType)
+            {
+                lua_pushvalue(L, -1);
+                lua_pushinteger(L, hint);
+                lua_rawset(L, -4);
+            }
+        }
+        lua_setiuservalue(L, -5, PLAN_UV_HINTS);
+    }
+    lua_pop(L, 3);
+
+    // Stack is metatable, cache, plan.
+    lua_pushvalue(L, -3);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, -4);
+    lua_replace(L, -3);
+    lua_pop(L, 1);
+    return plan;
+}
+
+/**
+ * Drops the plan for the metatable at idx, so that the next encode reads its hints again.
+ */
+static void forget_plan(lua_State *L, int idx)
+{
+    idx = lua_absindex(L, idx);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, planCacheRef);
+    lua_pushvalue(L, idx);
+    lua_pushnil(L);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+}
+
+/**
+ * Value hint for the key on the top of the stack, from a plan whose hints by key (if it has them) are at hintsIdx.
+ */
+static CborType value_hint(lua_State *L, const encode_plan_t *plan, int hintsIdx)
+{
+    if (!plan->perKey)
+    {
+        return plan->valHint;
+    }
+    lua_pushvalue(L, -1);
+    CborType hint = lua_rawget(L, hintsIdx) == LUA_TNUMBER ? (CborType)lua_tointeger(L, -1) : CborInvalidType;
+    lua_pop(L, 1);
+    return hint;
+}
+
+/**
+ * Number of items in a sequence, the same way that encode_lua_sequence finds them (up to the first nil).
+ */
+static size_t sequence_length(lua_State *L, int stackPos)
+{
+    size_t n = 0;
+    while (lua_geti(L, stackPos, n + 1) != LUA_TNIL)
+    {
+        lua_pop(L, 1);
+        n++;
+    }
+    lua_pop(L, 1);
+    return n;
+}
 
-static CborError encode_lua_sequence(lua_State *L, int stackPos, CborEncoder *enc, uint8_t *buf, bool strict)
+static CborError encode_lua_sequence(lua_State *L, int stackPos, CborEncoder *enc, const encode_plan_t *plan,
+                                     encode_ctx_t *ctx)
 {
     CborError err;
     CborEncoder objectEnc;
 
-    CborType typeHint = CborInvalidType;
-    if (lua_getmetatable(L, stackPos))
+    err = cbor_encoder_create_array(enc, &objectEnc, ctx->deterministic ? sequence_length(L, stackPos) : CborIndefiniteLength);
+    if (ENCODE_FAILED(err))
     {
-        lua_getfield(L, stackPos, "__valenc");
-        typeHint = to_typehint(L, -1);
-        lua_pop(L, 2);
+        return err;
     }
-
-    err = cbor_encoder_create_array(enc, &objectEnc, CborIndefiniteLength);
     int i = 1;
     do
     {
@@ -65,10 +244,10 @@ static CborError encode_lua_sequence(lua_State *L, int stackPos, CborEncoder *en
         if (!lua_isnil(L, -1))
         {
             // Encode the value.
-            err = encode_luaval(L, -1, &objectEnc, buf, typeHint, strict);
-            if (err != CborNoError)
+            err = encode_luaval(L, -1, &objectEnc, plan->valHint, ctx);
+            if (ENCODE_FAILED(err))
             {
-                lua_pop(L, 2);
+                lua_pop(L, 1);
                 return err;
             }
         }
@@ -83,102 +262,312 @@ static CborError encode_lua_sequence(lua_State *L, int stackPos, CborEncoder *en
     return err;
 }
 
-static CborError encode_lua_table(lua_State *L, int stackPos, CborEncoder *enc, uint8_t *buf, CborType typehint, bool strict)
+/**
+ * Encodes the key and value on the top of the stack.  Leaves the stack as it was.
+ */
+static CborError encode_map_entry(lua_State *L, CborEncoder *enc, const encode_plan_t *plan, int hintsIdx,
+                                  encode_ctx_t *ctx)
 {
-    CborError err;
-    CborEncoder objectEnc;
-
-    int tableStackPos = lua_absindex(L, stackPos);
-    int valueHintType = LUA_TNIL;
+    CborError err = encode_luaval(L, -2, enc, plan->keyHint, ctx);
+    if (ENCODE_FAILED(err))
+    {
+        ESP_LOGE(TAG, "Error encoding key: %s", cbor_error_string(err));
+        return err;
+    }
 
-    if (lua_getmetatable(L, tableStackPos))
+    lua_pushvalue(L, -2);
+    CborType valHint = value_hint(L, plan, hintsIdx);
+    lua_pop(L, 1);
+    err = encode_luaval(L, -1, enc, valHint, ctx);
+    if (ENCODE_FAILED(err))
     {
-        lua_getfield(L, -1, "__keyenc");
-        lua_getfield(L, -2, "__valenc");
-        valueHintType = lua_type(L, -1);
+        ESP_LOGE(TAG, "Error encoding value for key: %s", cbor_error_string(err));
+    }
+    return err;
+}
 
-        // If it wasn't explicitly specified, see if there's an __enc for this to turn it into an array
-        if (typehint == CborInvalidType)
+typedef struct
+{
+    const char *bytes;
+    size_t len;
+    int idx;
+} sort_key_t;
+
+static int compare_keys(const void *a, const void *b)
+{
+    const sort_key_t *ka = a, *kb = b;
+    int c = memcmp(ka->bytes, kb->bytes, ka->len < kb->len ? ka->len : kb->len);
+    return c ? c : (ka->len > kb->len) - (ka->len < kb->len);
+}
+
+/**
+ * Pushes an array of the keys of the table at tableIdx, in the bytewise order of their encodings, as RFC 8949 (4.2.1)
+ * has it.
+ */
+static CborError push_sorted_keys(lua_State *L, int tableIdx, CborType keyHint, encode_ctx_t *ctx)
+{
+    // Each key, and then its encoding, to keep them while they are sorted.
+    lua_newtable(L);
+    int keysIdx = lua_gettop(L);
+    int n = 0;
+    lua_pushnil(L);
+    while (lua_next(L, tableIdx))
+    {
+        lua_pop(L, 1);
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, keysIdx, 2 * n + 1);
+        CborError err = push_encoded(L, -1, keyHint, ctx);
+        if (err != CborNoError)
         {
-            lua_getfield(L, -3, "__enc");
-            typehint = to_typehint(L, -1);
-            lua_pop(L, 1);
+            lua_settop(L, keysIdx - 1);
+            return err;
         }
-        lua_remove(L, -3); // Remove the metadata table.
-    }
-    else
-    {
-        lua_pushnil(L); // No key hint
-        lua_pushnil(L); // No value hint
-        valueHintType = LUA_TNIL;
+        lua_rawseti(L, keysIdx, 2 * n + 2);
+        n++;
     }
 
-    if (typehint == CborArrayType)
+    sort_key_t *order = lua_newuserdatauv(L, n * sizeof(sort_key_t), 0);
+    for (int i = 0; i < n; i++)
     {
-        lua_pop(L, 2); // We don't need the hints.
-        return encode_lua_sequence(L, tableStackPos, enc, buf, strict);
+        lua_rawgeti(L, keysIdx, 2 * i + 2);
+        order[i].bytes = lua_tolstring(L, -1, &order[i].len); // Kept alive by keys.
+        order[i].idx = i;
+        lua_pop(L, 1);
     }
+    qsort(order, n, sizeof(sort_key_t), compare_keys);
 
-    err = cbor_encoder_create_map(enc, &objectEnc, CborIndefiniteLength);
-    if (err != CborNoError)
+    lua_createtable(L, n, 0);
+    for (int i = 0; i < n; i++)
     {
-        return err;
+        lua_rawgeti(L, keysIdx, 2 * order[i].idx + 1);
+        lua_rawseti(L, -2, i + 1);
     }
+    lua_replace(L, keysIdx);
+    lua_settop(L, keysIdx);
+    return CborNoError;
+}
 
+static size_t map_length(lua_State *L, int tableStackPos)
+{
+    size_t n = 0;
     lua_pushnil(L);
-    ESP_LOGD(TAG, "Dumping a table, value pos is %d", tableStackPos);
     while (lua_next(L, tableStackPos))
     {
-        // CBOR doesn't care what the key is, but be sensible.  Be careful not to call lua_tostring() because this messes up the key if it isn't already a string
+        lua_pop(L, 1);
+        n++;
+    }
+    return n;
+}
 
-        CborType keyHint = to_typehint(L, -4);
-        err = encode_luaval(L, -2, &objectEnc, buf, keyHint, strict);
-        if (err != CborNoError)
+/**
+ * Pushes the keys of the table in deterministic order.  Tables whose keys are all ones that the plan has hints for
+ * use the order kept in the plan, so their keys don't need encoding twice.  Returns the number of keys.
+ */
+static CborError push_key_order(lua_State *L, int tableStackPos, const encode_plan_t *plan, int planIdx, int hintsIdx,
+                                encode_ctx_t *ctx, size_t *count)
+{
+    size_t n = map_length(L, tableStackPos);
+    if (plan->perKey)
+    {
+        if (lua_getiuservalue(L, planIdx, PLAN_UV_ORDER) != LUA_TTABLE)
         {
-            ESP_LOGE(TAG, "Error encoding key: %s", cbor_error_string(err));
-            lua_pop(L, 4);
-            return err;
+            lua_pop(L, 1);
+            CborError err = push_sorted_keys(L, hintsIdx, plan->keyHint, ctx);
+            if (err != CborNoError)
+            {
+                return err;
+            }
+            lua_pushvalue(L, -1);
+            lua_setiuservalue(L, planIdx, PLAN_UV_ORDER);
         }
-        ESP_LOGD(TAG, "Key hint is %d", keyHint);
-
-        // Encode the value.  Hint will depend on value from metatable.
-        CborType valHint;
-        if (valueHintType == LUA_TTABLE)
+        size_t present = 0;
+        lua_Integer len = luaL_len(L, -1);
+        for (lua_Integer i = 1; i <= len; i++)
         {
-            // Look up the key in the hint table.
-            lua_getfield(L, -3, lua_tostring(L, -2));
-            valHint = to_typehint(L, -1);
+            lua_rawgeti(L, -1, i);
+            if (lua_rawget(L, tableStackPos) != LUA_TNIL)
+            {
+                present++;
+            }
             lua_pop(L, 1);
         }
-        else
+        if (present == n)
         {
-            valHint = to_typehint(L, -3);
+            *count = n;
+            return CborNoError;
         }
-        ESP_LOGD(TAG, "Value hint is %d", keyHint);
+        lua_pop(L, 1);
+    }
+    *count = n;
+    return push_sorted_keys(L, tableStackPos, plan->keyHint, ctx);
+}
 
-        err = encode_luaval(L, -1, &objectEnc, buf, valHint, strict);
-        if (err != CborNoError)
+static CborError encode_sorted_map(lua_State *L, int tableStackPos, CborEncoder *enc, const encode_plan_t *plan,
+                                   int planIdx, int hintsIdx, encode_ctx_t *ctx)
+{
+    size_t n;
+    CborError err = push_key_order(L, tableStackPos, plan, planIdx, hintsIdx, ctx, &n);
+    if (err != CborNoError)
+    {
+        return err;
+    }
+    int orderIdx = lua_gettop(L);
+    lua_Integer len = luaL_len(L, orderIdx);
+
+    CborEncoder objectEnc;
+    err = cbor_encoder_create_map(enc, &objectEnc, n);
+    for (lua_Integer i = 1; i <= len && !ENCODE_FAILED(err); i++)
+    {
+        lua_rawgeti(L, orderIdx, i);
+        lua_pushvalue(L, -1);
+        if (lua_rawget(L, tableStackPos) != LUA_TNIL) // Keys in a plan's order might not all be there.
+        {
+            err = encode_map_entry(L, &objectEnc, plan, hintsIdx, ctx);
+        }
+        lua_pop(L, 2);
+    }
+    if (!ENCODE_FAILED(err))
+    {
+        err = cbor_encoder_close_container(enc, &objectEnc);
+    }
+    lua_pop(L, 1);
+    return err;
+}
+
+static CborError encode_map(lua_State *L, int tableStackPos, CborEncoder *enc, const encode_plan_t *plan, int hintsIdx,
+                            encode_ctx_t *ctx)
+{
+    CborEncoder objectEnc;
+    CborError err = cbor_encoder_create_map(enc, &objectEnc, ctx->deterministic ? map_length(L, tableStackPos) : CborIndefiniteLength);
+    if (ENCODE_FAILED(err))
+    {
+        return err;
+    }
+
+    lua_pushnil(L);
+    while (lua_next(L, tableStackPos))
+    {
+        err = encode_map_entry(L, &objectEnc, plan, hintsIdx, ctx);
+        if (ENCODE_FAILED(err))
         {
-            ESP_LOGE(TAG, "Error encoding value for key: %s", cbor_error_string(err));
-            lua_pop(L, 4);
+            lua_pop(L, 2);
             return err;
         }
         lua_pop(L, 1); // Only pop the value.  Leave the key for the iterator.
     }
-    err = cbor_encoder_close_container(enc, &objectEnc);
+    return cbor_encoder_close_container(enc, &objectEnc);
+}
+
+static CborError encode_lua_table(lua_State *L, int stackPos, CborEncoder *enc, CborType typehint, encode_ctx_t *ctx)
+{
+    int tableStackPos = lua_absindex(L, stackPos);
+    const encode_plan_t *plan = push_plan(L, tableStackPos);
+    int planIdx = lua_gettop(L);
+    if (plan->perKey)
+    {
+        lua_getiuservalue(L, planIdx, PLAN_UV_HINTS);
+    }
+    else
+    {
+        lua_pushnil(L);
+    }
+    int hintsIdx = lua_gettop(L);
+
+    // If it wasn't explicitly specified, see if there's an __enc for this to turn it into an array
+    if (typehint == CborInvalidType)
+    {
+        typehint = plan->enc;
+    }
 
-    lua_pop(L, 2); // the two hints.
+    CborError err;
+    if (typehint == CborArrayType)
+    {
+        err = encode_lua_sequence(L, tableStackPos, enc, plan, ctx);
+    }
+    else if (ctx->sort_keys)
+    {
+        err = encode_sorted_map(L, tableStackPos, enc, plan, planIdx, hintsIdx, ctx);
+    }
+    else
+    {
+        err = encode_map(L, tableStackPos, enc, plan, hintsIdx, ctx);
+    }
+    lua_settop(L, planIdx - 1);
     return err;
 }
 
-static CborError encode_luaval(lua_State *L, int stackPos, CborEncoder *enc, uint8_t *buf, CborType typehint, bool strict)
+/**
+ * Converts f to a half precision float, if that can be done without losing anything.
+ */
+static bool float_to_half(float f, uint16_t *out)
+{
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    uint16_t sign = (bits >> 16) & 0x8000;
+    int exp = (bits >> 23) & 0xff;
+    uint32_t mant = bits & 0x7fffff;
+
+    if (exp == 0xff)
+    {
+        *out = sign | 0x7c00 | (mant ? 0x200 : 0); // Infinity, or the canonical NaN.
+        return true;
+    }
+    if (exp == 0)
+    {
+        // Zero is fine.  Single precision subnormals are all too small.
+        *out = sign;
+        return mant == 0;
+    }
+    int e = exp - 127;
+    if (e >= -14 && e <= 15)
+    {
+        if (mant & 0x1fff)
+        {
+            return false;
+        }
+        *out = sign | (e + 15) << 10 | mant >> 13;
+        return true;
+    }
+    if (e >= -24 && e < -14)
+    {
+        // A half precision subnormal, if the bits that would be shifted out are all 0.
+        uint32_t full = mant | 0x800000;
+        int shift = -e - 1;
+        if (full & ((1u << shift) - 1))
+        {
+            return false;
+        }
+        *out = sign | full >> shift;
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Encodes d in the shortest of half, single and double precision that holds it exactly.
+ */
+static CborError encode_preferred_float(CborEncoder *enc, double d)
+{
+    float f = (float)d;
+    if ((double)f != d && !isnan(d))
+    {
+        return cbor_encode_double(enc, d);
+    }
+    uint16_t half;
+    if (float_to_half(f, &half))
+    {
+        return cbor_encode_half_float(enc, &half);
+    }
+    return cbor_encode_float(enc, f);
+}
+
+static CborError encode_luaval(lua_State *L, int stackPos, CborEncoder *enc, CborType typehint, encode_ctx_t *ctx)
 {
     CborError err = CborErrorImproperValue;
 
     switch (lua_type(L, stackPos))
     {
     case LUA_TBOOLEAN:
-        ESP_LOGD(TAG, "Encoding boolean");
         err = cbor_encode_boolean(enc, lua_toboolean(L, stackPos));
         break;
     case LUA_TNUMBER:
@@ -193,16 +582,15 @@ static CborError encode_luaval(lua_State *L, int stackPos, CborEncoder *enc, uin
         switch (typehint)
         {
         case CborIntegerType:
-            ESP_LOGD(TAG, "Encoding Integer");
             err = cbor_encode_int(enc, lua_tointeger(L, stackPos));
             break;
         case CborFloatType:
-            ESP_LOGD(TAG, "Encoding Float");
-            err = cbor_encode_float(enc, lua_tonumber(L, stackPos));
+            err = ctx->deterministic ? encode_preferred_float(enc, (float)lua_tonumber(L, stackPos))
+                                     : cbor_encode_float(enc, lua_tonumber(L, stackPos));
             break;
         default:
-            ESP_LOGD(TAG, "Encoding Double");
-            err = cbor_encode_double(enc, lua_tonumber(L, stackPos));
+            err = ctx->deterministic ? encode_preferred_float(enc, lua_tonumber(L, stackPos))
+                                     : cbor_encode_double(enc, lua_tonumber(L, stackPos));
             break;
         }
         break;
@@ -212,228 +600,1464 @@ static CborError encode_luaval(lua_State *L, int stackPos, CborEncoder *enc, uin
         switch (typehint)
         {
         case CborByteStringType:
-            ESP_LOGD(TAG, "Encoding Byte String");
             err = cbor_encode_byte_string(enc, (uint8_t *)txt, sz);
             break;
         // We default to a text string rather than a byte string, because normally that will be what a user wants.
         default:
-            ESP_LOGD(TAG, "Encoding Text String");
             err = cbor_encode_text_string(enc, txt, sz);
             break;
         }
         break;
 
     case LUA_TTABLE:
-        err = encode_lua_table(L, stackPos, enc, buf, typehint, strict);
+        // Each level holds on to a few stack slots (the plan, its hints, the key order, key and value).
+        if (ctx->depth >= CBOR_MAX_DEPTH || !lua_checkstack(L, 8))
+        {
+            ESP_LOGE(TAG, "Tables nested too deeply to encode");
+            return CborErrorNestingTooDeep;
+        }
+        ctx->depth++;
+        err = encode_lua_table(L, stackPos, enc, typehint, ctx);
+        ctx->depth--;
         break;
 
+    case LUA_TUSERDATA:
+    {
+        const cbor_tagged_t *tagged = luaL_testudata(L, stackPos, TAG_CLASS);
+        const cbor_simple_t *simple = luaL_testudata(L, stackPos, SIMPLE_CLASS);
+        if (tagged)
+        {
+            if (ctx->depth >= CBOR_MAX_DEPTH || !lua_checkstack(L, 8))
+            {
+                ESP_LOGE(TAG, "Tags nested too deeply to encode");
+                return CborErrorNestingTooDeep;
+            }
+            err = cbor_encode_tag(enc, tagged->tag);
+            if (!ENCODE_FAILED(err))
+            {
+                lua_getiuservalue(L, stackPos, 1);
+                ctx->depth++;
+                err = encode_luaval(L, -1, enc, CborInvalidType, ctx);
+                ctx->depth--;
+                lua_pop(L, 1);
+            }
+            break;
+        }
+        if (simple)
+        {
+            err = cbor_encode_simple_value(enc, simple->value);
+            break;
+        }
+    }
+        // Fall through
     // These are unsupported and will throw an error.
     case LUA_TFUNCTION:
-    case LUA_TUSERDATA:
     case LUA_TLIGHTUSERDATA:
     case LUA_TTHREAD:
         ESP_LOGE(TAG, "Attempt to serialise non supported value of type %s", lua_type_str(L, stackPos));
         return CborErrorIllegalType;
         // Fall through
     case LUA_TNIL:
-        ESP_LOGD(TAG, "Encoding nil");
         err = cbor_encode_null(enc);
         break;
     }
     return err;
 }
 
-int lua_cbor_encode(lua_State *L)
+/**
+ * Encodes the value at stackPos, and pushes the result as a string.  Most documents fit in a buffer on the stack.  If
+ * one doesn't, that attempt has counted how many bytes it needed, so it is encoded again, straight into a Lua buffer of
+ * exactly that size.
+ */
+static CborError push_encoded(lua_State *L, int stackPos, CborType typeHint, encode_ctx_t *ctx)
 {
-    CborType typeHint = CborInvalidType;
-    uint8_t buf[1024];
+    uint8_t buf[ENCODE_STACK_BUF];
     CborEncoder enc;
+    stackPos = lua_absindex(L, stackPos);
 
-    int nArgs = lua_gettop(L);
-    if (nArgs > 1)
+    cbor_encoder_init(&enc, buf, sizeof(buf), 0);
+    CborError err = encode_luaval(L, stackPos, &enc, typeHint, ctx);
+    if (err == CborNoError)
     {
-        // Second optional argument is the typehint for the top level object. Useful if its not a table with metadata (e.g. a number)
-        typeHint = to_typehint(L, 2);
-        lua_pop(L, nArgs - 1); // We need the first arg to be the only thing on the stack
+        lua_pushlstring(L, (char *)buf, cbor_encoder_get_buffer_size(&enc, buf));
     }
-
-    cbor_encoder_init(&enc, buf, sizeof(buf), 0);
-    CborError err = encode_luaval(L, -1, &enc, buf, typeHint, false);
-    if (err != CborNoError)
+    else if (!ENCODE_FAILED(err))
     {
-        luaL_error(L, err == CborErrorIllegalType ? "Attempt to encode invalid value" : cbor_error_string(err));
-        return 1;
+        size_t size = sizeof(buf) + cbor_encoder_get_extra_bytes_needed(&enc);
+        luaL_Buffer b;
+        uint8_t *out = (uint8_t *)luaL_buffinitsize(L, &b, size);
+        cbor_encoder_init(&enc, out, size, 0);
+        err = encode_luaval(L, stackPos, &enc, typeHint, ctx);
+        if (err == CborNoError)
+        {
+            luaL_pushresultsize(&b, cbor_encoder_get_buffer_size(&enc, out));
+        }
+        else
+        {
+            lua_pop(L, 1); // The buffer.
+        }
     }
-    lua_pushlstring(L, (char *)buf, enc.data.ptr - buf);
-
+    return err;
+}
+
+/**
+ * cbor.encode(value, [hint], [options]) - options is a table with:
+ *   deterministic - use definite lengths, and the shortest float that holds each number exactly, so that the same data
+ *                   always gives the same (and fewer) bytes.
+ *   sort_keys - also put map keys in the order of RFC 8949 deterministic encoding.  Needed for the output to be the
+ *               same whatever order Lua keeps the keys in, but costs encoding every key twice.
+ */
+int lua_cbor_encode(lua_State *L)
+{
+    CborType typeHint = CborInvalidType;
+    encode_ctx_t ctx = {.strict = false, .depth = 0};
+
+    int nArgs = lua_gettop(L);
+    if (nArgs > 1)
+    {
+        // Second optional argument is the typehint for the top level object. Useful if its not a table with metadata (e.g. a number)
+        typeHint = to_typehint(L, 2);
+    }
+    if (nArgs > 2 && !lua_isnil(L, 3))
+    {
+        luaL_checktype(L, 3, LUA_TTABLE);
+        lua_getfield(L, 3, "sort_keys");
+        ctx.sort_keys = lua_toboolean(L, -1);
+        lua_getfield(L, 3, "deterministic");
+        ctx.deterministic = ctx.sort_keys || lua_toboolean(L, -1);
+    }
+    lua_settop(L, 1); // We need the first arg to be the only thing on the stack
+
+    CborError err = push_encoded(L, 1, typeHint, &ctx);
+    if (err != CborNoError)
+    {
+        luaL_error(L, err == CborErrorIllegalType ? "Attempt to encode invalid value" : cbor_error_string(err));
+    }
+    return 1;
+}
+
+/**
+ * Pushes a text or byte string.  Strings are pushed straight from the source buffer; only a string that was sent in
+ * chunks has to be put together first.
+ */
+static CborError decode_string(lua_State *L, CborValue *it)
+{
+    bool text = cbor_value_is_text_string(it);
+    const void *chunk;
+    size_t len;
+    CborValue next;
+    CborError err = text ? cbor_value_get_text_string_chunk(it, (const char **)&chunk, &len, &next)
+                         : cbor_value_get_byte_string_chunk(it, (const uint8_t **)&chunk, &len, &next);
+    if (err != CborNoError)
+    {
+        return err;
+    }
+    const void *first = chunk;
+    size_t firstLen = len;
+    luaL_Buffer b;
+    bool chunked = false;
+    while (chunk)
+    {
+        CborValue cur = next;
+        err = text ? cbor_value_get_text_string_chunk(&cur, (const char **)&chunk, &len, &next)
+                   : cbor_value_get_byte_string_chunk(&cur, (const uint8_t **)&chunk, &len, &next);
+        if (err != CborNoError)
+        {
+            return err;
+        }
+        if (!chunk)
+        {
+            break;
+        }
+        if (!chunked)
+        {
+            luaL_buffinit(L, &b);
+            luaL_addlstring(&b, first, firstLen);
+            chunked = true;
+        }
+        luaL_addlstring(&b, chunk, len);
+    }
+    if (chunked)
+    {
+        luaL_pushresult(&b);
+    }
+    else
+    {
+        lua_pushlstring(L, first ? first : "", first ? firstLen : 0);
+    }
+    *it = next;
+    return CborNoError;
+}
+
+static CborError decode_item(lua_State *L, CborValue *it, int depth);
+
+static void push_tagged(lua_State *L, CborTag tag)
+{
+    cbor_tagged_t *tagged = lua_newuserdatauv(L, sizeof(cbor_tagged_t), 1);
+    tagged->tag = tag;
+    luaL_setmetatable(L, TAG_CLASS);
+    lua_insert(L, -2);
+    lua_setiuservalue(L, -2, 1);
+}
+
+static void push_simple(lua_State *L, uint8_t value)
+{
+    cbor_simple_t *simple = lua_newuserdatauv(L, sizeof(cbor_simple_t), 0);
+    simple->value = value;
+    luaL_setmetatable(L, SIMPLE_CLASS);
+}
+
+/**
+ * Pushes the bignum whose bytes are the string at it - as an integer if it fits, and otherwise as the nearest float,
+ * as with integers that are out of range.
+ */
+static CborError decode_bignum(lua_State *L, CborValue *it, bool negative)
+{
+    CborError err = decode_string(L, it);
+    if (err != CborNoError)
+    {
+        return err;
+    }
+    size_t len;
+    const uint8_t *bytes = (const uint8_t *)lua_tolstring(L, -1, &len);
+    uint64_t u = 0;
+    double d = 0;
+    bool fits = true;
+    for (size_t i = 0; i < len; i++)
+    {
+        fits = fits && (u >> 56) == 0;
+        u = u << 8 | bytes[i];
+        d = d * 256 + bytes[i];
+    }
+    lua_pop(L, 1);
+    if (fits && u <= INT64_MAX)
+    {
+        lua_pushinteger(L, negative ? -1 - (int64_t)u : (int64_t)u);
+    }
+    else
+    {
+        lua_pushnumber(L, negative ? -1 - d : d);
+    }
+    return CborNoError;
+}
+
+/**
+ * Pushes the tagged item at it.  Bignums become numbers, and any other tag a cbor.tag of the decoded value.
+ */
+static CborError decode_tag(lua_State *L, CborValue *it, int depth)
+{
+    CborTag tag;
+    CborError err = cbor_value_get_tag(it, &tag);
+    if (err == CborNoError)
+    {
+        err = cbor_value_advance_fixed(it);
+    }
+    if (err != CborNoError)
+    {
+        return err;
+    }
+    if ((tag == CborPositiveBignumTag || tag == CborNegativeBignumTag) && cbor_value_is_byte_string(it))
+    {
+        return decode_bignum(L, it, tag == CborNegativeBignumTag);
+    }
+    err = decode_item(L, it, depth + 1);
+    if (err == CborNoError)
+    {
+        push_tagged(L, tag);
+    }
+    return err;
+}
+
+/**
+ * Pushes an array or a map as a table, sized up front if the container says how big it is.
+ */
+static CborError decode_container(lua_State *L, CborValue *it, int depth)
+{
+    bool isMap = cbor_value_is_map(it);
+    size_t len = 0;
+    if (cbor_value_is_length_known(it))
+    {
+        if (isMap)
+        {
+            cbor_value_get_map_length(it, &len);
+        }
+        else
+        {
+            cbor_value_get_array_length(it, &len);
+        }
+    }
+    // Only a hint.  Don't let a bogus length make us allocate a huge table.
+    int hint = len > 1024 ? 1024 : (int)len;
+    lua_createtable(L, isMap ? 0 : hint, isMap ? hint : 0);
+
+    CborValue contit;
+    CborError err = cbor_value_enter_container(it, &contit);
+    lua_Integer i = 1;
+    while (err == CborNoError && !cbor_value_at_end(&contit))
+    {
+        if (isMap)
+        {
+            err = decode_item(L, &contit, depth + 1);
+            if (err == CborNoError)
+            {
+                err = decode_item(L, &contit, depth + 1);
+            }
+            if (err == CborNoError)
+            {
+                if (lua_isnil(L, -2))
+                {
+                    return CborErrorImproperValue; // Lua can't have a nil key.
+                }
+                lua_rawset(L, -3);
+            }
+        }
+        else
+        {
+            err = decode_item(L, &contit, depth + 1);
+            if (err == CborNoError)
+            {
+                lua_rawseti(L, -2, i++);
+            }
+        }
+    }
+    if (err == CborNoError)
+    {
+        err = cbor_value_leave_container(it, &contit);
+    }
+    return err;
+}
+
+/**
+ * Pushes the item at it, and moves it on to the next one.  Errors are returned rather than raised, and the stack is
+ * left as it is, as the caller raises them anyway.
+ */
+static CborError decode_item(lua_State *L, CborValue *it, int depth)
+{
+    CborError err;
+    if (depth >= CBOR_MAX_DEPTH || !lua_checkstack(L, 4))
+    {
+        return CborErrorNestingTooDeep;
+    }
+
+    switch (cbor_value_get_type(it))
+    {
+    case CborIntegerType:
+    {
+        int64_t ival;
+        err = cbor_value_get_int64_checked(it, &ival);
+        if (err == CborErrorDataTooLarge)
+        {
+            // Outside the range of a Lua integer, so all we can do is give an approximation.
+            uint64_t raw;
+            cbor_value_get_raw_integer(it, &raw);
+            lua_pushnumber(L, cbor_value_is_unsigned_integer(it) ? (lua_Number)raw : -1 - (lua_Number)raw);
+            err = CborNoError;
+        }
+        else if (err == CborNoError)
+        {
+            lua_pushinteger(L, ival);
+        }
+        break;
+    }
+    case CborByteStringType:
+    case CborTextStringType:
+        return decode_string(L, it);
+    case CborBooleanType:
+    {
+        bool bval;
+        err = cbor_value_get_boolean(it, &bval);
+        lua_pushboolean(L, bval);
+        break;
+    }
+    case CborNullType:
+    case CborUndefinedType: // Undefined gets treated as nil in Lua
+        lua_pushnil(L);
+        err = CborNoError;
+        break;
+
+    case CborHalfFloatType:
+    case CborFloatType:
+    {
+        float fval;
+        err = cbor_value_get_type(it) == CborHalfFloatType ? cbor_value_get_half_float_as_float(it, &fval)
+                                                            : cbor_value_get_float(it, &fval);
+        lua_pushnumber(L, fval);
+        break;
+    }
+    case CborDoubleType:
+    {
+        double dval;
+        err = cbor_value_get_double(it, &dval);
+        lua_pushnumber(L, dval);
+        break;
+    }
+
+    case CborArrayType:
+    case CborMapType:
+        return decode_container(L, it, depth);
+
+    case CborTagType:
+        return decode_tag(L, it, depth);
+    case CborSimpleType:
+    {
+        uint8_t sval;
+        err = cbor_value_get_simple_type(it, &sval);
+        push_simple(L, sval);
+        break;
+    }
+
+    default:
+        return CborErrorUnsupportedType;
+    }
+    if (err == CborNoError)
+    {
+        err = cbor_value_advance_fixed(it);
+    }
+    return err;
+}
+
+CborError lua_cbor_push_item(lua_State *L, CborValue *it)
+{
+    return decode_item(L, it, 0);
+}
+
+static void raise_decode_error(lua_State *L, CborError err)
+{
+    if (err == CborErrorUnsupportedType)
+    {
+        luaL_error(L, "Type of object is invalid");
+    }
+    else if (err != CborNoError)
+    {
+        luaL_error(L, "Error parsing CBOR value: %s", cbor_error_string(err));
+    }
+}
+
+#define VIEW_CLASS "cbor.view"
+
+/**
+ * Lookups that walk the container before an index of it is built.  Most handlers only want a field or two once, and
+ * walking is cheaper than indexing for that.
+ */
+#define VIEW_WALKS_BEFORE_INDEX 1
+
+/**
+ * A view of an array or a map in an encoded document, as returned by cbor.view().  Indexing it walks the encoded bytes
+ * to find the item, and only that item is turned into a Lua value (or another view, if it is a container).
+ */
+typedef struct
+{
+    CborParser parser;  // Only used by the view of the whole document.  Views inside it point to their root's.
+    CborValue value;    // The array or map.
+    lua_Integer length; // Items (pairs for a map), or -1 until it has been counted.
+    uint8_t lookups;    // Lookups so far that walked rather than used the index.
+} cbor_view_t;
+
+enum
+{
+    VIEW_UV_PARENT = 1, // The view that this is inside, or the bytes for the whole document.
+    VIEW_UV_KEYS,       // For a map with an index, key to the position in the slots.
+    VIEW_UV_SLOTS,      // With an index, a CborValue for each item (or each value of a map).
+    VIEW_UV_COUNT = VIEW_UV_SLOTS,
+};
+
+/**
+ * Pushes the item at it - as a view, if it's a container, or else decoded.  Doesn't move it.
+ */
+static CborError push_view_item(lua_State *L, int parentIdx, const CborValue *it)
+{
+    if (cbor_value_is_container(it))
+    {
+        cbor_view_t *view = lua_newuserdatauv(L, sizeof(cbor_view_t), VIEW_UV_COUNT);
+        view->value = *it;
+        view->length = -1;
+        view->lookups = 0;
+        luaL_setmetatable(L, VIEW_CLASS);
+        lua_pushvalue(L, parentIdx);
+        lua_setiuservalue(L, -2, VIEW_UV_PARENT);
+        return CborNoError;
+    }
+    CborValue copy = *it;
+    return decode_item(L, &copy, 0);
+}
+
+/**
+ * Compares the string at it to s, without copying it, and moves it past the string.
+ */
+static CborError string_equals(CborValue *it, const char *s, size_t len, bool *equal)
+{
+    bool text = cbor_value_is_text_string(it);
+    size_t off = 0;
+    CborValue cur = *it;
+    *equal = true;
+    for (;;)
+    {
+        const void *chunk;
+        size_t chunkLen;
+        CborError err = text ? cbor_value_get_text_string_chunk(&cur, (const char **)&chunk, &chunkLen, it)
+                             : cbor_value_get_byte_string_chunk(&cur, (const uint8_t **)&chunk, &chunkLen, it);
+        if (err != CborNoError)
+        {
+            return err;
+        }
+        if (!chunk)
+        {
+            break;
+        }
+        if (*equal)
+        {
+            *equal = chunkLen <= len - off && memcmp(chunk, s + off, chunkLen) == 0;
+            off += chunkLen;
+        }
+        cur = *it;
+    }
+    *equal = *equal && off == len;
+    return CborNoError;
+}
+
+/**
+ * Whether the map key at it is the Lua value at keyIdx.  Moves it on to the value.  Only keys that can be looked up
+ * (strings, numbers and booleans) are compared; anything else never matches.
+ */
+static CborError key_matches(lua_State *L, int keyIdx, CborValue *it, bool *match)
+{
+    *match = false;
+    switch (cbor_value_get_type(it))
+    {
+    case CborTextStringType:
+    case CborByteStringType:
+        if (lua_type(L, keyIdx) == LUA_TSTRING)
+        {
+            size_t len;
+            const char *s = lua_tolstring(L, keyIdx, &len);
+            return string_equals(it, s, len, match);
+        }
+        break;
+    case CborIntegerType:
+    case CborHalfFloatType:
+    case CborFloatType:
+    case CborDoubleType:
+    case CborBooleanType:
+        if (lua_type(L, keyIdx) != LUA_TSTRING)
+        {
+            CborError err = decode_item(L, it, 0);
+            if (err == CborNoError)
+            {
+                *match = lua_rawequal(L, keyIdx, -1);
+                lua_pop(L, 1);
+            }
+            return err;
+        }
+        break;
+    default:
+        break;
+    }
+    return cbor_value_advance(it);
+}
+
+/**
+ * Finds the item with the key at keyIdx by walking the container.
+ */
+static CborError view_walk(lua_State *L, const cbor_view_t *view, int keyIdx, CborValue *item, bool *found)
+{
+    CborValue it;
+    *found = false;
+    CborError err = cbor_value_enter_container(&view->value, &it);
+    if (cbor_value_is_array(&view->value))
+    {
+        int isnum = lua_type(L, keyIdx) == LUA_TNUMBER;
+        lua_Integer n = isnum ? lua_tointegerx(L, keyIdx, &isnum) : 0;
+        if (!isnum || n < 1)
+        {
+            return err;
+        }
+        while (err == CborNoError && !cbor_value_at_end(&it) && --n > 0)
+        {
+            err = cbor_value_advance(&it);
+        }
+    }
+    else
+    {
+        bool match = false;
+        while (err == CborNoError && !cbor_value_at_end(&it))
+        {
+            err = key_matches(L, keyIdx, &it, &match);
+            if (match)
+            {
+                break;
+            }
+            if (err == CborNoError)
+            {
+                err = cbor_value_advance(&it);
+            }
+        }
+        if (!match)
+        {
+            return err;
+        }
+    }
+    if (err == CborNoError && !cbor_value_at_end(&it))
+    {
+        *item = it;
+        *found = true;
+    }
+    return err;
+}
+
+/**
+ * Counts the items in the view by walking them.  The length in the header isn't used: it's whatever the sender said,
+ * and the index is sized by it.
+ */
+static CborError view_count(cbor_view_t *view)
+{
+    if (view->length >= 0)
+    {
+        return CborNoError;
+    }
+    size_t n = 0;
+    CborValue it;
+    CborError err = cbor_value_enter_container(&view->value, &it);
+    while (err == CborNoError && !cbor_value_at_end(&it))
+    {
+        err = cbor_value_advance(&it);
+        n++;
+    }
+    if (err == CborNoError)
+    {
+        view->length = cbor_value_is_map(&view->value) ? n / 2 : n;
+    }
+    return err;
+}
+
+/**
+ * Builds the index of the view at viewIdx: a CborValue for each item, and for a map, a table of the keys.  If a key
+ * appears more than once, the first one wins, as it does when walking.
+ */
+static CborError view_build_index(lua_State *L, int viewIdx, cbor_view_t *view)
+{
+    CborError err = view_count(view);
+    if (err != CborNoError)
+    {
+        return err;
+    }
+    if ((lua_Unsigned)view->length > SIZE_MAX / sizeof(CborValue))
+    {
+        return CborErrorDataTooLarge;
+    }
+    bool isMap = cbor_value_is_map(&view->value);
+    CborValue *slots = lua_newuserdatauv(L, (size_t)view->length * sizeof(CborValue), 0);
+    if (isMap)
+    {
+        lua_createtable(L, 0, view->length);
+    }
+
+    CborValue it;
+    err = cbor_value_enter_container(&view->value, &it);
+    for (lua_Integer i = 0; err == CborNoError && !cbor_value_at_end(&it); i++)
+    {
+        if (i >= view->length)
+        {
+            err = CborErrorTooManyItems;
+            break;
+        }
+        if (isMap)
+        {
+            switch (cbor_value_get_type(&it))
+            {
+            case CborTextStringType:
+            case CborByteStringType:
+            case CborIntegerType:
+            case CborHalfFloatType:
+            case CborFloatType:
+            case CborDoubleType:
+            case CborBooleanType:
+                err = decode_item(L, &it, 0);
+                if (err == CborNoError)
+                {
+                    // Null and NaN keys can't be looked up, so aren't indexed.
+                    lua_pushvalue(L, -1);
+                    if (lua_rawget(L, -3) == LUA_TNIL && !lua_isnil(L, -2) && lua_rawequal(L, -2, -2))
+                    {
+                        lua_pop(L, 1);
+                        lua_pushinteger(L, i);
+                        lua_rawset(L, -3);
+                    }
+                    else
+                    {
+                        lua_pop(L, 2);
+                    }
+                }
+                break;
+            default:
+                err = cbor_value_advance(&it);
+                break;
+            }
+        }
+        if (err == CborNoError)
+        {
+            slots[i] = it;
+            err = cbor_value_advance(&it);
+        }
+    }
+    if (err != CborNoError)
+    {
+        lua_pop(L, isMap ? 2 : 1);
+        return err;
+    }
+    if (isMap)
+    {
+        lua_setiuservalue(L, viewIdx, VIEW_UV_KEYS);
+    }
+    lua_setiuservalue(L, viewIdx, VIEW_UV_SLOTS);
+    return CborNoError;
+}
+
+static CborError view_lookup(lua_State *L, int viewIdx, int keyIdx, CborValue *item, bool *found)
+{
+    cbor_view_t *view = lua_touserdata(L, viewIdx);
+    if (view->lookups < VIEW_WALKS_BEFORE_INDEX)
+    {
+        view->lookups++;
+        return view_walk(L, view, keyIdx, item, found);
+    }
+
+    if (lua_getiuservalue(L, viewIdx, VIEW_UV_SLOTS) != LUA_TUSERDATA)
+    {
+        lua_pop(L, 1);
+        CborError err = view_build_index(L, viewIdx, view);
+        if (err != CborNoError)
+        {
+            return err;
+        }
+        lua_getiuservalue(L, viewIdx, VIEW_UV_SLOTS);
+    }
+    const CborValue *slots = lua_touserdata(L, -1);
+    lua_pop(L, 1); // Kept by the view.
+
+    int isnum = 0;
+    lua_Integer i;
+    if (cbor_value_is_map(&view->value))
+    {
+        lua_getiuservalue(L, viewIdx, VIEW_UV_KEYS);
+        lua_pushvalue(L, keyIdx);
+        lua_rawget(L, -2);
+        i = lua_tointegerx(L, -1, &isnum);
+        lua_pop(L, 2);
+    }
+    else
+    {
+        i = lua_type(L, keyIdx) == LUA_TNUMBER ? lua_tointegerx(L, keyIdx, &isnum) - 1 : 0;
+    }
+    *found = isnum && i >= 0 && i < view->length;
+    if (*found)
+    {
+        *item = slots[i];
+    }
+    return CborNoError;
+}
+
+static int view_index(lua_State *L)
+{
+    luaL_checkudata(L, 1, VIEW_CLASS);
+    CborValue item;
+    bool found;
+    CborError err = view_lookup(L, 1, 2, &item, &found);
+    if (err == CborNoError)
+    {
+        if (found)
+        {
+            err = push_view_item(L, 1, &item);
+        }
+        else
+        {
+            lua_pushnil(L);
+        }
+    }
+    raise_decode_error(L, err);
+    return 1;
+}
+
+static int view_len(lua_State *L)
+{
+    cbor_view_t *view = luaL_checkudata(L, 1, VIEW_CLASS);
+    raise_decode_error(L, view_count(view));
+    lua_pushinteger(L, view->length);
+    return 1;
+}
+
+typedef struct
+{
+    CborValue it;
+    lua_Integer i;
+} view_iter_t;
+
+/**
+ * The iterator returned by pairs(view).  Upvalues are the iterator state and the view.
+ */
+static int view_next(lua_State *L)
+{
+    view_iter_t *iter = lua_touserdata(L, lua_upvalueindex(1));
+    lua_pushvalue(L, lua_upvalueindex(2));
+    int viewIdx = lua_gettop(L);
+    bool isMap = cbor_value_is_map(&((cbor_view_t *)lua_touserdata(L, viewIdx))->value);
+    CborError err = CborNoError;
+    while (err == CborNoError && !cbor_value_at_end(&iter->it))
+    {
+        if (isMap)
+        {
+            err = decode_item(L, &iter->it, 0);
+            if (err == CborNoError && lua_isnil(L, -1))
+            {
+                // A null key.  Lua has no way to show it, so skip the pair.
+                lua_pop(L, 1);
+                err = cbor_value_advance(&iter->it);
+                continue;
+            }
+        }
+        else
+        {
+            lua_pushinteger(L, ++iter->i);
+        }
+        if (err == CborNoError)
+        {
+            err = push_view_item(L, viewIdx, &iter->it);
+        }
+        if (err == CborNoError)
+        {
+            err = cbor_value_advance(&iter->it);
+        }
+        if (err == CborNoError)
+        {
+            return 2;
+        }
+    }
+    raise_decode_error(L, err);
+    return 0;
+}
+
+static int view_pairs(lua_State *L)
+{
+    cbor_view_t *view = luaL_checkudata(L, 1, VIEW_CLASS);
+    view_iter_t *iter = lua_newuserdatauv(L, sizeof(view_iter_t), 0);
+    iter->i = 0;
+    raise_decode_error(L, cbor_value_enter_container(&view->value, &iter->it));
+    lua_pushvalue(L, 1);
+    lua_pushcclosure(L, view_next, 2);
+    lua_pushvalue(L, 1);
+    lua_pushnil(L);
+    return 3;
+}
+
+static const struct luaL_Reg view_funcs[] = {
+    {"__index", view_index},
+    {"__len", view_len},
+    {"__pairs", view_pairs},
+    {NULL, NULL}};
+
+const CborValue *lua_cbor_test_view(lua_State *L, int idx)
+{
+    cbor_view_t *view = luaL_testudata(L, idx, VIEW_CLASS);
+    return view ? &view->value : NULL;
+}
+
+/**
+ * Returns a view of the encoded document in arg 1, if it is an array or a map, for handlers that only want part of it.
+ * Anything else is simply decoded.
+ */
+static int lua_cbor_view(lua_State *L)
+{
+    size_t sz;
+    const uint8_t *src = (const uint8_t *)luaL_checklstring(L, 1, &sz);
+    cbor_view_t *view = lua_newuserdatauv(L, sizeof(cbor_view_t), VIEW_UV_COUNT);
+    view->length = -1;
+    view->lookups = 0;
+    CborError err = cbor_parser_init(src, sz, 0, &view->parser, &view->value);
+    if (err == CborNoError && !cbor_value_is_container(&view->value))
+    {
+        // Decoded while the view (and so the parser) is still on the stack.
+        CborValue it = view->value;
+        err = decode_item(L, &it, 0);
+        raise_decode_error(L, err);
+        return 1;
+    }
+    raise_decode_error(L, err);
+    luaL_setmetatable(L, VIEW_CLASS);
+    lua_pushvalue(L, 1);
+    lua_setiuservalue(L, -2, VIEW_UV_PARENT);
+    return 1;
+}
+
+int lua_cbor_decode(lua_State *L)
+{
+    CborValue it;
+    size_t sz;
+    CborParser parser;
+    CborError err;
+
+    cbor_view_t *view = luaL_testudata(L, 1, VIEW_CLASS);
+    if (view)
+    {
+        // Decodes all of what the view is of.
+        it = view->value;
+        err = decode_item(L, &it, 0);
+    }
+    else
+    {
+        if (!lua_isstring(L, 1))
+        {
+            luaL_argerror(L, 1, "Arg should be a byte string");
+            return 1;
+        }
+
+        uint8_t *src = (uint8_t *)lua_tolstring(L, 1, &sz);
+        err = cbor_parser_init(src, sz, 0, &parser, &it);
+        if (err == CborNoError)
+        {
+            err = decode_item(L, &it, 0);
+        }
+    }
+    raise_decode_error(L, err);
+    return 1;
+}
+
+/**
+ * Decorator that takes a table and sets it metadata to one that indicates that the table should be encoded as a list.
+ */
+int lua_encode_as_list(lua_State *L)
+{
+    if (!lua_istable(L, 1))
+    {
+        luaL_argerror(L, 1, "Must be a table");
+    }
+    if (lua_getmetatable(L, 1))
+    {
+        // It already has a metatable.  Just set the __enc field, and forget how tables with it used to be encoded.
+        lua_pushstring(L, "array");
+        lua_setfield(L, -2, "__enc");
+        forget_plan(L, -1);
+        lua_pop(L, 1);
+    }
+    else
+    {
+        lua_getglobal(L, "cbor");
+        lua_getfield(L, -1, "__list_meta");
+        lua_setmetatable(L, 1);
+        lua_pop(L, 1); // the cbor global
+    }
+
+    lua_pushvalue(L, 1); // Returns what was passed in.
     return 1;
 }
 
-#define CBOR_ERROR_WRAP(x)                                                         \
-    {                                                                              \
-        CborError err = (x);                                                       \
-        if (x != CborNoError)                                                      \
-        {                                                                          \
-            luaL_error(L, "Error parsing CBOR value: %s", cbor_error_string(err)); \
-            return 1;                                                              \
-        }                                                                          \
-    }
+/**
+ * cbor.tag(tag, value) - value, to be encoded with the tag.
+ */
+static int lua_cbor_tag(lua_State *L)
+{
+    lua_Integer tag = luaL_checkinteger(L, 1);
+    luaL_argcheck(L, tag >= 0, 1, "Tags can't be negative");
+    lua_settop(L, 2);
+    push_tagged(L, tag);
+    return 1;
+}
 
-typedef union
+static int tag_index(lua_State *L)
 {
-    char *buf;
-    int64_t ival;
-    bool bval;
-    double dval;
-    float fval;
-    CborValue contit;
-} data_t;
+    const cbor_tagged_t *tagged = luaL_checkudata(L, 1, TAG_CLASS);
+    const char *key = lua_tostring(L, 2);
+    if (key && strcmp(key, "tag") == 0)
+    {
+        lua_pushinteger(L, tagged->tag);
+    }
+    else if (key && strcmp(key, "value") == 0)
+    {
+        lua_getiuservalue(L, 1, 1);
+    }
+    else
+    {
+        lua_pushnil(L);
+    }
+    return 1;
+}
 
-static bool lua_decode_item(lua_State *L, CborValue *it)
+static int tag_tostring(lua_State *L)
 {
-    data_t d;
-    size_t sz;
-    CborValue contit;
+    const cbor_tagged_t *tagged = luaL_checkudata(L, 1, TAG_CLASS);
+    lua_pushfstring(L, "cbor.tag(%I)", (lua_Integer)tagged->tag);
+    return 1;
+}
+
+static const struct luaL_Reg tag_funcs[] = {
+    {"__index", tag_index},
+    {"__tostring", tag_tostring},
+    {NULL, NULL}};
 
-    ESP_LOGI(TAG, "Decoding type %d", cbor_value_get_type(it));
+/**
+ * cbor.simple(value) - a simple value, other than the ones that are booleans, nil or reserved.
+ */
+static int lua_cbor_simple(lua_State *L)
+{
+    lua_Integer value = luaL_checkinteger(L, 1);
+    luaL_argcheck(L, value >= 0 && value <= 255 && (value < 24 || value > 31), 1, "Not a simple value");
+    push_simple(L, value);
+    return 1;
+}
 
-    switch (cbor_value_get_type(it))
+static int simple_index(lua_State *L)
+{
+    const cbor_simple_t *simple = luaL_checkudata(L, 1, SIMPLE_CLASS);
+    const char *key = lua_tostring(L, 2);
+    if (key && strcmp(key, "value") == 0)
+    {
+        lua_pushinteger(L, simple->value);
+    }
+    else
     {
-    case CborIntegerType:
-        CBOR_ERROR_WRAP(cbor_value_get_int64(it, &d.ival));
-        lua_pushinteger(L, d.ival);
-        cbor_value_advance(it);
-        break;
-    case CborByteStringType:
-        CBOR_ERROR_WRAP(cbor_value_dup_byte_string(it, (uint8_t **)&d.buf, &sz, it));
-        lua_pushlstring(L, d.buf, sz);
-        free(d.buf);
-        break;
-    case CborTextStringType:
-        ESP_LOGI(TAG, "Is this string really a a string? %d", cbor_value_is_text_string(it));
-        CBOR_ERROR_WRAP(cbor_value_dup_text_string(it, &d.buf, &sz, it));
-        ESP_LOGI(TAG, "Decoded string %.*s", sz, d.buf);
-        lua_pushlstring(L, d.buf, sz);
-        free(d.buf);
-        break;
-    case CborBooleanType:
-        CBOR_ERROR_WRAP(cbor_value_get_boolean(it, &d.bval));
-        lua_pushboolean(L, d.bval);
-        cbor_value_advance(it);
-        break;
-    case CborNullType:
-    case CborUndefinedType: // Undefined gets treated as nil in Lua
         lua_pushnil(L);
-        cbor_value_advance(it);
-        break;
+    }
+    return 1;
+}
 
-    case CborHalfFloatType:
-        CBOR_ERROR_WRAP(cbor_value_get_half_float_as_float(it, &d.fval));
-        lua_pushnumber(L, d.fval);
-        cbor_value_advance(it);
-        break;
-    case CborFloatType:
-        CBOR_ERROR_WRAP(cbor_value_get_float(it, &d.fval));
-        lua_pushnumber(L, d.fval);
-        cbor_value_advance(it);
-        break;
-    case CborDoubleType:
-        CBOR_ERROR_WRAP(cbor_value_get_double(it, &d.dval));
-        lua_pushnumber(L, d.dval);
-        cbor_value_advance(it);
-        break;
+static int simple_eq(lua_State *L)
+{
+    const cbor_simple_t *a = luaL_checkudata(L, 1, SIMPLE_CLASS);
+    const cbor_simple_t *b = luaL_testudata(L, 2, SIMPLE_CLASS);
+    lua_pushboolean(L, b && a->value == b->value);
+    return 1;
+}
 
-    case CborArrayType:
-    case CborMapType:
-        lua_newtable(L);
-        CBOR_ERROR_WRAP(cbor_value_enter_container(it, &contit));
-        int i = 1;
-        while (!cbor_value_at_end(&contit))
+static int simple_tostring(lua_State *L)
+{
+    const cbor_simple_t *simple = luaL_checkudata(L, 1, SIMPLE_CLASS);
+    lua_pushfstring(L, "cbor.simple(%d)", simple->value);
+    return 1;
+}
+
+static const struct luaL_Reg simple_funcs[] = {
+    {"__index", simple_index},
+    {"__eq", simple_eq},
+    {"__tostring", simple_tostring},
+    {NULL, NULL}};
+
+/**
+ * cbor.expr(fn, args...) - the CBOR expression (see expressions.md) that calls the function with the arguments, which
+ * can be expressions themselves.  nil can't be an argument, as the array would end there; use cbor.null instead.
+ */
+static int lua_cbor_expr(lua_State *L)
+{
+    int n = lua_gettop(L);
+    luaL_checkinteger(L, 1);
+    lua_createtable(L, n, 0);
+    for (int i = 1; i <= n; i++)
+    {
+        if (lua_isnil(L, i))
+        {
+            luaL_argerror(L, i, "Use cbor.null rather than nil in an expression");
+        }
+        lua_pushvalue(L, i);
+        lua_rawseti(L, -2, i);
+    }
+    lua_pushcfunction(L, lua_encode_as_list);
+    lua_insert(L, -2);
+    lua_call(L, 1, 1);
+    push_tagged(L, CBOR_EXPR_TAG);
+    return 1;
+}
+
+/**
+ * cbor.encode_seq(...) - each argument encoded, one after another, as an RFC 8742 sequence.
+ */
+static int lua_cbor_encode_seq(lua_State *L)
+{
+    int n = lua_gettop(L);
+    luaL_checkstack(L, n + 1, "Too many items to encode");
+    encode_ctx_t ctx = {.strict = false, .depth = 0};
+    for (int i = 1; i <= n; i++)
+    {
+        CborError err = push_encoded(L, i, CborInvalidType, &ctx);
+        if (err != CborNoError)
+        {
+            luaL_error(L, err == CborErrorIllegalType ? "Attempt to encode invalid value" : cbor_error_string(err));
+        }
+    }
+    lua_concat(L, n);
+    return 1;
+}
+
+/**
+ * Pushes the item that starts at data[*pos], and moves pos past it.  Returns CborErrorUnexpectedEOF, without pushing
+ * anything, if the data ends part way through it.
+ */
+static CborError decode_next(lua_State *L, const uint8_t *data, size_t len, size_t *pos)
+{
+    CborParser parser;
+    CborValue it, end;
+    CborError err = cbor_parser_init(data + *pos, len - *pos, 0, &parser, &it);
+    if (err == CborNoError)
+    {
+        // Check that all of it is there before decoding any of it.
+        end = it;
+        err = cbor_value_advance(&end);
+    }
+    if (err == CborErrorAdvancePastEOF)
+    {
+        err = CborErrorUnexpectedEOF;
+    }
+    if (err == CborNoError)
+    {
+        err = decode_item(L, &it, 0);
+    }
+    if (err == CborNoError)
+    {
+        *pos = cbor_value_get_next_byte(&it) - data;
+    }
+    return err;
+}
+
+/**
+ * cbor.decode_seq(bytes) - decodes an RFC 8742 sequence, and returns an array of the items and the number of them (as
+ * any that are nil leave holes).
+ */
+static int lua_cbor_decode_seq(lua_State *L)
+{
+    size_t len;
+    const uint8_t *data = (const uint8_t *)luaL_checklstring(L, 1, &len);
+    lua_newtable(L);
+    size_t pos = 0;
+    lua_Integer n = 0;
+    while (pos < len)
+    {
+        raise_decode_error(L, decode_next(L, data, len, &pos));
+        lua_rawseti(L, -2, ++n);
+    }
+    lua_pushinteger(L, n);
+    return 2;
+}
+
+#define DECODER_CLASS "cbor.decoder"
+#define SCAN_INDEFINITE UINT64_MAX
+
+/**
+ * An incremental decoder of a sequence, that is fed it a chunk at a time (the blocks of an upload, say).  The chunks
+ * that haven't all been decoded yet are kept in a table, its user value, as they are.  Each byte is scanned once, to
+ * find where the next item ends, and the state of the scan is kept here between chunks, so an item that spans many
+ * chunks costs no more than one that doesn't.  An item in one chunk is decoded where it is, and one that spans several
+ * is put together once, when it's complete.
+ */
+typedef struct
+{
+    size_t pos;        // Of the next item, in the first chunk.
+    lua_Integer count; // Items decoded so far.
+    int chunks;        // In the table.
+    int scanChunk;     // Where the scan for the end of the next item has got to.
+    size_t scanPos;
+    uint64_t skip;     // Bytes of a string still to pass over.
+    uint8_t head[9];   // Initial byte and argument, as far as they have come.
+    uint8_t headLen;
+    uint8_t depth;
+    uint64_t left[CBOR_MAX_DEPTH]; // Items left in each enclosing array or map, or SCAN_INDEFINITE until a break.
+} cbor_decoder_t;
+
+/**
+ * One more item has ended.  Returns true if that was the end of the item being scanned for, taking it out of whatever
+ * arrays and maps it has ended too.
+ */
+static bool scan_item_done(cbor_decoder_t *dec)
+{
+    while (dec->depth)
+    {
+        uint64_t *left = &dec->left[dec->depth - 1];
+        if (*left == SCAN_INDEFINITE || --*left)
+        {
+            return false;
+        }
+        dec->depth--;
+    }
+    return true;
+}
+
+static CborError scan_push(cbor_decoder_t *dec, uint64_t items)
+{
+    if (dec->depth >= CBOR_MAX_DEPTH)
+    {
+        return CborErrorNestingTooDeep;
+    }
+    dec->left[dec->depth++] = items;
+    return CborNoError;
+}
+
+/**
+ * Scans data from *pos for the end of the item being scanned for.  Returns CborNoError with *pos just past it, or
+ * CborErrorUnexpectedEOF at the end of the data, having kept where it got to.  Only as much is checked as it takes to
+ * find the end; the decode that follows checks the rest.
+ */
+static CborError scan_item(cbor_decoder_t *dec, const uint8_t *data, size_t len, size_t *pos)
+{
+    static const uint8_t arg_bytes[] = {1, 2, 4, 8};
+    while (*pos < len)
+    {
+        if (dec->skip)
         {
-            if (it->type == CborMapType)
+            size_t n = dec->skip < len - *pos ? dec->skip : len - *pos;
+            *pos += n;
+            dec->skip -= n;
+            if (!dec->skip && scan_item_done(dec))
             {
-                // Push The Key
-                if (lua_decode_item(L, &contit))
-                {
-                    return true;
-                }
+                return CborNoError;
             }
-            else
+            continue;
+        }
+
+        uint8_t ai = (dec->headLen ? dec->head[0] : data[*pos]) & 0x1f;
+        uint8_t headSize = 1 + (ai >= 24 && ai <= 27 ? arg_bytes[ai - 24] : 0);
+        while (dec->headLen < headSize && *pos < len)
+        {
+            dec->head[dec->headLen++] = data[(*pos)++];
+        }
+        if (dec->headLen < headSize)
+        {
+            break;
+        }
+        dec->headLen = 0;
+        uint8_t major = dec->head[0] >> 5;
+        uint64_t arg = ai;
+        if (headSize > 1)
+        {
+            arg = 0;
+            for (int i = 1; i < headSize; i++)
             {
-                // Push an Index
-                lua_pushinteger(L, i++);
+                arg = arg << 8 | dec->head[i];
             }
-            // Push the value
-            if (lua_decode_item(L, &contit))
+        }
+
+        CborError err = CborNoError;
+        bool done = false;
+        if (dec->head[0] == 0xff)
+        {
+            if (!dec->depth || dec->left[dec->depth - 1] != SCAN_INDEFINITE)
             {
-                return true;
+                return CborErrorUnexpectedBreak;
             }
-            lua_settable(L, -3);
-            cbor_value_advance(&contit);
+            dec->depth--;
+            done = true;
+        }
+        else if (ai >= 28 && ai <= 30)
+        {
+            return CborErrorIllegalNumber;
+        }
+        else if (ai == 31)
+        {
+            if (major != CborByteStringType >> 5 && major != CborTextStringType >> 5 &&
+                major != CborArrayType >> 5 && major != CborMapType >> 5)
+            {
+                return CborErrorIllegalNumber;
+            }
+            err = scan_push(dec, SCAN_INDEFINITE);
+        }
+        else if (major == CborByteStringType >> 5 || major == CborTextStringType >> 5)
+        {
+            dec->skip = arg;
+            done = !arg;
+        }
+        else if (major == CborArrayType >> 5 || major == CborMapType >> 5)
+        {
+            if (major == CborMapType >> 5)
+            {
+                arg = arg > (SCAN_INDEFINITE - 1) / 2 ? SCAN_INDEFINITE - 1 : arg * 2;
+            }
+            err = arg ? scan_push(dec, arg) : CborNoError;
+            done = !arg;
+        }
+        else
+        {
+            // A tag is followed by the item it tags, and everything else is just the head.
+            done = major != CborTagType >> 5;
+        }
+        if (err != CborNoError)
+        {
+            return err;
+        }
+        if (done && scan_item_done(dec))
+        {
+            return CborNoError;
         }
-        CBOR_ERROR_WRAP(cbor_value_leave_container(it, &contit))
-        break;
-
-    // We don't support these types - THey will fall through to the error case
-    case CborTagType:
-    case CborSimpleType:
-
-    default:
-        luaL_error(L, "Type of object is invalid");
-        return true;
     }
-    return false; // This isn't the number of items - its actually an error code.
+    return CborErrorUnexpectedEOF;
 }
 
-int lua_cbor_decode(lua_State *L)
+/**
+ * Removes the first n chunks from the table at idx.
+ */
+static void decoder_drop_chunks(lua_State *L, cbor_decoder_t *dec, int idx, int n)
 {
-    CborValue it;
-    size_t sz;
-    CborParser parser;
-
-    if (!lua_isstring(L, 1))
+    if (!n)
     {
-        luaL_argerror(L, 1, "Arg should be a byte string");
-        return 1;
+        return;
+    }
+    for (int i = 1; i <= dec->chunks; i++)
+    {
+        if (i + n <= dec->chunks)
+        {
+            lua_rawgeti(L, idx, i + n);
+        }
+        else
+        {
+            lua_pushnil(L);
+        }
+        lua_rawseti(L, idx, i);
     }
+    dec->chunks -= n;
+    dec->scanChunk -= n;
+}
 
-    uint8_t *src = (uint8_t *)lua_tolstring(L, 1, &sz);
-    CBOR_ERROR_WRAP(cbor_parser_init(src, sz, 0, &parser, &it));
-    lua_decode_item(L, &it);
+/**
+ * cbor.decoder() - a new incremental decoder.
+ */
+static int lua_cbor_decoder(lua_State *L)
+{
+    cbor_decoder_t *dec = lua_newuserdatauv(L, sizeof(cbor_decoder_t), 1);
+    memset(dec, 0, sizeof(*dec));
+    dec->scanChunk = 1;
+    lua_newtable(L);
+    lua_setiuservalue(L, -2, 1);
+    luaL_setmetatable(L, DECODER_CLASS);
     return 1;
 }
 
 /**
- * Decorator that takes a table and sets it metadata to one that indicates that the table should be encoded as a list.
+ * The iterator returned by feed().  Its upvalue is the decoder.
  */
-int lua_encode_as_list(lua_State *L)
+static int decoder_next(lua_State *L)
 {
-    if (!lua_istable(L, 1))
+    cbor_decoder_t *dec = lua_touserdata(L, lua_upvalueindex(1));
+    lua_getiuservalue(L, lua_upvalueindex(1), 1);
+    int chunks = lua_gettop(L);
+
+    CborError err = CborErrorUnexpectedEOF;
+    while (err == CborErrorUnexpectedEOF && dec->scanChunk <= dec->chunks)
     {
-        luaL_argerror(L, 1, "Must be a table");
+        // The chunk stays in the table, so its bytes do too.
+        lua_rawgeti(L, chunks, dec->scanChunk);
+        size_t len;
+        const uint8_t *data = (const uint8_t *)lua_tolstring(L, -1, &len);
+        lua_pop(L, 1);
+        err = scan_item(dec, data, len, &dec->scanPos);
+        if (err == CborErrorUnexpectedEOF)
+        {
+            dec->scanChunk++;
+            dec->scanPos = 0;
+        }
     }
-    if (lua_getmetatable(L, 1))
+    if (err == CborErrorUnexpectedEOF)
     {
-        // It already has a metatable.  Just set the __enc field
-        lua_pushstring(L, "array");
-        lua_setfield(L, -2, "__enc");
-        lua_pop(L, 1);
+        return 0; // The rest of it comes with the next chunk.
+    }
+    raise_decode_error(L, err);
+
+    size_t start = dec->pos;
+    if (dec->scanChunk > 1)
+    {
+        luaL_Buffer b;
+        luaL_buffinit(L, &b);
+        for (int i = 1; i <= dec->scanChunk; i++)
+        {
+            lua_rawgeti(L, chunks, i);
+            size_t len;
+            const char *chunk = lua_tolstring(L, -1, &len);
+            lua_pop(L, 1);
+            size_t from = i == 1 ? dec->pos : 0;
+            luaL_addlstring(&b, chunk + from, (i == dec->scanChunk ? dec->scanPos : len) - from);
+        }
+        luaL_pushresult(&b);
+        start = 0;
     }
     else
     {
-        lua_getglobal(L, "cbor");
-        lua_getfield(L, -1, "__list_meta");
-        lua_setmetatable(L, 1);
+        lua_rawgeti(L, chunks, 1);
+    }
+    size_t len;
+    const uint8_t *data = (const uint8_t *)lua_tolstring(L, -1, &len);
+    if (dec->scanChunk == 1)
+    {
+        len = dec->scanPos;
     }
-    lua_pop(L, 1); // the coap global
+    raise_decode_error(L, decode_next(L, data, len, &start));
 
-    lua_pushvalue(L, 1); // Returns what was passed in.
+    // The next item starts where this one ended, and the chunks before that have been dealt with.
+    decoder_drop_chunks(L, dec, chunks, dec->scanChunk - 1);
+    lua_rawgeti(L, chunks, 1);
+    if (lua_rawlen(L, -1) == dec->scanPos)
+    {
+        decoder_drop_chunks(L, dec, chunks, 1);
+        dec->scanChunk = 1;
+        dec->scanPos = 0;
+    }
+    lua_pop(L, 1);
+    dec->pos = dec->scanPos;
+    lua_pushinteger(L, ++dec->count);
+    lua_insert(L, -2);
+    return 2;
+}
+
+/**
+ * dec:feed(chunk) - adds the next chunk, and returns an iterator of the number and the value of each item that is now
+ * complete.  Items are decoded as the iterator gets to them, and any that it doesn't get to are kept for the next one.
+ */
+static int decoder_feed(lua_State *L)
+{
+    cbor_decoder_t *dec = luaL_checkudata(L, 1, DECODER_CLASS);
+    size_t len;
+    luaL_checklstring(L, 2, &len);
+    if (len)
+    {
+        lua_getiuservalue(L, 1, 1);
+        lua_pushvalue(L, 2);
+        lua_rawseti(L, -2, ++dec->chunks);
+        lua_pop(L, 1);
+    }
+    lua_pushvalue(L, 1);
+    lua_pushcclosure(L, decoder_next, 1);
+    return 1;
+}
+
+/**
+ * dec:finish() - checks that the sequence didn't end part way through an item, and returns the number of items.
+ */
+static int decoder_finish(lua_State *L)
+{
+    cbor_decoder_t *dec = luaL_checkudata(L, 1, DECODER_CLASS);
+    lua_getiuservalue(L, 1, 1);
+    size_t left = 0;
+    for (int i = 1; i <= dec->chunks; i++)
+    {
+        lua_rawgeti(L, -1, i);
+        left += lua_rawlen(L, -1) - (i == 1 ? dec->pos : 0);
+        lua_pop(L, 1);
+    }
+    if (left)
+    {
+        luaL_error(L, "CBOR sequence has %d bytes left that weren't decoded", (int)left);
+    }
+    lua_pushinteger(L, dec->count);
     return 1;
 }
 
+static const struct luaL_Reg decoder_funcs[] = {
+    {"feed", decoder_feed},
+    {"finish", decoder_finish},
+    {NULL, NULL}};
+
 static const struct luaL_Reg funcs[] = {
     {"encode", lua_cbor_encode},
     {"decode", lua_cbor_decode},
+    {"view", lua_cbor_view},
+    {"compile", lua_cbor_compile},
+    {"tag", lua_cbor_tag},
+    {"simple", lua_cbor_simple},
+    {"expr", lua_cbor_expr},
+    {"encode_seq", lua_cbor_encode_seq},
+    {"decode_seq", lua_cbor_decode_seq},
+    {"decoder", lua_cbor_decoder},
     {"encode_as_list", lua_encode_as_list},
     {NULL, NULL}};
 
@@ -449,5 +2073,31 @@ int luaopen_cbor(lua_State *L)
     lua_settable(L, -3);
     lua_settable(L, -3);
 
+    luaL_newmetatable(L, VIEW_CLASS);
+    luaL_setfuncs(L, view_funcs, 0);
+    lua_pop(L, 1);
+    lua_cbor_expr_init(L);
+    luaL_newmetatable(L, TAG_CLASS);
+    luaL_setfuncs(L, tag_funcs, 0);
+    lua_pop(L, 1);
+    luaL_newmetatable(L, SIMPLE_CLASS);
+    luaL_setfuncs(L, simple_funcs, 0);
+    lua_pop(L, 1);
+    luaL_newmetatable(L, DECODER_CLASS);
+    luaL_newlib(L, decoder_funcs);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+
+    push_simple(L, 22);
+    lua_setfield(L, -2, "null");
+
+    // Encode plans, by metatable.
+    lua_newtable(L);
+    lua_createtable(L, 0, 1);
+    lua_pushstring(L, "k");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+    planCacheRef = luaL_ref(L, LUA_REGISTRYINDEX);
+
     return 1;
 }
\ No newline at end of file
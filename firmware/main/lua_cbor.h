@@ -4,6 +4,21 @@
 #include <cbor.h>
 #include <lua/lua.h>
 
+/**
+ * Nesting deeper than this is refused, when encoding or decoding, rather than recursing until the stack runs out (as
+ * encoding a table that contains itself would).
+ */
+#define CBOR_MAX_DEPTH 32
 
 int lua_cbor_encode(lua_State *L);
 int luaopen_cbor(lua_State *L);
+
+/**
+ * Pushes the item at it, decoded as cbor.decode() would, and moves it on.  Returns rather than raises errors.
+ */
+CborError lua_cbor_push_item(lua_State *L, CborValue *it);
+
+/**
+ * The item that the cbor.view at idx is of, or NULL if it isn't a view.
+ */
+const CborValue *lua_cbor_test_view(lua_State *L, int idx);
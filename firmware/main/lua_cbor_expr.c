@@ -0,0 +1,1396 @@
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <esp_log.h>
+#include <lua/lua.h>
+#include <lua/lauxlib.h>
+#include "lua_cbor.h"
+#include "lua_cbor_expr.h"
+
+#define TAG "cbor_expr"
+
+/**
+ * Evaluates the CBOR expressions of expressions.md, so that rules binding events to actions don't have to go through
+ * the Lua interpreter.  An expression is checked and compiled once, by cbor.compile(), into a bytecode for a stack
+ * machine, and the values that the expression is made of stay where they are in the encoded expression.  Evaluating it
+ * works on the encoded event in the same way, and uses only fixed size areas for its stack, and for the arrays, maps
+ * and strings that it builds, so doesn't allocate anything until the result is turned into Lua values.
+ *
+ * Arrays are indexed from 0, as the expressions come from outside Lua.  nil, false and 0 are false; everything else is
+ * true.
+ */
+#define EXPR_STACK 16         // Values on the evaluation stack.  Deeper expressions don't compile.
+#define EXPR_LIST_SLOTS 64    // Items of the arrays (and keys and values of the maps) built during an evaluation.
+#define EXPR_STRING_BYTES 256 // Bytes of the strings built during an evaluation.
+#define EXPR_MAX_NESTING 16   // How deep expressions can be nested in each other.
+#define EXPR_CLASS "cbor.expr"
+
+typedef enum
+{
+    FN_SELF,
+    FN_INDEX,
+    FN_IF,
+    FN_FILTER,
+    FN_MAP,
+    FN_SEQUENCE,
+    FN_ADD,
+    FN_SUB,
+    FN_MUL,
+    FN_DIV,
+    FN_NOT,
+    FN_OR,
+    FN_AND,
+    FN_EQ,
+    FN_MOD,
+    FN_RETURN,
+    FN_COUNT,
+} expr_fn_t;
+
+typedef enum
+{
+    OP_SELF,
+    OP_NIL,
+    OP_TRUE,
+    OP_FALSE,
+    OP_INT,           // int64_t follows.
+    OP_FLOAT,         // double follows.
+    OP_CONST,         // uint16_t index of a string, or an array or map without expressions in it, follows.
+    OP_ARRAY,         // uint16_t count follows.  Makes an array of that many values.
+    OP_MAP,           // uint16_t count follows.  Makes a map of that many keys and values.
+    OP_INDEX,
+    OP_JUMP_IF_FALSE, // uint16_t offset follows.
+    OP_JUMP,          // uint16_t offset follows.
+    OP_FILTER,        // uint16_t length of the body, then the body.
+    OP_COLLECT,       // uint16_t length of the body, then the body.  The map function, but "map" is taken.
+    OP_POP,
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_NOT,
+    OP_OR,
+    OP_AND,
+    OP_EQ,
+    OP_MOD,
+    OP_RETURN,
+} expr_op_t;
+
+/**
+ * Arguments that each function takes (-1 for one or more), and the op that it compiles to, for those that are just
+ * their arguments and then an op.
+ */
+static const struct
+{
+    int8_t args;
+    uint8_t op;
+} functions[FN_COUNT] = {
+    [FN_SELF] = {0, OP_SELF},
+    [FN_INDEX] = {2, OP_INDEX},
+    [FN_IF] = {3, 0},
+    [FN_FILTER] = {2, OP_FILTER},
+    [FN_MAP] = {2, OP_COLLECT},
+    [FN_SEQUENCE] = {-1, 0},
+    [FN_ADD] = {2, OP_ADD},
+    [FN_SUB] = {2, OP_SUB},
+    [FN_MUL] = {2, OP_MUL},
+    [FN_DIV] = {2, OP_DIV},
+    [FN_NOT] = {1, OP_NOT},
+    [FN_OR] = {2, OP_OR},
+    [FN_AND] = {2, OP_AND},
+    [FN_EQ] = {2, OP_EQ},
+    [FN_MOD] = {2, OP_MOD},
+    [FN_RETURN] = {1, OP_RETURN},
+};
+
+/**
+ * A compiled expression.  The constants and the code follow it in the same userdata, and the encoded expression is
+ * its user value, so the constants (which point into it) stay valid.
+ */
+typedef struct
+{
+    CborParser parser;
+    const CborValue *consts;
+    const uint8_t *code;
+    size_t codeLen;
+} expr_prog_t;
+
+typedef struct
+{
+    uint8_t *code; // NULL while working out the size.
+    size_t len;
+    CborValue *consts;
+    size_t nconsts;
+    int depth; // Values on the stack at this point.
+    int maxDepth;
+} compiler_t;
+
+static void emit(compiler_t *c, const void *bytes, size_t len)
+{
+    if (c->code)
+    {
+        memcpy(c->code + c->len, bytes, len);
+    }
+    c->len += len;
+}
+
+static void emit_op(compiler_t *c, uint8_t op)
+{
+    emit(c, &op, 1);
+}
+
+static void emit_u16(compiler_t *c, uint16_t v)
+{
+    emit(c, &v, sizeof(v));
+}
+
+static void patch_u16(compiler_t *c, size_t at, size_t v)
+{
+    if (c->code)
+    {
+        uint16_t v16 = v;
+        memcpy(c->code + at, &v16, sizeof(v16));
+    }
+}
+
+static void stack_change(compiler_t *c, int n)
+{
+    c->depth += n;
+    if (c->depth > c->maxDepth)
+    {
+        c->maxDepth = c->depth;
+    }
+}
+
+static CborError emit_const(compiler_t *c, const CborValue *it)
+{
+    if (c->nconsts > UINT16_MAX)
+    {
+        return CborErrorDataTooLarge;
+    }
+    if (c->consts)
+    {
+        c->consts[c->nconsts] = *it;
+    }
+    emit_op(c, OP_CONST);
+    emit_u16(c, c->nconsts++);
+    stack_change(c, 1);
+    return CborNoError;
+}
+
+/**
+ * Whether there's an expression anywhere in the item at it.
+ */
+static CborError contains_expr(const CborValue *it, int nesting, bool *found)
+{
+    if (nesting > CBOR_MAX_DEPTH)
+    {
+        return CborErrorNestingTooDeep;
+    }
+    CborValue cur = *it;
+    CborError err = CborNoError;
+    if (cbor_value_is_tag(&cur))
+    {
+        CborTag tag;
+        cbor_value_get_tag(&cur, &tag);
+        if (tag == CBOR_EXPR_TAG)
+        {
+            *found = true;
+            return CborNoError;
+        }
+        err = cbor_value_advance_fixed(&cur);
+        return err == CborNoError ? contains_expr(&cur, nesting + 1, found) : err;
+    }
+    if (!cbor_value_is_container(&cur))
+    {
+        return CborNoError;
+    }
+    CborValue contit;
+    err = cbor_value_enter_container(&cur, &contit);
+    while (err == CborNoError && !*found && !cbor_value_at_end(&contit))
+    {
+        err = contains_expr(&contit, nesting + 1, found);
+        if (err == CborNoError)
+        {
+            err = cbor_value_advance(&contit);
+        }
+    }
+    return err;
+}
+
+static CborError compile_item(compiler_t *c, CborValue *it, int nesting);
+
+/**
+ * Compiles the items of the array or map at it into an op that builds it, and moves it past the container.
+ */
+static CborError compile_container(compiler_t *c, CborValue *it, int nesting)
+{
+    bool isMap = cbor_value_is_map(it);
+    size_t n = 0;
+    CborValue contit;
+    CborError err = cbor_value_enter_container(it, &contit);
+    while (err == CborNoError && !cbor_value_at_end(&contit))
+    {
+        err = compile_item(c, &contit, nesting + 1);
+        n++;
+    }
+    if (err != CborNoError)
+    {
+        return err;
+    }
+    if (n > EXPR_LIST_SLOTS)
+    {
+        return CborErrorDataTooLarge;
+    }
+    emit_op(c, isMap ? OP_MAP : OP_ARRAY);
+    emit_u16(c, isMap ? n / 2 : n);
+    stack_change(c, 1 - (int)n);
+    return cbor_value_leave_container(it, &contit);
+}
+
+/**
+ * Compiles the body of a filter or map at it, after the op, with the length of the body.
+ */
+static CborError compile_body(compiler_t *c, CborValue *it, uint8_t op, int nesting)
+{
+    emit_op(c, op);
+    size_t lenAt = c->len;
+    emit_u16(c, 0);
+    CborError err = compile_item(c, it, nesting);
+    if (err != CborNoError)
+    {
+        return err;
+    }
+    size_t len = c->len - lenAt - sizeof(uint16_t);
+    if (len > UINT16_MAX)
+    {
+        return CborErrorDataTooLarge;
+    }
+    patch_u16(c, lenAt, len);
+    stack_change(c, -1); // The body's result is taken each time round.
+    return CborNoError;
+}
+
+/**
+ * Compiles the function call in the array at it, which is the content of an expression tag.
+ */
+static CborError compile_call(compiler_t *c, CborValue *it, int nesting)
+{
+    if (!cbor_value_is_array(it))
+    {
+        return CborErrorImproperValue;
+    }
+    CborValue args;
+    CborError err = cbor_value_enter_container(it, &args);
+    int64_t fn = -1;
+    if (err == CborNoError && cbor_value_is_integer(&args))
+    {
+        cbor_value_get_int64_checked(&args, &fn);
+        err = cbor_value_advance_fixed(&args);
+    }
+    if (err != CborNoError)
+    {
+        return err;
+    }
+    if (fn < 0 || fn >= FN_COUNT)
+    {
+        return CborErrorImproperValue;
+    }
+
+    int n = 0;
+    size_t jumpAt = 0, elseAt = 0;
+    while (err == CborNoError && !cbor_value_at_end(&args))
+    {
+        if (functions[fn].args >= 0 && n >= functions[fn].args)
+        {
+            return CborErrorTooManyItems;
+        }
+        if (fn == FN_SEQUENCE && n > 0)
+        {
+            // Only the last value of a sequence is kept.
+            emit_op(c, OP_POP);
+            stack_change(c, -1);
+        }
+        if ((fn == FN_FILTER || fn == FN_MAP) && n == 1)
+        {
+            err = compile_body(c, &args, functions[fn].op, nesting + 1);
+            n++;
+            continue;
+        }
+        if (fn == FN_IF && n == 2)
+        {
+            // Then there's the else, which starts with the jump over it at the end of the then.
+            emit_op(c, OP_JUMP);
+            elseAt = c->len;
+            emit_u16(c, 0);
+            patch_u16(c, jumpAt, c->len - jumpAt - sizeof(uint16_t));
+            stack_change(c, -1); // Only one of then and else runs.
+        }
+        err = compile_item(c, &args, nesting + 1);
+        if (fn == FN_IF && n == 0)
+        {
+            emit_op(c, OP_JUMP_IF_FALSE);
+            jumpAt = c->len;
+            emit_u16(c, 0);
+            stack_change(c, -1);
+        }
+        n++;
+    }
+    if (err != CborNoError)
+    {
+        return err;
+    }
+    if ((functions[fn].args >= 0 && n < functions[fn].args) || (functions[fn].args < 0 && n == 0))
+    {
+        return CborErrorTooFewItems;
+    }
+
+    switch (fn)
+    {
+    case FN_IF:
+        if (c->len - elseAt - sizeof(uint16_t) > UINT16_MAX)
+        {
+            return CborErrorDataTooLarge;
+        }
+        patch_u16(c, elseAt, c->len - elseAt - sizeof(uint16_t));
+        break;
+    case FN_FILTER:
+    case FN_MAP:
+    case FN_SEQUENCE:
+        break;
+    default:
+        emit_op(c, functions[fn].op);
+        stack_change(c, 1 - n);
+        break;
+    }
+    return cbor_value_leave_container(it, &args);
+}
+
+/**
+ * Compiles the item at it into code that pushes its value, and moves it on to the next item.
+ */
+static CborError compile_item(compiler_t *c, CborValue *it, int nesting)
+{
+    if (nesting > EXPR_MAX_NESTING)
+    {
+        return CborErrorNestingTooDeep;
+    }
+
+    CborError err;
+    switch (cbor_value_get_type(it))
+    {
+    case CborTagType:
+    {
+        CborTag tag;
+        cbor_value_get_tag(it, &tag);
+        if (tag != CBOR_EXPR_TAG)
+        {
+            return CborErrorUnknownTag;
+        }
+        err = cbor_value_advance_fixed(it);
+        return err == CborNoError ? compile_call(c, it, nesting) : err;
+    }
+    case CborIntegerType:
+    {
+        int64_t ival;
+        err = cbor_value_get_int64_checked(it, &ival);
+        if (err == CborErrorDataTooLarge)
+        {
+            // Too big for an integer, so it has to be a float, as it would be when decoded.
+            uint64_t raw;
+            cbor_value_get_raw_integer(it, &raw);
+            double d = cbor_value_is_unsigned_integer(it) ? (double)raw : -1 - (double)raw;
+            emit_op(c, OP_FLOAT);
+            emit(c, &d, sizeof(d));
+            err = CborNoError;
+        }
+        else
+        {
+            emit_op(c, OP_INT);
+            emit(c, &ival, sizeof(ival));
+        }
+        break;
+    }
+    case CborHalfFloatType:
+    case CborFloatType:
+    case CborDoubleType:
+    {
+        double d;
+        float f;
+        if (cbor_value_get_type(it) == CborDoubleType)
+        {
+            err = cbor_value_get_double(it, &d);
+        }
+        else
+        {
+            err = cbor_value_get_type(it) == CborFloatType ? cbor_value_get_float(it, &f)
+                                                          : cbor_value_get_half_float_as_float(it, &f);
+            d = f;
+        }
+        emit_op(c, OP_FLOAT);
+        emit(c, &d, sizeof(d));
+        break;
+    }
+    case CborBooleanType:
+    {
+        bool b;
+        err = cbor_value_get_boolean(it, &b);
+        emit_op(c, b ? OP_TRUE : OP_FALSE);
+        break;
+    }
+    case CborNullType:
+    case CborUndefinedType:
+        emit_op(c, OP_NIL);
+        err = CborNoError;
+        break;
+    case CborTextStringType:
+    case CborByteStringType:
+        err = emit_const(c, it);
+        return err == CborNoError ? cbor_value_advance(it) : err;
+    case CborArrayType:
+    case CborMapType:
+    {
+        bool found = false;
+        err = contains_expr(it, 0, &found);
+        if (err == CborNoError && found)
+        {
+            return compile_container(c, it, nesting);
+        }
+        err = err == CborNoError ? emit_const(c, it) : err;
+        return err == CborNoError ? cbor_value_advance(it) : err;
+    }
+    default:
+        return CborErrorUnsupportedType;
+    }
+    if (err != CborNoError)
+    {
+        return err;
+    }
+    stack_change(c, 1);
+    return cbor_value_advance_fixed(it);
+}
+
+/**
+ * Compiles the whole of the encoded expression, and checks that there's nothing after it.
+ */
+static CborError compile(compiler_t *c, const uint8_t *src, size_t len, CborParser *parser)
+{
+    CborValue it;
+    CborError err = cbor_parser_init(src, len, 0, parser, &it);
+    if (err == CborNoError)
+    {
+        err = compile_item(c, &it, 0);
+    }
+    if (err == CborNoError && cbor_value_get_next_byte(&it) != src + len)
+    {
+        err = CborErrorGarbageAtEnd;
+    }
+    if (err == CborNoError && (c->maxDepth > EXPR_STACK || c->len > UINT16_MAX))
+    {
+        err = CborErrorNestingTooDeep;
+    }
+    return err;
+}
+
+typedef enum
+{
+    VAL_NIL,
+    VAL_BOOL,
+    VAL_INT,
+    VAL_FLOAT,
+    VAL_TEXT,
+    VAL_BYTES,
+    VAL_CBOR,  // An array or map (or anything else) that is still encoded.
+    VAL_ARRAY, // Built by the expression.
+    VAL_MAP,   // Built by the expression.
+} val_type_t;
+
+typedef struct
+{
+    uint8_t type;
+    union
+    {
+        bool b;
+        int64_t i;
+        double f;
+        struct
+        {
+            const char *ptr;
+            size_t len;
+        } s;
+        CborValue cbor;
+        struct
+        {
+            uint16_t first; // In slots.
+            uint16_t n;     // Items, or pairs for a map.
+        } list;
+    };
+} expr_val_t;
+
+/**
+ * Everything that an evaluation uses.  There's only the one, as only the Lua task evaluates, and nothing that runs
+ * during an evaluation can start another.
+ */
+static struct
+{
+    const expr_prog_t *prog;
+    int top;
+    uint16_t slotsUsed;
+    size_t stringsUsed;
+    expr_val_t stack[EXPR_STACK];
+    expr_val_t slots[EXPR_LIST_SLOTS];
+    char strings[EXPR_STRING_BYTES];
+} vm;
+
+static CborError alloc_slots(size_t n, uint16_t *first)
+{
+    if (n > EXPR_LIST_SLOTS - vm.slotsUsed)
+    {
+        return CborErrorOutOfMemory;
+    }
+    *first = vm.slotsUsed;
+    vm.slotsUsed += n;
+    return CborNoError;
+}
+
+static char *alloc_string(size_t len)
+{
+    if (len > EXPR_STRING_BYTES - vm.stringsUsed)
+    {
+        return NULL;
+    }
+    char *s = vm.strings + vm.stringsUsed;
+    vm.stringsUsed += len;
+    return s;
+}
+
+/**
+ * Loads the string at it.  A string in one chunk stays where it is; one sent in chunks is put together.
+ */
+static CborError load_string(const CborValue *it, expr_val_t *out)
+{
+    bool text = cbor_value_is_text_string(it);
+    out->type = text ? VAL_TEXT : VAL_BYTES;
+    const void *chunk;
+    size_t len;
+    CborValue next, cur = *it;
+    CborError err = text ? cbor_value_get_text_string_chunk(&cur, (const char **)&chunk, &len, &next)
+                         : cbor_value_get_byte_string_chunk(&cur, (const uint8_t **)&chunk, &len, &next);
+    out->s.ptr = chunk ? chunk : "";
+    out->s.len = chunk ? len : 0;
+    bool copied = false;
+    while (err == CborNoError && chunk)
+    {
+        cur = next;
+        err = text ? cbor_value_get_text_string_chunk(&cur, (const char **)&chunk, &len, &next)
+                   : cbor_value_get_byte_string_chunk(&cur, (const uint8_t **)&chunk, &len, &next);
+        if (err != CborNoError || !chunk)
+        {
+            break;
+        }
+        if (!copied)
+        {
+            char *s = alloc_string(out->s.len);
+            if (!s)
+            {
+                return CborErrorOutOfMemory;
+            }
+            memcpy(s, out->s.ptr, out->s.len);
+            out->s.ptr = s;
+            copied = true;
+        }
+        // Chunks are put together at the end of the strings, so this one follows on.
+        char *s = alloc_string(len);
+        if (!s)
+        {
+            return CborErrorOutOfMemory;
+        }
+        memcpy(s, chunk, len);
+        out->s.len += len;
+    }
+    return err;
+}
+
+/**
+ * Loads the item at it as a value.  Doesn't move it.
+ */
+static CborError load_cbor(const CborValue *it, expr_val_t *out)
+{
+    CborError err = CborNoError;
+    switch (cbor_value_get_type(it))
+    {
+    case CborIntegerType:
+        out->type = VAL_INT;
+        err = cbor_value_get_int64_checked(it, &out->i);
+        if (err == CborErrorDataTooLarge)
+        {
+            uint64_t raw;
+            cbor_value_get_raw_integer(it, &raw);
+            out->type = VAL_FLOAT;
+            out->f = cbor_value_is_unsigned_integer(it) ? (double)raw : -1 - (double)raw;
+            err = CborNoError;
+        }
+        break;
+    case CborBooleanType:
+        out->type = VAL_BOOL;
+        err = cbor_value_get_boolean(it, &out->b);
+        break;
+    case CborNullType:
+    case CborUndefinedType:
+        out->type = VAL_NIL;
+        break;
+    case CborHalfFloatType:
+    case CborFloatType:
+    {
+        float f;
+        err = cbor_value_get_type(it) == CborHalfFloatType ? cbor_value_get_half_float_as_float(it, &f)
+                                                            : cbor_value_get_float(it, &f);
+        out->type = VAL_FLOAT;
+        out->f = f;
+        break;
+    }
+    case CborDoubleType:
+        out->type = VAL_FLOAT;
+        err = cbor_value_get_double(it, &out->f);
+        break;
+    case CborTextStringType:
+    case CborByteStringType:
+        return load_string(it, out);
+    default:
+        out->type = VAL_CBOR;
+        out->cbor = *it;
+        break;
+    }
+    return err;
+}
+
+static bool truthy(const expr_val_t *v)
+{
+    switch (v->type)
+    {
+    case VAL_NIL:
+        return false;
+    case VAL_BOOL:
+        return v->b;
+    case VAL_INT:
+        return v->i != 0;
+    case VAL_FLOAT:
+        return v->f != 0;
+    default:
+        return true;
+    }
+}
+
+static bool is_number(const expr_val_t *v)
+{
+    return v->type == VAL_INT || v->type == VAL_FLOAT;
+}
+
+static double to_double(const expr_val_t *v)
+{
+    return v->type == VAL_INT ? (double)v->i : v->f;
+}
+
+static bool is_string(const expr_val_t *v)
+{
+    return v->type == VAL_TEXT || v->type == VAL_BYTES;
+}
+
+static bool is_array(const expr_val_t *v)
+{
+    return v->type == VAL_ARRAY || (v->type == VAL_CBOR && cbor_value_is_array(&v->cbor));
+}
+
+static bool val_equals(const expr_val_t *a, const expr_val_t *b)
+{
+    if (is_number(a) && is_number(b))
+    {
+        return a->type == VAL_INT && b->type == VAL_INT ? a->i == b->i : to_double(a) == to_double(b);
+    }
+    if (a->type != b->type)
+    {
+        return false;
+    }
+    switch (a->type)
+    {
+    case VAL_NIL:
+        return true;
+    case VAL_BOOL:
+        return a->b == b->b;
+    case VAL_TEXT:
+    case VAL_BYTES:
+        return a->s.len == b->s.len && memcmp(a->s.ptr, b->s.ptr, a->s.len) == 0;
+    case VAL_CBOR:
+        // Only the same item is equal.
+        return cbor_value_get_next_byte(&a->cbor) == cbor_value_get_next_byte(&b->cbor);
+    default:
+        return a->list.first == b->list.first && a->list.n == b->list.n;
+    }
+}
+
+/**
+ * Number of items in an array (or pairs in a map) that's still encoded.  Always found by walking: the length in the
+ * header is whatever the sender put there, and the slots are sized from this.
+ */
+static CborError cbor_length(const CborValue *it, size_t *n)
+{
+    CborValue contit;
+    CborError err = cbor_value_enter_container(it, &contit);
+    *n = 0;
+    while (err == CborNoError && !cbor_value_at_end(&contit))
+    {
+        err = cbor_value_advance(&contit);
+        (*n)++;
+    }
+    if (cbor_value_is_map(it))
+    {
+        *n /= 2;
+    }
+    return err;
+}
+
+/**
+ * src[key], or nil if there's no such item (or src isn't an array or map).
+ */
+static CborError index_val(const expr_val_t *src, const expr_val_t *key, expr_val_t *out)
+{
+    out->type = VAL_NIL;
+    if (src->type == VAL_ARRAY)
+    {
+        if (key->type == VAL_INT && key->i >= 0 && key->i < src->list.n)
+        {
+            *out = vm.slots[src->list.first + key->i];
+        }
+        return CborNoError;
+    }
+    if (src->type == VAL_MAP)
+    {
+        for (int i = 0; i < src->list.n; i++)
+        {
+            if (val_equals(&vm.slots[src->list.first + 2 * i], key))
+            {
+                *out = vm.slots[src->list.first + 2 * i + 1];
+                break;
+            }
+        }
+        return CborNoError;
+    }
+    if (src->type != VAL_CBOR || !cbor_value_is_container(&src->cbor))
+    {
+        return CborNoError;
+    }
+
+    CborValue it;
+    CborError err = cbor_value_enter_container(&src->cbor, &it);
+    if (cbor_value_is_array(&src->cbor))
+    {
+        if (key->type != VAL_INT || key->i < 0)
+        {
+            return err;
+        }
+        for (int64_t i = key->i; err == CborNoError && i > 0 && !cbor_value_at_end(&it); i--)
+        {
+            err = cbor_value_advance(&it);
+        }
+        return err == CborNoError && !cbor_value_at_end(&it) ? load_cbor(&it, out) : err;
+    }
+    size_t stringsUsed = vm.stringsUsed;
+    while (err == CborNoError && !cbor_value_at_end(&it))
+    {
+        expr_val_t k;
+        err = load_cbor(&it, &k);
+        bool match = err == CborNoError && val_equals(&k, key);
+        vm.stringsUsed = stringsUsed; // Keys that were put together aren't needed after the comparison.
+        if (err == CborNoError)
+        {
+            err = cbor_value_advance(&it);
+        }
+        if (err == CborNoError && match)
+        {
+            return load_cbor(&it, out);
+        }
+        if (err == CborNoError)
+        {
+            err = cbor_value_advance(&it);
+        }
+    }
+    return err;
+}
+
+/**
+ * Formats a value for concatenating to a string.
+ */
+static CborError to_string(const expr_val_t *v, expr_val_t *out)
+{
+    if (is_string(v))
+    {
+        *out = *v;
+        return CborNoError;
+    }
+    char buf[32];
+    int len;
+    switch (v->type)
+    {
+    case VAL_NIL:
+        len = snprintf(buf, sizeof(buf), "null");
+        break;
+    case VAL_BOOL:
+        len = snprintf(buf, sizeof(buf), "%s", v->b ? "true" : "false");
+        break;
+    case VAL_INT:
+        len = snprintf(buf, sizeof(buf), "%lld", (long long)v->i);
+        break;
+    case VAL_FLOAT:
+        len = snprintf(buf, sizeof(buf), "%.14g", v->f);
+        break;
+    default:
+        return CborErrorIllegalType;
+    }
+    char *s = alloc_string(len);
+    if (!s)
+    {
+        return CborErrorOutOfMemory;
+    }
+    memcpy(s, buf, len);
+    out->type = VAL_TEXT;
+    out->s.ptr = s;
+    out->s.len = len;
+    return CborNoError;
+}
+
+/**
+ * Copies the items of an array into the slots from first.
+ */
+static CborError copy_items(const expr_val_t *v, uint16_t first)
+{
+    if (v->type == VAL_ARRAY)
+    {
+        memcpy(vm.slots + first, vm.slots + v->list.first, v->list.n * sizeof(expr_val_t));
+        return CborNoError;
+    }
+    CborValue it;
+    CborError err = cbor_value_enter_container(&v->cbor, &it);
+    for (uint16_t i = first; err == CborNoError && !cbor_value_at_end(&it); i++)
+    {
+        err = load_cbor(&it, &vm.slots[i]);
+        if (err == CborNoError)
+        {
+            err = cbor_value_advance(&it);
+        }
+    }
+    return err;
+}
+
+static CborError array_length(const expr_val_t *v, size_t *n)
+{
+    if (v->type == VAL_ARRAY)
+    {
+        *n = v->list.n;
+        return CborNoError;
+    }
+    return cbor_length(&v->cbor, n);
+}
+
+static CborError add(const expr_val_t *a, const expr_val_t *b, expr_val_t *out)
+{
+    if (a->type == VAL_INT && b->type == VAL_INT)
+    {
+        out->type = VAL_INT;
+        if (!__builtin_add_overflow(a->i, b->i, &out->i))
+        {
+            return CborNoError;
+        }
+    }
+    if (is_number(a) && is_number(b))
+    {
+        out->type = VAL_FLOAT;
+        out->f = to_double(a) + to_double(b);
+        return CborNoError;
+    }
+    if (is_string(a) || is_string(b))
+    {
+        // The copy of b comes straight after the copy of a, to make them one string.
+        expr_val_t sa, sb;
+        CborError err = to_string(a, &sa);
+        err = err == CborNoError ? to_string(b, &sb) : err;
+        if (err != CborNoError)
+        {
+            return err;
+        }
+        char *s = alloc_string(sa.s.len + sb.s.len);
+        if (!s)
+        {
+            return CborErrorOutOfMemory;
+        }
+        memmove(s, sa.s.ptr, sa.s.len);
+        memmove(s + sa.s.len, sb.s.ptr, sb.s.len);
+        out->type = a->type == VAL_BYTES || b->type == VAL_BYTES ? VAL_BYTES : VAL_TEXT;
+        out->s.ptr = s;
+        out->s.len = sa.s.len + sb.s.len;
+        return CborNoError;
+    }
+    if (is_array(a) && is_array(b))
+    {
+        size_t na, nb;
+        uint16_t first;
+        CborError err = array_length(a, &na);
+        err = err == CborNoError ? array_length(b, &nb) : err;
+        err = err == CborNoError && nb > SIZE_MAX - na ? CborErrorDataTooLarge : err;
+        err = err == CborNoError ? alloc_slots(na + nb, &first) : err;
+        err = err == CborNoError ? copy_items(a, first) : err;
+        err = err == CborNoError ? copy_items(b, first + na) : err;
+        out->type = VAL_ARRAY;
+        out->list.first = first;
+        out->list.n = na + nb;
+        return err;
+    }
+    return CborErrorIllegalType;
+}
+
+static CborError arithmetic(uint8_t op, const expr_val_t *a, const expr_val_t *b, expr_val_t *out)
+{
+    if (!is_number(a) || !is_number(b))
+    {
+        return CborErrorIllegalType;
+    }
+    if (a->type == VAL_INT && b->type == VAL_INT && op != OP_DIV)
+    {
+        out->type = VAL_INT;
+        switch (op)
+        {
+        case OP_SUB:
+            if (!__builtin_sub_overflow(a->i, b->i, &out->i))
+            {
+                return CborNoError;
+            }
+            break;
+        case OP_MUL:
+            if (!__builtin_mul_overflow(a->i, b->i, &out->i))
+            {
+                return CborNoError;
+            }
+            break;
+        default: // OP_MOD, with the sign of the divisor, as in Lua.
+            if (b->i == 0)
+            {
+                return CborErrorIllegalNumber;
+            }
+            out->i = b->i == -1 ? 0 : a->i % b->i;
+            if (out->i != 0 && (out->i ^ b->i) < 0)
+            {
+                out->i += b->i;
+            }
+            return CborNoError;
+        }
+    }
+    double x = to_double(a), y = to_double(b);
+    out->type = VAL_FLOAT;
+    switch (op)
+    {
+    case OP_SUB:
+        out->f = x - y;
+        break;
+    case OP_MUL:
+        out->f = x * y;
+        break;
+    case OP_DIV:
+        out->f = x / y;
+        break;
+    default:
+        out->f = fmod(x, y);
+        if (out->f != 0 && (out->f < 0) != (y < 0))
+        {
+            out->f += y;
+        }
+        break;
+    }
+    return CborNoError;
+}
+
+static CborError run(size_t pc, size_t end, const expr_val_t *self);
+
+/**
+ * Runs the body of a filter or a map for each item of the array on the top of the stack, and replaces it with the
+ * array of results.  A nil array is taken as an empty one.
+ */
+static CborError run_body(size_t pc, size_t end, bool filter)
+{
+    expr_val_t src = vm.stack[vm.top - 1];
+    size_t n = 0;
+    CborError err = CborNoError;
+    if (src.type != VAL_NIL)
+    {
+        err = is_array(&src) ? array_length(&src, &n) : CborErrorIllegalType;
+    }
+    uint16_t first = 0;
+    err = err == CborNoError ? alloc_slots(n, &first) : err;
+
+    CborValue it;
+    if (err == CborNoError && src.type == VAL_CBOR)
+    {
+        err = cbor_value_enter_container(&src.cbor, &it);
+    }
+    uint16_t kept = 0;
+    for (size_t i = 0; err == CborNoError && i < n; i++)
+    {
+        expr_val_t item;
+        if (src.type == VAL_ARRAY)
+        {
+            item = vm.slots[src.list.first + i];
+        }
+        else
+        {
+            err = load_cbor(&it, &item);
+            err = err == CborNoError ? cbor_value_advance(&it) : err;
+        }
+        err = err == CborNoError ? run(pc, end, &item) : err;
+        if (err == CborNoError)
+        {
+            expr_val_t *result = &vm.stack[--vm.top];
+            if (!filter)
+            {
+                vm.slots[first + kept++] = *result;
+            }
+            else if (truthy(result))
+            {
+                vm.slots[first + kept++] = item;
+            }
+        }
+    }
+    expr_val_t *top = &vm.stack[vm.top - 1];
+    top->type = VAL_ARRAY;
+    top->list.first = first;
+    top->list.n = kept;
+    return err;
+}
+
+static uint16_t read_u16(size_t *pc)
+{
+    uint16_t v;
+    memcpy(&v, vm.prog->code + *pc, sizeof(v));
+    *pc += sizeof(v);
+    return v;
+}
+
+/**
+ * Runs the code from pc to end, which pushes one value.
+ */
+static CborError run(size_t pc, size_t end, const expr_val_t *self)
+{
+    const uint8_t *code = vm.prog->code;
+    int base = vm.top;
+    CborError err = CborNoError;
+    while (err == CborNoError && pc < end)
+    {
+        uint8_t op = code[pc++];
+        expr_val_t *top = &vm.stack[vm.top - 1];
+        expr_val_t *next = &vm.stack[vm.top];
+        switch (op)
+        {
+        case OP_SELF:
+            *next = *self;
+            vm.top++;
+            break;
+        case OP_NIL:
+            next->type = VAL_NIL;
+            vm.top++;
+            break;
+        case OP_TRUE:
+        case OP_FALSE:
+            next->type = VAL_BOOL;
+            next->b = op == OP_TRUE;
+            vm.top++;
+            break;
+        case OP_INT:
+            next->type = VAL_INT;
+            memcpy(&next->i, code + pc, sizeof(next->i));
+            pc += sizeof(next->i);
+            vm.top++;
+            break;
+        case OP_FLOAT:
+            next->type = VAL_FLOAT;
+            memcpy(&next->f, code + pc, sizeof(next->f));
+            pc += sizeof(next->f);
+            vm.top++;
+            break;
+        case OP_CONST:
+            err = load_cbor(&vm.prog->consts[read_u16(&pc)], next);
+            vm.top++;
+            break;
+        case OP_ARRAY:
+        case OP_MAP:
+        {
+            uint16_t n = read_u16(&pc) * (op == OP_MAP ? 2 : 1);
+            uint16_t first;
+            err = alloc_slots(n, &first);
+            if (err == CborNoError)
+            {
+                vm.top -= n;
+                memcpy(vm.slots + first, vm.stack + vm.top, n * sizeof(expr_val_t));
+                next = &vm.stack[vm.top++];
+                next->type = op == OP_MAP ? VAL_MAP : VAL_ARRAY;
+                next->list.first = first;
+                next->list.n = op == OP_MAP ? n / 2 : n;
+            }
+            break;
+        }
+        case OP_INDEX:
+        {
+            expr_val_t src = top[-1];
+            err = index_val(&src, top, &top[-1]);
+            vm.top--;
+            break;
+        }
+        case OP_JUMP_IF_FALSE:
+        {
+            uint16_t offset = read_u16(&pc);
+            if (!truthy(top))
+            {
+                pc += offset;
+            }
+            vm.top--;
+            break;
+        }
+        case OP_JUMP:
+        {
+            uint16_t offset = read_u16(&pc);
+            pc += offset;
+            break;
+        }
+        case OP_FILTER:
+        case OP_COLLECT:
+        {
+            uint16_t len = read_u16(&pc);
+            err = run_body(pc, pc + len, op == OP_FILTER);
+            pc += len;
+            break;
+        }
+        case OP_POP:
+            vm.top--;
+            break;
+        case OP_ADD:
+        {
+            expr_val_t a = top[-1];
+            err = add(&a, top, &top[-1]);
+            vm.top--;
+            break;
+        }
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+        case OP_MOD:
+        {
+            expr_val_t a = top[-1];
+            err = arithmetic(op, &a, top, &top[-1]);
+            vm.top--;
+            break;
+        }
+        case OP_NOT:
+            top->b = !truthy(top);
+            top->type = VAL_BOOL;
+            break;
+        case OP_OR:
+            if (!truthy(&top[-1]))
+            {
+                top[-1] = *top;
+            }
+            vm.top--;
+            break;
+        case OP_AND:
+            if (truthy(&top[-1]))
+            {
+                top[-1] = *top;
+            }
+            vm.top--;
+            break;
+        case OP_EQ:
+        {
+            bool eq = val_equals(&top[-1], top);
+            top[-1].type = VAL_BOOL;
+            top[-1].b = eq;
+            vm.top--;
+            break;
+        }
+        case OP_RETURN:
+            vm.stack[base] = *top;
+            vm.top = base + 1;
+            return CborNoError;
+        default:
+            return CborErrorInternalError;
+        }
+    }
+    return err;
+}
+
+static void push_val(lua_State *L, const expr_val_t *v);
+
+static void push_list(lua_State *L, const expr_val_t *v)
+{
+    luaL_checkstack(L, 4, "Result nested too deeply");
+    bool isMap = v->type == VAL_MAP;
+    lua_createtable(L, isMap ? 0 : v->list.n, isMap ? v->list.n : 0);
+    for (int i = 0; i < v->list.n; i++)
+    {
+        if (isMap)
+        {
+            push_val(L, &vm.slots[v->list.first + 2 * i]);
+            push_val(L, &vm.slots[v->list.first + 2 * i + 1]);
+            if (lua_isnil(L, -2))
+            {
+                lua_pop(L, 2); // Lua can't have a nil key.
+            }
+            else
+            {
+                lua_rawset(L, -3);
+            }
+        }
+        else
+        {
+            push_val(L, &vm.slots[v->list.first + i]);
+            lua_rawseti(L, -2, i + 1);
+        }
+    }
+}
+
+static void push_val(lua_State *L, const expr_val_t *v)
+{
+    switch (v->type)
+    {
+    case VAL_NIL:
+        lua_pushnil(L);
+        break;
+    case VAL_BOOL:
+        lua_pushboolean(L, v->b);
+        break;
+    case VAL_INT:
+        lua_pushinteger(L, v->i);
+        break;
+    case VAL_FLOAT:
+        lua_pushnumber(L, v->f);
+        break;
+    case VAL_TEXT:
+    case VAL_BYTES:
+        lua_pushlstring(L, v->s.ptr, v->s.len);
+        break;
+    case VAL_CBOR:
+    {
+        CborValue it = v->cbor;
+        CborError err = lua_cbor_push_item(L, &it);
+        if (err != CborNoError)
+        {
+            luaL_error(L, "Error decoding result: %s", cbor_error_string(err));
+        }
+        break;
+    }
+    default:
+        push_list(L, v);
+        break;
+    }
+}
+
+static const char *expr_error_string(CborError err)
+{
+    switch (err)
+    {
+    case CborErrorIllegalType:
+        return "wrong type of value";
+    case CborErrorIllegalNumber:
+        return "division by zero";
+    case CborErrorOutOfMemory:
+        return "too many values built";
+    default:
+        return cbor_error_string(err);
+    }
+}
+
+/**
+ * rule(event) - evaluates the compiled expression with the event (CBOR bytes, a cbor.view, or anything that can be
+ * encoded) as its self, and returns the result.
+ */
+static int expr_call(lua_State *L)
+{
+    const expr_prog_t *prog = luaL_checkudata(L, 1, EXPR_CLASS);
+    CborParser parser;
+    CborValue it;
+    CborError err = CborNoError;
+    const CborValue *view = lua_cbor_test_view(L, 2);
+    if (view)
+    {
+        it = *view;
+    }
+    else
+    {
+        if (lua_type(L, 2) != LUA_TSTRING)
+        {
+            lua_pushcfunction(L, lua_cbor_encode);
+            lua_pushvalue(L, 2);
+            lua_call(L, 1, 1);
+            lua_replace(L, 2);
+        }
+        size_t sz;
+        const uint8_t *src = (const uint8_t *)lua_tolstring(L, 2, &sz);
+        err = cbor_parser_init(src, sz, 0, &parser, &it);
+    }
+
+    vm.prog = prog;
+    vm.top = 0;
+    vm.slotsUsed = 0;
+    vm.stringsUsed = 0;
+    expr_val_t self;
+    err = err == CborNoError ? load_cbor(&it, &self) : err;
+    err = err == CborNoError ? run(0, prog->codeLen, &self) : err;
+    if (err != CborNoError)
+    {
+        luaL_error(L, "Error evaluating expression: %s", expr_error_string(err));
+    }
+    push_val(L, &vm.stack[0]);
+    return 1;
+}
+
+int lua_cbor_compile(lua_State *L)
+{
+    if (lua_type(L, 1) != LUA_TSTRING)
+    {
+        // An expression made with cbor.expr().
+        lua_pushcfunction(L, lua_cbor_encode);
+        lua_pushvalue(L, 1);
+        lua_call(L, 1, 1);
+        lua_replace(L, 1);
+    }
+    size_t len;
+    const uint8_t *src = (const uint8_t *)lua_tolstring(L, 1, &len);
+
+    // Once to find the size, and then again into the program.
+    compiler_t c = {0};
+    CborParser parser;
+    CborError err = compile(&c, src, len, &parser);
+    if (err != CborNoError)
+    {
+        luaL_error(L, "Invalid expression: %s", cbor_error_string(err));
+    }
+    size_t nconsts = c.nconsts, codeLen = c.len;
+    expr_prog_t *prog = lua_newuserdatauv(L, sizeof(expr_prog_t) + nconsts * sizeof(CborValue) + codeLen, 1);
+    CborValue *consts = (CborValue *)(prog + 1);
+    uint8_t *code = (uint8_t *)(consts + nconsts);
+    c = (compiler_t){.code = code, .consts = consts};
+    compile(&c, src, len, &prog->parser);
+    prog->consts = consts;
+    prog->code = code;
+    prog->codeLen = codeLen;
+    luaL_setmetatable(L, EXPR_CLASS);
+    lua_pushvalue(L, 1);
+    lua_setiuservalue(L, -2, 1);
+    ESP_LOGD(TAG, "Compiled %u byte expression to %u bytes of code and %u constants", (unsigned)len, (unsigned)codeLen,
+             (unsigned)nconsts);
+    return 1;
+}
+
+static const struct luaL_Reg expr_funcs[] = {
+    {"__call", expr_call},
+    {NULL, NULL}};
+
+void lua_cbor_expr_init(lua_State *L)
+{
+    luaL_newmetatable(L, EXPR_CLASS);
+    luaL_setfuncs(L, expr_funcs, 0);
+    lua_pop(L, 1);
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <lua/lua.h>
+
+/**
+ * Tag that marks a CBOR expression (see expressions.md).  It is in the first come first served range, and isn't
+ * registered.
+ */
+#define CBOR_EXPR_TAG 52462
+
+/**
+ * cbor.compile(expr) - checks the CBOR expression (encoded, or made with cbor.expr()) and compiles it into a function
+ * of an event.
+ */
+int lua_cbor_compile(lua_State *L);
+
+/**
+ * Creates the metatable of compiled expressions.  Called from luaopen_cbor().
+ */
+void lua_cbor_expr_init(lua_State *L);
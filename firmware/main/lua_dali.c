@@ -8,6 +8,7 @@
 #include "dali_driver.h"
 #include "lua_dali.h"
 #include "lua_system.h"
+#include "lua_await.h"
 
 #define TAG "dali"
 
@@ -15,6 +16,9 @@ typedef struct
 {
     int cbRef;
     int selfRef;
+    int result;
+    lua_event_source_t event; // Carries the result from the DALI task to the Lua task.
+    lua_awaiter_t waiter;     // The task in await_transmit, if that is how it was sent.
 } dali_lua_callback_t;
 
 static void free_cbctx(lua_State *L, dali_lua_callback_t *cb)
@@ -24,37 +28,52 @@ static void free_cbctx(lua_State *L, dali_lua_callback_t *cb)
     free(cb);
 }
 
-static void command_callback(int result, void *arg)
+/**
+ * Runs the Lua callback for a completed command, on the Lua task.
+ */
+static void dispatch_result(lua_State *L, void *arg)
 {
     dali_lua_callback_t *cb = (dali_lua_callback_t *)arg;
-    if (cb)
+    if (lua_await_pending(&cb->waiter))
+    {
+        lua_pushinteger(L, cb->result);
+        lua_await_resume(L, &cb->waiter, 1);
+    }
+    else if (cb->cbRef != LUA_REFNIL)
     {
-        lua_State *L = acquireLuaMutex();
-        if (cb->cbRef != LUA_REFNIL)
+        assert(lua_rawgeti(L, LUA_REGISTRYINDEX, cb->cbRef)); // The callback function
+        if (!lua_isfunction(L, -1))
         {
-            assert(lua_rawgeti(L, LUA_REGISTRYINDEX, cb->cbRef)); // The callback function
-            if (!lua_isfunction(L, -1))
-            {
-                ESP_LOGE(TAG, "Callback value isn't a function");
-                goto end;
-            }
-            // ESP_LOGI(TAG, "Using %d for self reference", cb->selfRef);
-            if (cb->selfRef != LUA_REFNIL)
-            {
-                assert(lua_rawgeti(L, LUA_REGISTRYINDEX, cb->selfRef)); // Arg 1 - the self value for this callback
-            }
-            lua_pushinteger(L, result); // Arg 2 - the response
-            // ESP_LOGW(TAG, "Calling Dali LUA callback for %d, %d", cb->cbRef, cb->selfRef);
-            // dumpStack(L);
-            if (lua_pcall(L, 2, 0, 0))
-            {
-                ESP_LOGE(TAG, "Error calling DALI callback: %s", lua_tostring(L, -1));
-                lua_pop(L, 1);
-            }
+            ESP_LOGE(TAG, "Callback value isn't a function");
+            lua_pop(L, 1);
+            goto end;
+        }
+        if (cb->selfRef != LUA_REFNIL)
+        {
+            assert(lua_rawgeti(L, LUA_REGISTRYINDEX, cb->selfRef)); // Arg 1 - the self value for this callback
+        }
+        lua_pushinteger(L, cb->result); // Arg 2 - the response
+        if (lua_pcall(L, 2, 0, 0))
+        {
+            ESP_LOGE(TAG, "Error calling DALI callback: %s", lua_tostring(L, -1));
+            lua_pop(L, 1);
         }
-    end:
-        free_cbctx(L, cb);
-        releaseLuaMutex();
+    }
+end:
+    free_cbctx(L, cb);
+}
+
+/**
+ * Called by the DALI task when a command completes.  The result is handed over to the Lua task rather than running
+ * Lua here, so that the bus never waits on a script.  An event source can't be dropped, so neither can the result.
+ */
+static void command_callback(int result, void *arg)
+{
+    dali_lua_callback_t *cb = (dali_lua_callback_t *)arg;
+    if (cb)
+    {
+        cb->result = result;
+        schedule_event(&cb->event);
     }
 }
 
@@ -85,6 +104,8 @@ static int transmit(lua_State *L)
             return 1;
         }
         ccb = command_callback;
+        lua_event_source_init(&cb->event, LUA_SOURCE_DALI, LUA_PRIORITY_NETWORK, dispatch_result, cb);
+        lua_awaiter_init(&cb->waiter);
         lua_pushvalue(L, 3);
         cb->cbRef = luaL_ref(L, LUA_REGISTRYINDEX);
 
@@ -110,6 +131,44 @@ static int transmit(lua_State *L)
     return 0;
 }
 
+/**
+ * Sends a command and suspends the calling task until it completes, returning the result.  The same as passing a
+ * callback to transmit, without creating a future or a closure.
+ */
+static int await_transmit(lua_State *L)
+{
+    if (!lua_istable(L, 1))
+    {
+        luaL_argerror(L, 1, "Self should be a driver object");
+    }
+    int cmd = luaL_checkinteger(L, 2);
+    lua_await_check(L, NULL);
+
+    dali_lua_callback_t *cb = (dali_lua_callback_t *)malloc(sizeof(dali_lua_callback_t));
+    if (!cb)
+    {
+        luaL_error(L, "Could not allocate memory for callback context");
+        return 1;
+    }
+    cb->cbRef = LUA_REFNIL;
+    cb->selfRef = LUA_REFNIL;
+    lua_event_source_init(&cb->event, LUA_SOURCE_DALI, LUA_PRIORITY_NETWORK, dispatch_result, cb);
+    lua_awaiter_init(&cb->waiter);
+
+    lua_getfield(L, 1, "driver");
+    dali_driver_t *driver = (dali_driver_t *)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    // The result can't be dispatched until this task yields, so there's no race with lua_await below.
+    ccpeed_err_t err = dali_send_command(driver, cmd, command_callback, cb);
+    if (err != CCPEED_NO_ERR)
+    {
+        free_cbctx(L, cb);
+        luaL_error(L, "Could not transmit: %d", err);
+        return 1;
+    }
+    return lua_await(L, &cb->waiter);
+}
+
 static int init_dali_driver(lua_State *L)
 {
     // We expect three parameters - First is self, second is tx, third is rx.  self is used as metadata for returned object.
@@ -146,6 +205,7 @@ static int init_dali_driver(lua_State *L)
 static const struct luaL_Reg dali_funcs[] = {
     {"new", init_dali_driver},
     {"transmit", transmit},
+    {"await_transmit", await_transmit},
     {NULL, NULL}};
 
 int luaopen_dali(lua_State *L)
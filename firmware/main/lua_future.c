@@ -0,0 +1,709 @@
+#include <string.h>
+#include <sdkconfig.h>
+#include <lua/lua.h>
+#include <lua/lauxlib.h>
+#include <esp_log.h>
+#include "lua_future.h"
+#include "lua_await.h"
+#include "lua_hooks.h"
+#include "lua_system.h"
+#include "timer_wheel.h"
+
+#define TAG "async"
+#define FUTURE_CLASS "Future"
+#define WORKER_CLASS "Future.worker"
+#define MAX_TASKS CONFIG_CCPEED_LUA_MAX_TASKS
+#define QUEUE_LENGTH CONFIG_CCPEED_LUA_TASK_QUEUE_LENGTH
+
+/**
+ * A future's state is in the struct, and everything that is a Lua value is in its user values, so that creating one
+ * is a single allocation.  Fields added from Lua (Future:new{...}, or assigning to a future) go in a table, which only
+ * exists if there are any.  A future has one waiter - the coroutine of the task awaiting it, or the oneof it is a
+ * choice of - which is all that tasks have ever needed.
+ */
+enum
+{
+    UV_VALUE = 1, // The value once set.  For a deferred future, the value it will be set to.
+    UV_FIELDS,    // Table of fields added from Lua, or nil.
+    UV_WAITER,    // The coroutine, or the oneof future, waiting on this one.
+    UV_EXTRA,     // Oneof: the first choice, with the rest following.
+};
+
+typedef enum
+{
+    FUTURE_PLAIN,
+    FUTURE_DEFERRED,
+    FUTURE_ONEOF,
+} future_kind_t;
+
+typedef struct
+{
+    uint8_t kind;
+    bool is_set;
+    uint16_t nchoices;
+} future_t;
+
+/**
+ * A deferred future carries its own timer wheel entry, so deferring costs nothing more than the future.
+ */
+typedef struct
+{
+    future_t future;
+    timer_wheel_entry_t entry;
+    int selfRef; // Keeps the future alive while it's armed.
+} deferred_t;
+
+static future_t *push_future(lua_State *L, future_kind_t kind, int nuv)
+{
+    size_t size = kind == FUTURE_DEFERRED ? sizeof(deferred_t) : sizeof(future_t);
+    future_t *f = (future_t *)lua_newuserdatauv(L, size, nuv);
+    memset(f, 0, size);
+    f->kind = kind;
+    luaL_setmetatable(L, FUTURE_CLASS);
+    return f;
+}
+
+static future_t *check_future(lua_State *L, int idx)
+{
+    return (future_t *)luaL_checkudata(L, idx, FUTURE_CLASS);
+}
+
+/**
+ * Pushes the function stored under name in the fields added from Lua, if there is one.
+ */
+static bool push_hook(lua_State *L, int idx, const char *name)
+{
+    if (lua_getiuservalue(L, idx, UV_FIELDS) == LUA_TTABLE)
+    {
+        if (lua_getfield(L, -1, name) == LUA_TFUNCTION)
+        {
+            lua_remove(L, -2);
+            return true;
+        }
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+    return false;
+}
+
+static void cancel_choice(lua_State *L, int idx);
+
+static void disarm(lua_State *L, future_t *f)
+{
+    deferred_t *d = (deferred_t *)f;
+    timer_wheel_stop(&d->entry);
+    luaL_unref(L, LUA_REGISTRYINDEX, d->selfRef);
+    d->selfRef = LUA_NOREF;
+}
+
+static void cancel(lua_State *L, int idx)
+{
+    idx = lua_absindex(L, idx);
+    future_t *f = (future_t *)lua_touserdata(L, idx);
+    if (f->kind == FUTURE_DEFERRED)
+    {
+        disarm(L, f);
+    }
+    else if (f->kind == FUTURE_ONEOF)
+    {
+        for (int i = 0; i < f->nchoices; i++)
+        {
+            lua_getiuservalue(L, idx, UV_EXTRA + i);
+            cancel_choice(L, -1);
+            lua_pop(L, 1);
+        }
+    }
+    if (push_hook(L, idx, "cancel"))
+    {
+        lua_pushvalue(L, idx);
+        lua_call(L, 1, 0);
+    }
+}
+
+/**
+ * Detaches a choice from its oneof, so that it setting later on is ignored, and cancels it if it isn't set yet.
+ */
+static void cancel_choice(lua_State *L, int idx)
+{
+    idx = lua_absindex(L, idx);
+    lua_pushnil(L);
+    lua_setiuservalue(L, idx, UV_WAITER);
+    if (!((future_t *)lua_touserdata(L, idx))->is_set)
+    {
+        cancel(L, idx);
+    }
+}
+
+/**
+ * Sets the future at idx to the value on top of the stack, which is popped, and wakes whatever is waiting on it.
+ */
+static void set(lua_State *L, int idx)
+{
+    idx = lua_absindex(L, idx);
+    future_t *f = (future_t *)lua_touserdata(L, idx);
+    if (f->is_set)
+    {
+        luaL_error(L, "Condition already completed");
+    }
+    f->is_set = true;
+    if (f->kind == FUTURE_DEFERRED)
+    {
+        disarm(L, f);
+    }
+    lua_pushvalue(L, -1);
+    lua_setiuservalue(L, idx, UV_VALUE);
+
+    if (push_hook(L, idx, "on_set"))
+    {
+        lua_pushvalue(L, idx);
+        lua_pushvalue(L, -3);
+        lua_call(L, 2, 0);
+    }
+
+    int waiter = lua_getiuservalue(L, idx, UV_WAITER);
+    if (waiter == LUA_TNIL)
+    {
+        lua_pop(L, 2);
+        return;
+    }
+    lua_pushnil(L);
+    lua_setiuservalue(L, idx, UV_WAITER);
+    if (waiter == LUA_TTHREAD)
+    {
+        lua_insert(L, -2);
+        lua_await_resume_thread(L, 1);
+        return;
+    }
+
+    // A oneof waiting on this choice.  The others are cancelled, and the oneof gets the same value.
+    int parent = lua_gettop(L);
+    future_t *p = (future_t *)lua_touserdata(L, parent);
+    for (int i = 0; i < p->nchoices; i++)
+    {
+        lua_getiuservalue(L, parent, UV_EXTRA + i);
+        if (!lua_rawequal(L, -1, idx))
+        {
+            cancel_choice(L, -1);
+        }
+        lua_pop(L, 1);
+    }
+    lua_insert(L, -2);
+    set(L, -2);
+    lua_pop(L, 1);
+}
+
+/**
+ * Pushes a future that is set by whichever of the futures from first to last is set first, or just that future if
+ * there is only one.
+ */
+static void push_oneof(lua_State *L, int first, int last)
+{
+    int n = last - first + 1;
+    luaL_argcheck(L, n > 0, first, "Expected at least one future");
+    for (int i = first; i <= last; i++)
+    {
+        check_future(L, i);
+    }
+    if (n == 1)
+    {
+        lua_pushvalue(L, first);
+        return;
+    }
+    for (int i = first; i <= last; i++)
+    {
+        if (lua_getiuservalue(L, i, UV_WAITER) != LUA_TNIL)
+        {
+            luaL_argerror(L, i, "Something is already waiting on this future");
+        }
+        lua_pop(L, 1);
+    }
+
+    future_t *f = push_future(L, FUTURE_ONEOF, UV_EXTRA - 1 + n);
+    f->nchoices = n;
+    int idx = lua_gettop(L);
+    for (int i = 0; i < n; i++)
+    {
+        lua_pushvalue(L, first + i);
+        lua_setiuservalue(L, idx, UV_EXTRA + i);
+    }
+    // If one of the choices is already set, so is the oneof.
+    for (int i = first; i <= last; i++)
+    {
+        if (((future_t *)lua_touserdata(L, i))->is_set)
+        {
+            cancel(L, idx);
+            lua_getiuservalue(L, i, UV_VALUE);
+            set(L, idx);
+            return;
+        }
+    }
+    for (int i = first; i <= last; i++)
+    {
+        lua_pushvalue(L, idx);
+        lua_setiuservalue(L, i, UV_WAITER);
+    }
+}
+
+bool lua_future_wait(lua_State *L, int idx, int thread_idx)
+{
+    idx = lua_absindex(L, idx);
+    thread_idx = lua_absindex(L, thread_idx);
+    future_t *f = (future_t *)luaL_testudata(L, idx, FUTURE_CLASS);
+    if (!f)
+    {
+        return false;
+    }
+    if (f->is_set)
+    {
+        lua_pushvalue(L, thread_idx);
+        lua_getiuservalue(L, idx, UV_VALUE);
+        lua_await_resume_thread(L, 1);
+        return true;
+    }
+    if (lua_getiuservalue(L, idx, UV_WAITER) != LUA_TNIL)
+    {
+        lua_pop(L, 1);
+        return false;
+    }
+    lua_pop(L, 1);
+    lua_pushvalue(L, thread_idx);
+    lua_setiuservalue(L, idx, UV_WAITER);
+    return true;
+}
+
+/**
+ * Sets the deferred future that is the argument, which is due.  Called protected.
+ */
+static int fire_deferred(lua_State *L)
+{
+    future_t *f = (future_t *)lua_touserdata(L, 1);
+    disarm(L, f);
+    if (!f->is_set)
+    {
+        lua_getiuservalue(L, 1, UV_VALUE);
+        set(L, 1);
+    }
+    return 0;
+}
+
+static void deferred_expired(lua_State *L, void *ctx, uint32_t count)
+{
+    deferred_t *d = (deferred_t *)ctx;
+    lua_pushcfunction(L, fire_deferred);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, d->selfRef);
+    if (lua_pcall(L, 1, 0, 0))
+    {
+        ESP_LOGE(TAG, "Error setting deferred future: %s", lua_tostring(L, -1));
+        lua_pop(L, 1);
+    }
+}
+
+void lua_future_push_deferred(lua_State *L, int delay_ms, int value_idx)
+{
+    value_idx = value_idx ? lua_absindex(L, value_idx) : 0;
+    deferred_t *d = (deferred_t *)push_future(L, FUTURE_DEFERRED, UV_WAITER);
+    if (value_idx)
+    {
+        lua_pushvalue(L, value_idx);
+        lua_setiuservalue(L, -2, UV_VALUE);
+    }
+    timer_wheel_entry_init(&d->entry, deferred_expired, d);
+    lua_pushvalue(L, -1);
+    d->selfRef = luaL_ref(L, LUA_REGISTRYINDEX);
+    timer_wheel_start(&d->entry, delay_ms, 0);
+}
+
+/**
+ * Future:new([fields]) - creates a future, optionally with some fields of its own (which may include on_set and cancel
+ * hooks).
+ */
+static int future_new(lua_State *L)
+{
+    push_future(L, FUTURE_PLAIN, UV_WAITER);
+    if (lua_istable(L, 2))
+    {
+        lua_pushvalue(L, 2);
+        lua_setiuservalue(L, -2, UV_FIELDS);
+    }
+    return 1;
+}
+
+/**
+ * Future:oneof(...) - a future that resolves to the first of the futures passed to it to resolve.  The others are
+ * cancelled.
+ */
+static int future_oneof(lua_State *L)
+{
+    push_oneof(L, 2, lua_gettop(L));
+    return 1;
+}
+
+/**
+ * Future:defer(timeout, [value]) - a future that is set to value after timeout milliseconds, unless it is cancelled
+ * first.  A Timer to reuse used to be passed as well, which is no longer needed, and is ignored.
+ */
+static int future_defer(lua_State *L)
+{
+    int delay = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, delay >= 0, 2, "Expected a positive number of milliseconds");
+    lua_future_push_deferred(L, delay, lua_isnone(L, 3) ? 0 : 3);
+    return 1;
+}
+
+static int future_set(lua_State *L)
+{
+    check_future(L, 1);
+    lua_settop(L, 2);
+    set(L, 1);
+    return 0;
+}
+
+static int future_cancel(lua_State *L)
+{
+    check_future(L, 1);
+    cancel(L, 1);
+    return 0;
+}
+
+static int future_index(lua_State *L)
+{
+    future_t *f = (future_t *)lua_touserdata(L, 1);
+    if (lua_type(L, 2) == LUA_TSTRING)
+    {
+        const char *key = lua_tostring(L, 2);
+        if (strcmp(key, "is_set") == 0)
+        {
+            lua_pushboolean(L, f->is_set);
+            return 1;
+        }
+        if (strcmp(key, "value") == 0)
+        {
+            if (f->is_set)
+            {
+                lua_getiuservalue(L, 1, UV_VALUE);
+            }
+            else
+            {
+                lua_pushnil(L);
+            }
+            return 1;
+        }
+    }
+    if (lua_getiuservalue(L, 1, UV_FIELDS) == LUA_TTABLE)
+    {
+        lua_pushvalue(L, 2);
+        if (lua_rawget(L, -2) != LUA_TNIL)
+        {
+            return 1;
+        }
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+    // Then the methods.
+    lua_getmetatable(L, 1);
+    lua_pushvalue(L, 2);
+    lua_rawget(L, -2);
+    return 1;
+}
+
+static int future_newindex(lua_State *L)
+{
+    if (lua_type(L, 2) == LUA_TSTRING &&
+        (strcmp(lua_tostring(L, 2), "is_set") == 0 || strcmp(lua_tostring(L, 2), "value") == 0))
+    {
+        luaL_error(L, "Use set() to set a future");
+    }
+    if (lua_getiuservalue(L, 1, UV_FIELDS) != LUA_TTABLE)
+    {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_setiuservalue(L, 1, UV_FIELDS);
+    }
+    lua_insert(L, 2);
+    lua_rawset(L, 2);
+    return 0;
+}
+
+/**
+ * Tasks run in a pool of worker coroutines, rather than each getting a new one.  A worker runs the function it is
+ * resumed with, then any tasks that are waiting, and then suspends itself in the idle list until it is needed again.
+ * Tasks that are started while all MAX_TASKS workers are busy wait in a ring of fn, arg pairs.
+ *
+ * A worker that is suspended on a future that is never set is garbage once the future is, and is collected.  Each
+ * worker has a worker_t at the bottom of its stack, below the frame of worker_main, so that it goes with the worker,
+ * and gives back the worker's place in the pool if the worker was collected while it had one.
+ */
+typedef struct
+{
+    bool running;
+} worker_t;
+
+static struct
+{
+    int idleRef;    // Table of idle workers, 1 to nidle.
+    int pendingRef; // Table of tasks waiting for a worker, as fn, arg pairs.
+    int nidle;
+    int running;
+    int head;
+    int npending;
+} pool;
+
+static int worker_traceback(lua_State *L)
+{
+    luaL_traceback(L, L, lua_tostring(L, 1), 1);
+    return 1;
+}
+
+/**
+ * Pushes the next waiting task's function and argument, if there is one.
+ */
+static bool pop_pending(lua_State *L)
+{
+    if (pool.npending == 0)
+    {
+        return false;
+    }
+    lua_rawgeti(L, LUA_REGISTRYINDEX, pool.pendingRef);
+    for (int i = 1; i <= 2; i++)
+    {
+        lua_rawgeti(L, -i, pool.head * 2 + i);
+        lua_pushnil(L);
+        lua_rawseti(L, -2 - i, pool.head * 2 + i);
+    }
+    lua_remove(L, -3);
+    pool.head = (pool.head + 1) % QUEUE_LENGTH;
+    pool.npending--;
+    return true;
+}
+
+static int worker_done(lua_State *L, int status, lua_KContext ctx);
+static int worker_next(lua_State *L, int status, lua_KContext ctx);
+static void run_pending(lua_State *L, void *ctx);
+
+static worker_t *worker_of(lua_State *L)
+{
+    return *(worker_t **)lua_getextraspace(L);
+}
+
+/**
+ * __gc of a worker_t, and so of its worker.
+ */
+static int worker_gc(lua_State *L)
+{
+    worker_t *w = lua_touserdata(L, 1);
+    if (w->running)
+    {
+        ESP_LOGW(TAG, "Task was collected while waiting on a future that can no longer be set");
+        w->running = false;
+        pool.running--;
+        if (pool.npending)
+        {
+            // From a callback of its own, as a finaliser is no place to be running tasks.
+            schedule_callback(LUA_SOURCE_TASK, LUA_PRIORITY_HOUSEKEEPING, run_pending, NULL);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Runs the task whose function and argument are the only things on the worker's stack.
+ */
+static int worker_run(lua_State *L)
+{
+    lua_pushcfunction(L, worker_traceback);
+    lua_insert(L, 1);
+    return worker_done(L, lua_pcallk(L, 1, 0, 1, 0, worker_done), 0);
+}
+
+/**
+ * Continuation for a task that has finished, which is called directly if it never suspended.
+ */
+static int worker_done(lua_State *L, int status, lua_KContext ctx)
+{
+    for (;;)
+    {
+        if (status != LUA_OK && status != LUA_YIELD)
+        {
+            ESP_LOGE(TAG, "Unhandled error running task: %s", lua_tostring(L, -1));
+        }
+        lua_settop(L, 0);
+        // The callback that we're running in is out of budget, and would kill the next task straight away, so it
+        // gets a callback, and a budget, of its own instead.  Unless the queue is full, when there's nothing for it.
+        if (pool.npending && lua_hooks_overrun() &&
+            schedule_callback(LUA_SOURCE_TASK, LUA_PRIORITY_HOUSEKEEPING, run_pending, NULL))
+        {
+            break;
+        }
+        if (!pop_pending(L))
+        {
+            break;
+        }
+        // Run it here and now, looping rather than recursing for tasks that finish without suspending.
+        lua_pushcfunction(L, worker_traceback);
+        lua_insert(L, 1);
+        status = lua_pcallk(L, 1, 0, 1, 0, worker_done);
+    }
+    pool.running--;
+    worker_of(L)->running = false;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, pool.idleRef);
+    lua_pushthread(L);
+    lua_rawseti(L, -2, ++pool.nidle);
+    lua_pop(L, 1);
+    // Yielding nothing, so that whoever resumed us doesn't take it for a future to wait on.
+    return lua_yieldk(L, 0, 0, worker_next);
+}
+
+static int worker_next(lua_State *L, int status, lua_KContext ctx)
+{
+    return worker_run(L);
+}
+
+static int worker_main(lua_State *L)
+{
+    return worker_run(L);
+}
+
+/**
+ * Runs the task whose function and argument are on the top of the stack on an idle worker, or a new one.
+ */
+static void run_on_worker(lua_State *L)
+{
+    if (pool.nidle > 0)
+    {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, pool.idleRef);
+        lua_rawgeti(L, -1, pool.nidle);
+        lua_pushnil(L);
+        lua_rawseti(L, -3, pool.nidle--);
+        lua_remove(L, -2);
+    }
+    else
+    {
+        lua_State *co = lua_newthread(L);
+        worker_t *w = lua_newuserdatauv(co, sizeof(worker_t), 0);
+        w->running = false;
+        luaL_setmetatable(co, WORKER_CLASS);
+        // Threads start with a copy of the main thread's extra space, so only workers have this.
+        *(worker_t **)lua_getextraspace(co) = w;
+        lua_pushcfunction(co, worker_main);
+    }
+    worker_of(lua_tothread(L, -1))->running = true;
+    pool.running++;
+    lua_insert(L, -3);
+    lua_await_resume_thread(L, 2);
+}
+
+/**
+ * Callback that starts as many waiting tasks as there is room for, for when the worker that would have run them
+ * couldn't.
+ */
+static void run_pending(lua_State *L, void *ctx)
+{
+    while (pool.running < MAX_TASKS && pop_pending(L))
+    {
+        run_on_worker(L);
+    }
+}
+
+/**
+ * start_async_task(fn, [arg]) - runs fn(arg) as a task, which may await futures, and C functions that suspend it
+ * (DaliBus:await_transmit, Timer:sleep, sock:receive).  If there are already CONFIG_CCPEED_LUA_MAX_TASKS tasks
+ * running it is queued, and runs when one of them finishes.
+ */
+static int start_async_task(lua_State *L)
+{
+    luaL_checktype(L, 1, LUA_TFUNCTION);
+    lua_settop(L, 2);
+    if (pool.running >= MAX_TASKS)
+    {
+        if (pool.npending >= QUEUE_LENGTH)
+        {
+            luaL_error(L, "Too many async tasks waiting to run");
+        }
+        int slot = (pool.head + pool.npending) % QUEUE_LENGTH;
+        lua_rawgeti(L, LUA_REGISTRYINDEX, pool.pendingRef);
+        lua_pushvalue(L, 1);
+        lua_rawseti(L, -2, slot * 2 + 1);
+        lua_pushvalue(L, 2);
+        lua_rawseti(L, -2, slot * 2 + 2);
+        pool.npending++;
+        return 0;
+    }
+
+    run_on_worker(L);
+    return 0;
+}
+
+/**
+ * await(...) - suspends the task until one of the futures is set, and returns its value.  The others are cancelled.
+ */
+static int await(lua_State *L)
+{
+    int n = lua_gettop(L);
+    bool any_set = false;
+    for (int i = 1; i <= n; i++)
+    {
+        any_set = check_future(L, i)->is_set || any_set;
+    }
+    if (!any_set)
+    {
+        lua_await_check(L, NULL);
+    }
+    push_oneof(L, 1, n);
+    future_t *f = (future_t *)lua_touserdata(L, -1);
+    if (f->is_set)
+    {
+        lua_getiuservalue(L, -1, UV_VALUE);
+        return 1;
+    }
+    if (lua_getiuservalue(L, -1, UV_WAITER) != LUA_TNIL)
+    {
+        luaL_error(L, "Something is already waiting on this future");
+    }
+    lua_pop(L, 1);
+    // The future stays on our stack while we're suspended, which keeps it alive.
+    lua_pushthread(L);
+    lua_setiuservalue(L, -2, UV_WAITER);
+    return lua_await_suspend(L);
+}
+
+static const struct luaL_Reg future_funcs[] = {
+    {"new", future_new},
+    {"oneof", future_oneof},
+    {"defer", future_defer},
+    {"set", future_set},
+    {"cancel", future_cancel},
+    {"__index", future_index},
+    {"__newindex", future_newindex},
+    {NULL, NULL}};
+
+bool lua_future_in_task(lua_State *L)
+{
+    return worker_of(L) != NULL;
+}
+
+int luaopen_future(lua_State *L)
+{
+    // Copied into every thread that is created, so workers are the only ones marked.
+    *(void **)lua_getextraspace(L) = NULL;
+    memset(&pool, 0, sizeof(pool));
+    lua_newtable(L);
+    pool.idleRef = luaL_ref(L, LUA_REGISTRYINDEX);
+    lua_createtable(L, QUEUE_LENGTH * 2, 0);
+    pool.pendingRef = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    luaL_newmetatable(L, WORKER_CLASS);
+    lua_pushcfunction(L, worker_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    lua_pushcfunction(L, start_async_task);
+    lua_setglobal(L, "start_async_task");
+    lua_pushcfunction(L, await);
+    lua_setglobal(L, "await");
+
+    // The metatable of futures is the Future class itself, so getmetatable(f) == Future as before.
+    luaL_newmetatable(L, FUTURE_CLASS);
+    luaL_setfuncs(L, future_funcs, 0);
+    return 1;
+}
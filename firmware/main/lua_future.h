@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdbool.h>
+#include <lua/lua.h>
+
+/**
+ * Futures and tasks (start_async_task, await, Future:new/oneof/defer/set/cancel), implemented natively.  A future is a
+ * single userdata - its value, the task or oneof waiting on it and its choices are all kept in user values.
+ */
+
+/**
+ * Makes the coroutine at thread_idx wait on the future at idx, resuming it straight away if the future is already set.
+ * Returns false if idx isn't a future, or something is already waiting on it.  Doesn't raise errors.
+ */
+bool lua_future_wait(lua_State *L, int idx, int thread_idx);
+
+/**
+ * Pushes a future that is set to the value at value_idx (0 for nil) after delay_ms.
+ */
+void lua_future_push_deferred(lua_State *L, int delay_ms, int value_idx);
+
+/**
+ * Whether L is the coroutine of a task started by start_async_task (rather than the main thread, or a coroutine that
+ * Lua code created for itself).
+ */
+bool lua_future_in_task(lua_State *L);
+
+int luaopen_future(lua_State *L);
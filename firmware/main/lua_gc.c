@@ -0,0 +1,240 @@
+#include <string.h>
+#include <esp_timer.h>
+#include <esp_log.h>
+#include <lua/lua.h>
+#include <lua/lauxlib.h>
+#include "lua_gc.h"
+#include "lua_system.h"
+#include "loop_stats.h"
+#include "sdkconfig.h"
+
+#define TAG "lua_gc"
+#define GC_SENTINEL_META "GcSentinel"
+
+typedef enum
+{
+    GC_MODE_INCREMENTAL = LUA_GCINC,
+    GC_MODE_GENERATIONAL = LUA_GCGEN,
+} gc_mode_t;
+
+static const code_lookup_t gc_modes[] = {
+    {.sval = "incremental", .ival = GC_MODE_INCREMENTAL},
+    {.sval = "generational", .ival = GC_MODE_GENERATIONAL},
+    {.sval = NULL, .ival = -1}};
+
+typedef struct
+{
+    gc_mode_t mode;
+    int pause;     // Incremental: how much the heap grows (%) before a new cycle starts.
+    int stepmul;   // Incremental: how much work each step does, relative to allocation.
+    int stepsize;  // Incremental: log2 of the bytes allocated between steps.
+    int minormul;  // Generational: heap growth (%) that triggers a minor collection.
+    int majormul;  // Generational: heap growth (%) that triggers a major collection.
+    int idle_step_kb;
+    int idle_budget_us; // Longest that idle collection holds onto the Lua mutex.  0 turns idle collection off.
+} gc_config_t;
+
+typedef struct
+{
+    latency_histogram_t idle_pause;
+    uint32_t idle_cycles;
+    uint32_t cycles[LUA_SOURCE_MAX]; // Which type of event was running when each cycle finished.
+} gc_stats_t;
+
+static gc_config_t config = {
+#ifdef CONFIG_CCPEED_LUA_GC_GENERATIONAL
+    .mode = GC_MODE_GENERATIONAL,
+#else
+    .mode = GC_MODE_INCREMENTAL,
+#endif
+    .pause = 200,
+    .stepmul = 100,
+    .stepsize = 13,
+    .minormul = 20,
+    .majormul = 100,
+    .idle_step_kb = CONFIG_CCPEED_LUA_GC_IDLE_STEP_KB,
+    .idle_budget_us = CONFIG_CCPEED_LUA_GC_IDLE_BUDGET_US,
+};
+static gc_stats_t stats;
+static bool idle_cycle_done;
+static int idle_done_kb; // Heap size when idle collection last completed a cycle.
+
+static void apply_config(lua_State *L)
+{
+    if (config.mode == GC_MODE_GENERATIONAL)
+    {
+        lua_gc(L, LUA_GCGEN, config.minormul, config.majormul);
+    }
+    else
+    {
+        lua_gc(L, LUA_GCINC, config.pause, config.stepmul, config.stepsize);
+    }
+}
+
+static void new_sentinel(lua_State *L)
+{
+    lua_newuserdatauv(L, 0, 0);
+    luaL_setmetatable(L, GC_SENTINEL_META);
+    lua_pop(L, 1);
+}
+
+/**
+ * Finaliser for an unreferenced object, which is therefore called once at the end of every collection cycle. It
+ * records who was running at the time, then replaces itself for the next cycle.
+ */
+static int gc_sentinel(lua_State *L)
+{
+    stats.cycles[lua_running_source()]++;
+    new_sentinel(L);
+    return 0;
+}
+
+void lua_gc_init(lua_State *L)
+{
+    apply_config(L);
+
+    luaL_newmetatable(L, GC_SENTINEL_META);
+    lua_pushcfunction(L, gc_sentinel);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+    new_sentinel(L);
+}
+
+bool lua_gc_idle_step(lua_State *L, bool (*interrupted)())
+{
+    if (config.idle_budget_us <= 0 || !lua_gc(L, LUA_GCISRUNNING))
+    {
+        return false;
+    }
+    int kb = lua_gc(L, LUA_GCCOUNT);
+    if (idle_cycle_done && kb < idle_done_kb + config.idle_step_kb)
+    {
+        // Not enough has been allocated since the last cycle to be worth collecting.
+        return false;
+    }
+
+    int64_t start = esp_timer_get_time();
+    int64_t deadline = start + config.idle_budget_us;
+    bool finished;
+    do
+    {
+        finished = lua_gc(L, LUA_GCSTEP, config.idle_step_kb);
+        if (config.mode == GC_MODE_GENERATIONAL)
+        {
+            // A step is a whole minor collection, and never reports a finished cycle.
+            finished = true;
+        }
+    } while (!finished && esp_timer_get_time() < deadline && !interrupted());
+    histogram_record(&stats.idle_pause, esp_timer_get_time() - start);
+
+    idle_cycle_done = finished;
+    if (finished)
+    {
+        stats.idle_cycles++;
+        idle_done_kb = lua_gc(L, LUA_GCCOUNT);
+    }
+    return !finished;
+}
+
+static void get_config_int(lua_State *L, const char *field, int *out, int min)
+{
+    if (lua_getfield(L, 1, field) != LUA_TNIL)
+    {
+        int v = luaL_checkinteger(L, -1);
+        if (v < min)
+        {
+            luaL_error(L, "%s must be at least %d", field, min);
+        }
+        *out = v;
+    }
+    lua_pop(L, 1);
+}
+
+static void set_config_int(lua_State *L, const char *field, int v)
+{
+    lua_pushstring(L, field);
+    lua_pushinteger(L, v);
+    lua_settable(L, -3);
+}
+
+/**
+ * Lua accessible function to read (and optionally update) the collector settings. Takes a table with any of mode
+ * ("incremental" or "generational"), pause, stepmul, stepsize, minormul, majormul, idle_step_kb and idle_budget_us.
+ * Returns the resulting settings.
+ */
+int lua_gc_config(lua_State *L)
+{
+    if (!lua_isnoneornil(L, 1))
+    {
+        luaL_checktype(L, 1, LUA_TTABLE);
+        gc_config_t updated = config;
+        if (lua_getfield(L, 1, "mode") != LUA_TNIL)
+        {
+            int mode = code_str_to_int(luaL_checkstring(L, -1), gc_modes);
+            luaL_argcheck(L, mode >= 0, 1, "unknown gc mode");
+            updated.mode = mode;
+        }
+        lua_pop(L, 1);
+        get_config_int(L, "pause", &updated.pause, 0);
+        get_config_int(L, "stepmul", &updated.stepmul, 1);
+        get_config_int(L, "stepsize", &updated.stepsize, 0);
+        get_config_int(L, "minormul", &updated.minormul, 1);
+        get_config_int(L, "majormul", &updated.majormul, 1);
+        get_config_int(L, "idle_step_kb", &updated.idle_step_kb, 1);
+        get_config_int(L, "idle_budget_us", &updated.idle_budget_us, 0);
+        config = updated;
+        apply_config(L);
+        idle_cycle_done = false;
+    }
+
+    lua_newtable(L);
+    lua_pushstring(L, "mode");
+    lua_pushstring(L, code_int_to_str(config.mode, gc_modes));
+    lua_settable(L, -3);
+    set_config_int(L, "pause", config.pause);
+    set_config_int(L, "stepmul", config.stepmul);
+    set_config_int(L, "stepsize", config.stepsize);
+    set_config_int(L, "minormul", config.minormul);
+    set_config_int(L, "majormul", config.majormul);
+    set_config_int(L, "idle_step_kb", config.idle_step_kb);
+    set_config_int(L, "idle_budget_us", config.idle_budget_us);
+    return 1;
+}
+
+/**
+ * Returns the histogram of idle collection pauses, and which type of event was running when each GC cycle finished.
+ * Cycles finishing under anything but "idle" mean that collection work is still landing in callbacks. Pass true to
+ * reset after reading.
+ */
+int lua_gc_stats(lua_State *L)
+{
+    bool reset = lua_toboolean(L, 1);
+    lua_newtable(L);
+    lua_pushstring(L, "count_kb");
+    lua_pushinteger(L, lua_gc(L, LUA_GCCOUNT));
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "idle_pause");
+    histogram_push(L, &stats.idle_pause);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "idle_cycles");
+    lua_pushinteger(L, stats.idle_cycles);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "cycles");
+    lua_newtable(L);
+    for (int i = 0; i < LUA_SOURCE_MAX; i++)
+    {
+        lua_pushstring(L, lua_source_name(i));
+        lua_pushinteger(L, stats.cycles[i]);
+        lua_settable(L, -3);
+    }
+    lua_settable(L, -3);
+
+    if (reset)
+    {
+        memset(&stats, 0, sizeof(stats));
+    }
+    return 1;
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stdbool.h>
+#include <lua/lua.h>
+
+/**
+ * Sets up the collector for the state according to the configured defaults.
+ */
+void lua_gc_init(lua_State *L);
+
+/**
+ * Does a bounded amount of garbage collection while the loop has nothing else to do.  `interrupted` is polled between
+ * steps so that new events cut it short.  Returns true if there is more collection work to do.
+ */
+bool lua_gc_idle_step(lua_State *L, bool (*interrupted)());
+
+int lua_gc_config(lua_State *L);
+int lua_gc_stats(lua_State *L);
@@ -16,6 +16,7 @@ typedef struct {
     int argRef;
     gpio_int_type_t type;
     bool pending;
+    lua_event_source_t event;
 } interrupt_handler_info_t;
 
 static interrupt_handler_info_t interrupt_handler_refs[32];
@@ -89,7 +90,7 @@ void gpio_isr(void *arg) {
     }
     ih->pending = true;
     gpio_intr_disable(ih->pin); 
-    schedule_callback_from_ISR(do_callback, arg);
+    schedule_event_from_ISR(&ih->event);
     // For things like level interrupts, this would immediately re-raise, before the handler
     // function has been completed.  to deal with this, we turn them off until the handler completes.
 
@@ -191,6 +192,7 @@ int luaopen_gpio(lua_State *L)
         ii->handlerRef = LUA_NOREF;
         ii->type = GPIO_INTR_DISABLE;
         ii->pending = false;
+        lua_event_source_init(&ii->event, LUA_SOURCE_GPIO, LUA_PRIORITY_INPUT, do_callback, ii);
     }
     luaL_newlib(L, log_funcs);
     esp_err_t err = gpio_install_isr_service(0);
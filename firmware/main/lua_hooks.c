@@ -0,0 +1,268 @@
+#include <stdio.h>
+#include <string.h>
+#include <esp_timer.h>
+#include <esp_log.h>
+#include <lua/lua.h>
+#include <lua/lauxlib.h>
+#include "lua_hooks.h"
+#include "lua_system.h"
+#include "loop_stats.h"
+#include "lua_future.h"
+#include "lua_await.h"
+#include "lua_profiler.h"
+#include "sdkconfig.h"
+
+#define TAG "lua_hooks"
+
+// Instructions between calls of the hook, and so the granularity of the budget.
+#define HOOK_INTERVAL 1000
+
+typedef struct
+{
+    int instructions; // Most instructions a callback may run.  0 for no limit.
+    int time_ms;      // Longest a callback may run for.  0 for no limit.
+    int slice_ms;     // How long an async task may run before it is suspended to let events in.  0 to never do so.
+} budget_config_t;
+
+typedef struct
+{
+    uint32_t overruns[LUA_SOURCE_MAX];
+    uint32_t sliced; // Times that an async task was suspended at the end of its slice.
+    lua_source_type_t last_source;
+    char last_where[96]; // The function that last went over budget.
+} budget_stats_t;
+
+static budget_config_t config = {
+    .instructions = CONFIG_CCPEED_LUA_BUDGET_INSTRUCTIONS,
+    .time_ms = CONFIG_CCPEED_LUA_BUDGET_MS,
+    .slice_ms = CONFIG_CCPEED_LUA_TASK_SLICE_MS,
+};
+static budget_stats_t stats;
+
+/**
+ * The callback that is running.  Only touched with the Lua mutex held.
+ */
+static struct
+{
+    bool active;
+    bool overrun;
+    lua_source_type_t source;
+    uint32_t checks_left; // Hook calls until the instruction budget is used up, or 0 for no limit.
+    int64_t deadline;     // When the time budget is used up, or INT64_MAX.
+    int64_t since;
+} current;
+
+/**
+ * Tasks that have been suspended at the end of their slice, in the order that they were, and so the order that their
+ * callbacks will come round.
+ */
+static struct
+{
+    int ref;
+    uint32_t head;
+    uint32_t tail;
+} sliced;
+
+static void resume_sliced(lua_State *L, void *ctx)
+{
+    lua_rawgeti(L, LUA_REGISTRYINDEX, sliced.ref);
+    lua_rawgeti(L, -1, ++sliced.head);
+    lua_pushnil(L);
+    lua_rawseti(L, -3, sliced.head);
+    lua_remove(L, -2);
+    lua_await_resume_thread(L, 0);
+}
+
+/**
+ * If L is a task that has had its slice, queues it to carry on behind whatever events are waiting, and returns true, in
+ * which case the hook must yield.  Tasks can only be suspended where they could await.
+ */
+static bool end_slice(lua_State *L)
+{
+    if (!config.slice_ms || esp_timer_get_time() - current.since < (int64_t)config.slice_ms * 1000 ||
+        !lua_future_in_task(L) || !lua_isyieldable(L))
+    {
+        return false;
+    }
+    lua_rawgeti(L, LUA_REGISTRYINDEX, sliced.ref);
+    lua_pushthread(L);
+    lua_rawseti(L, -2, sliced.tail + 1);
+    if (!schedule_callback(LUA_SOURCE_TASK, LUA_PRIORITY_HOUSEKEEPING, resume_sliced, NULL))
+    {
+        // The queue is full, so there's plenty to be getting on with anyway.  Try again later.
+        lua_pushnil(L);
+        lua_rawseti(L, -2, sliced.tail + 1);
+        lua_pop(L, 1);
+        return false;
+    }
+    lua_pop(L, 1);
+    sliced.tail++;
+    stats.sliced++;
+    return true;
+}
+
+/**
+ * Counts the overrun against the callback's source, and logs where it happened.  Only done for the first time that a
+ * callback goes over.
+ */
+static void record_overrun(lua_State *L, lua_Debug *ar, const char *what)
+{
+    lua_getinfo(L, "Sln", ar);
+    snprintf(stats.last_where, sizeof(stats.last_where), "%s (%s:%d)", ar->name ? ar->name : "?", ar->short_src,
+             ar->currentline);
+    stats.last_source = current.source;
+    stats.overruns[current.source]++;
+    ESP_LOGW(TAG, "%s callback went over its %s budget in %s", lua_source_name(current.source), what,
+             stats.last_where);
+}
+
+static void hook(lua_State *L, lua_Debug *ar)
+{
+    if (lua_profiler_due)
+    {
+        lua_profiler_sample(L);
+    }
+    if (!current.active)
+    {
+        return;
+    }
+    if (!current.overrun && end_slice(L))
+    {
+        lua_yield(L, 0);
+        return;
+    }
+    if (!current.overrun)
+    {
+        const char *what = NULL;
+        if (current.checks_left && --current.checks_left == 0)
+        {
+            what = "instruction";
+        }
+        if (current.deadline != INT64_MAX && esp_timer_get_time() >= current.deadline)
+        {
+            what = "time";
+        }
+        if (!what)
+        {
+            return;
+        }
+        current.overrun = true;
+        record_overrun(L, ar, what);
+    }
+    luaL_error(L, "Budget exceeded in %s callback", lua_source_name(current.source));
+}
+
+void lua_hooks_init(lua_State *L)
+{
+    lua_sethook(L, hook, LUA_MASKCOUNT, HOOK_INTERVAL);
+    lua_newtable(L);
+    sliced.ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    sliced.head = sliced.tail = 0;
+}
+
+void lua_hooks_begin(lua_source_type_t source)
+{
+    current.source = source;
+    current.overrun = false;
+    lua_profiler_due = false; // A tick while Lua was idle isn't down to this callback.
+    current.active = source != LUA_SOURCE_BOOT && (config.instructions > 0 || config.time_ms > 0 || config.slice_ms > 0);
+    current.checks_left = config.instructions > 0 ? (config.instructions + HOOK_INTERVAL - 1) / HOOK_INTERVAL : 0;
+    current.since = esp_timer_get_time();
+    current.deadline = config.time_ms > 0 ? current.since + (int64_t)config.time_ms * 1000 : INT64_MAX;
+}
+
+void lua_hooks_end()
+{
+    current.active = false;
+}
+
+bool lua_hooks_overrun()
+{
+    return current.active && current.overrun;
+}
+
+static void get_config_int(lua_State *L, const char *field, int *out)
+{
+    if (lua_getfield(L, 1, field) != LUA_TNIL)
+    {
+        int v = luaL_checkinteger(L, -1);
+        if (v < 0)
+        {
+            luaL_error(L, "%s must be at least 0", field);
+        }
+        *out = v;
+    }
+    lua_pop(L, 1);
+}
+
+static void set_config_int(lua_State *L, const char *field, int v)
+{
+    lua_pushstring(L, field);
+    lua_pushinteger(L, v);
+    lua_settable(L, -3);
+}
+
+/**
+ * Lua accessible function to read (and optionally update) the budget that each callback has.  Takes a table with
+ * instructions and/or time_ms, either of which can be 0 for no limit, and slice_ms, to have async tasks that run for
+ * longer than that suspended and carried on after any events that are waiting (0 for never).  Returns the resulting
+ * settings.  A change applies from the next callback.
+ */
+int lua_budget_config(lua_State *L)
+{
+    if (!lua_isnoneornil(L, 1))
+    {
+        luaL_checktype(L, 1, LUA_TTABLE);
+        budget_config_t updated = config;
+        get_config_int(L, "instructions", &updated.instructions);
+        get_config_int(L, "time_ms", &updated.time_ms);
+        get_config_int(L, "slice_ms", &updated.slice_ms);
+        config = updated;
+    }
+
+    lua_newtable(L);
+    set_config_int(L, "instructions", config.instructions);
+    set_config_int(L, "time_ms", config.time_ms);
+    set_config_int(L, "slice_ms", config.slice_ms);
+    return 1;
+}
+
+/**
+ * Returns the number of callbacks of each source that have gone over budget, and where the last one was, and the number
+ * of times that tasks have been time sliced.  Pass true to reset after reading.
+ */
+int lua_budget_stats(lua_State *L)
+{
+    bool reset = lua_toboolean(L, 1);
+    lua_newtable(L);
+    lua_pushstring(L, "overruns");
+    lua_newtable(L);
+    for (int i = 0; i < LUA_SOURCE_MAX; i++)
+    {
+        lua_pushstring(L, lua_source_name(i));
+        lua_pushinteger(L, stats.overruns[i]);
+        lua_settable(L, -3);
+    }
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "sliced");
+    lua_pushinteger(L, stats.sliced);
+    lua_settable(L, -3);
+
+    if (stats.last_where[0])
+    {
+        lua_pushstring(L, "last_source");
+        lua_pushstring(L, lua_source_name(stats.last_source));
+        lua_settable(L, -3);
+
+        lua_pushstring(L, "last_where");
+        lua_pushstring(L, stats.last_where);
+        lua_settable(L, -3);
+    }
+
+    if (reset)
+    {
+        memset(&stats, 0, sizeof(stats));
+    }
+    return 1;
+}
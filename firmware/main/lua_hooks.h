@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdbool.h>
+#include <lua/lua.h>
+#include "loop_stats.h"
+
+/**
+ * Installs the count hook that enforces the per callback budget, time slices async tasks and takes the profiler's
+ * samples.  Threads inherit it from the thread that creates them,
+ * so this must be done before any others are created.
+ */
+void lua_hooks_init(lua_State *L);
+
+/**
+ * Brackets each callback (or other use of the Lua state) on behalf of a source.  While one is running, Lua code that
+ * goes over the instruction or time budget gets a "budget exceeded" error, which is raised again every few instructions
+ * until the callback gives up, so that catching it doesn't help.  Boot (init.lua) has no budget.
+ */
+void lua_hooks_begin(lua_source_type_t source);
+
+void lua_hooks_end();
+
+/**
+ * Whether the callback that is running has gone over its budget, and so is having every hook call raise an error.
+ */
+bool lua_hooks_overrun();
+
+int lua_budget_config(lua_State *L);
+int lua_budget_stats(lua_State *L);
@@ -0,0 +1,222 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <esp_log.h>
+#include <lua/lua.h>
+#include <lua/lauxlib.h>
+#include "lua_loader.h"
+
+#define TAG "loader"
+
+#define FNV_OFFSET 2166136261u
+#define FNV_PRIME 16777619u
+#define LUAC_MAX_HEADER 32 // Signature, version, format, LUAC_DATA, 3 sizes, then a test integer and number.
+#define READ_BUF_SIZE 256
+
+typedef struct
+{
+    uint8_t buf[LUAC_MAX_HEADER];
+    size_t len;
+} dump_header_t;
+
+typedef struct
+{
+    FILE *fp;
+    char buf[READ_BUF_SIZE];
+} file_reader_t;
+
+static uint32_t fingerprint;
+
+static uint32_t fnv1a(uint32_t h, const uint8_t *data, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        h = (h ^ data[i]) * FNV_PRIME;
+    }
+    return h;
+}
+
+static int collect_header(lua_State *L, const void *p, size_t sz, void *ud)
+{
+    dump_header_t *hdr = ud;
+    size_t n = sizeof(hdr->buf) - hdr->len;
+    if (n > sz)
+    {
+        n = sz;
+    }
+    memcpy(hdr->buf + hdr->len, p, n);
+    hdr->len += n;
+    return 0;
+}
+
+/**
+ * The length of the fixed header at the start of a dumped chunk, which encodes the Lua version, bytecode format and the
+ * sizes and representations of the integer and float types.  Everything after it is the function itself.
+ */
+static size_t luac_header_length(const dump_header_t *hdr)
+{
+    if (hdr->len < 15)
+    {
+        return hdr->len;
+    }
+    size_t len = 15 + hdr->buf[13] + hdr->buf[14];
+    return len < hdr->len ? len : hdr->len;
+}
+
+static const char *read_file(lua_State *L, void *ud, size_t *size)
+{
+    file_reader_t *reader = ud;
+    *size = fread(reader->buf, 1, sizeof(reader->buf), reader->fp);
+    return *size ? reader->buf : NULL;
+}
+
+static uint32_t read_le32(uint32_t v)
+{
+    const uint8_t *b = (const uint8_t *)&v;
+    return b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24);
+}
+
+/**
+ * Whether the source at path, if there is any, is what the image was compiled from.
+ */
+static bool source_matches(const char *path, uint32_t hash)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+    {
+        return true;
+    }
+    uint8_t buf[READ_BUF_SIZE];
+    uint32_t h = FNV_OFFSET;
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+    {
+        h = fnv1a(h, buf, n);
+    }
+    fclose(fp);
+    return h == hash;
+}
+
+/**
+ * Loads a precompiled image, leaving either the function or an error message on the stack.  sourcePath is the source
+ * that it should have been compiled from.
+ */
+static int load_image(lua_State *L, const char *path, const char *sourcePath)
+{
+    file_reader_t reader;
+    reader.fp = fopen(path, "rb");
+    if (!reader.fp)
+    {
+        lua_pushfstring(L, "cannot open %s", path);
+        return LUA_ERRFILE;
+    }
+
+    luac_image_header_t hdr;
+    int status = LUA_ERRFILE;
+    if (fread(&hdr, sizeof(hdr), 1, reader.fp) != 1 || memcmp(hdr.magic, LUAC_IMAGE_MAGIC, sizeof(hdr.magic)) != 0)
+    {
+        lua_pushfstring(L, "%s is not a bytecode image", path);
+    }
+    else if (hdr.version != LUAC_IMAGE_VERSION)
+    {
+        lua_pushfstring(L, "%s has unsupported image version %d", path, hdr.version);
+    }
+    else if (read_le32(hdr.fingerprint) != fingerprint)
+    {
+        lua_pushfstring(L, "%s was compiled for a different Lua build", path);
+    }
+    else
+    {
+        if (!source_matches(sourcePath, read_le32(hdr.source_hash)))
+        {
+            // A valid image wins.  The source is most likely one left behind by a sync from before images, which
+            // doesn't remove anything; an edit made on the device needs the image deleting too.
+            ESP_LOGW(TAG, "%s isn't what %s was compiled from; loading the image", sourcePath, path);
+        }
+        lua_pushfstring(L, "@%s", path);
+        status = lua_load(L, read_file, &reader, lua_tostring(L, -1), "b");
+        lua_remove(L, -2);
+    }
+    fclose(reader.fp);
+    return status;
+}
+
+/**
+ * Package searcher that looks for a precompiled image of the module, using package.path with .lua swapped for .luac.
+ * If there isn't a usable one, it returns a message and require moves on to the source searcher.
+ */
+static int luac_searcher(lua_State *L)
+{
+    const char *name = luaL_checkstring(L, 1);
+    lua_getglobal(L, "package");
+    lua_getfield(L, -1, "searchpath");
+    lua_pushstring(L, name);
+    lua_getfield(L, -3, "path");
+    luaL_gsub(L, luaL_checkstring(L, -1), ".lua", ".luac");
+    lua_remove(L, -2);
+    lua_call(L, 2, 2);
+    if (lua_isnil(L, -2))
+    {
+        return 1; // The error message
+    }
+
+    const char *path = lua_tostring(L, -2);
+    lua_pushlstring(L, path, strlen(path) - 1);
+    int status = load_image(L, path, lua_tostring(L, -1));
+    lua_remove(L, -2);
+    if (status != LUA_OK)
+    {
+        ESP_LOGW(TAG, "Ignoring %s", lua_tostring(L, -1));
+        return 1;
+    }
+    lua_pushvalue(L, -3);
+    return 2;
+}
+
+void lua_loader_init(lua_State *L)
+{
+    dump_header_t hdr = {.len = 0};
+    luaL_loadstring(L, "");
+    lua_dump(L, collect_header, &hdr, 1);
+    lua_pop(L, 1);
+    fingerprint = fnv1a(FNV_OFFSET, hdr.buf, luac_header_length(&hdr));
+    ESP_LOGI(TAG, "Bytecode fingerprint %08lx", (unsigned long)fingerprint);
+
+    // Insert our searcher before the one that loads source, so that it gets first go.
+    lua_getglobal(L, "package");
+    lua_getfield(L, -1, "searchers");
+    for (lua_Integer i = luaL_len(L, -1); i >= 2; i--)
+    {
+        lua_rawgeti(L, -1, i);
+        lua_rawseti(L, -2, i + 1);
+    }
+    lua_pushcfunction(L, luac_searcher);
+    lua_rawseti(L, -2, 2);
+    lua_pop(L, 2);
+}
+
+uint32_t lua_loader_fingerprint()
+{
+    return fingerprint;
+}
+
+int lua_loader_loadfile(lua_State *L, const char *path)
+{
+    size_t len = strlen(path);
+    if (len > 4 && strcmp(path + len - 4, ".lua") == 0)
+    {
+        lua_pushfstring(L, "%sc", path);
+        int status = load_image(L, lua_tostring(L, -1), path);
+        lua_remove(L, -2);
+        if (status == LUA_OK)
+        {
+            return status;
+        }
+        if (status != LUA_ERRFILE || strncmp(lua_tostring(L, -1), "cannot open", 11) != 0)
+        {
+            ESP_LOGW(TAG, "Falling back to source: %s", lua_tostring(L, -1));
+        }
+        lua_pop(L, 1);
+    }
+    return luaL_loadfile(L, path);
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdint.h>
+#include <lua/lua.h>
+
+#define LUAC_IMAGE_MAGIC "CCLC"
+#define LUAC_IMAGE_VERSION 1
+
+/**
+ * Header in front of precompiled chunks (.luac files), written by lua/compile.py.  The fingerprint identifies the Lua
+ * build that the bytecode was compiled for, so that we don't hand Lua bytecode that it will choke on, and the source
+ * hash lets the loader warn about a source beside the image that it wasn't compiled from.  All integers are little
+ * endian.
+ */
+typedef struct __attribute__((packed))
+{
+    char magic[4];
+    uint8_t version;
+    uint8_t reserved[3];
+    uint32_t fingerprint; // FNV-1a of the header that lua_dump() writes
+    uint32_t source_hash; // FNV-1a of the source text the chunk was compiled from
+} luac_image_header_t;
+
+/**
+ * Works out the firmware's bytecode fingerprint, and installs a package searcher that prefers precompiled modules.
+ */
+void lua_loader_init(lua_State *L);
+
+uint32_t lua_loader_fingerprint();
+
+/**
+ * Like luaL_loadfile(), except that if there is a usable precompiled image alongside the file (e.g. init.luac for
+ * init.lua) that is loaded instead.  If the file isn't what the image was compiled from, that is logged, but the image
+ * is still loaded.
+ */
+int lua_loader_loadfile(lua_State *L, const char *path);
@@ -1,3 +1,5 @@
+#include <string.h>
+#include <stdatomic.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 #include <driver/gpio.h>
@@ -25,8 +27,11 @@
 #include <openthread/dataset_ftd.h>
 
 #include "esp_vfs_eventfd.h"
+#include "esp_openthread_lock.h"
 
 #include "lua_system.h"
+#include "event_pool.h"
+#include "lua_await.h"
 
 #define TAG "openthread"
 
@@ -479,23 +484,57 @@ typedef struct
     otSockAddr sockAddr;
     otUdpSocket sock;
     int objRef;
+    atomic_uint pending; // Datagrams queued for the Lua task that still refer to this listener.
+    bool closed;
+    lua_awaiter_t receiver; // A task in sock:receive(), which gets the next datagram instead of the handler.
 } udp_listener_t;
 
+/**
+ * A received datagram on its way from the OpenThread task to the Lua task.  Lives in the event pool.
+ */
+typedef struct
+{
+    udp_listener_t *listener;
+    uint8_t peer_addr[OT_IP6_ADDRESS_SIZE];
+    uint8_t sock_addr[OT_IP6_ADDRESS_SIZE];
+    uint16_t peer_port;
+    uint16_t sock_port;
+    uint16_t len;
+    uint8_t body[];
+} udp_datagram_t;
+
 static int close_udp(lua_State *L)
 {
     lua_getfield(L, 1, "sock");
     udp_listener_t *l = (udp_listener_t *)lua_touserdata(L, -1);
     lua_pop(L, 1);
+    if (l->closed)
+    {
+        return 0;
+    }
 
     otInstance *instance = esp_openthread_get_instance();
 
+    // Once this returns, the OpenThread task won't call udpCallback for this socket again.
+    esp_openthread_lock_acquire(portMAX_DELAY);
     otError otErr = otUdpClose(instance, &l->sock);
+    esp_openthread_lock_release();
     if (otErr != OT_ERROR_NONE)
     {
         luaL_error(L, "Error closing socket: %s", otThreadErrorToString(otErr));
         return 1;
     }
-    luaL_unref(L, LUA_REGISTRYINDEX, l->objRef);
+    l->closed = true;
+    if (lua_await_pending(&l->receiver))
+    {
+        lua_pushnil(L);
+        lua_await_resume(L, &l->receiver, 1);
+    }
+    // Datagrams still in the queue point at the listener, so it's kept alive until the last of them is dispatched.
+    if (atomic_load(&l->pending) == 0)
+    {
+        luaL_unref(L, LUA_REGISTRYINDEX, l->objRef);
+    }
     return 1;
 }
 
@@ -555,76 +594,170 @@ static int send_datagram(lua_State *L)
     }
 
     otInstance *instance = esp_openthread_get_instance();
+    esp_openthread_lock_acquire(portMAX_DELAY);
+    otError oErr = OT_ERROR_NO_BUFS;
     otMessage *respMsg = otUdpNewMessage(instance, NULL);
-    otMessageAppend(respMsg, (uint8_t *)msg, sz);
-
-    otError oErr = otUdpSendDatagram(instance, respMsg, &msgInfo);
+    if (respMsg)
+    {
+        oErr = otMessageAppend(respMsg, (const uint8_t *)msg, sz);
+        if (oErr == OT_ERROR_NONE)
+        {
+            oErr = otUdpSendDatagram(instance, respMsg, &msgInfo);
+        }
+        if (oErr != OT_ERROR_NONE)
+        {
+            // Only a message that has been sent belongs to OpenThread, and it must be freed under the lock.
+            otMessageFree(respMsg);
+        }
+    }
+    esp_openthread_lock_release();
     if (oErr != OT_ERROR_NONE)
     {
         ESP_LOGE(TAG, "could not send datagram");
-        otMessageFree(respMsg);
         luaL_error(L, "Error sending UDP datagram: %s", otThreadErrorToString(oErr));
         return 1;
     }
     return 0;
 }
 
-void udpCallback(void *aContext, otMessage *aMessage, const otMessageInfo *aMessageInfo)
+/**
+ * Pushes the table describing a received datagram, as passed to handlers and returned from receive.
+ */
+static void push_datagram(lua_State *L, const udp_datagram_t *d)
 {
-    udp_listener_t *sock = (udp_listener_t *)aContext;
-    uint8_t buf[1500]; // Bigger than the MTU
-    size_t bufsz;
-
-    ESP_LOGD(TAG, "Received UDP Datagram. AllowZeroHopLimit %d, ecn %d, hopLimit %d, isHostInterface %d, linkInfo %p multicastLoop %d",
-             aMessageInfo->mAllowZeroHopLimit,
-             aMessageInfo->mEcn,
-             aMessageInfo->mHopLimit,
-             aMessageInfo->mIsHostInterface,
-             aMessageInfo->mLinkInfo,
-             aMessageInfo->mMulticastLoop);
-
-    lua_State *L = acquireLuaMutex();
-    // Get the serverSocket object
-    assert(lua_rawgeti(L, LUA_REGISTRYINDEX, sock->objRef));
-
-    // Get the handler from the object.
-    lua_getfield(L, -1, "handler");
-    lua_pushvalue(L, -2); // First argument is the The "sock" object
-
-    // Second argument is a request object with information about the message received.
     lua_newtable(L);
     lua_pushstring(L, "body");
-    bufsz = otMessageRead(aMessage, 0, buf, sizeof(buf));
-
-    ESP_LOG_BUFFER_HEX_LEVEL(TAG, buf, bufsz, ESP_LOG_DEBUG);
-
-    lua_pushlstring(L, (char *)buf, bufsz);
+    lua_pushlstring(L, (char *)d->body, d->len);
     lua_settable(L, -3);
 
     lua_pushstring(L, "peer_addr");
-    lua_pushlstring(L, (const char *)aMessageInfo->mPeerAddr.mFields.m8, OT_IP6_ADDRESS_SIZE);
+    lua_pushlstring(L, (const char *)d->peer_addr, OT_IP6_ADDRESS_SIZE);
     lua_settable(L, -3);
 
     lua_pushstring(L, "peer_port");
-    lua_pushinteger(L, aMessageInfo->mPeerPort);
+    lua_pushinteger(L, d->peer_port);
     lua_settable(L, -3);
 
     lua_pushstring(L, "sock_addr");
-    lua_pushlstring(L, (const char *)aMessageInfo->mSockAddr.mFields.m8, OT_IP6_ADDRESS_SIZE);
+    lua_pushlstring(L, (const char *)d->sock_addr, OT_IP6_ADDRESS_SIZE);
     lua_settable(L, -3);
 
     lua_pushstring(L, "sock_port");
-    lua_pushinteger(L, aMessageInfo->mSockPort);
+    lua_pushinteger(L, d->sock_port);
     lua_settable(L, -3);
+}
+
+/**
+ * Hands a received datagram to a task waiting in receive, or else runs the listener's handler.  On the Lua task.
+ */
+static void dispatch_datagram(lua_State *L, void *ctx)
+{
+    udp_datagram_t *d = (udp_datagram_t *)ctx;
+    udp_listener_t *sock = d->listener;
+    uint16_t sock_port = d->sock_port;
 
-    if (lua_pcall(L, 2, 0, 0))
+    if (sock->closed)
     {
-        ESP_LOGE(TAG, "Error processing UDP Packet on port %d: %s", aMessageInfo->mSockPort, lua_tostring(L, -1));
-        lua_pop(L, 1);
+        event_pool_free(d);
+    }
+    else if (lua_await_pending(&sock->receiver))
+    {
+        push_datagram(L, d);
+        event_pool_free(d);
+        lua_await_resume(L, &sock->receiver, 1);
+    }
+    else
+    {
+        // Get the serverSocket object
+        assert(lua_rawgeti(L, LUA_REGISTRYINDEX, sock->objRef));
+
+        // Get the handler from the object.
+        lua_getfield(L, -1, "handler");
+        if (lua_isfunction(L, -1))
+        {
+            lua_pushvalue(L, -2); // First argument is the The "sock" object
+            // Second argument is a request object with information about the message received.
+            push_datagram(L, d);
+            // Everything has been copied into Lua, so the block can go back before the handler runs.
+            event_pool_free(d);
+
+            if (lua_pcall(L, 2, 0, 0))
+            {
+                ESP_LOGE(TAG, "Error processing UDP Packet on port %d: %s", sock_port, lua_tostring(L, -1));
+                lua_pop(L, 1);
+            }
+        }
+        else
+        {
+            ESP_LOGD(TAG, "Nothing receiving on port %d, dropping datagram", sock_port);
+            event_pool_free(d);
+            lua_pop(L, 1);
+        }
+        lua_pop(L, 1); // The object that we fetched first up
+    }
+
+    if (atomic_fetch_sub(&sock->pending, 1) == 1 && sock->closed)
+    {
+        luaL_unref(L, LUA_REGISTRYINDEX, sock->objRef);
+    }
+}
+
+/**
+ * sock:receive() - suspends the calling task until the next datagram arrives, and returns it in the same form as the
+ * handler gets it.  Returns nil if the socket is closed.
+ */
+static int receive_udp(lua_State *L)
+{
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_getfield(L, 1, "sock");
+    udp_listener_t *l = (udp_listener_t *)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    if (l->closed)
+    {
+        lua_pushnil(L);
+        return 1;
+    }
+    return lua_await(L, &l->receiver);
+}
+
+/**
+ * Called on the OpenThread task.  The datagram is copied into the event pool and queued for the Lua task, so that
+ * OpenThread never waits on Lua.  If there's no room it is dropped - the sender will retransmit if it matters.
+ */
+void udpCallback(void *aContext, otMessage *aMessage, const otMessageInfo *aMessageInfo)
+{
+    udp_listener_t *sock = (udp_listener_t *)aContext;
+
+    ESP_LOGD(TAG, "Received UDP Datagram. AllowZeroHopLimit %d, ecn %d, hopLimit %d, isHostInterface %d, linkInfo %p multicastLoop %d",
+             aMessageInfo->mAllowZeroHopLimit,
+             aMessageInfo->mEcn,
+             aMessageInfo->mHopLimit,
+             aMessageInfo->mIsHostInterface,
+             aMessageInfo->mLinkInfo,
+             aMessageInfo->mMulticastLoop);
+
+    uint16_t len = otMessageGetLength(aMessage);
+    udp_datagram_t *d = event_pool_alloc(sizeof(udp_datagram_t) + len);
+    if (!d)
+    {
+        ESP_LOGW(TAG, "No buffer for %d byte datagram on port %d, dropping", len, aMessageInfo->mSockPort);
+        return;
     }
-    lua_pop(L, 1); // The object that we fetched first up
+    d->listener = sock;
+    d->len = otMessageRead(aMessage, 0, d->body, len);
+    memcpy(d->peer_addr, aMessageInfo->mPeerAddr.mFields.m8, OT_IP6_ADDRESS_SIZE);
+    d->peer_port = aMessageInfo->mPeerPort;
+    memcpy(d->sock_addr, aMessageInfo->mSockAddr.mFields.m8, OT_IP6_ADDRESS_SIZE);
+    d->sock_port = aMessageInfo->mSockPort;
 
-    releaseLuaMutex();
+    ESP_LOG_BUFFER_HEX_LEVEL(TAG, d->body, d->len, ESP_LOG_DEBUG);
+
+    atomic_fetch_add(&sock->pending, 1);
+    if (!schedule_callback(LUA_SOURCE_UDP, LUA_PRIORITY_NETWORK, dispatch_datagram, d))
+    {
+        atomic_fetch_sub(&sock->pending, 1);
+        event_pool_free(d);
+    }
 }
 
 static int listen_udp(lua_State *L)
@@ -643,29 +776,40 @@ static int listen_udp(lua_State *L)
     lua_pushcfunction(L, close_udp);
     lua_settable(L, -3);
 
+    lua_pushstring(L, "receive");
+    lua_pushcfunction(L, receive_udp);
+    lua_settable(L, -3);
+
     lua_pushstring(L, "handler");
     lua_pushvalue(L, 3);
     lua_settable(L, -3);
 
     memset(&udpListener->sockAddr, 0, sizeof(otSockAddr)); // Unspecified (every address)
     udpListener->sockAddr.mPort = lua_tointeger(L, 2);
+    atomic_init(&udpListener->pending, 0);
+    udpListener->closed = false;
+    lua_awaiter_init(&udpListener->receiver);
 
     otInstance *instance = esp_openthread_get_instance();
+    esp_openthread_lock_acquire(portMAX_DELAY);
     otError error = otUdpOpen(instance, &udpListener->sock, udpCallback, udpListener);
-    if (error != OT_ERROR_NONE)
-    {
-        luaL_error(L, "Error opening UDP");
-        return 1;
-    }
-    else
+    if (error == OT_ERROR_NONE)
     {
         error = otUdpBind(instance, &udpListener->sock, &udpListener->sockAddr, OT_NETIF_THREAD);
         if (error != OT_ERROR_NONE)
         {
+            otUdpClose(instance, &udpListener->sock);
+            esp_openthread_lock_release();
             luaL_error(L, "Error binding UDP");
             return 1;
         }
     }
+    esp_openthread_lock_release();
+    if (error != OT_ERROR_NONE)
+    {
+        luaL_error(L, "Error opening UDP");
+        return 1;
+    }
     // Take a reference to the object so that it doesn't get garbage collected.
     lua_pushvalue(L, -1);
     udpListener->objRef = luaL_ref(L, LUA_REGISTRYINDEX);
@@ -0,0 +1,257 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <esp_timer.h>
+#include <esp_log.h>
+#include <lua/lua.h>
+#include <lua/lauxlib.h>
+#include "lua_profiler.h"
+#include "sdkconfig.h"
+
+#define TAG "profiler"
+
+/**
+ * A sampling profiler.  An esp_timer ticks at the sample period and only sets a flag, and the count hook (lua_hooks.c),
+ * which is called every thousand instructions anyway, takes a sample the next time that it runs after the flag is
+ * set.  So a sample costs a walk of the Lua stack, and the rest of the time the profiler costs a test of a flag.  As
+ * the hook only runs while Lua does, the samples show where the time spent in Lua goes; time in C functions that Lua
+ * calls is put down to whatever Lua function runs next.
+ *
+ * Samples are counted by stack, in a fixed size hash table of folded stacks - the frames from the outermost in, joined
+ * with ';' - which is the format that flamegraph.pl and speedscope take.  Once the table is full, stacks that aren't
+ * in it already are only counted as dropped.
+ */
+#define DEFAULT_PERIOD_US 1000
+#define MIN_PERIOD_US 100
+#define MAX_DEPTH 32   // Frames kept, from the innermost.  Deeper stacks start with "...".
+#define STACK_LEN 256  // Longest folded stack.  Longer ones are cut short.
+#define FRAME_LEN 80
+
+typedef struct
+{
+    uint32_t hash;
+    uint32_t count; // 0 for an empty slot.
+    char stack[STACK_LEN];
+} profiler_slot_t;
+
+volatile bool lua_profiler_due;
+
+static struct
+{
+    esp_timer_handle_t timer;
+    profiler_slot_t *slots; // CONFIG_CCPEED_LUA_PROFILER_SLOTS of them, from the first start.
+    bool running;
+    int period_us;
+    uint32_t ticks;   // Timer ticks while running, whether or not Lua was.
+    uint32_t samples; // Stacks counted.
+    uint32_t dropped; // Samples of stacks that there was no room for.
+    uint32_t stacks;  // Slots used.
+} profiler;
+
+static void tick(void *arg)
+{
+    profiler.ticks++;
+    lua_profiler_due = true;
+}
+
+static uint32_t hash_stack(const char *s)
+{
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    while (*s)
+    {
+        h = (h ^ (uint8_t)*s++) * 16777619u;
+    }
+    return h;
+}
+
+static void frame_name(lua_State *L, int level, char *buf)
+{
+    lua_Debug ar;
+    lua_getstack(L, level, &ar);
+    lua_getinfo(L, "Sn", &ar);
+    if (*ar.what == 'C')
+    {
+        snprintf(buf, FRAME_LEN, "%s", ar.name ? ar.name : "[C]");
+    }
+    else if (*ar.what == 'm')
+    {
+        snprintf(buf, FRAME_LEN, "main (%s)", ar.short_src);
+    }
+    else
+    {
+        snprintf(buf, FRAME_LEN, "%s (%s:%d)", ar.name ? ar.name : "?", ar.short_src, ar.linedefined);
+    }
+}
+
+/**
+ * Writes the folded stack of L into out, outermost frame first.
+ */
+static void fold_stack(lua_State *L, char *out)
+{
+    lua_Debug ar;
+    int depth = 0;
+    while (depth <= MAX_DEPTH && lua_getstack(L, depth, &ar))
+    {
+        depth++;
+    }
+    size_t len = 0;
+    out[0] = '\0';
+    if (depth > MAX_DEPTH)
+    {
+        len = snprintf(out, STACK_LEN, "...");
+        depth = MAX_DEPTH;
+    }
+    char frame[FRAME_LEN];
+    for (int level = depth - 1; level >= 0 && len < STACK_LEN - 1; level--)
+    {
+        frame_name(L, level, frame);
+        len += snprintf(out + len, STACK_LEN - len, "%s%s", len ? ";" : "", frame);
+    }
+}
+
+void lua_profiler_sample(lua_State *L)
+{
+    lua_profiler_due = false;
+    if (!profiler.running)
+    {
+        return;
+    }
+    static char stack[STACK_LEN]; // Only ever used from the Lua task.
+    fold_stack(L, stack);
+    uint32_t hash = hash_stack(stack);
+    for (int i = 0; i < CONFIG_CCPEED_LUA_PROFILER_SLOTS; i++)
+    {
+        profiler_slot_t *slot = &profiler.slots[(hash + i) % CONFIG_CCPEED_LUA_PROFILER_SLOTS];
+        if (!slot->count)
+        {
+            slot->hash = hash;
+            slot->count = 1;
+            strcpy(slot->stack, stack);
+            profiler.stacks++;
+            profiler.samples++;
+            return;
+        }
+        if (slot->hash == hash && !strcmp(slot->stack, stack))
+        {
+            slot->count++;
+            profiler.samples++;
+            return;
+        }
+    }
+    profiler.dropped++;
+}
+
+/**
+ * system.profiler.start([period_us]) - clears the results and starts sampling, every period_us microseconds (default
+ * 1000).
+ */
+static int profiler_start(lua_State *L)
+{
+    int period_us = luaL_optinteger(L, 1, DEFAULT_PERIOD_US);
+    luaL_argcheck(L, period_us >= MIN_PERIOD_US, 1, "period must be at least 100us");
+    if (!profiler.timer)
+    {
+        esp_timer_create_args_t args = {
+            .callback = tick,
+            .arg = NULL,
+            .name = "profiler",
+            .dispatch_method = ESP_TIMER_TASK,
+            .skip_unhandled_events = true};
+        ESP_ERROR_CHECK(esp_timer_create(&args, &profiler.timer));
+    }
+    if (!profiler.slots)
+    {
+        profiler.slots = calloc(CONFIG_CCPEED_LUA_PROFILER_SLOTS, sizeof(profiler_slot_t));
+        if (!profiler.slots)
+        {
+            luaL_error(L, "Not enough memory for the profiler");
+        }
+    }
+    if (profiler.running)
+    {
+        esp_timer_stop(profiler.timer);
+    }
+    memset(profiler.slots, 0, CONFIG_CCPEED_LUA_PROFILER_SLOTS * sizeof(profiler_slot_t));
+    profiler.ticks = profiler.samples = profiler.dropped = profiler.stacks = 0;
+    profiler.period_us = period_us;
+    profiler.running = true;
+    lua_profiler_due = false;
+    ESP_ERROR_CHECK(esp_timer_start_periodic(profiler.timer, period_us));
+    ESP_LOGI(TAG, "Sampling every %dus", period_us);
+    return 0;
+}
+
+/**
+ * system.profiler.stop() - stops sampling, keeping the results.
+ */
+static int profiler_stop(lua_State *L)
+{
+    if (profiler.running)
+    {
+        esp_timer_stop(profiler.timer);
+        profiler.running = false;
+    }
+    return 0;
+}
+
+/**
+ * system.profiler.folded() - the samples so far as folded stacks, one "frame;frame;frame count" line per stack, for
+ * flamegraph.pl or speedscope.
+ */
+static int profiler_folded(lua_State *L)
+{
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    for (int i = 0; profiler.slots && i < CONFIG_CCPEED_LUA_PROFILER_SLOTS; i++)
+    {
+        profiler_slot_t *slot = &profiler.slots[i];
+        if (slot->count)
+        {
+            char count[16];
+            snprintf(count, sizeof(count), " %lu\n", (unsigned long)slot->count);
+            luaL_addstring(&b, slot->stack);
+            luaL_addstring(&b, count);
+        }
+    }
+    luaL_pushresult(&b);
+    return 1;
+}
+
+static void set_stat(lua_State *L, const char *field, lua_Integer v)
+{
+    lua_pushstring(L, field);
+    lua_pushinteger(L, v);
+    lua_settable(L, -3);
+}
+
+/**
+ * system.profiler.stats() - whether it's running, the period, and counts of ticks, samples, stacks and samples dropped
+ * for want of room.  Ticks that don't turn into samples were while Lua wasn't running.
+ */
+static int profiler_stats(lua_State *L)
+{
+    lua_newtable(L);
+    lua_pushstring(L, "running");
+    lua_pushboolean(L, profiler.running);
+    lua_settable(L, -3);
+    set_stat(L, "period_us", profiler.period_us);
+    set_stat(L, "ticks", profiler.ticks);
+    set_stat(L, "samples", profiler.samples);
+    set_stat(L, "stacks", profiler.stacks);
+    set_stat(L, "dropped", profiler.dropped);
+    return 1;
+}
+
+static const struct luaL_Reg funcs[] = {
+    {"start", profiler_start},
+    {"stop", profiler_stop},
+    {"folded", profiler_folded},
+    {"stats", profiler_stats},
+    {NULL, NULL}};
+
+int luaopen_profiler(lua_State *L)
+{
+    luaL_newlib(L, funcs);
+    return 1;
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stdbool.h>
+#include <lua/lua.h>
+
+/**
+ * Set by the profiler's esp_timer tick, and taken by the count hook, which then calls lua_profiler_sample().
+ */
+extern volatile bool lua_profiler_due;
+
+/**
+ * Counts the stack of L (the running thread) as one sample.  Only called from the count hook.
+ */
+void lua_profiler_sample(lua_State *L);
+
+/**
+ * Pushes the system.profiler table.
+ */
+int luaopen_profiler(lua_State *L);
@@ -22,9 +22,22 @@
 #include "lua_dali.h"
 #include "lua_digest.h"
 #include "lua_timer.h"
+#include "lua_future.h"
 #include "lua_crypto.h"
 #include "lua_openthread.h"
 #include "lua_cbor.h"
+#include "lua_alloc.h"
+#include "lua_gc.h"
+#include "lua_loader.h"
+#include "lua_bundle.h"
+#include "event_pool.h"
+#include "timer_wheel.h"
+#include "lua_hooks.h"
+#include "lua_profiler.h"
+#ifdef CCPEED_HOST
+#include "sim.h"
+#include "alloc_trace.h"
+#endif
 #include <dirent.h>
 #include <sys/stat.h>
 
@@ -34,18 +47,73 @@
 static int restart_system(lua_State *L);
 static int get_heap(lua_State *L);
 static int lua_uptime(lua_State *L);
+static int heap_limit(lua_State *L);
+static int heap_peak(lua_State *L);
+static int get_event_stats(lua_State *L);
+static int get_loop_stats(lua_State *L);
+
+#define EVENT_RING_SIZE CONFIG_CCPEED_EVENT_QUEUE_SIZE
+#define EVENT_RING_MASK (EVENT_RING_SIZE - 1)
+_Static_assert((EVENT_RING_SIZE & EVENT_RING_MASK) == 0, "CONFIG_CCPEED_EVENT_QUEUE_SIZE must be a power of two");
 
 typedef struct
 {
     lua_callback_helper_t fn;
     void *ctx;
+    lua_event_source_t *src; // If set, fn, ctx and type come from the source instead.
+    lua_source_type_t type;
+    int64_t enqueued_at;
 } lua_callback_t;
 
+/**
+ * One slot of the event ring.  The ring is a bounded multi-producer queue - each slot carries a sequence number that
+ * tells producers whether it is free, and the (single) consumer whether it has been published.
+ */
+typedef struct
+{
+    atomic_uint seq;
+    lua_callback_t cb;
+} event_slot_t;
+
+/**
+ * One ring per priority class, each with its own overflow list.
+ */
+typedef struct
+{
+    event_slot_t slots[EVENT_RING_SIZE];
+    atomic_uint head; // Next position producers will claim.
+    uint32_t tail;    // Next position the Lua task will consume.  Only touched by the Lua task.
+    // Sources that raised while the ring was full. They are parked here (allocation free, as the link lives in the
+    // source) until the Lua task has room for them, so that a one shot event is never lost.
+    _Atomic(lua_event_source_t *) overflow;
+    uint32_t skipped;    // Dispatches from higher classes in a row while this one had something waiting.
+    uint32_t dispatched;
+    uint32_t high_water;
+    uint32_t starved;    // Times that this class was served ahead of a higher one for having been skipped too often.
+} event_ring_t;
+
+typedef struct
+{
+    uint32_t dispatched;
+    uint32_t high_water;
+    atomic_uint coalesced; // Raises that were merged into an already pending entry.
+    atomic_uint overflows; // Number of times a producer found the ring full.
+    atomic_uint dropped;   // Plain callbacks that were discarded because the ring was full.
+} event_stats_t;
+
 static const struct luaL_Reg system_funcs[] = {
     // { "start_task", start_task },
     {"restart", restart_system},
     {"heap_info", get_heap},
+    {"heap_limit", heap_limit},
+    {"heap_peak", heap_peak},
     {"uptime", lua_uptime},
+    {"event_stats", get_event_stats},
+    {"loop_stats", get_loop_stats},
+    {"gc_config", lua_gc_config},
+    {"gc_stats", lua_gc_stats},
+    {"budget_config", lua_budget_config},
+    {"budget_stats", lua_budget_stats},
     {NULL, NULL}};
 
 void lua_report_error(lua_State *L, int status, const char *prefix)
@@ -58,7 +126,18 @@ void lua_report_error(lua_State *L, int status, const char *prefix)
 
 SemaphoreHandle_t mutex;
 static lua_State *L;
-QueueHandle_t callback_queue;
+static TaskHandle_t lua_task;
+static lua_source_type_t running_source; // What the holder of the mutex is running, and since when.
+static int64_t running_since;
+
+static event_ring_t event_rings[LUA_PRIORITY_MAX];
+static event_stats_t event_stats;
+
+static const code_lookup_t priority_lookup[] = {
+    {.sval = "input", .ival = LUA_PRIORITY_INPUT},
+    {.sval = "network", .ival = LUA_PRIORITY_NETWORK},
+    {.sval = "housekeeping", .ival = LUA_PRIORITY_HOUSEKEEPING},
+    {.sval = NULL, .ival = -1}};
 
 static const char *type_names[] = {
     "nil",
@@ -91,16 +170,303 @@ static const code_lookup_t reset_reason_lookup[] = {
 
 };
 
-void schedule_callback_from_ISR(lua_callback_helper_t fn, void *ctx)
+static void event_ring_init()
+{
+    for (int p = 0; p < LUA_PRIORITY_MAX; p++)
+    {
+        event_ring_t *ring = &event_rings[p];
+        for (int i = 0; i < EVENT_RING_SIZE; i++)
+        {
+            atomic_init(&ring->slots[i].seq, i);
+        }
+        atomic_init(&ring->head, 0);
+        ring->tail = 0;
+        atomic_init(&ring->overflow, NULL);
+        ring->skipped = ring->dispatched = ring->high_water = ring->starved = 0;
+    }
+}
+
+/**
+ * Claims a slot and publishes the callback into it.  Safe to call from any number of ISRs and tasks concurrently.
+ * Returns false if the ring is full.
+ */
+static bool event_ring_push(event_ring_t *ring, const lua_callback_t *cb)
+{
+    event_slot_t *slot;
+    unsigned int pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    for (;;)
+    {
+        slot = &ring->slots[pos & EVENT_RING_MASK];
+        unsigned int seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        int diff = (int)(seq - pos);
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&ring->head, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            return false;
+        }
+        else
+        {
+            pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        }
+    }
+    slot->cb = *cb;
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    return true;
+}
+
+/**
+ * Takes the next published callback off the ring.  Only ever called from the Lua task.
+ */
+static bool event_ring_pop(event_ring_t *ring, lua_callback_t *out)
+{
+    event_slot_t *slot = &ring->slots[ring->tail & EVENT_RING_MASK];
+    unsigned int seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    if ((int)(seq - (ring->tail + 1)) < 0)
+    {
+        // Either empty, or the producer that claimed this slot hasn't published it yet.  It will wake us when it has.
+        return false;
+    }
+    uint32_t depth = atomic_load_explicit(&ring->head, memory_order_relaxed) - ring->tail;
+    if (depth > ring->high_water)
+    {
+        ring->high_water = depth;
+    }
+    if (depth > event_stats.high_water)
+    {
+        event_stats.high_water = depth;
+    }
+    *out = slot->cb;
+    atomic_store_explicit(&slot->seq, ring->tail + EVENT_RING_SIZE, memory_order_release);
+    ring->tail++;
+    return true;
+}
+
+static bool event_ring_waiting(event_ring_t *ring)
+{
+    return atomic_load(&ring->head) != ring->tail || atomic_load(&ring->overflow);
+}
+
+/**
+ * The ring to serve next: the highest class with anything waiting, unless a lower one has been skipped too many times
+ * in a row, in which case the lowest such one.  NULL if there is nothing to do.
+ */
+static event_ring_t *event_ring_next()
+{
+    event_ring_t *next = NULL;
+    event_ring_t *starving = NULL;
+    for (int p = LUA_PRIORITY_MAX - 1; p >= 0; p--)
+    {
+        event_ring_t *ring = &event_rings[p];
+        if (!event_ring_waiting(ring))
+        {
+            continue;
+        }
+        if (!starving && ring->skipped >= CONFIG_CCPEED_EVENT_STARVATION_LIMIT)
+        {
+            starving = ring;
+        }
+        next = ring;
+    }
+    // Only a turn taken from a higher class that has something waiting counts; otherwise it would have been next anyway.
+    if (starving && starving != next)
+    {
+        starving->starved++;
+        return starving;
+    }
+    return next;
+}
+
+/**
+ * Notes that ring has been served, which counts as skipping every lower class that has something waiting.
+ */
+static void event_ring_served(event_ring_t *ring)
+{
+    ring->skipped = 0;
+    for (event_ring_t *lower = ring + 1; lower < &event_rings[LUA_PRIORITY_MAX]; lower++)
+    {
+        if (event_ring_waiting(lower))
+        {
+            lower->skipped++;
+        }
+    }
+}
+
+static void wake_lua_task(bool from_isr)
+{
+    if (!lua_task)
+    {
+        return;
+    }
+    if (from_isr)
+    {
+        BaseType_t higherPriorityTaskWoken = pdFALSE;
+        vTaskNotifyGiveFromISR(lua_task, &higherPriorityTaskWoken);
+        portYIELD_FROM_ISR(higherPriorityTaskWoken);
+    }
+    else
+    {
+        xTaskNotifyGive(lua_task);
+    }
+}
+
+void lua_event_source_init(lua_event_source_t *src, lua_source_type_t type, lua_priority_t priority,
+                           lua_callback_helper_t fn, void *ctx)
+{
+    src->fn = fn;
+    src->ctx = ctx;
+    src->type = type;
+    src->priority = priority;
+    src->raised_at = 0;
+    atomic_init(&src->pending, 0);
+    atomic_init(&src->queued, false);
+    src->overflow_next = NULL;
+    src->count = 0;
+}
+
+static void raise_event(lua_event_source_t *src, bool from_isr)
+{
+    atomic_fetch_add(&src->pending, 1);
+    if (atomic_exchange(&src->queued, true))
+    {
+        // Already waiting to be dispatched - it will pick this raise up in its count.
+        atomic_fetch_add_explicit(&event_stats.coalesced, 1, memory_order_relaxed);
+        return;
+    }
+    src->raised_at = esp_timer_get_time();
+    lua_callback_t cb = {
+        .fn = NULL,
+        .ctx = NULL,
+        .src = src,
+        .type = src->type,
+        .enqueued_at = src->raised_at};
+    event_ring_t *ring = &event_rings[src->priority];
+    if (!event_ring_push(ring, &cb))
+    {
+        // No room.  Park the source on the overflow list instead of dropping it.
+        atomic_fetch_add_explicit(&event_stats.overflows, 1, memory_order_relaxed);
+        lua_event_source_t *head = atomic_load(&ring->overflow);
+        do
+        {
+            src->overflow_next = head;
+        } while (!atomic_compare_exchange_weak(&ring->overflow, &head, src));
+    }
+    wake_lua_task(from_isr);
+}
+
+void schedule_event_from_ISR(lua_event_source_t *src)
+{
+    raise_event(src, true);
+}
+
+void schedule_event(lua_event_source_t *src)
+{
+    raise_event(src, false);
+}
+
+static bool push_callback(lua_source_type_t type, lua_priority_t priority, lua_callback_helper_t fn, void *ctx,
+                          bool from_isr)
 {
     lua_callback_t cb = {
         .fn = fn,
-        .ctx = ctx};
-    BaseType_t higherPriorityTaskWoken;
+        .ctx = ctx,
+        .src = NULL,
+        .type = type,
+        .enqueued_at = esp_timer_get_time()};
+
+    if (!event_ring_push(&event_rings[priority], &cb))
+    {
+        // There's nowhere to keep a plain callback, so it has to go.  Sources that must not be lost should use schedule_event_from_ISR.
+        atomic_fetch_add_explicit(&event_stats.overflows, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&event_stats.dropped, 1, memory_order_relaxed);
+        ESP_EARLY_LOGW(TAG, "Event queue full, dropping callback");
+        return false;
+    }
+    wake_lua_task(from_isr);
+    return true;
+}
+
+void schedule_callback_from_ISR(lua_priority_t priority, lua_callback_helper_t fn, void *ctx)
+{
+    push_callback(LUA_SOURCE_OTHER, priority, fn, ctx, true);
+}
+
+bool schedule_callback(lua_source_type_t type, lua_priority_t priority, lua_callback_helper_t fn, void *ctx)
+{
+    return push_callback(type, priority, fn, ctx, false);
+}
 
-    // If the task queue fills up, panic
-    assert(xQueueSendFromISR(callback_queue, &cb, &higherPriorityTaskWoken) == pdTRUE);
-    portYIELD_FROM_ISR(higherPriorityTaskWoken);
+static void dispatch_source(lua_State *L, lua_event_source_t *src)
+{
+    // Clear queued first, so that a raise that happens while we run gets a new entry rather than being lost.
+    atomic_store(&src->queued, false);
+    uint32_t count = atomic_exchange(&src->pending, 0);
+    if (count == 0)
+    {
+        // An earlier entry for this source already consumed the raises.
+        return;
+    }
+    src->count = count;
+    src->fn(L, src->ctx);
+}
+
+static lua_State *acquire_lua(lua_source_type_t source, int64_t enqueued_at)
+{
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    running_source = source;
+    running_since = esp_timer_get_time();
+    loop_stats_record_queued(source, running_since - enqueued_at);
+    lua_hooks_begin(source);
+    return L;
+}
+
+/**
+ * Whether there is anything for the Lua task to dispatch.  Used to cut idle work short.
+ */
+static bool events_waiting()
+{
+    for (int p = 0; p < LUA_PRIORITY_MAX; p++)
+    {
+        if (event_ring_waiting(&event_rings[p]))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Runs a slice of garbage collection, so that the collector's work gets done between events rather than during them.
+ * Returns true if there is more to do.
+ */
+static bool idle_collect()
+{
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    running_source = LUA_SOURCE_IDLE;
+    bool more = lua_gc_idle_step(L, events_waiting);
+    xSemaphoreGive(mutex);
+    return more;
+}
+
+static void dispatch_overflowed_sources(event_ring_t *ring)
+{
+    lua_event_source_t *src = atomic_exchange(&ring->overflow, NULL);
+    while (src)
+    {
+        lua_event_source_t *next = src->overflow_next;
+        src->overflow_next = NULL;
+        lua_State *L = acquire_lua(src->type, src->raised_at);
+        event_stats.dispatched++;
+        ring->dispatched++;
+        dispatch_source(L, src);
+        releaseLuaMutex();
+        src = next;
+    }
 }
 
 int code_str_to_int(const char *str, const code_lookup_t *lookup)
@@ -199,10 +565,21 @@ const char *lua_type_str(lua_State *L, int idx)
     return type_names[lua_type(L, idx)];
 }
 
-lua_State *acquireLuaMutex()
+/**
+ * Takes exclusive use of the Lua state, on behalf of the supplied source.  Time spent waiting and time spent holding
+ * the mutex are recorded against that source in the loop stats.
+ */
+lua_State *acquireLuaMutex(lua_source_type_t source)
 {
-    xSemaphoreTake(mutex, portMAX_DELAY);
-    return L;
+    return acquire_lua(source, esp_timer_get_time());
+}
+
+/**
+ * What type of event the Lua code that is running right now is handling.  Only meaningful with the mutex held.
+ */
+lua_source_type_t lua_running_source()
+{
+    return running_source;
 }
 
 void releaseLuaMutex()
@@ -213,6 +590,8 @@ void releaseLuaMutex()
         dumpStack(L);
         lua_settop(L, 0);
     }
+    lua_hooks_end();
+    loop_stats_record_run(running_source, esp_timer_get_time() - running_since);
     xSemaphoreGive(mutex);
 }
 
@@ -252,9 +631,45 @@ static int get_heap(lua_State *L)
     lua_pushstring(L, "total_allocated");
     lua_pushinteger(L, info.total_allocated_bytes);
     lua_settable(L, -3);
+
+    lua_pushstring(L, "largest_free_block");
+    lua_pushinteger(L, info.largest_free_block);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "lua");
+    lua_heap_push_stats(L);
+    lua_settable(L, -3);
+    return 1;
+}
+
+/**
+ * Returns the limit on memory used by Lua, in bytes (0 for none). If an argument is supplied, it becomes the new limit.
+ */
+static int heap_limit(lua_State *L)
+{
+    lua_Integer old = lua_heap_get_limit();
+    if (!lua_isnoneornil(L, 1))
+    {
+        lua_Integer limit = luaL_checkinteger(L, 1);
+        luaL_argcheck(L, limit >= 0, 1, "limit must not be negative");
+        lua_heap_set_limit(limit);
+    }
+    lua_pushinteger(L, old);
     return 1;
 }
 
+/**
+ * system.heap_peak([reset]) - returns the most memory Lua has had in use, in bytes, and what it has in use now.  With
+ * reset true, the peak is first brought down to what is in use now.  Doesn't allocate, so it can be called either side
+ * of something to measure it.
+ */
+static int heap_peak(lua_State *L)
+{
+    lua_pushinteger(L, lua_heap_get_peak(lua_toboolean(L, 1)));
+    lua_pushinteger(L, lua_gc(L, LUA_GCCOUNT, 0) * 1024 + lua_gc(L, LUA_GCCOUNTB, 0));
+    return 2;
+}
+
 bool get_int(lua_State *L, const char *fname, int *out, int default_value)
 {
     bool res = false;
@@ -331,6 +746,81 @@ static int lua_patch_io(lua_State *L)
     return 1;
 }
 
+static int get_event_stats(lua_State *L)
+{
+    lua_newtable(L);
+    lua_pushstring(L, "queue_size");
+    lua_pushinteger(L, EVENT_RING_SIZE);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "high_water");
+    lua_pushinteger(L, event_stats.high_water);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "dispatched");
+    lua_pushinteger(L, event_stats.dispatched);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "coalesced");
+    lua_pushinteger(L, atomic_load(&event_stats.coalesced));
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "overflows");
+    lua_pushinteger(L, atomic_load(&event_stats.overflows));
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "dropped");
+    lua_pushinteger(L, atomic_load(&event_stats.dropped));
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "classes");
+    lua_newtable(L);
+    for (int p = 0; p < LUA_PRIORITY_MAX; p++)
+    {
+        event_ring_t *ring = &event_rings[p];
+        lua_pushstring(L, code_int_to_str(p, priority_lookup));
+        lua_newtable(L);
+
+        lua_pushstring(L, "dispatched");
+        lua_pushinteger(L, ring->dispatched);
+        lua_settable(L, -3);
+
+        lua_pushstring(L, "high_water");
+        lua_pushinteger(L, ring->high_water);
+        lua_settable(L, -3);
+
+        lua_pushstring(L, "starved");
+        lua_pushinteger(L, ring->starved);
+        lua_settable(L, -3);
+
+        lua_settable(L, -3);
+    }
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "pool");
+    event_pool_push_stats(L);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "timers");
+    timer_wheel_push_stats(L);
+    lua_settable(L, -3);
+    return 1;
+}
+
+/**
+ * Returns latency histograms for each type of event source.  Pass true to reset them after they have been read.
+ */
+static int get_loop_stats(lua_State *L)
+{
+    bool reset = lua_toboolean(L, 1);
+    loop_stats_push(L);
+    if (reset)
+    {
+        loop_stats_reset();
+    }
+    return 1;
+}
+
 static int lua_uptime(lua_State *L)
 {
     long long num_secs = esp_timer_get_time() / 1000;
@@ -349,6 +839,15 @@ int luaopen_system(lua_State *L)
     lua_pushlstring(L, (char *)defaultMac, sizeof(defaultMac));
     lua_settable(L, -3);
 
+    // So that tools can check that precompiled images will be accepted.
+    lua_pushstring(L, "bytecode_fingerprint");
+    lua_pushinteger(L, lua_loader_fingerprint());
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "profiler");
+    luaopen_profiler(L);
+    lua_settable(L, -3);
+
     lua_pushstring(L, "reset_reason");
     lua_pushstring(L, code_int_to_str(esp_reset_reason(), reset_reason_lookup));
     lua_settable(L, -3);
@@ -406,8 +905,21 @@ static void load_custom_libs(lua_State *L)
     lua_pop(L, 1);
     luaL_requiref(L, "Timer", luaopen_timer, true);
     lua_pop(L, 1);
+    luaL_requiref(L, "Future", luaopen_future, true);
+    lua_pop(L, 1);
     luaL_requiref(L, "crypto", luaopen_crypto, true);
     lua_pop(L, 1);
+#ifdef CCPEED_HOST
+    luaL_requiref(L, "sim", luaopen_sim, true);
+    lua_pop(L, 1);
+#endif
+}
+
+static int lua_panic(lua_State *L)
+{
+    const char *msg = lua_tostring(L, -1);
+    ESP_LOGE(TAG, "Unprotected error in Lua: %s", msg ? msg : "(error object is not a string)");
+    return 0; // Lua will abort
 }
 
 void run_lua_loop()
@@ -418,9 +930,17 @@ void run_lua_loop()
     mutex = xSemaphoreCreateMutex();
     assert(mutex);
 
-    acquireLuaMutex();
+    // Set up the event queue before any Lua runs, as init.lua may well start timers and interrupts.
+    event_ring_init();
+    lua_task = xTaskGetCurrentTaskHandle();
+
+    acquireLuaMutex(LUA_SOURCE_BOOT);
 
-    L = luaL_newstate();
+#ifdef CCPEED_HOST
+    L = lua_newstate(host_alloc_trace(lua_heap_alloc), NULL);
+#else
+    L = lua_newstate(lua_heap_alloc, NULL);
+#endif
     // lua_task_t *coro;
     bool running = true;
 
@@ -429,11 +949,21 @@ void run_lua_loop()
         ESP_LOGE(TAG, "Could not create state\n");
         abort();
     }
+    lua_atpanic(L, lua_panic);
+    lua_hooks_init(L);
     luaL_openlibs(L);
+    lua_gc_init(L);
+    lua_loader_init(L);
+    lua_bundle_init(L);
     load_custom_libs(L);
 
-    ESP_LOGI(TAG, "Running '/fs/init.lua' from filesystem");
-    int r = luaL_loadfile(L, "/fs/init.lua");
+    int r = lua_bundle_load(L, "init");
+    if (r == LUA_ERRFILE)
+    {
+        lua_pop(L, 1);
+        ESP_LOGI(TAG, "Running '%s' from filesystem", CONFIG_LUA_ROOT "/init.lua");
+        r = lua_loader_loadfile(L, CONFIG_LUA_ROOT "/init.lua");
+    }
     if (r)
     {
         lua_report_error(L, r, "Parsing Error");
@@ -451,22 +981,44 @@ void run_lua_loop()
     }
     releaseLuaMutex();
 
-    callback_queue = xQueueCreate(10, sizeof(lua_callback_t));
-    assert(callback_queue);
-
     ESP_LOGI(TAG, "Waiting for code to initiate callbacks");
     lua_callback_t cb;
+    bool gc_pending = true;
     while (running)
     {
-        if (xQueueReceive(callback_queue, &cb, portMAX_DELAY))
+        event_ring_t *ring = event_ring_next();
+        if (!ring || !event_ring_pop(ring, &cb))
         {
-            lua_State *L = acquireLuaMutex();
-            if (cb.fn)
+            if (ring && atomic_load(&ring->overflow))
+            {
+                event_ring_served(ring);
+                dispatch_overflowed_sources(ring);
+            }
+            else
             {
-                cb.fn(L, cb.ctx);
+                if (gc_pending)
+                {
+                    gc_pending = idle_collect();
+                }
+                // While there is collection left to do, only wait a tick so that lower priority tasks get a look in.
+                ulTaskNotifyTake(pdTRUE, gc_pending ? 1 : portMAX_DELAY);
+                gc_pending = true;
             }
-            releaseLuaMutex();
+            continue;
+        }
+        event_ring_served(ring);
+        lua_State *L = acquire_lua(cb.src ? cb.src->type : cb.type, cb.enqueued_at);
+        event_stats.dispatched++;
+        ring->dispatched++;
+        if (cb.src)
+        {
+            dispatch_source(L, cb.src);
+        }
+        else if (cb.fn)
+        {
+            cb.fn(L, cb.ctx);
         }
+        releaseLuaMutex();
     }
 
     // Close down the LUA Context.
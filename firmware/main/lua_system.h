@@ -1,10 +1,13 @@
 #ifndef MAIN_SYSTEM_H_
 #define MAIN_SYSTEM_H_
 
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <lua/lua.h>
 #include <lua/lauxlib.h>
 #include <esp_err.h>
 #include "ccpeed_err.h"
+#include "loop_stats.h"
 
 #define LUA_ESP_ERR_CHECK(X) { int err = check_esp_err(L, X); if (err) return err; }
 
@@ -16,8 +19,50 @@ typedef struct {
 
 typedef void (*lua_callback_helper_t)(lua_State *L, void *ctx);
 
+/**
+ * The classes of event that the Lua task serves, most urgent first.  Whatever is waiting in the highest class goes
+ * next, except that a class that has been passed over CONFIG_CCPEED_EVENT_STARVATION_LIMIT times in a row gets a turn,
+ * so that a flood of one kind of event can delay the rest but never shut them out.  Within a class, events are served
+ * in the order that they were raised.
+ */
+typedef enum
+{
+    LUA_PRIORITY_INPUT,        // Somebody is waiting to see what happens (button presses...).
+    LUA_PRIORITY_NETWORK,      // Datagrams, DALI transactions.
+    LUA_PRIORITY_HOUSEKEEPING, // Timers, time sliced tasks and anything else.
+    LUA_PRIORITY_MAX,
+} lua_priority_t;
 
-void schedule_callback_from_ISR(lua_callback_helper_t fn, void *ctx);
+/**
+ * Something that raises events from an ISR (a timer, a GPIO pin...).  A source occupies at most one slot in the event
+ * queue - raising it again while it is still pending just increments the pending count, so a storm of interrupts gets
+ * merged into a single callback.  The callback can read the number of merged raises from `count`.
+ */
+typedef struct lua_event_source
+{
+    lua_callback_helper_t fn;
+    void *ctx;
+    lua_source_type_t type;
+    lua_priority_t priority;
+    int64_t raised_at;                // esp_timer time of the first raise that the queued entry stands for.
+    atomic_uint pending;              // Number of raises since the last dispatch.
+    atomic_bool queued;               // True while there is an entry for this source in the queue (or overflow list).
+    struct lua_event_source *overflow_next;
+    uint32_t count;                   // Number of raises merged into the current dispatch.  Only valid inside fn.
+} lua_event_source_t;
+
+void lua_event_source_init(lua_event_source_t *src, lua_source_type_t type, lua_priority_t priority,
+                           lua_callback_helper_t fn, void *ctx);
+void schedule_event_from_ISR(lua_event_source_t *src);
+void schedule_callback_from_ISR(lua_priority_t priority, lua_callback_helper_t fn, void *ctx);
+
+/**
+ * Task context versions of the above, for other tasks (OpenThread, DALI...) to hand work to the Lua task without ever
+ * waiting on it.  schedule_callback() returns false if the queue was full and the callback was dropped, in which case
+ * the caller still owns ctx.
+ */
+void schedule_event(lua_event_source_t *src);
+bool schedule_callback(lua_source_type_t type, lua_priority_t priority, lua_callback_helper_t fn, void *ctx);
 
 void run_lua_loop();
 void lua_report_error(lua_State *L, int status, const char *prefix);
@@ -25,8 +70,9 @@ void dumpStack(lua_State *L);
 const char *lua_type_str(lua_State *L, int idx);
 
 
-lua_State *acquireLuaMutex();
+lua_State *acquireLuaMutex(lua_source_type_t source);
 void releaseLuaMutex();
+lua_source_type_t lua_running_source();
 ccpeed_err_t lua_execute_callback(int fnRef, int nArgs);
 int check_esp_err(lua_State *L, esp_err_t err);
 
@@ -1,30 +1,81 @@
-#include <freertos/FreeRTOS.h>
-#include <esp_timer.h>
 #include <esp_log.h>
 #include <string.h>
 #include <lua/lua.h>
 #include <lua/lauxlib.h>
 #include <lua/lualib.h>
 #include "lua_system.h"
+#include "lua_await.h"
+#include "lua_future.h"
+#include "lua_timer.h"
+#include "timer_wheel.h"
 
 #define TAG "timer"
+#define TIMER_CLASS "Timer"
 
+/**
+ * A Timer is a userdata, with a table of its fields (on_timeout, and anything else that Lua code hangs off it) as its
+ * user value.  The timer wheel only has a plain pointer to it, so while it is armed it is pinned in the registry - an
+ * armed timer will call back, so it can't be garbage - and as soon as it is stopped or has fired for the last time it
+ * is unpinned, and is collected like anything else once Lua has forgotten about it.
+ */
 typedef struct
 {
-    esp_timer_handle_t timer;
-    int timerRef;
+    timer_wheel_entry_t entry;
+    int selfRef;           // Set while armed.
+    lua_awaiter_t sleeper; // A task in Timer:sleep(), which gets the timeout instead of on_timeout.
+    bool deleted;
 } lua_timer_userdata_t;
 
+static void pin(lua_State *L, lua_timer_userdata_t *ud, int idx)
+{
+    if (ud->selfRef == LUA_NOREF)
+    {
+        lua_pushvalue(L, idx);
+        ud->selfRef = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+}
+
+static void unpin(lua_State *L, lua_timer_userdata_t *ud)
+{
+    luaL_unref(L, LUA_REGISTRYINDEX, ud->selfRef);
+    ud->selfRef = LUA_NOREF;
+}
+
+static void start(lua_State *L, lua_timer_userdata_t *ud, int idx, uint32_t delay_ms, uint32_t period_ms)
+{
+    pin(L, ud, idx);
+    timer_wheel_start(&ud->entry, delay_ms, period_ms);
+}
+
 /**
- * Ran on the main lua thread from a queue.
+ * Ran on the main lua thread by the timer wheel.
  */
-static void timer_callback(lua_State *L, void *ctx)
+static void timer_expired(lua_State *L, void *ctx, uint32_t count)
 {
     lua_timer_userdata_t *ud = (lua_timer_userdata_t *)ctx;
-    lua_rawgeti(L, LUA_REGISTRYINDEX, ud->timerRef);
+    // Held on the stack while it runs, as it's no longer pinned unless it goes round again.
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ud->selfRef);
+    if (!timer_wheel_is_armed(&ud->entry))
+    {
+        unpin(L, ud);
+    }
+    if (lua_await_pending(&ud->sleeper))
+    {
+        lua_pushboolean(L, true);
+        lua_await_resume(L, &ud->sleeper, 1);
+        lua_pop(L, 1);
+        return;
+    }
     lua_getfield(L, -1, "on_timeout");
+    if (!lua_isfunction(L, -1))
+    {
+        // Only used for sleeping, and nobody is.
+        lua_pop(L, 2);
+        return;
+    }
     lua_pushvalue(L, -2); // Pass self as an argument
-    if (lua_pcall(L, 1, 0, 0))
+    lua_pushinteger(L, count); // Number of expiries merged into this call (for periodic timers running behind)
+    if (lua_pcall(L, 2, 0, 0))
     {
         ESP_LOGE(TAG, "Error running timer callback: %s", lua_tostring(L, -1));
         lua_pop(L, 1);
@@ -32,129 +83,200 @@ static void timer_callback(lua_State *L, void *ctx)
     lua_pop(L, 1); // Pop self.
 }
 
-static void timer_fired(void *arg)
-{
-    schedule_callback_from_ISR(timer_callback, arg);
-}
-
-lua_timer_userdata_t *get_timer_userdata(lua_State *L, int argidx)
+static lua_timer_userdata_t *get_timer_userdata(lua_State *L, int argidx)
 {
-    lua_getfield(L, 1, "_t");
-    lua_timer_userdata_t *ud = (lua_timer_userdata_t *)lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    lua_timer_userdata_t *ud = (lua_timer_userdata_t *)luaL_checkudata(L, argidx, TIMER_CLASS);
+    if (ud->deleted)
+    {
+        luaL_argerror(L, argidx, "Expected a Timer that hasn't been deleted");
+    }
     return ud;
 }
 
-int start_timer(lua_State *L)
+static int check_delay(lua_State *L, int idx)
 {
     int isnum;
-    int delayMs = lua_tointegerx(L, 2, &isnum);
-    bool repeat = false;
-
-    if (!lua_istable(L, 1))
-    {
-        luaL_argerror(L, 1, "Expected table (self) in first arg");
-        return 1;
-    }
-
+    int delayMs = lua_tointegerx(L, idx, &isnum);
     if (!isnum || delayMs < 0)
     {
-        luaL_argerror(L, 2, "Expected a positive number of milliseconds");
-        return 1;
+        luaL_argerror(L, idx, "Expected a positive number of milliseconds");
     }
-    repeat = lua_toboolean(L, 3);
+    return delayMs;
+}
 
+/**
+ * Timer:start(delay, [repeat]) - starts the timer, or starts it again from now if it is already running.
+ */
+int start_timer(lua_State *L)
+{
     lua_timer_userdata_t *ud = get_timer_userdata(L, 1);
-    if (repeat)
-    {
-        LUA_ESP_ERR_CHECK(esp_timer_start_periodic(ud->timer, delayMs * 1000));
-    }
-    else
-    {
-        LUA_ESP_ERR_CHECK(esp_timer_start_once(ud->timer, delayMs * 1000));
-    }
+    int delayMs = check_delay(L, 2);
+    bool repeat = lua_toboolean(L, 3);
+    luaL_argcheck(L, !repeat || delayMs > 0, 2, "A repeating timer needs a period of at least 1ms");
+    start(L, ud, 1, delayMs, repeat ? delayMs : 0);
     return 0;
 }
 
+/**
+ * Timer:restart(delay) - starts the timer again from now, keeping it repeating (with the new period) if it was.
+ */
 int restart_timer(lua_State *L)
 {
-    int isnum;
-    int delayMs = lua_tointegerx(L, 2, &isnum);
-    if (!lua_istable(L, 1))
-    {
-        luaL_argerror(L, 1, "Expected table (self) in first arg");
-        return 1;
-    }
-    if (!isnum || delayMs < 0)
+    lua_timer_userdata_t *ud = get_timer_userdata(L, 1);
+    int delayMs = check_delay(L, 2);
+    bool repeat = timer_wheel_is_armed(&ud->entry) && ud->entry.period;
+    luaL_argcheck(L, !repeat || delayMs > 0, 2, "A repeating timer needs a period of at least 1ms");
+    start(L, ud, 1, delayMs, repeat ? delayMs : 0);
+    return 0;
+}
+
+/**
+ * Suspends the calling task for the given number of milliseconds.  Returns true once the time is up, or false if the
+ * timer was stopped first.
+ */
+int sleep_timer(lua_State *L)
+{
+    lua_timer_userdata_t *ud = get_timer_userdata(L, 1);
+    int delayMs = check_delay(L, 2);
+    lua_await_check(L, &ud->sleeper);
+    start(L, ud, 1, delayMs, 0);
+    return lua_await(L, &ud->sleeper);
+}
+
+/**
+ * Wakes up a task sleeping on the timer, if there is one.
+ */
+static void cancel_sleep(lua_State *L, lua_timer_userdata_t *ud)
+{
+    if (lua_await_pending(&ud->sleeper))
     {
-        luaL_argerror(L, 2, "Expected a positive number of milliseconds");
-        return 1;
+        lua_pushboolean(L, false);
+        lua_await_resume(L, &ud->sleeper, 1);
     }
+}
+
+static void stop(lua_State *L, lua_timer_userdata_t *ud)
+{
+    timer_wheel_stop(&ud->entry);
+    unpin(L, ud);
+    cancel_sleep(L, ud);
+}
+
+int stop_timer(lua_State *L)
+{
+    stop(L, get_timer_userdata(L, 1));
+    return 0;
+}
+
+/**
+ * Stops the timer for good.  Timers no longer need deleting, as they are collected once they are stopped and
+ * forgotten about, but it's still useful to make sure that nothing uses one again.
+ */
+int delete_timer(lua_State *L)
+{
     lua_timer_userdata_t *ud = get_timer_userdata(L, 1);
-    LUA_ESP_ERR_CHECK(esp_timer_restart(ud->timer, delayMs * 1000));
+    ud->deleted = true; // All subsequent calls will then fail.
+    stop(L, ud);
     return 0;
 }
 
-int stop_timer(lua_State *L)
+/**
+ * __close - deletes the timer when a to-be-closed variable holding it goes out of scope.
+ */
+static int close_timer(lua_State *L)
 {
-    if (!lua_istable(L, 1))
+    lua_timer_userdata_t *ud = (lua_timer_userdata_t *)luaL_checkudata(L, 1, TIMER_CLASS);
+    if (!ud->deleted)
     {
-        luaL_argerror(L, 1, "Expected table (self) in first arg");
-        return 1;
+        ud->deleted = true;
+        stop(L, ud);
     }
-    lua_timer_userdata_t *ud = get_timer_userdata(L, 1);
-    LUA_ESP_ERR_CHECK(esp_timer_stop(ud->timer));
     return 0;
 }
 
-int delete_timer(lua_State *L)
+/**
+ * __gc.  A timer that is garbage can't be armed, as it would be pinned, except when the state is being closed, and
+ * then all there is to do is to take it out of the wheel.
+ */
+static int gc_timer(lua_State *L)
 {
-    if (!lua_istable(L, 1))
+    lua_timer_userdata_t *ud = (lua_timer_userdata_t *)lua_touserdata(L, 1);
+    timer_wheel_stop(&ud->entry);
+    return 0;
+}
+
+static int timer_index(lua_State *L)
+{
+    if (lua_getiuservalue(L, 1, 1) == LUA_TTABLE)
     {
-        luaL_argerror(L, 1, "Expected table (self) in first arg");
-        return 1;
+        lua_pushvalue(L, 2);
+        if (lua_rawget(L, -2) != LUA_TNIL)
+        {
+            return 1;
+        }
+        lua_pop(L, 1);
     }
-    lua_timer_userdata_t *ud = get_timer_userdata(L, 1);
-    LUA_ESP_ERR_CHECK(esp_timer_delete(ud->timer));
-    ud->timer = 0; // This should be an invalid value, so all subsequent calls will then fail.
+    lua_pop(L, 1);
+    // Then the methods.
+    lua_getmetatable(L, 1);
+    lua_pushvalue(L, 2);
+    lua_rawget(L, -2);
+    return 1;
+}
+
+static int timer_newindex(lua_State *L)
+{
+    if (lua_getiuservalue(L, 1, 1) != LUA_TTABLE)
+    {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_setiuservalue(L, 1, 1);
+    }
+    lua_insert(L, 2);
+    lua_rawset(L, 2);
     return 0;
 }
 
+/**
+ * Timer:new([on_timeout]) - on_timeout(timer, count) is called when it expires.
+ */
 int lua_timer_new(lua_State *L)
 {
     if (!lua_istable(L, 1))
     {
         luaL_argerror(L, 1, "Expected new to be called as a class method");
     }
-    if (!lua_isfunction(L, 2))
+    if (!lua_isfunction(L, 2) && !lua_isnoneornil(L, 2))
     {
-        luaL_argerror(L, 2, "Expected function argument");
+        luaL_argerror(L, 2, "Expected function argument, or nothing for a timer that is only slept on");
     }
 
-    lua_newtable(L); // Our timer object
-    lua_pushstring(L, "_t");
-    lua_timer_userdata_t *ud = lua_newuserdata(L, sizeof(lua_timer_userdata_t));
-    lua_settable(L, -3);
-
-    // Create the timer
-    esp_timer_create_args_t args = {
-        .callback = timer_fired,
-        .arg = ud,
-        .name = NULL,
-        .dispatch_method = ESP_TIMER_ISR};
-    LUA_ESP_ERR_CHECK(esp_timer_create(&args, &ud->timer));
+    lua_timer_userdata_t *ud = (lua_timer_userdata_t *)lua_newuserdatauv(L, sizeof(lua_timer_userdata_t), 1);
+    timer_wheel_entry_init(&ud->entry, timer_expired, ud);
+    ud->selfRef = LUA_NOREF;
+    lua_awaiter_init(&ud->sleeper);
+    ud->deleted = false;
+    luaL_setmetatable(L, TIMER_CLASS);
 
-    lua_pushstring(L, "on_timeout");
-    lua_pushvalue(L, 2);
-    lua_settable(L, -3);
-
-    // Make this object a class, using "self" (which should be Timer) as its meta-ref
-    lua_pushvalue(L, 1);
-    lua_setmetatable(L, -2);
+    if (lua_isfunction(L, 2))
+    {
+        lua_newtable(L);
+        lua_pushvalue(L, 2);
+        lua_setfield(L, -2, "on_timeout");
+        lua_setiuservalue(L, -2, 1);
+    }
+    return 1;
+}
 
-    // Duplicate it so that we can take a ref
-    lua_pushvalue(L, -1);
-    ud->timerRef = luaL_ref(L, LUA_REGISTRYINDEX);
+/**
+ * Timer:defer(delay, [value]) - a future that is set to value after delay milliseconds, the same as Future:defer().
+ * Deferred futures have their own place in the timer wheel, so this no longer needs to borrow the timer.
+ */
+static int defer_timer(lua_State *L)
+{
+    get_timer_userdata(L, 1);
+    lua_future_push_deferred(L, check_delay(L, 2), lua_isnone(L, 3) ? 0 : 3);
     return 1;
 }
 
@@ -165,15 +287,20 @@ static const struct luaL_Reg funcs[] = {
     {"stop", stop_timer},
     {"restart", restart_timer},
     {"delete", delete_timer},
+    {"sleep", sleep_timer},
+    {"defer", defer_timer},
+    {"__index", timer_index},
+    {"__newindex", timer_newindex},
+    {"__gc", gc_timer},
+    {"__close", close_timer},
     {NULL, NULL}
 
 };
 
 int luaopen_timer(lua_State *L)
 {
-    luaL_newlib(L, funcs);
-
-    lua_pushvalue(L, -1);
-    lua_setfield(L, -2, "__index");
+    // Timer is the metatable of timers, so getmetatable(t) == Timer as before.
+    luaL_newmetatable(L, TIMER_CLASS);
+    luaL_setfuncs(L, funcs, 0);
     return 1;
 }
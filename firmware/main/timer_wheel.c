@@ -0,0 +1,399 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <lua/lua.h>
+#include <esp_timer.h>
+#include <esp_log.h>
+#include "lua_system.h"
+#include "timer_wheel.h"
+
+#define TAG "timer_wheel"
+
+/**
+ * A tick is a millisecond.  Four wheels of 64 slots cover 2^24 ticks (about four and a half hours) - anything further
+ * out sits in the top wheel and is put back when its slot comes round, until it is close enough.
+ *
+ * This is the scheme of William Ahern's timeout.c.  Entries are kept by absolute expiry, in the lowest wheel whose span
+ * covers the time remaining.  A slot in a higher wheel is emptied a rotation early, when its entries are put back into
+ * lower wheels, so nothing ever has to be moved until it is nearly due.  Each wheel has a bitmap of the slots that
+ * aren't empty, so that both advancing the clock over a long gap and finding the next deadline only look at the slots
+ * that have anything in them.
+ */
+#define US_PER_TICK 1000
+#define WHEEL_BIT 6
+#define WHEEL_LEN (1 << WHEEL_BIT)
+#define WHEEL_MASK (WHEEL_LEN - 1)
+#define WHEEL_NUM 4
+#define TIMEOUT_MAX ((UINT64_C(1) << (WHEEL_BIT * WHEEL_NUM)) - 1)
+
+typedef struct
+{
+    uint32_t armed;      // Entries armed right now.
+    uint32_t high_water; // Most entries that have been armed at once.
+    uint32_t expired;    // Expiries run.
+    uint32_t dispatches; // Times the hardware timer has woken the Lua task.
+    uint32_t programmed; // Times the hardware timer has been (re)armed.
+} wheel_stats_t;
+
+static struct
+{
+    bool initialised;
+    timer_wheel_link_t slots[WHEEL_NUM][WHEEL_LEN];
+    uint64_t pending[WHEEL_NUM]; // Bit n set means slots[wheel][n] isn't empty.
+    timer_wheel_link_t expired;  // Entries that are due, waiting to be run.
+    uint64_t now;                // Tick up to which the wheels have been advanced.
+    uint64_t deadline;           // Tick that the hardware timer is armed for, or UINT64_MAX.
+    esp_timer_handle_t hw;
+    lua_event_source_t event;
+} wheel;
+
+static wheel_stats_t stats;
+
+static inline uint64_t rotl(uint64_t v, int c)
+{
+    c &= 63;
+    return c ? (v << c) | (v >> (64 - c)) : v;
+}
+
+static inline uint64_t rotr(uint64_t v, int c)
+{
+    c &= 63;
+    return c ? (v >> c) | (v << (64 - c)) : v;
+}
+
+static inline void list_init(timer_wheel_link_t *l)
+{
+    l->next = l->prev = l;
+}
+
+static inline bool list_empty(const timer_wheel_link_t *l)
+{
+    return l->next == l;
+}
+
+static inline void list_append(timer_wheel_link_t *l, timer_wheel_link_t *n)
+{
+    n->prev = l->prev;
+    n->next = l;
+    l->prev->next = n;
+    l->prev = n;
+}
+
+static inline void list_remove(timer_wheel_link_t *n)
+{
+    n->prev->next = n->next;
+    n->next->prev = n->prev;
+}
+
+/**
+ * Moves everything in from onto the end of to.
+ */
+static void list_splice(timer_wheel_link_t *to, timer_wheel_link_t *from)
+{
+    if (list_empty(from))
+    {
+        return;
+    }
+    from->next->prev = to->prev;
+    to->prev->next = from->next;
+    from->prev->next = to;
+    to->prev = from->prev;
+    list_init(from);
+}
+
+static uint64_t now_ticks(void)
+{
+    return (uint64_t)esp_timer_get_time() / US_PER_TICK;
+}
+
+static void unlink_entry(timer_wheel_entry_t *e)
+{
+    list_remove(&e->link);
+    if (e->list != &wheel.expired && list_empty(e->list))
+    {
+        ptrdiff_t index = e->list - &wheel.slots[0][0];
+        wheel.pending[index / WHEEL_LEN] &= ~(UINT64_C(1) << (index % WHEEL_LEN));
+    }
+    e->list = NULL;
+}
+
+/**
+ * Puts an entry that isn't on any list into the wheel that its expiry belongs in, or on the expired list if it's due.
+ */
+static void sched(timer_wheel_entry_t *e)
+{
+    if (e->expires > wheel.now)
+    {
+        uint64_t rem = e->expires - wheel.now;
+        int w = (63 - __builtin_clzll(rem < TIMEOUT_MAX ? rem : TIMEOUT_MAX)) / WHEEL_BIT;
+        int slot = WHEEL_MASK & ((e->expires >> (w * WHEEL_BIT)) - (w ? 1 : 0));
+        e->list = &wheel.slots[w][slot];
+        wheel.pending[w] |= UINT64_C(1) << slot;
+    }
+    else
+    {
+        e->list = &wheel.expired;
+    }
+    list_append(e->list, &e->link);
+}
+
+/**
+ * Advances the wheels to now.  Every slot passed over is emptied, and its entries either go on the expired list or,
+ * for those from higher wheels that aren't due yet, back into a lower wheel.
+ */
+static void advance(uint64_t now)
+{
+    uint64_t elapsed = now - wheel.now;
+    timer_wheel_link_t todo;
+    list_init(&todo);
+
+    for (int w = 0; w < WHEEL_NUM; w++)
+    {
+        uint64_t passed;
+        if ((elapsed >> (w * WHEEL_BIT)) > WHEEL_MASK)
+        {
+            passed = ~UINT64_C(0);
+        }
+        else
+        {
+            // The slots from the last one processed (inclusive) round to the current one.
+            int n = WHEEL_MASK & (elapsed >> (w * WHEEL_BIT));
+            int oslot = WHEEL_MASK & (wheel.now >> (w * WHEEL_BIT));
+            int nslot = WHEEL_MASK & (now >> (w * WHEEL_BIT));
+            passed = rotl((UINT64_C(1) << n) - 1, oslot);
+            passed |= rotr(rotl((UINT64_C(1) << n) - 1, nslot), n);
+            passed |= UINT64_C(1) << nslot;
+        }
+        while (passed & wheel.pending[w])
+        {
+            int slot = __builtin_ctzll(passed & wheel.pending[w]);
+            list_splice(&todo, &wheel.slots[w][slot]);
+            wheel.pending[w] &= ~(UINT64_C(1) << slot);
+        }
+        if (!(passed & 1))
+        {
+            // This wheel didn't wrap round, so the ones above it haven't moved.
+            break;
+        }
+        if (elapsed < ((uint64_t)WHEEL_LEN << (w * WHEEL_BIT)))
+        {
+            elapsed = (uint64_t)WHEEL_LEN << (w * WHEEL_BIT);
+        }
+    }
+
+    wheel.now = now;
+    while (!list_empty(&todo))
+    {
+        timer_wheel_entry_t *e = (timer_wheel_entry_t *)todo.next;
+        list_remove(&e->link);
+        sched(e);
+    }
+}
+
+/**
+ * Ticks from wheel.now until the wheels next need looking at - either something expires, or a slot of a higher wheel
+ * needs emptying into the lower ones.  UINT64_MAX if there's nothing armed.
+ */
+static uint64_t next_timeout(void)
+{
+    uint64_t timeout = UINT64_MAX;
+    uint64_t relmask = 0;
+    for (int w = 0; w < WHEEL_NUM; w++)
+    {
+        if (wheel.pending[w])
+        {
+            int slot = WHEEL_MASK & (wheel.now >> (w * WHEEL_BIT));
+            // Higher wheels are a rotation ahead, otherwise the entries would be in a lower wheel or expired.
+            uint64_t t = (uint64_t)(__builtin_ctzll(rotr(wheel.pending[w], slot)) + (w ? 1 : 0)) << (w * WHEEL_BIT);
+            // Less however far the lower wheels have got.
+            t -= relmask & wheel.now;
+            if (t < timeout)
+            {
+                timeout = t;
+            }
+        }
+        relmask = (relmask << WHEEL_BIT) | WHEEL_MASK;
+    }
+    return timeout;
+}
+
+static void program(uint64_t tick)
+{
+    esp_timer_stop(wheel.hw);
+    int64_t delay = (int64_t)(tick * US_PER_TICK) - esp_timer_get_time();
+    esp_err_t err = esp_timer_start_once(wheel.hw, delay > 0 ? delay : 0);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Couldn't arm the timer: %s", esp_err_to_name(err));
+        wheel.deadline = UINT64_MAX;
+        return;
+    }
+    wheel.deadline = tick;
+    stats.programmed++;
+}
+
+static void rearm(void)
+{
+    uint64_t next = UINT64_MAX;
+    if (!list_empty(&wheel.expired))
+    {
+        next = wheel.now;
+    }
+    else
+    {
+        uint64_t timeout = next_timeout();
+        if (timeout != UINT64_MAX)
+        {
+            next = wheel.now + timeout;
+        }
+    }
+    if (next == UINT64_MAX)
+    {
+        esp_timer_stop(wheel.hw);
+        wheel.deadline = UINT64_MAX;
+        return;
+    }
+    program(next);
+}
+
+/**
+ * Ran on the main lua thread from a queue when the hardware timer fires.  Runs everything that is due, then arms the
+ * timer for whatever is next.
+ */
+static void dispatch(lua_State *L, void *ctx)
+{
+    stats.dispatches++;
+    wheel.deadline = UINT64_MAX;
+    uint64_t now = now_ticks();
+    advance(now);
+
+    // Entries that become due while these run (started with no delay, say) wait for the next dispatch, so that one
+    // can't keep the Lua task here forever.
+    timer_wheel_link_t due;
+    list_init(&due);
+    list_splice(&due, &wheel.expired);
+    while (!list_empty(&due))
+    {
+        timer_wheel_entry_t *e = (timer_wheel_entry_t *)due.next;
+        list_remove(&e->link);
+        e->list = NULL;
+        uint32_t count = 1;
+        if (e->period)
+        {
+            uint64_t next = e->expires + e->period;
+            if (next <= now)
+            {
+                // Fallen behind, so merge the expiries that were missed into this one.
+                uint64_t behind = (now - next) / e->period + 1;
+                count += behind;
+                next += behind * e->period;
+            }
+            e->expires = next;
+            sched(e);
+        }
+        else
+        {
+            stats.armed--;
+        }
+        stats.expired++;
+        e->fn(L, e->ctx, count);
+    }
+    rearm();
+}
+
+static void hw_fired(void *arg)
+{
+    schedule_event_from_ISR(&wheel.event);
+}
+
+static void init_wheel(void)
+{
+    for (int w = 0; w < WHEEL_NUM; w++)
+    {
+        for (int s = 0; s < WHEEL_LEN; s++)
+        {
+            list_init(&wheel.slots[w][s]);
+        }
+    }
+    list_init(&wheel.expired);
+    wheel.now = now_ticks();
+    wheel.deadline = UINT64_MAX;
+    lua_event_source_init(&wheel.event, LUA_SOURCE_TIMER, LUA_PRIORITY_HOUSEKEEPING, dispatch, NULL);
+
+    esp_timer_create_args_t args = {
+        .callback = hw_fired,
+        .arg = NULL,
+        .name = "timer_wheel",
+        .dispatch_method = ESP_TIMER_ISR};
+    ESP_ERROR_CHECK(esp_timer_create(&args, &wheel.hw));
+    wheel.initialised = true;
+}
+
+void timer_wheel_entry_init(timer_wheel_entry_t *e, timer_wheel_fn_t fn, void *ctx)
+{
+    e->link.next = e->link.prev = NULL;
+    e->list = NULL;
+    e->expires = 0;
+    e->period = 0;
+    e->fn = fn;
+    e->ctx = ctx;
+}
+
+void timer_wheel_start(timer_wheel_entry_t *e, uint32_t delay_ms, uint32_t period_ms)
+{
+    if (!wheel.initialised)
+    {
+        init_wheel();
+    }
+    if (e->list)
+    {
+        unlink_entry(e);
+    }
+    else if (++stats.armed > stats.high_water)
+    {
+        stats.high_water = stats.armed;
+    }
+    // Rounded up to the next tick, so that it never fires early.
+    e->expires = ((uint64_t)esp_timer_get_time() + US_PER_TICK - 1) / US_PER_TICK + delay_ms;
+    e->period = period_ms;
+    sched(e);
+    // Waking up at the exact expiry, rather than when the wheels would next need looking at, is fine: advancing then
+    // takes care of any slots of higher wheels on the way.
+    if (e->expires < wheel.deadline)
+    {
+        program(e->expires);
+    }
+}
+
+void timer_wheel_stop(timer_wheel_entry_t *e)
+{
+    if (e->list)
+    {
+        unlink_entry(e);
+        stats.armed--;
+    }
+    // The hardware timer is left alone.  If this was the next thing due, it just wakes up to find nothing to do.
+}
+
+void timer_wheel_push_stats(lua_State *L)
+{
+    lua_newtable(L);
+    lua_pushstring(L, "armed");
+    lua_pushinteger(L, stats.armed);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "high_water");
+    lua_pushinteger(L, stats.high_water);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "expired");
+    lua_pushinteger(L, stats.expired);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "dispatches");
+    lua_pushinteger(L, stats.dispatches);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "programmed");
+    lua_pushinteger(L, stats.programmed);
+    lua_settable(L, -3);
+}
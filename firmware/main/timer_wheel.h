@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <lua/lua.h>
+
+/**
+ * Timers for the Lua task, kept in a hierarchical timer wheel that is driven by a single esp_timer.  The entries are
+ * embedded in whatever owns them (a Timer, a deferred future...) so starting and stopping never touches the heap, and
+ * start, stop and restart are O(1).  The hardware timer is only armed for the next deadline, and when it fires every
+ * entry that is due is run in one go on the Lua task, so expiries never queue individually.
+ *
+ * Everything here must only be called from the Lua task.
+ */
+typedef struct timer_wheel_link
+{
+    struct timer_wheel_link *next;
+    struct timer_wheel_link *prev;
+} timer_wheel_link_t;
+
+/**
+ * Called on the Lua task when an entry expires.  count is the number of expiries that it stands for, which is more than
+ * one for a periodic entry that has fallen behind.  The entry (or any other) may be started or stopped from inside, but
+ * it must not raise errors.
+ */
+typedef void (*timer_wheel_fn_t)(lua_State *L, void *ctx, uint32_t count);
+
+typedef struct
+{
+    timer_wheel_link_t link;  // Must be first.
+    timer_wheel_link_t *list; // The slot or list it's on, or NULL when it isn't armed.
+    uint64_t expires;         // In ticks.
+    uint32_t period;          // In ticks, 0 for a one shot.
+    timer_wheel_fn_t fn;
+    void *ctx;
+} timer_wheel_entry_t;
+
+void timer_wheel_entry_init(timer_wheel_entry_t *e, timer_wheel_fn_t fn, void *ctx);
+
+/**
+ * (Re)arms the entry to expire after delay_ms, and then every period_ms if that isn't 0.  Never fires early.
+ */
+void timer_wheel_start(timer_wheel_entry_t *e, uint32_t delay_ms, uint32_t period_ms);
+void timer_wheel_stop(timer_wheel_entry_t *e);
+
+static inline bool timer_wheel_is_armed(const timer_wheel_entry_t *e)
+{
+    return e->list != NULL;
+}
+
+void timer_wheel_push_stats(lua_State *L);
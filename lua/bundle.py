@@ -0,0 +1,137 @@
+#!/usr/bin/env python
+"""
+Builds and checks module bundles - a flash partition image holding precompiled Lua modules that the firmware maps and
+loads in place (see firmware/main/lua_bundle.h for the layout).  Modules are named after their files, so init.lua
+becomes "init" and coap.lua becomes "coap".
+"""
+import argparse
+import os
+import struct
+import subprocess
+import sys
+import zlib
+from os.path import join
+
+from compile import compile_file, fingerprint, MAGIC as IMAGE_MAGIC
+
+MAGIC = b'CCLB'
+VERSION = 1
+HEADER = struct.Struct('<4sB3xIIII')
+ENTRY = struct.Struct('<IIII')
+IMAGE_HEADER_SIZE = 16
+PARTITION_SIZE = 0x100000
+
+
+def align4(n):
+    return (n + 3) & ~3
+
+
+def load_modules(srcdir, luac):
+    """ Returns a sorted list of (name, chunk), compiling sources and unwrapping .luac images as needed """
+    files = {}
+    for fname in sorted(os.listdir(srcdir)):
+        name, ext = os.path.splitext(fname)
+        # An image takes precedence over its source, just as it does on the device
+        if ext == '.luac' or (ext == '.lua' and name not in files):
+            files[name] = fname
+
+    modules = []
+    for name, fname in sorted(files.items()):
+        path = join(srcdir, fname)
+        if fname.endswith('.luac'):
+            with open(path, 'rb') as f:
+                data = f.read()
+            if data[:4] != IMAGE_MAGIC:
+                raise ValueError('{} is not a bytecode image'.format(fname))
+            chunk = data[IMAGE_HEADER_SIZE:]
+        else:
+            chunk = compile_file(luac, path)
+        modules.append((name.encode(), chunk))
+    return sorted(modules)
+
+
+def build(modules):
+    fingerprints = set(fingerprint(chunk) for _, chunk in modules)
+    if len(fingerprints) != 1:
+        raise ValueError('modules were compiled by different Lua builds')
+
+    names_offset = HEADER.size + ENTRY.size * len(modules)
+    names = b''.join(name for name, _ in modules)
+    offset = align4(names_offset + len(names))
+    index = b''
+    chunks = b''
+    name_offset = names_offset
+    for name, chunk in modules:
+        index += ENTRY.pack(name_offset, len(name), offset + len(chunks), len(chunk))
+        name_offset += len(name)
+        chunks += chunk + b'\0' * (align4(len(chunk)) - len(chunk))
+    body = index + names + b'\0' * (offset - names_offset - len(names)) + chunks
+    header = HEADER.pack(MAGIC, VERSION, fingerprints.pop(), len(modules), HEADER.size + len(body), zlib.crc32(body))
+    return header + body
+
+
+def verify(data, expected_fingerprint=None):
+    """ Checks a bundle, returning its fingerprint and a list of (name, chunk length).  Raises ValueError if broken """
+    magic, version, fp, count, size, crc = HEADER.unpack_from(data)
+    if magic != MAGIC:
+        raise ValueError('not a bundle')
+    if version != VERSION:
+        raise ValueError('unsupported bundle version {}'.format(version))
+    if size > len(data) or size > PARTITION_SIZE:
+        raise ValueError('bundle size {} is invalid'.format(size))
+    if zlib.crc32(data[HEADER.size:size]) != crc:
+        raise ValueError('bad CRC')
+    if expected_fingerprint is not None and fp != expected_fingerprint:
+        raise ValueError('fingerprint {:08x} does not match {:08x}'.format(fp, expected_fingerprint))
+
+    modules = []
+    for i in range(count):
+        name_off, name_len, chunk_off, chunk_len = ENTRY.unpack_from(data, HEADER.size + i * ENTRY.size)
+        if name_off + name_len > size or chunk_off + chunk_len > size:
+            raise ValueError('entry {} is out of bounds'.format(i))
+        name = data[name_off:name_off + name_len]
+        chunk = data[chunk_off:chunk_off + chunk_len]
+        if modules and name <= modules[-1][0]:
+            raise ValueError('index is not sorted at {}'.format(name))
+        if fingerprint(chunk) != fp:
+            raise ValueError('module {} does not match the bundle fingerprint'.format(name))
+        modules.append((name, chunk_len))
+    return fp, modules
+
+
+def main(args):
+    if args.command == 'build':
+        data = build(load_modules(args.dir, args.luac))
+        if len(data) > PARTITION_SIZE:
+            raise ValueError('bundle is {} bytes, which does not fit the partition'.format(len(data)))
+        with open(args.output, 'wb') as f:
+            f.write(data)
+        print('Wrote {} ({} bytes)'.format(args.output, len(data)))
+    else:
+        with open(args.bundle, 'rb') as f:
+            data = f.read()
+        expected = int(args.fingerprint, 16) if args.fingerprint else None
+        fp, modules = verify(data, expected)
+        print('Fingerprint {:08x}'.format(fp))
+        for name, length in modules:
+            print('{:24} {:7}'.format(name.decode(), length))
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(
+                        prog='bundle',
+                        description='Builds and verifies Lua module bundles for the lua partition')
+    sub = parser.add_subparsers(dest='command', required=True)
+    b = sub.add_parser('build', help='compile a directory of modules into a bundle')
+    b.add_argument('dir', nargs='?', default='/tmp/espcoap_tmp_img')
+    b.add_argument('-o', '--output', default='../firmware/build/lua_bundle.bin')
+    b.add_argument('--luac', default=os.environ.get('LUAC', 'luac'), help='luac built to match the firmware')
+    v = sub.add_parser('verify', help='check a bundle and list its modules')
+    v.add_argument('bundle')
+    v.add_argument('--fingerprint', help='fingerprint the bundle must have (system.bytecode_fingerprint, in hex)')
+
+    try:
+        main(parser.parse_args())
+    except (subprocess.CalledProcessError, ValueError) as e:
+        print('Failed:', e, file=sys.stderr)
+        sys.exit(1)
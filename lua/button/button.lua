@@ -48,8 +48,8 @@ function Button:new(initval)
     b.repeat_count = 0
     setmetatable(b, self)
     self.__index = self
-    -- Create a re-usable timer that by default does nothing. It'll be re-used for each Wait that the state machine does
-    self.timer = Timer:new(function() end)
+    -- Create a re-usable timer for this button. It'll be re-used for each Wait that the state machine does
+    b.timer = Timer:new()
 
     -- Configure pin as an input.
     gpio.config_input(b.pin);
@@ -63,7 +63,7 @@ end
 ---@return integer the level of the switch after this delay (to ensure that its still at the right level)
 function Button:debounce()
     -- Do a debounce (ignore input for a bit)
-    await(self.timer:defer(75))
+    self.timer:sleep(75)
     -- If it is still pressed, then we have a valid button press
     return gpio.get(self.pin)
 end
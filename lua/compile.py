@@ -0,0 +1,100 @@
+#!/usr/bin/env python
+"""
+Compiles the lua files in an image directory to stripped bytecode, so that the device doesn't have to parse source at
+boot.  Each .lua file is replaced by a .luac file that has a small header in front of the luac output (see
+firmware/main/lua_loader.h).  luac must be built with the same luaconf.h settings as the firmware - the device checks
+the fingerprint in the header and falls back to source (if there is any) when it doesn't match.  A source beside the
+image that it wasn't compiled from is only warned about, as it is most likely one left behind by an older sync.  `--fingerprint` prints the fingerprint that luac compiles for, which
+flashfs.sh checks against the device's before copying anything.
+"""
+import argparse
+import os
+import struct
+import subprocess
+import sys
+import tempfile
+from os.path import join
+
+MAGIC = b'CCLC'
+IMAGE_VERSION = 1
+LUA_SIGNATURE = b'\x1bLua'
+
+
+def fnv1a(data):
+    h = 2166136261
+    for b in data:
+        h = ((h ^ b) * 16777619) & 0xFFFFFFFF
+    return h
+
+
+def header_length(chunk):
+    # Signature, version, format, LUAC_DATA, then the sizes of Instruction, lua_Integer and lua_Number followed by a
+    # test integer and number.
+    return 15 + chunk[13] + chunk[14]
+
+
+def fingerprint(chunk):
+    if not chunk.startswith(LUA_SIGNATURE):
+        raise ValueError('luac output is not a Lua chunk')
+    return fnv1a(chunk[:header_length(chunk)])
+
+
+def compile_file(luac, src, strip=True):
+    with tempfile.NamedTemporaryFile(suffix='.luac', delete=False) as tmp:
+        out = tmp.name
+    try:
+        cmd = [luac, '-s', '-o', out, src] if strip else [luac, '-o', out, src]
+        subprocess.run(cmd, check=True)
+        with open(out, 'rb') as f:
+            return f.read()
+    finally:
+        os.unlink(out)
+
+
+def build_image(source, chunk):
+    return struct.pack('<4sB3xII', MAGIC, IMAGE_VERSION, fingerprint(chunk), fnv1a(source)) + chunk
+
+
+def main(args):
+    if args.fingerprint:
+        with tempfile.NamedTemporaryFile(suffix='.lua', delete=False) as tmp:
+            src = tmp.name
+        try:
+            print('{:08x}'.format(fingerprint(compile_file(args.luac, src))))
+        finally:
+            os.unlink(src)
+        return
+
+    total_src = total_img = 0
+    for fname in sorted(os.listdir(args.dir)):
+        if not fname.endswith('.lua'):
+            continue
+        path = join(args.dir, fname)
+        with open(path, 'rb') as f:
+            source = f.read()
+        image = build_image(source, compile_file(args.luac, path, not args.no_strip))
+        with open(path + 'c', 'wb') as f:
+            f.write(image)
+        if not args.keep_source:
+            os.unlink(path)
+        total_src += len(source)
+        total_img += len(image)
+        print('{:24} {:7} -> {:7}'.format(fname, len(source), len(image)))
+    print('{:24} {:7} -> {:7}'.format('total', total_src, total_img))
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(
+                        prog='compile',
+                        description='Compiles lua sources in an image directory to bytecode images')
+    parser.add_argument('dir', nargs='?', default='/tmp/espcoap_tmp_img')
+    parser.add_argument('--luac', default=os.environ.get('LUAC', 'luac'), help='luac built to match the firmware')
+    parser.add_argument('--keep-source', action='store_true', help='leave the .lua files alongside the images')
+    parser.add_argument('--no-strip', action='store_true', help='keep debug information (line numbers, local names)')
+    parser.add_argument('--fingerprint', action='store_true', help='print the fingerprint of luac and exit')
+
+    try:
+        main(parser.parse_args())
+    except (subprocess.CalledProcessError, ValueError) as e:
+        print('Failed to compile:', e, file=sys.stderr)
+        sys.exit(1)
@@ -14,12 +14,9 @@ function Dali:gear_address(logical_address)
     return logical_address << 9;
 end
 
---- Glues a dali transmit callback to the async/await system, returning the result.
+--- Transmits a command and suspends the calling task until the result comes back, returning the result.
 function Dali:await_cmd(cmd)
-    -- Only one command can be waiting at a time
-    local f = Future:new()
-    self.bus:transmit(cmd, Future.set, f)
-    return await(f)
+    return self.bus:await_transmit(cmd)
 end
 
 ---Queries a device to determine what its current level is
@@ -31,18 +31,46 @@ cp shared/* $DIR
 cp $DEVCLASS/* $DIR
 # Also copy device specific
 cp devices/$DEVID/* $DIR
+# Precompile to bytecode, unless told not to (e.g. to get line numbers in errors).  Set LUAC to a luac built with the
+# firmware's luaconf.h
+if [ -z "$NOCOMPILE" ]; then
+    python3 compile.py $DIR || exit 1
+    FINGERPRINT=$(python3 compile.py --fingerprint) || exit 1
+fi
+
+# Makes sure that the device will load the bytecode, rather than finding out from warnings at boot.  Needs the device
+# to be up on the network; set NOCHECK to skip it (e.g. for a first flash).
+check_fingerprint() {
+    if [ -n "$FINGERPRINT" ] && [ -z "$NOCHECK" ]; then
+        python3 sync.py $IP --check --fingerprint $FINGERPRINT || exit 1
+    fi
+}
 
 case $SYNCTYPE in
     sync)
+        check_fingerprint
         python3 sync.py $IP
         # idf.py -B $BUILDDIR -p $PORT monitor
         ;;
+    bundle)
+        # Code goes into the lua partition, where it is loaded in place, leaving the filesystem for data.
+        python3 bundle.py build $DIR -o $BUILDDIR/lua_bundle.bin || exit 1
+        python3 bundle.py verify $BUILDDIR/lua_bundle.bin || exit 1
+        check_fingerprint
+        esptool.py --chip esp32c6 -p $PORT -b 460800 --before=default_reset --after=hard_reset write_flash --flash_mode dio --flash_freq 80m --flash_size 8MB 0x500000 $BUILDDIR/lua_bundle.bin
+        idf.py -B $BUILDDIR -p $PORT monitor
+        ;;
+    host)
+        # Runs the scripts on this machine, with the host build of the runtime (see firmware/README.md)
+        ../firmware/build.host/ccpeed_host $DIR
+        ;;
     flash)
+        check_fingerprint
         $HOME/esp/esp-idf/components/spiffs/spiffsgen.py 0xF0000 $DIR $BINFILE
         esptool.py --chip esp32c6 -p $PORT -b 460800 --before=default_reset --after=hard_reset write_flash --flash_mode dio --flash_freq 80m --flash_size 8MB 0x10000 $BINFILE
         idf.py -B $BUILDDIR -p $PORT monitor
         ;;
     *)
-        echo "You should specify a sync or a flash as the second option"
+        echo "You should specify a sync, flash, bundle or host as the second option"
         ;;
 esac
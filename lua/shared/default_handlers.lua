@@ -5,11 +5,20 @@ require("helpers")
 local log = Logger:get("default_handlers")
 
 
+-- One metatable per hints table, so that the encoder can reuse what it worked out from the hints last time.  This only
+-- helps when the same hints table is passed in each time, rather than a new literal.
+local hint_metatables = setmetatable({}, { __mode = "k" })
+
 function cbor.encode_values_as(src, hints)
     -- Make a shallow copy of the table
     local copy = Helpers.assign(src, {})
+    local meta = hint_metatables[hints]
+    if not meta then
+        meta = { __valenc = hints }
+        hint_metatables[hints] = meta
+    end
     -- Set a metatable with cbor encoding hints
-    setmetatable(copy, { __valenc = hints })
+    setmetatable(copy, meta)
     return copy
 end
 
@@ -29,6 +38,9 @@ coap.resources[{ "restart" }] = {
 }
 
 
+local firmware_hints = { sha256 = 'bstr' }
+local info_hints = { mac_address = 'bstr' }
+
 coap.resources[{ "info" }] = {
     get = {
         desc = "fetches device info",
@@ -38,10 +50,11 @@ coap.resources[{ "info" }] = {
                 uptime = system.uptime() / 1000,
                 mac_address = system.mac_address,
                 reset_reason = system.reset_reason,
+                bytecode_fingerprint = system.bytecode_fingerprint,
                 heap = system.heap_info(),
-                firmware = cbor.encode_values_as(system.firmware, { sha256 = 'bstr' })
+                firmware = cbor.encode_values_as(system.firmware, firmware_hints)
             }
-            req.reply { code = "content", format = "cbor", payload = cbor.encode(cbor.encode_values_as(info, { mac_address = 'bstr' })) };
+            req.reply { code = "content", format = "cbor", payload = cbor.encode(cbor.encode_values_as(info, info_hints)) };
         end
     }
 }
@@ -67,6 +80,71 @@ coap.resources[{}] = {
     }
 }
 
+coap.resources[{ "stats", "loop" }] = {
+    get = {
+        desc = "fetches event loop latency histograms",
+        handler = function(req)
+            req.reply { code = "content", format = "cbor", payload = cbor.encode(system.loop_stats()) }
+        end
+    },
+    delete = {
+        desc = "resets event loop latency histograms",
+        handler = function(req)
+            system.loop_stats(true)
+            req.reply { code = "deleted" }
+        end
+    }
+}
+
+-- The folded stacks as they were at block 0 of each peer's transfer, so that all the blocks of a transfer come from
+-- the same snapshot while the profiler carries on sampling.  Dropped once the last block has gone.
+local profile_snapshots = {}
+
+coap.resources[{ "profile" }] = {
+    get = {
+        desc = "fetches the profiler's samples as folded stacks, for flamegraph.pl",
+        handler = function(req)
+            local block2 = req.block2 or { id = 0, size = 1024 }
+            local peer = req.peer_addr .. req.peer_port
+            if block2.id == 0 then
+                profile_snapshots[peer] = system.profiler.folded()
+            end
+            local folded = profile_snapshots[peer]
+            if not folded then
+                return req.reply { code = "bad_option", payload = "BlockID2 transfer must start from block 0" }
+            end
+            local offset = block2.id * block2.size
+            if offset > #folded then
+                return req.reply { code = "bad_option", payload = "BlockID2 index beyond end of profile" }
+            end
+            local more = offset + block2.size < #folded
+            if not more then
+                profile_snapshots[peer] = nil
+            end
+            req.reply {
+                code = "content",
+                format = "text",
+                payload = folded:sub(offset + 1, offset + block2.size),
+                block2 = { id = block2.id, size = block2.size, more = more }
+            }
+        end
+    },
+    post = {
+        desc = "starts the profiler, sampling every payload microseconds (default 1000)",
+        handler = function(req)
+            system.profiler.start(req.payload and tonumber(req.payload))
+            req.reply { code = "changed" }
+        end
+    },
+    delete = {
+        desc = "stops the profiler, keeping the samples",
+        handler = function(req)
+            system.profiler.stop()
+            req.reply { code = "deleted" }
+        end
+    }
+}
+
 coap.resources[{ "log", "*" }] = {
     get = {
         desc = "gets the log threshold",
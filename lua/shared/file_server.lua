@@ -164,11 +164,16 @@ local function handle_fs_delete(req)
 
     local ret, msg = os.remove(fname);
     if not ret then
-        return req.reply{ code="not_found", payload="msg"}
+        return req.reply{ code="not_found", payload=msg}
     end
+    req.reply{ code="deleted" }
 end
 
 
+-- Values in the listing are binary strings (etags), not utf8, so the encoder needs a hint.  One metatable is shared by
+-- every listing, so that its encode plan is only worked out once.
+local file_list_mt = { __valenc = "bstr" }
+
 local function handle_list(req)
     local dirname = "/"..req.path_str
     log:info("Listing directory", dirname);
@@ -178,9 +183,7 @@ local function handle_list(req)
     if req.query and #req.query > 0 then
         startfrom = req.query[1]
     end
-    local file_list = {}
-    -- Values in the table are binary strings, not utf8 - we have to give the encoder a hint
-    setmetatable(file_list, { __valenc= "bstr" })
+    local file_list = setmetatable({}, file_list_mt)
 
     local filenames = io.readdir(dirname)
     -- we sort them so that we can paginate
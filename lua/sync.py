@@ -7,6 +7,7 @@ from os import listdir
 from os.path import isfile, join
 import yaml
 import argparse
+import sys
 
 from aiocoap import *
 from aiocoap.numbers import GET,PUT,POST
@@ -49,9 +50,26 @@ def readfile(f):
     
 
 
+async def check_fingerprint(protocol, ip_addr, expected):
+    """ Exits if the device won't load bytecode compiled for the expected fingerprint (a hex string) """
+    info = await call(protocol, ip_addr, "info", GET)
+    device = info.get('bytecode_fingerprint')
+    if device is None:
+        print("Device doesn't report a bytecode fingerprint, so images can't be checked")
+        sys.exit(1)
+    if device != int(expected, 16):
+        print("Device bytecode fingerprint is {:08x}, but the images were compiled for {}".format(device, expected))
+        sys.exit(1)
+    print("Bytecode fingerprint {:08x} matches".format(device))
+
+
 async def main(args):
     print("Syncing with args", args.ip)
     protocol = await Context.create_client_context()
+    if args.fingerprint:
+        await check_fingerprint(protocol, args.ip, args.fingerprint)
+    if args.check:
+        return
     remote_files = (await call(protocol, args.ip, "fs", GET))['files']
 
     srcpath = "/tmp/espcoap_tmp_img"
@@ -59,11 +77,9 @@ async def main(args):
 
     try:
         num_changes = 0
-        for idx, fname in enumerate(localfiles):
-            if idx == 0:
-                remote_file = "init.lua"
-            else:
-                remote_file = fname
+        for fname in localfiles:
+            # Files keep their names, as the image may hold init.luac rather than init.lua
+            remote_file = fname
 
             remote_etag = remote_files.get(remote_file, None)
             content = readfile(join(srcpath,fname))
@@ -90,4 +106,6 @@ parser = argparse.ArgumentParser(
                     description='Copies files from local directories onto COAP based devices',
                     epilog='copyright © 2024 mechination.com.au')
 parser.add_argument('ip')
+parser.add_argument('--fingerprint', help='bytecode fingerprint the images were compiled for (compile.py --fingerprint)')
+parser.add_argument('--check', action='store_true', help='only check the fingerprint, without copying anything')
 asyncio.run(main(parser.parse_args()))